@@ -36,6 +36,17 @@
 //config:	5                  67.05             9427
 //config:	4-0 (fastest)      64.14            12083
 //config:
+//config:config FEATURE_BZIP2_SAIS
+//config:	bool "Linear time sorting of repetitive data"
+//config:	default y
+//config:	depends on BZIP2
+//config:	help
+//config:	Block sorting of bzip2 gives up on very repetitive data
+//config:	(logs, sparse images) and falls back to a slower sort.
+//config:	This option makes it use SA-IS suffix array construction
+//config:	in that case, which runs in linear time. It needs 8 bytes
+//config:	of temporary memory per block byte (7.2 Mb with -9).
+//config:
 //config:config FEATURE_BZIP2_DECOMPRESS
 //config:	bool "Enable decompression"
 //config:	default y
@@ -37,7 +37,7 @@ aa:      85.1% -- replaced with aa.gz
 //config:	int "Trade memory for speed (0:small,slow - 2:fast,big)"
 //config:	default 0
 //config:	range 0 2
-//config:	depends on GZIP
+//config:	depends on GZIP || ZIP
 //config:	help
 //config:	Enable big memory options for gzip.
 //config:	0: small buffers, small hash-tables
@@ -48,7 +48,7 @@ aa:      85.1% -- replaced with aa.gz
 //config:config FEATURE_GZIP_LEVELS
 //config:	bool "Enable compression levels"
 //config:	default n
-//config:	depends on GZIP
+//config:	depends on GZIP || ZIP
 //config:	help
 //config:	Enable support for compression levels 4-9. The default level
 //config:	is 6. If levels 1-3 are specified, 4 is used.
@@ -63,10 +63,29 @@ aa:      85.1% -- replaced with aa.gz
 //config:	Enable -d (--decompress) and -t (--test) options for gzip.
 //config:	This will be automatically selected if gunzip or zcat is
 //config:	enabled.
+//config:
+//config:config ZIP
+//config:	bool "zip (9 kb)"
+//config:	default y
+//config:	help
+//config:	zip creates ZIP archives. Members are compressed
+//config:	by the same deflate code as gzip uses.
+//config:	Archive can be written to a pipe.
+//config:
+//config:config FEATURE_ZIP_PARALLEL
+//config:	bool "Support parallel compression (-J N)"
+//config:	default y
+//config:	depends on ZIP && !NOMMU && PLATFORM_POSIX
+//config:	help
+//config:	"zip -J N" compresses up to N members at once,
+//config:	in separate processes. Members are stored
+//config:	in the archive in the usual order.
 
 //applet:IF_GZIP(APPLET(gzip, BB_DIR_BIN, BB_SUID_DROP))
+//applet:IF_ZIP(APPLET(zip, BB_DIR_USR_BIN, BB_SUID_DROP))
 
 //kbuild:lib-$(CONFIG_GZIP) += gzip.o
+//kbuild:lib-$(CONFIG_ZIP) += gzip.o
 
 //usage:#define gzip_trivial_usage
 //usage:       "[-cfk" IF_FEATURE_GZIP_DECOMPRESS("dt") IF_FEATURE_GZIP_LEVELS("123456789") "] [FILE]..."
@@ -91,6 +110,22 @@ aa:      85.1% -- replaced with aa.gz
 //usage:       "$ gzip /tmp/busybox.tar\n"
 //usage:       "$ ls -la /tmp/busybox*\n"
 //usage:       "-rw-rw-r--    1 andersen andersen   554058 Apr 14 17:49 /tmp/busybox.tar.gz\n"
+//usage:
+//usage:#define zip_trivial_usage
+//usage:       "[-rjq0" IF_FEATURE_GZIP_LEVELS("123456789") "] "IF_FEATURE_ZIP_PARALLEL("[-J N] ")"ZIPFILE FILE..."
+//usage:#define zip_full_usage "\n\n"
+//usage:       "Create ZIP archive (- writes it to stdout).\n"
+//usage:       "FILE - is stdin.\n"
+//usage:     "\n	-r	Recurse into directories"
+//usage:     "\n	-j	Do not store paths"
+//usage:     "\n	-q	Quiet"
+//usage:     "\n	-0	Do not compress"
+//usage:	IF_FEATURE_GZIP_LEVELS(
+//usage:     "\n	-1..9	Compression level"
+//usage:	)
+//usage:	IF_FEATURE_ZIP_PARALLEL(
+//usage:     "\n	-J N	Compress N files at once"
+//usage:	)
 
 #include "libbb.h"
 #include "bb_archive.h"
@@ -349,6 +384,11 @@ struct globals {
 #define nice_match        (G1.nice_match)
 #endif
 
+#if ENABLE_ZIP
+	/* Total bytes written to ofd, for zip's offsets and sizes */
+	uoff_t bytes_out;
+#endif
+
 /* =========================================================================== */
 /* all members below are zeroed out in pack_gzip() for each next file */
 
@@ -379,7 +419,7 @@ struct globals {
 	unsigned lookahead;	/* number of valid bytes ahead in window */
 
 /* number of input bytes */
-	ulg isize;		/* only 32 bits stored in .gz file */
+	uoff_t isize;		/* only 32 bits stored in .gz file */
 
 /* bbox always use stdin/stdout */
 #define ifd STDIN_FILENO	/* input file descriptor */
@@ -428,6 +468,9 @@ static void flush_outbuf(void)
 		return;
 
 	xwrite(ofd, (char *) G1.outbuf, G1.outcnt);
+#if ENABLE_ZIP
+	G1.bytes_out += G1.outcnt;
+#endif
 	G1.outcnt = 0;
 }
 
@@ -2057,6 +2100,96 @@ static void ct_init(void)
 	init_block();
 }
 
+/* ===========================================================================
+ * Reinit G1.xxx except pointers to allocated buffers, and entire G2.
+ * Done before every file we compress.
+ */
+static void reinit_globals(void)
+{
+	memset(&G1.crc, 0, (sizeof(G1) - offsetof(struct globals, crc)) + sizeof(G2));
+
+	/* Clear input and output buffers */
+	//G1.outcnt = 0;
+#ifdef DEBUG
+	//G1.insize = 0;
+#endif
+	//G1.isize = 0;
+
+	/* Reinit G2.xxx */
+	G2.l_desc.dyn_tree     = G2.dyn_ltree;
+	G2.l_desc.static_tree  = G2.static_ltree;
+	G2.l_desc.extra_bits   = extra_lbits;
+	G2.l_desc.extra_base   = LITERALS + 1;
+	G2.l_desc.elems        = L_CODES;
+	G2.l_desc.max_length   = MAX_BITS;
+	//G2.l_desc.max_code     = 0;
+	G2.d_desc.dyn_tree     = G2.dyn_dtree;
+	G2.d_desc.static_tree  = G2.static_dtree;
+	G2.d_desc.extra_bits   = extra_dbits;
+	//G2.d_desc.extra_base   = 0;
+	G2.d_desc.elems        = D_CODES;
+	G2.d_desc.max_length   = MAX_BITS;
+	//G2.d_desc.max_code     = 0;
+	G2.bl_desc.dyn_tree    = G2.bl_tree;
+	//G2.bl_desc.static_tree = NULL;
+	G2.bl_desc.extra_bits  = extra_blbits,
+	//G2.bl_desc.extra_base  = 0;
+	G2.bl_desc.elems       = BL_CODES;
+	G2.bl_desc.max_length  = MAX_BL_BITS;
+	//G2.bl_desc.max_code    = 0;
+}
+
+#if ENABLE_FEATURE_GZIP_LEVELS
+static const struct {
+	uint8_t good;
+	uint8_t chain_shift;
+	uint8_t lazy2;
+	uint8_t nice2;
+} gzip_level_config[6] = {
+	{4,   4,   4/2,  16/2}, /* Level 4 */
+	{8,   5,  16/2,  32/2}, /* Level 5 */
+	{8,   7,  16/2, 128/2}, /* Level 6 */
+	{8,   8,  32/2, 128/2}, /* Level 7 */
+	{32, 10, 128/2, 258/2}, /* Level 8 */
+	{32, 12, 258/2, 258/2}, /* Level 9 */
+};
+
+/* opt is a bitmask of -1..-9 options */
+static void set_comp_level(unsigned opt)
+{
+	if (opt == 0)
+		opt = 1 << 5; /* default: 6 */
+	opt = ffs(opt >> 4); /* Maps -1..-4 to [0], -5 to [1] ... -9 to [5] */
+
+	comp_level_minus4 = opt;
+
+	max_chain_length = 1 << gzip_level_config[opt].chain_shift;
+	good_match	 = gzip_level_config[opt].good;
+	max_lazy_match	 = gzip_level_config[opt].lazy2 * 2;
+	nice_match	 = gzip_level_config[opt].nice2 * 2;
+}
+#endif
+
+static void alloc_globals(void)
+{
+// TODO: use less ugly "split-globals" trick via SET_OFFSET_PTR_TO_GLOBALS().
+// The problem is, the current method strategically places G2.heap[]
+// (~24 references) so that it has zero offset.
+	SET_PTR_TO_GLOBALS((char *)xzalloc(sizeof(struct globals)+sizeof(struct globals2))
+			+ sizeof(struct globals));
+
+	/* Allocate all global buffers (for DYN_ALLOC option) */
+	ALLOC(uch, G1.l_buf, INBUFSIZ);
+	ALLOC(uch, G1.outbuf, OUTBUFSIZ);
+	ALLOC(ush, G1.d_buf, DIST_BUFSIZE);
+	ALLOC(uch, G1.window, 2L * WSIZE);
+	ALLOC(ush, G1.prev, 1L << BITS);
+
+	/* Initialize the CRC32 table */
+	global_crc32_new_table_le();
+}
+
+#if ENABLE_GZIP
 /* ===========================================================================
  * Deflate in to out.
  * IN assertions: the input and output buffers are cleared.
@@ -2106,39 +2239,7 @@ static void zip(void)
 static
 IF_DESKTOP(long long) int FAST_FUNC pack_gzip(transformer_state_t *xstate UNUSED_PARAM)
 {
-	/* Reinit G1.xxx except pointers to allocated buffers, and entire G2 */
-	memset(&G1.crc, 0, (sizeof(G1) - offsetof(struct globals, crc)) + sizeof(G2));
-
-	/* Clear input and output buffers */
-	//G1.outcnt = 0;
-#ifdef DEBUG
-	//G1.insize = 0;
-#endif
-	//G1.isize = 0;
-
-	/* Reinit G2.xxx */
-	G2.l_desc.dyn_tree     = G2.dyn_ltree;
-	G2.l_desc.static_tree  = G2.static_ltree;
-	G2.l_desc.extra_bits   = extra_lbits;
-	G2.l_desc.extra_base   = LITERALS + 1;
-	G2.l_desc.elems        = L_CODES;
-	G2.l_desc.max_length   = MAX_BITS;
-	//G2.l_desc.max_code     = 0;
-	G2.d_desc.dyn_tree     = G2.dyn_dtree;
-	G2.d_desc.static_tree  = G2.static_dtree;
-	G2.d_desc.extra_bits   = extra_dbits;
-	//G2.d_desc.extra_base   = 0;
-	G2.d_desc.elems        = D_CODES;
-	G2.d_desc.max_length   = MAX_BITS;
-	//G2.d_desc.max_code     = 0;
-	G2.bl_desc.dyn_tree    = G2.bl_tree;
-	//G2.bl_desc.static_tree = NULL;
-	G2.bl_desc.extra_bits  = extra_blbits,
-	//G2.bl_desc.extra_base  = 0;
-	G2.bl_desc.elems       = BL_CODES;
-	G2.bl_desc.max_length  = MAX_BL_BITS;
-	//G2.bl_desc.max_code    = 0;
-
+	reinit_globals();
 #if 0
 	/* Saving of timestamp is disabled. Why?
 	 * - it is not Y2038-safe.
@@ -2199,27 +2300,6 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 #endif
 {
 	unsigned opt;
-#if ENABLE_FEATURE_GZIP_LEVELS
-	static const struct {
-		uint8_t good;
-		uint8_t chain_shift;
-		uint8_t lazy2;
-		uint8_t nice2;
-	} gzip_level_config[6] = {
-		{4,   4,   4/2,  16/2}, /* Level 4 */
-		{8,   5,  16/2,  32/2}, /* Level 5 */
-		{8,   7,  16/2, 128/2}, /* Level 6 */
-		{8,   8,  32/2, 128/2}, /* Level 7 */
-		{32, 10, 128/2, 258/2}, /* Level 8 */
-		{32, 12, 258/2, 258/2}, /* Level 9 */
-	};
-#endif
-
-// TODO: use less ugly "split-globals" trick via SET_OFFSET_PTR_TO_GLOBALS().
-// The problem is, the current method strategically places G2.heap[]
-// (~24 references) so that it has zero offset.
-	SET_PTR_TO_GLOBALS((char *)xzalloc(sizeof(struct globals)+sizeof(struct globals2))
-			+ sizeof(struct globals));
 
 	/* Must match bbunzip's constants OPT_STDOUT, OPT_FORCE! */
 #if ENABLE_FEATURE_GZIP_LONG_OPTIONS
@@ -2231,31 +2311,509 @@ int gzip_main(int argc UNUSED_PARAM, char **argv)
 	if (opt & (BBUNPK_OPT_DECOMPRESS|BBUNPK_OPT_TEST)) /* -d and/or -t */
 		return gunzip_main(argc, argv);
 #endif
+	alloc_globals();
 #if ENABLE_FEATURE_GZIP_LEVELS
 	opt >>= (BBUNPK_OPTSTRLEN IF_FEATURE_GZIP_DECOMPRESS(+ 2) + 1); /* drop cfkvq[dt]n bits */
-	if (opt == 0)
-		opt = 1 << 5; /* default: 6 */
-	opt = ffs(opt >> 4); /* Maps -1..-4 to [0], -5 to [1] ... -9 to [5] */
+	set_comp_level(opt);
+#endif
+	option_mask32 &= BBUNPK_OPTSTRMASK; /* retain only -cfkvq */
 
-	comp_level_minus4 = opt;
+	argv += optind;
+	return bbunpack(argv, pack_gzip, append_ext, "gz");
+}
+#endif /* GZIP */
 
-	max_chain_length = 1 << gzip_level_config[opt].chain_shift;
-	good_match	 = gzip_level_config[opt].good;
-	max_lazy_match	 = gzip_level_config[opt].lazy2 * 2;
-	nice_match	 = gzip_level_config[opt].nice2 * 2;
+#if ENABLE_ZIP
+/* ZIP archive creation, see
+ * https://pkware.cachefly.net/webdocs/casestudies/APPNOTE.TXT
+ *
+ * Output is never seeked: local headers say "crc and sizes follow
+ * the data" (flag 0x0008), and data descriptors carry them.
+ * Thus "zip - FILES | ..." works.
+ * With -J N, members are compressed into temp files first, and their
+ * local headers carry real sizes.
+ * Members and archives over 4G get Zip64 extra fields and records.
+ */
+enum {
+	ZIP_FILEHEADER_MAGIC = 0x04034b50,
+	ZIP_CDF_MAGIC        = 0x02014b50,
+	ZIP_CDE_MAGIC        = 0x06054b50,
+	ZIP64_CDE_MAGIC      = 0x06064b50,
+	ZIP64_CDL_MAGIC      = 0x07064b50, /* Zip64 CDE locator */
+	ZIP_DD_MAGIC         = 0x08074b50,
+	ZIP_FLAG_DD          = 0x0008,
+	ZIP_MADE_BY          = (3 << 8) + 45, /* Unix, spec version 4.5 */
+	ZIP64_EXTRA_ID       = 0x0001,
+};
+/* Deflate can expand incompressible data a bit. For files this big,
+ * reserve room for Zip64 sizes in local header.
+ */
+#define ZIP64_SIZE_THRESHOLD ((uoff_t)0xff000000)
+
+struct zip_entry {
+	char *name;
+	uoff_t offset;
+	uoff_t csize;
+	uoff_t usize;
+	uint32_t crc;
+	uint32_t dostime;
+	uint32_t attr;
+	uint16_t method;
+	uint16_t flags;
+	smallint zip64; /* local header has Zip64 extra field */
+};
+
+#if ENABLE_FEATURE_ZIP_PARALLEL
+struct zip_job {
+	pid_t pid; /* 0: nothing to wait for (directory) */
+	int tmp_fd;
+	unsigned idx;
+};
+/* Appended by worker to compressed data */
+struct zip_trailer {
+	uoff_t usize;
+	uint32_t crc;
+};
 #endif
-	option_mask32 &= BBUNPK_OPTSTRMASK; /* retain only -cfkvq */
 
-	/* Allocate all global buffers (for DYN_ALLOC option) */
-	ALLOC(uch, G1.l_buf, INBUFSIZ);
-	ALLOC(uch, G1.outbuf, OUTBUFSIZ);
-	ALLOC(ush, G1.d_buf, DIST_BUFSIZE);
-	ALLOC(uch, G1.window, 2L * WSIZE);
-	ALLOC(ush, G1.prev, 1L << BITS);
+struct zip_state {
+	struct zip_entry *entries;
+	unsigned cnt;
+	unsigned method;
+	dev_t out_dev;
+	ino_t out_ino;
+	FILE *msg; /* stdout may be the archive */
+	smallint quiet;
+	smallint junk_paths;
+#if ENABLE_FEATURE_ZIP_PARALLEL
+	unsigned workers;
+	unsigned job_first;
+	unsigned job_cnt;
+	struct zip_job *jobs;
+#endif
+};
 
-	/* Initialize the CRC32 table */
-	global_crc32_new_table_le();
+static void put_64bit(uoff_t n)
+{
+	put_32bit((uint32_t)n);
+	put_32bit((uint32_t)((uint64_t)n >> 32));
+}
+
+static void put_name(const char *name)
+{
+	while (*name)
+		put_8bit(*name++);
+}
+
+static uoff_t zip_offset(void)
+{
+	return G1.bytes_out + G1.outcnt;
+}
+
+static uint32_t dos_time(time_t t)
+{
+	struct tm *tm = localtime(&t);
+
+	if (!tm || tm->tm_year < 80)
+		return (1 << 5 | 1) << 16; /* 1980-01-01 00:00 */
+	return ((tm->tm_year - 80) << 25)
+		| ((tm->tm_mon + 1) << 21)
+		| (tm->tm_mday << 16)
+		| (tm->tm_hour << 11)
+		| (tm->tm_min << 5)
+		| (tm->tm_sec >> 1);
+}
+
+static unsigned zip_version_needed(struct zip_entry *e, int zip64)
+{
+	if (zip64)
+		return 45;
+	return e->method ? 20 : 10;
+}
+
+static void put_local_header(struct zip_entry *e)
+{
+	put_32bit(ZIP_FILEHEADER_MAGIC);
+	put_16bit(zip_version_needed(e, e->zip64));
+	put_16bit(e->flags);
+	put_16bit(e->method);
+	put_32bit(e->dostime);
+	put_32bit(e->crc);
+	if (e->zip64) {
+		put_32bit(0xffffffff);
+		put_32bit(0xffffffff);
+	} else {
+		put_32bit(e->csize);
+		put_32bit(e->usize);
+	}
+	put_16bit(strlen(e->name));
+	put_16bit(e->zip64 ? 4 + 16 : 0);
+	put_name(e->name);
+	if (e->zip64) {
+		put_16bit(ZIP64_EXTRA_ID);
+		put_16bit(16);
+		put_64bit(e->usize);
+		put_64bit(e->csize);
+	}
+}
+
+/* Compress (or store) STDIN_FILENO to ofd */
+static void zip_compress(struct zip_entry *e)
+{
+	uoff_t start;
+
+	flush_outbuf(); /* reinit_globals() clears outcnt */
+	start = G1.bytes_out;
+	reinit_globals();
+	G1.crc = ~0;
+	if (e->method == 0) {
+		unsigned n;
+		while ((n = file_read(G1.window, WINDOW_SIZE)) != 0 && n != (unsigned)-1) {
+			xwrite(ofd, G1.window, n);
+			G1.bytes_out += n;
+		}
+	} else {
+		bi_init();
+		ct_init();
+		lm_init();
+		deflate();
+		flush_outbuf();
+	}
+	e->crc = ~G1.crc;
+	e->usize = G1.isize;
+	e->csize = G1.bytes_out - start;
+}
+
+static void zip_report(struct zip_state *zs, struct zip_entry *e)
+{
+	unsigned percents = 0;
+
+	if (zs->quiet)
+		return;
+	if (e->usize > e->csize)
+		percents = (e->usize - e->csize) * 100 / e->usize;
+	fprintf(zs->msg, "  adding: %s (%s %u%%)\n",
+		printable_string(e->name),
+		e->method ? "deflated" : "stored",
+		percents
+	);
+}
+
+static void zip_write_member(struct zip_state *zs, struct zip_entry *e, int fd)
+{
+	e->offset = zip_offset();
+	if (fd < 0) {
+		/* Directory */
+		put_local_header(e);
+		goto report;
+	}
+
+	e->flags = ZIP_FLAG_DD;
+	put_local_header(e);
+	if (fd != STDIN_FILENO)
+		xmove_fd(fd, STDIN_FILENO);
+	zip_compress(e);
+
+	put_32bit(ZIP_DD_MAGIC);
+	put_32bit(e->crc);
+	if (e->zip64) {
+		put_64bit(e->csize);
+		put_64bit(e->usize);
+	} else {
+		if ((uint64_t)e->csize > 0xffffffff || (uint64_t)e->usize > 0xffffffff)
+			bb_error_msg_and_die("%s: file grew over 4G", e->name);
+		put_32bit(e->csize);
+		put_32bit(e->usize);
+	}
+ report:
+	zip_report(zs, e);
+}
+
+#if ENABLE_FEATURE_ZIP_PARALLEL
+static int zip_tmpfile(void)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char *name = concat_path_file(tmpdir ? tmpdir : "/tmp", "zipXXXXXX");
+	int fd = xmkstemp(name);
+
+	unlink(name);
+	free(name);
+	return fd;
+}
+
+/* Write out the oldest queued member */
+static void zip_finish_job(struct zip_state *zs)
+{
+	struct zip_job *job = &zs->jobs[zs->job_first];
+	struct zip_entry *e = &zs->entries[job->idx];
+
+	zs->job_first = (zs->job_first + 1) % zs->workers;
+	zs->job_cnt--;
+
+	e->offset = zip_offset();
+	if (job->pid) {
+		struct zip_trailer tr;
+		int status;
+
+		if (safe_waitpid(job->pid, &status, 0) < 0 || status != 0)
+			xfunc_die(); /* worker already complained */
+		e->csize = xlseek(job->tmp_fd, -(off_t)sizeof(tr), SEEK_END);
+		xread(job->tmp_fd, &tr, sizeof(tr));
+		e->crc = tr.crc;
+		e->usize = tr.usize;
+		e->zip64 = ((uint64_t)e->csize >= 0xffffffff || (uint64_t)e->usize >= 0xffffffff);
+		put_local_header(e);
+		flush_outbuf();
+		xlseek(job->tmp_fd, 0, SEEK_SET);
+		bb_copyfd_exact_size(job->tmp_fd, ofd, e->csize);
+		G1.bytes_out += e->csize;
+		close(job->tmp_fd);
+	} else {
+		put_local_header(e);
+	}
+	zip_report(zs, e);
+}
+
+static void zip_queue_job(struct zip_state *zs, unsigned idx, int fd)
+{
+	struct zip_job *job;
+
+	if (zs->job_cnt == zs->workers)
+		zip_finish_job(zs);
+	job = &zs->jobs[(zs->job_first + zs->job_cnt) % zs->workers];
+	zs->job_cnt++;
+	job->idx = idx;
+	job->pid = 0;
+	if (fd < 0) /* directory */
+		return;
+
+	job->tmp_fd = zip_tmpfile();
+	/* Child must not write out our buffered data */
+	flush_outbuf();
+	fflush_all();
+	job->pid = xfork();
+	if (job->pid == 0) {
+		struct zip_entry *e = &zs->entries[idx];
+		struct zip_trailer tr;
+
+		if (fd != STDIN_FILENO)
+			xmove_fd(fd, STDIN_FILENO);
+		xmove_fd(job->tmp_fd, ofd);
+		zip_compress(e);
+		tr.usize = e->usize;
+		tr.crc = e->crc;
+		xwrite(ofd, &tr, sizeof(tr));
+		_exit(EXIT_SUCCESS);
+	}
+	close(fd);
+}
+#endif
+
+static void zip_add_member(struct zip_state *zs, const char *name, struct stat *st, int fd)
+{
+	struct zip_entry *e;
+	unsigned idx = zs->cnt++;
+
+	zs->entries = xrealloc_vector(zs->entries, 6, idx);
+	e = &zs->entries[idx];
+	/* Directory names end with '/' */
+	e->name = (fd < 0) ? concat_path_file(name, "") : xstrdup(name);
+	e->dostime = dos_time(st->st_mtime);
+	e->attr = ((uint32_t)st->st_mode << 16) | (fd < 0 ? 0x10 : 0); /* 0x10: MSDOS dir */
+	if (fd >= 0) {
+		e->method = zs->method;
+		/* Size of stdin is not known in advance */
+		e->zip64 = (!S_ISREG(st->st_mode) || st->st_size >= ZIP64_SIZE_THRESHOLD);
+	}
+#if ENABLE_FEATURE_ZIP_PARALLEL
+	if (zs->workers) {
+		zip_queue_job(zs, idx, fd);
+		return;
+	}
+#endif
+	zip_write_member(zs, e, fd);
+}
+
+static int FAST_FUNC zip_add(recursive_state_t *state,
+		const char *fileName,
+		struct stat *st)
+{
+	struct zip_state *zs = state->userData;
+	const char *name;
+	int fd = -1;
+
+	if (st->st_dev == zs->out_dev && st->st_ino == zs->out_ino)
+		return TRUE; /* do not add archive to itself */
+
+	name = fileName;
+	if (zs->junk_paths) {
+		if (S_ISDIR(st->st_mode))
+			return TRUE;
+		name = bb_basename(name);
+	}
+	while (name[0] == '.' && name[1] == '/')
+		name += 2;
+	name = skip_unsafe_prefix(name);
+	if (!name[0] || LONE_CHAR(name, '.'))
+		return TRUE; /* "zip -r a.zip ." - no entry for "." */
+
+	if (S_ISREG(st->st_mode)) {
+		fd = open_or_warn(fileName, O_RDONLY);
+		if (fd < 0)
+			return FALSE;
+	} else if (!S_ISDIR(st->st_mode)) {
+		bb_error_msg("%s: not a regular file, skipped", fileName);
+		return TRUE;
+	}
+	zip_add_member(zs, name, st, fd);
+	return TRUE;
+}
+
+static void zip_write_cdir(struct zip_state *zs)
+{
+	uoff_t cd_start = zip_offset();
+	uoff_t cd_size;
+	unsigned i;
+
+	for (i = 0; i < zs->cnt; i++) {
+		struct zip_entry *e = &zs->entries[i];
+		/* Zip64 extra has only the fields which did not fit */
+		int big_u = ((uint64_t)e->usize >= 0xffffffff);
+		int big_c = ((uint64_t)e->csize >= 0xffffffff);
+		int big_o = ((uint64_t)e->offset >= 0xffffffff);
+		unsigned extra_len = (big_u + big_c + big_o) * 8;
+
+		if (extra_len)
+			extra_len += 4;
+		put_32bit(ZIP_CDF_MAGIC);
+		put_16bit(ZIP_MADE_BY);
+		put_16bit(zip_version_needed(e, e->zip64 || extra_len));
+		put_16bit(e->flags);
+		put_16bit(e->method);
+		put_32bit(e->dostime);
+		put_32bit(e->crc);
+		put_32bit(big_c ? 0xffffffff : e->csize);
+		put_32bit(big_u ? 0xffffffff : e->usize);
+		put_16bit(strlen(e->name));
+		put_16bit(extra_len);
+		put_16bit(0); /* file comment length */
+		put_16bit(0); /* disk number start */
+		put_16bit(0); /* internal attributes */
+		put_32bit(e->attr);
+		put_32bit(big_o ? 0xffffffff : e->offset);
+		put_name(e->name);
+		if (extra_len) {
+			put_16bit(ZIP64_EXTRA_ID);
+			put_16bit(extra_len - 4);
+			if (big_u)
+				put_64bit(e->usize);
+			if (big_c)
+				put_64bit(e->csize);
+			if (big_o)
+				put_64bit(e->offset);
+		}
+	}
+	cd_size = zip_offset() - cd_start;
+
+	if (zs->cnt >= 0xffff
+	 || (uint64_t)cd_size >= 0xffffffff
+	 || (uint64_t)cd_start >= 0xffffffff
+	) {
+		uoff_t cde64 = zip_offset();
+
+		put_32bit(ZIP64_CDE_MAGIC);
+		put_64bit(44); /* size of the rest of the record */
+		put_16bit(ZIP_MADE_BY);
+		put_16bit(45);
+		put_32bit(0); /* this disk */
+		put_32bit(0); /* disk with CD start */
+		put_64bit(zs->cnt);
+		put_64bit(zs->cnt);
+		put_64bit(cd_size);
+		put_64bit(cd_start);
+
+		put_32bit(ZIP64_CDL_MAGIC);
+		put_32bit(0); /* disk with Zip64 CDE */
+		put_64bit(cde64);
+		put_32bit(1); /* total number of disks */
+	}
+
+	put_32bit(ZIP_CDE_MAGIC);
+	put_32bit(0); /* this disk, disk with CD start */
+	put_16bit(MIN(zs->cnt, 0xffff));
+	put_16bit(MIN(zs->cnt, 0xffff));
+	put_32bit(MIN((uint64_t)cd_size, 0xffffffff));
+	put_32bit(MIN((uint64_t)cd_start, 0xffffffff));
+	put_16bit(0); /* comment length */
+	flush_outbuf();
+}
+
+int zip_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
+int zip_main(int argc UNUSED_PARAM, char **argv)
+{
+	enum {
+		OPT_r = (1 << 0),
+		OPT_j = (1 << 1),
+		OPT_q = (1 << 2),
+		OPT_0 = (1 << 3),
+		OPTBIT_1 = 4, /* -1..-9 */
+	};
+	struct zip_state zs;
+	struct stat st;
+	unsigned opt;
+	int retval = EXIT_SUCCESS;
+	IF_FEATURE_ZIP_PARALLEL(const char *workers = NULL;)
 
+	opt = getopt32(argv, "^" "rjq0123456789" IF_FEATURE_ZIP_PARALLEL("J:")
+			"\0" "-2" /* at least 2 args */
+			IF_FEATURE_ZIP_PARALLEL(, &workers)
+	);
 	argv += optind;
-	return bbunpack(argv, pack_gzip, append_ext, "gz");
+
+	memset(&zs, 0, sizeof(zs));
+	zs.method = (opt & OPT_0) ? 0 : 8;
+	zs.quiet = (opt & OPT_q);
+	zs.junk_paths = (opt & OPT_j);
+
+	alloc_globals();
+#if ENABLE_FEATURE_GZIP_LEVELS
+	set_comp_level((opt >> OPTBIT_1) & 0x1ff);
+#endif
+#if ENABLE_FEATURE_ZIP_PARALLEL
+	if (workers) {
+		zs.workers = xatou_range(workers, 1, 1024);
+		zs.jobs = xzalloc(zs.workers * sizeof(zs.jobs[0]));
+	}
+#endif
+
+	zs.msg = stderr;
+	if (!LONE_DASH(argv[0])) {
+		zs.msg = xfdopen_for_write(dup(STDOUT_FILENO));
+		xmove_fd(xopen(argv[0], O_WRONLY | O_CREAT | O_TRUNC), ofd);
+	}
+	xfstat(ofd, &st, argv[0]);
+	zs.out_dev = st.st_dev;
+	zs.out_ino = st.st_ino;
+
+	while (*++argv) {
+		if (LONE_DASH(*argv)) {
+			xfstat(STDIN_FILENO, &st, "stdin");
+			zip_add_member(&zs, "-", &st, STDIN_FILENO);
+			continue;
+		}
+		if (!recursive_action(*argv,
+				ACTION_FOLLOWLINKS | ((opt & OPT_r) ? ACTION_RECURSE : 0),
+				zip_add, zip_add, &zs)
+		) {
+			retval = EXIT_FAILURE;
+		}
+	}
+#if ENABLE_FEATURE_ZIP_PARALLEL
+	while (zs.job_cnt)
+		zip_finish_job(&zs);
+#endif
+	zip_write_cdir(&zs);
+
+	return retval;
 }
+#endif /* ZIP */
@@ -210,6 +210,225 @@ void fallbackQSort3(uint32_t* fmap,
 #undef FALLBACK_QSORT_STACK_SIZE
 
 
+#if ENABLE_FEATURE_BZIP2_SAIS
+/*---------------------------------------------*/
+/* Suffix array construction by induced sorting (SA-IS):
+ * G. Nong, S. Zhang, W. H. Chan, "Two Efficient Algorithms
+ * for Linear Time Suffix Array Construction", 2011.
+ *
+ * Text T[0..n-1] is followed by a virtual sentinel, smaller than
+ * any character. Characters are bytes (cs == 1) or names of
+ * LMS substrings (cs == 4, reduced problem).
+ * Running time is linear, however repetitive the text is.
+ */
+#define sais_chr(i)   (cs == 1 ? ((const uint8_t*)T)[i] : ((const int32_t*)T)[i])
+#define sais_isS(i)   ((types[(i) >> 3] >> ((i) & 7)) & 1)
+#define sais_isLMS(i) ((i) > 0 && sais_isS(i) && !sais_isS((i) - 1))
+
+static
+void sais_buckets(const void *T, int32_t *bkt, int32_t n, int32_t K, int cs, int end)
+{
+	int32_t i, sum;
+
+	memset(bkt, 0, (K + 1) * sizeof(bkt[0]));
+	for (i = 0; i < n; i++)
+		bkt[sais_chr(i)]++;
+	sum = 0;
+	for (i = 0; i <= K; i++) {
+		sum += bkt[i];
+		bkt[i] = end ? sum : sum - bkt[i];
+	}
+}
+
+static
+void sais_induce(const void *T, int32_t *SA, const uint8_t *types,
+		int32_t *bkt, int32_t n, int32_t K, int cs)
+{
+	int32_t i, j;
+
+	/* L-type suffixes, left to right */
+	sais_buckets(T, bkt, n, K, cs, 0);
+	/* The suffix before the sentinel is L-type and is induced first */
+	SA[bkt[sais_chr(n - 1)]++] = n - 1;
+	for (i = 0; i < n; i++) {
+		j = SA[i] - 1;
+		if (j >= 0 && !sais_isS(j))
+			SA[bkt[sais_chr(j)]++] = j;
+	}
+	/* S-type suffixes, right to left */
+	sais_buckets(T, bkt, n, K, cs, 1);
+	for (i = n - 1; i >= 0; i--) {
+		j = SA[i] - 1;
+		if (j >= 0 && sais_isS(j))
+			SA[--bkt[sais_chr(j)]] = j;
+	}
+}
+
+/* Returns 0 if out of memory */
+static
+int sais_main(const void *T, int32_t *SA, int32_t n, int32_t K, int cs)
+{
+	uint8_t *types;
+	int32_t *bkt;
+	int32_t *s1;
+	int32_t i, j, n1, name, prev;
+	int ok = 0;
+
+	types = calloc(n / 8 + 1, 1);
+	bkt = malloc((K + 1) * sizeof(bkt[0]));
+	if (!types || !bkt)
+		goto ret;
+
+	/* S-type: smaller than the next suffix.
+	 * T[n-1] is L-type, it is larger than the sentinel.
+	 */
+	for (i = n - 2; i >= 0; i--) {
+		int32_t c0 = sais_chr(i);
+		int32_t c1 = sais_chr(i + 1);
+		if (c0 < c1 || (c0 == c1 && sais_isS(i + 1)))
+			types[i >> 3] |= 1 << (i & 7);
+	}
+
+	/* Stage 1: sort LMS substrings */
+	sais_buckets(T, bkt, n, K, cs, 1);
+	for (i = 0; i < n; i++)
+		SA[i] = -1;
+	for (i = 1; i < n; i++)
+		if (sais_isLMS(i))
+			SA[--bkt[sais_chr(i)]] = i;
+	sais_induce(T, SA, types, bkt, n, K, cs);
+
+	/* Move sorted LMS substrings to SA[0..n1-1] */
+	n1 = 0;
+	for (i = 0; i < n; i++)
+		if (sais_isLMS(SA[i]))
+			SA[n1++] = SA[i];
+
+	/* Name them: equal substrings get equal names.
+	 * LMS positions are at least 2 apart, n1 <= n/2:
+	 * names can be stored in SA[n1 + pos/2].
+	 */
+	for (i = n1; i < n; i++)
+		SA[i] = -1;
+	name = 0;
+	prev = -1;
+	for (i = 0; i < n1; i++) {
+		int32_t pos = SA[i];
+		int32_t d;
+		for (d = 0; ; d++) {
+			if (prev < 0 || pos + d == n || prev + d == n
+			 || sais_chr(pos + d) != sais_chr(prev + d)
+			 || sais_isS(pos + d) != sais_isS(prev + d)
+			) {
+				name++;
+				prev = pos;
+				break;
+			}
+			if (d > 0 && (sais_isLMS(pos + d) || sais_isLMS(prev + d)))
+				break;
+		}
+		SA[n1 + pos / 2] = name - 1;
+	}
+	for (i = j = n - 1; i >= n1; i--)
+		if (SA[i] >= 0)
+			SA[j--] = SA[i];
+
+	/* Stage 2: sort suffixes of the reduced text s1 */
+	s1 = SA + n - n1;
+	if (name < n1) {
+		if (!sais_main(s1, SA, n1, name - 1, sizeof(int32_t)))
+			goto ret;
+	} else {
+		/* All names are unique, order is known */
+		for (i = 0; i < n1; i++)
+			SA[s1[i]] = i;
+	}
+
+	/* Stage 3: induce the result from sorted LMS suffixes */
+	sais_buckets(T, bkt, n, K, cs, 1);
+	for (i = 1, j = 0; i < n; i++)
+		if (sais_isLMS(i))
+			s1[j++] = i;
+	for (i = 0; i < n1; i++)
+		SA[i] = s1[SA[i]];
+	for (i = n1; i < n; i++)
+		SA[i] = -1;
+	for (i = n1 - 1; i >= 0; i--) {
+		j = SA[i];
+		SA[i] = -1;
+		SA[--bkt[sais_chr(j)]] = j;
+	}
+	sais_induce(T, SA, types, bkt, n, K, cs);
+	ok = 1;
+ ret:
+	free(bkt);
+	free(types);
+	return ok;
+}
+
+#undef sais_chr
+#undef sais_isS
+#undef sais_isLMS
+
+/* Is block a repetition of a shorter string? Uses KMP prefix function:
+ * block[0..n-1] has period n - pi[n-1], block is its power
+ * if the period divides n. PI is scratch space for n ints.
+ */
+static
+int is_periodic(const uint8_t *block, int32_t n, int32_t *pi)
+{
+	int32_t i, k;
+
+	pi[0] = k = 0;
+	for (i = 1; i < n; i++) {
+		while (k > 0 && block[i] != block[k])
+			k = pi[k - 1];
+		if (block[i] == block[k])
+			k++;
+		pi[i] = k;
+	}
+	return k != 0 && n % (n - k) == 0;
+}
+
+/* Sort rotations of the block using suffix array of block+block:
+ * for i,j < nblock, suffixes i and j of it are ordered as rotations
+ * i and j are.
+ * Only a periodic block has equal rotations. Their order decides
+ * origPtr, and SA-IS would not order them the way fallbackSort does,
+ * so such blocks are left to fallbackSort: output stays identical
+ * to bzip2's.
+ * Needs 8*nblock bytes of memory. Returns 0 if there is not enough,
+ * or block is periodic.
+ */
+static NOINLINE
+int saisSort(EState* state)
+{
+	uint8_t *const block = state->block;
+	const int32_t  nblock = state->nblock;
+	int32_t *SA;
+	int32_t i, j;
+
+	SA = malloc(2 * nblock * sizeof(SA[0]));
+	if (!SA)
+		return 0;
+	if (is_periodic(block, nblock, SA)) {
+		free(SA);
+		return 0;
+	}
+	/* arr2 is 4*nblock bytes long, there is room for the second copy */
+	memcpy(block + nblock, block, nblock);
+	i = sais_main(block, SA, 2 * nblock, 255, 1);
+	if (i) {
+		for (i = j = 0; i < 2 * nblock; i++)
+			if (SA[i] < nblock)
+				state->ptr[j++] = SA[i];
+		i = 1;
+	}
+	free(SA);
+	return i;
+}
+#endif
+
 /*---------------------------------------------*/
 /* Pre:
  *	nblock > 0
@@ -1055,6 +1274,11 @@ int32_t BZ2_blockSort(EState* state)
 		mainSort(state);
 		if (state->budget >= 0)
 			goto good;
+#if ENABLE_FEATURE_BZIP2_SAIS
+		/* Data is very repetitive, use linear time sort */
+		if (saisSort(state))
+			goto good;
+#endif
 	}
 	fallbackSort(state);
  good:
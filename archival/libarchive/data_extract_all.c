@@ -5,17 +5,46 @@
 #include "libbb.h"
 #include "bb_archive.h"
 
+static void get_owner(archive_handle_t *archive_handle, uid_t *uidp, gid_t *gidp)
+{
+	file_header_t *file_header = archive_handle->file_header;
+	uid_t uid = file_header->uid;
+	gid_t gid = file_header->gid;
+#if ENABLE_FEATURE_TAR_UNAME_GNAME
+	if (!(archive_handle->ah_flags & ARCHIVE_NUMERIC_OWNER)) {
+		if (file_header->tar__uname) {
+//TODO: cache last name/id pair?
+			struct passwd *pwd = getpwnam(file_header->tar__uname);
+			if (pwd) uid = pwd->pw_uid;
+		}
+		if (file_header->tar__gname) {
+			struct group *grp = getgrnam(file_header->tar__gname);
+			if (grp) gid = grp->gr_gid;
+		}
+	}
+#endif
+	*uidp = uid;
+	*gidp = gid;
+}
+
 void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 {
 	file_header_t *file_header = archive_handle->file_header;
 	int dst_fd;
 	int res;
 	char *hard_link;
+	uid_t uid;
+	gid_t gid;
 #if ENABLE_FEATURE_TAR_LONG_OPTIONS
 	char *dst_name;
 #else
 # define dst_name (file_header->name)
 #endif
+#if ENABLE_FEATURE_TAR_PARALLEL
+	int to_writer;
+#else
+# define to_writer 0
+#endif
 
 #if ENABLE_FEATURE_TAR_SELINUX
 	char *sctx = archive_handle->tar__sctx[PAX_NEXT_FILE];
@@ -34,6 +63,13 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 	if (S_ISREG(file_header->mode) && file_header->size == 0)
 		hard_link = file_header->link_target;
 
+#if ENABLE_FEATURE_TAR_PARALLEL
+	/* Regular files go to writer processes, if we have them */
+	to_writer = archive_handle->tar__writers
+		&& S_ISREG(file_header->mode) && !hard_link
+		IF_FEATURE_TAR_SELINUX(&& !sctx);
+#endif
+
 #if ENABLE_FEATURE_TAR_LONG_OPTIONS
 	dst_name = file_header->name;
 	if (archive_handle->tar__strip_components) {
@@ -89,7 +125,8 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 
 	if (archive_handle->ah_flags & ARCHIVE_UNLINK_OLD) {
 		/* Remove the entry if it exists */
-		if (!S_ISDIR(file_header->mode)) {
+		/* (writer does it itself, after earlier files of the same name) */
+		if (!S_ISDIR(file_header->mode) && !to_writer) {
 			if (hard_link) {
 				/* Ugly special case:
 				 * tar cf t.tar hardlink1 hardlink2 hardlink1
@@ -150,6 +187,13 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 		int flags = O_WRONLY | O_CREAT | O_EXCL;
 		if (archive_handle->ah_flags & ARCHIVE_O_TRUNC)
 			flags = O_WRONLY | O_CREAT | O_TRUNC;
+		if (to_writer) {
+#if ENABLE_FEATURE_TAR_PARALLEL
+			get_owner(archive_handle, &uid, &gid);
+			queue_to_extract_writer(archive_handle, dst_name, uid, gid);
+#endif
+			goto ret;
+		}
 		dst_nameN = dst_name;
 #ifdef ARCHIVE_REPLACE_VIA_RENAME
 		if (archive_handle->ah_flags & ARCHIVE_REPLACE_VIA_RENAME)
@@ -182,6 +226,14 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 		) {
 			bb_perror_msg("can't make dir %s", dst_name);
 		}
+#if ENABLE_FEATURE_TAR_PARALLEL
+		if (archive_handle->tar__writers) {
+			/* Writers may still be filling it */
+			get_owner(archive_handle, &uid, &gid);
+			defer_extracted_dir(archive_handle, dst_name, uid, gid);
+			goto ret;
+		}
+#endif
 		break;
 	case S_IFLNK:
 		/* Symlink */
@@ -227,21 +279,7 @@ void FAST_FUNC data_extract_all(archive_handle_t *archive_handle)
 
 	if (!S_ISLNK(file_header->mode)) {
 		if (!(archive_handle->ah_flags & ARCHIVE_DONT_RESTORE_OWNER)) {
-			uid_t uid = file_header->uid;
-			gid_t gid = file_header->gid;
-#if ENABLE_FEATURE_TAR_UNAME_GNAME
-			if (!(archive_handle->ah_flags & ARCHIVE_NUMERIC_OWNER)) {
-				if (file_header->tar__uname) {
-//TODO: cache last name/id pair?
-					struct passwd *pwd = getpwnam(file_header->tar__uname);
-					if (pwd) uid = pwd->pw_uid;
-				}
-				if (file_header->tar__gname) {
-					struct group *grp = getgrnam(file_header->tar__gname);
-					if (grp) gid = grp->gr_gid;
-				}
-			}
-#endif
+			get_owner(archive_handle, &uid, &gid);
 			/* GNU tar 1.15.1 uses chown, not lchown */
 			chown(dst_name, uid, gid);
 		}
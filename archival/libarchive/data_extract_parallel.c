@@ -0,0 +1,212 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ */
+#include "libbb.h"
+#include "bb_archive.h"
+
+/* Pool of writer processes for data_extract_all().
+ *
+ * The process reading (and possibly decompressing) the archive passes
+ * each regular file to a writer over a pipe: a job header, the name,
+ * then file data. Writer creates the file and sets its owner, mode
+ * and mtime. With many small files these syscalls dominate, and
+ * N writers can have N of them in flight.
+ *
+ * Files are assigned to writers by name hash, thus several members
+ * with the same name are written in archive order.
+ *
+ * Directory metadata is restored at the very end (writers may still be
+ * creating files in a directory we would make read-only, or whose
+ * mtime we would set).
+ */
+
+struct writer_job {
+	off_t size;
+	time_t mtime;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	unsigned ah_flags;
+	unsigned name_len;
+};
+
+struct deferred_dir {
+	time_t mtime;
+	uid_t uid;
+	gid_t gid;
+	mode_t mode;
+	char name[1];
+};
+
+struct extract_writers {
+	llist_t *dirs;
+	unsigned cnt;
+	struct {
+		int fd;
+		pid_t pid;
+	} w[];
+};
+
+static void writer_main(int fd) NORETURN;
+static void writer_main(int fd)
+{
+	struct writer_job job;
+	char *name = NULL;
+
+	while (full_read(fd, &job, sizeof(job)) == sizeof(job)) {
+		int dst_fd;
+		int flags = O_WRONLY | O_CREAT | O_EXCL;
+
+		name = xrealloc(name, job.name_len + 1);
+		xread(fd, name, job.name_len);
+		name[job.name_len] = '\0';
+
+		if ((job.ah_flags & ARCHIVE_UNLINK_OLD)
+		 && unlink(name) == -1
+		 && errno != ENOENT
+		) {
+			bb_perror_msg_and_die("can't remove old file %s", name);
+		}
+		if (job.ah_flags & ARCHIVE_O_TRUNC)
+			flags = O_WRONLY | O_CREAT | O_TRUNC;
+		dst_fd = xopen3(name, flags, job.mode);
+		bb_copyfd_exact_size(fd, dst_fd, job.size);
+
+		/* Same as data_extract_all(), but without name lookups */
+		if (!(job.ah_flags & ARCHIVE_DONT_RESTORE_OWNER))
+			fchown(dst_fd, job.uid, job.gid);
+		if (!(job.ah_flags & ARCHIVE_DONT_RESTORE_PERM))
+			fchmod(dst_fd, job.mode);
+		if (job.ah_flags & ARCHIVE_RESTORE_DATE) {
+			struct timespec t[2];
+
+			t[1].tv_sec = t[0].tv_sec = job.mtime;
+			t[1].tv_nsec = t[0].tv_nsec = 0;
+			futimens(dst_fd, t);
+		}
+		close(dst_fd);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+void FAST_FUNC start_extract_writers(archive_handle_t *archive_handle, unsigned cnt)
+{
+	struct extract_writers *ew;
+	unsigned i;
+
+	ew = xzalloc(sizeof(*ew) + cnt * sizeof(ew->w[0]));
+	ew->cnt = cnt;
+	/* Writer's death should be reported as write error, not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	fflush_all();
+	for (i = 0; i < cnt; i++) {
+		struct fd_pair fd_pipe;
+
+		xpiped_pair(fd_pipe);
+#ifdef F_SETPIPE_SZ
+		/* Let us run ahead of a writer busy creating a file */
+		fcntl(fd_pipe.wr, F_SETPIPE_SZ, 1024 * 1024);
+#endif
+		ew->w[i].pid = xfork();
+		if (ew->w[i].pid == 0) {
+			/* Child */
+			unsigned j;
+			/* Otherwise writers started earlier never see EOF */
+			for (j = 0; j < i; j++)
+				close(ew->w[j].fd);
+			close(fd_pipe.wr);
+			close(archive_handle->src_fd);
+			writer_main(fd_pipe.rd);
+		}
+		close(fd_pipe.rd);
+		ew->w[i].fd = fd_pipe.wr;
+	}
+	archive_handle->tar__writers = ew;
+}
+
+void FAST_FUNC queue_to_extract_writer(archive_handle_t *archive_handle,
+		const char *dst_name, uid_t uid, gid_t gid)
+{
+	file_header_t *file_header = archive_handle->file_header;
+	struct extract_writers *ew = archive_handle->tar__writers;
+	struct writer_job *job;
+	unsigned len = strlen(dst_name);
+	unsigned hash = 0;
+	const char *p;
+	int fd;
+
+	for (p = dst_name; *p; p++)
+		hash = hash * 31 + (unsigned char)*p;
+	fd = ew->w[hash % ew->cnt].fd;
+
+	job = xzalloc(sizeof(*job) + len);
+	job->size = file_header->size;
+	job->mtime = file_header->mtime;
+	job->uid = uid;
+	job->gid = gid;
+	job->mode = file_header->mode;
+	job->ah_flags = archive_handle->ah_flags;
+	job->name_len = len;
+	memcpy(job + 1, dst_name, len);
+	xwrite(fd, job, sizeof(*job) + len);
+	free(job);
+
+	bb_copyfd_exact_size(archive_handle->src_fd, fd, file_header->size);
+}
+
+void FAST_FUNC defer_extracted_dir(archive_handle_t *archive_handle,
+		const char *dst_name, uid_t uid, gid_t gid)
+{
+	file_header_t *file_header = archive_handle->file_header;
+	struct extract_writers *ew = archive_handle->tar__writers;
+	struct deferred_dir *dir;
+
+	dir = xmalloc(sizeof(*dir) + strlen(dst_name));
+	dir->mtime = file_header->mtime;
+	dir->uid = uid;
+	dir->gid = gid;
+	dir->mode = file_header->mode;
+	strcpy(dir->name, dst_name);
+	/* Prepending: subdirs will be fixed up before their parents */
+	llist_add_to(&ew->dirs, dir);
+}
+
+int FAST_FUNC stop_extract_writers(archive_handle_t *archive_handle)
+{
+	struct extract_writers *ew = archive_handle->tar__writers;
+	unsigned i;
+	int err = 0;
+
+	for (i = 0; i < ew->cnt; i++)
+		close(ew->w[i].fd); /* send EOF */
+	for (i = 0; i < ew->cnt; i++) {
+		int status;
+		if (safe_waitpid(ew->w[i].pid, &status, 0) < 0 || status != 0)
+			err = 1;
+	}
+	return err;
+}
+
+void FAST_FUNC fixup_extracted_dirs(archive_handle_t *archive_handle)
+{
+	struct extract_writers *ew = archive_handle->tar__writers;
+	unsigned ah_flags = archive_handle->ah_flags;
+
+	while (ew->dirs) {
+		struct deferred_dir *dir = llist_pop(&ew->dirs);
+
+		if (!(ah_flags & ARCHIVE_DONT_RESTORE_OWNER))
+			chown(dir->name, dir->uid, dir->gid);
+		if (!(ah_flags & ARCHIVE_DONT_RESTORE_PERM))
+			chmod(dir->name, dir->mode);
+		if (ah_flags & ARCHIVE_RESTORE_DATE) {
+			struct timeval t[2];
+
+			t[1].tv_sec = t[0].tv_sec = dir->mtime;
+			t[1].tv_usec = t[0].tv_usec = 0;
+			utimes(dir->name, t);
+		}
+		free(dir);
+	}
+}
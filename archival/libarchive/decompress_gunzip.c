@@ -115,6 +115,13 @@ typedef struct state_t {
 	unsigned inflate_stored_k;
 	unsigned inflate_stored_w;
 
+#if ENABLE_FEATURE_TAR_INDEX
+	/* access points */
+	transformer_state_t *xstate;
+	off_t ap_base; /* output of preceding gzip members */
+	off_t ap_last; /* last reported access point */
+#endif
+
 	const char *error_msg;
 	jmp_buf error_jmp;
 } state_t;
@@ -152,6 +159,9 @@ typedef struct state_t {
 #define inflate_stored_b    (S()inflate_stored_b   )
 #define inflate_stored_k    (S()inflate_stored_k   )
 #define inflate_stored_w    (S()inflate_stored_w   )
+#define ap_xstate           (S()xstate             )
+#define ap_base             (S()ap_base            )
+#define ap_last             (S()ap_last            )
 #define error_msg           (S()error_msg          )
 #define error_jmp           (S()error_jmp          )
 
@@ -959,11 +969,35 @@ static void calculate_gunzip_crc(STATE_PARAM_ONLY)
 	gunzip_bytes_out += gunzip_outbuf_count;
 }
 
+#if ENABLE_FEATURE_TAR_INDEX
+/* We are between two deflate blocks: if enough data was produced
+ * since the last access point, describe how to restart from here */
+static void report_access_point(STATE_PARAM_ONLY)
+{
+	gz_access_point_t ap;
+	off_t pos;
+	unsigned back;
+
+	ap.out = ap_base + gunzip_bytes_out + gunzip_outbuf_count;
+	if (ap.out - ap_last < ap_xstate->gz_ap_span)
+		return;
+	pos = lseek(gunzip_src_fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return; /* pipe? */
+	ap_last = ap.out;
+	/* Bytes we read ahead, plus bytes partially sitting in the bit buffer */
+	back = (gunzip_bk + 7) >> 3;
+	ap.in = pos - (bytebuffer_size - bytebuffer_offset) - back;
+	ap.bits = back * 8 - gunzip_bk;
+	ap.wpos = gunzip_outbuf_count;
+	ap.window = gunzip_window;
+	ap_xstate->gz_access_point(&ap);
+}
+#endif
+
 /* One callsite in inflate_unzip_internal */
 static int inflate_get_next_window(STATE_PARAM_ONLY)
 {
-	gunzip_outbuf_count = 0;
-
 	while (1) {
 		int ret;
 
@@ -974,6 +1008,10 @@ static int inflate_get_next_window(STATE_PARAM_ONLY)
 				/* NB: need_another_block is still set */
 				return 0; /* Last block */
 			}
+#if ENABLE_FEATURE_TAR_INDEX
+			if (ap_xstate->gz_access_point)
+				report_access_point(PASS_STATE_ONLY);
+#endif
 			method = inflate_block(PASS_STATE &end_reached);
 			need_another_block = 0;
 		}
@@ -1005,6 +1043,7 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long) int n = 0;
 	ssize_t nwrote;
+	unsigned skip = 0;
 
 	/* Allocate all global buffers (for DYN_ALLOC option) */
 	gunzip_window = xmalloc(GUNZIP_WSIZE);
@@ -1031,15 +1070,36 @@ inflate_unzip_internal(STATE_PARAM transformer_state_t *xstate)
 		goto ret;
 	}
 
+#if ENABLE_FEATURE_TAR_INDEX
+	ap_xstate = xstate;
+	if (xstate->gz_resume) {
+		const gz_access_point_t *ap = xstate->gz_resume;
+
+		xlseek(gunzip_src_fd, ap->in, SEEK_SET);
+		bytebuffer_offset = bytebuffer_size;
+		if (ap->bits) {
+			unsigned k = 0;
+			gunzip_bb = fill_bitbuffer(PASS_STATE 0, &k, 8) >> ap->bits;
+			gunzip_bk = 8 - ap->bits;
+		}
+		memcpy(gunzip_window, ap->window, GUNZIP_WSIZE);
+		/* Data before wpos was already output by whoever made the point */
+		gunzip_outbuf_count = skip = ap->wpos;
+		ap_base = ap->out - skip;
+		ap_last = ap->out;
+	}
+#endif
+
 	while (1) {
 		int r = inflate_get_next_window(PASS_STATE_ONLY);
-		nwrote = transformer_write(xstate, gunzip_window, gunzip_outbuf_count);
+		nwrote = transformer_write(xstate, gunzip_window + skip, gunzip_outbuf_count - skip);
 		if (nwrote == (ssize_t)-1) {
 			n = -1;
 			goto ret;
 		}
 		IF_DESKTOP(n += nwrote;)
 		if (r == 0) break;
+		gunzip_outbuf_count = skip = 0;
 	}
 
 	/* Store unused bytes in a global buffer so calling applets can access it */
@@ -1251,6 +1311,10 @@ unpack_gz_stream(transformer_state_t *xstate)
 	bytebuffer = xmalloc(bytebuffer_max);
 	gunzip_src_fd = xstate->src_fd;
 
+#if ENABLE_FEATURE_TAR_INDEX
+	if (xstate->gz_resume)
+		goto inflate;
+#endif
  again:
 	if (!check_header_gzip(PASS_STATE xstate)) {
 		bb_simple_error_msg("corrupted data");
@@ -1258,6 +1322,7 @@ unpack_gz_stream(transformer_state_t *xstate)
 		goto ret;
 	}
 
+ IF_FEATURE_TAR_INDEX(inflate:)
 	n = inflate_unzip_internal(PASS_STATE xstate);
 	if (n < 0) {
 		total = -1;
@@ -1271,6 +1336,17 @@ unpack_gz_stream(transformer_state_t *xstate)
 		goto ret;
 	}
 
+#if ENABLE_FEATURE_TAR_INDEX
+	ap_base += gunzip_bytes_out;
+	if (xstate->gz_resume) {
+		/* We did not see the beginning of this member,
+		 * crc and length can't match */
+		xstate->gz_resume = NULL;
+		bytebuffer_offset += 8;
+		goto next_member;
+	}
+#endif
+
 	/* Validate decompression - crc */
 	v32 = buffer_read_le_u32(PASS_STATE_ONLY);
 	if ((~gunzip_crc) != v32) {
@@ -1286,6 +1362,7 @@ unpack_gz_stream(transformer_state_t *xstate)
 		total = -1;
 	}
 
+ IF_FEATURE_TAR_INDEX(next_member:)
 	if (!top_up(PASS_STATE 2))
 		goto ret; /* EOF */
 
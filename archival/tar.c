@@ -103,6 +103,28 @@
 //config:	default y
 //config:	depends on TAR
 //config:
+//config:config FEATURE_TAR_INDEX
+//config:	bool "Support random access index (--index)"
+//config:	default y
+//config:	depends on TAR && FEATURE_TAR_LONG_OPTIONS
+//config:	help
+//config:	"tar -t --index IDX" records where each member starts
+//config:	(and, for gzipped tarballs, points where decompression
+//config:	can be restarted) in the file IDX. "tar -x --index IDX FILE"
+//config:	then goes straight to FILE instead of reading and
+//config:	decompressing the whole archive up to it.
+//config:
+//config:config FEATURE_TAR_PARALLEL
+//config:	bool "Support parallel file creation (--writers)"
+//config:	default y
+//config:	depends on TAR && FEATURE_TAR_LONG_OPTIONS && !NOMMU && PLATFORM_POSIX
+//config:	help
+//config:	"tar -x --writers N" creates extracted files in N helper
+//config:	processes, while tar itself keeps reading the archive.
+//config:	This helps when unpacking many small files, where
+//config:	time is spent in open/chown/utimes/close, especially
+//config:	on network filesystems.
+//config:
 //config:config FEATURE_TAR_SELINUX
 //config:	bool "Support extracting SELinux labels"
 //config:	default n
@@ -762,6 +784,308 @@ static llist_t *append_file_list_to_list(llist_t *list)
 }
 #endif
 
+#if ENABLE_FEATURE_TAR_INDEX
+/* Index file: a header followed by records in host byte order.
+ * 'M' record: offset of member's first header block (including
+ * longname/pax blocks) in uncompressed tar stream, followed by name.
+ * 'C' record: gzip access point, followed by its 32k window.
+ * 'C' records are appended by gunzip child while we append 'M' ones,
+ * so they interleave. Each record is written with one write()
+ * to O_APPEND fd, thus they don't mix.
+ */
+# define TAR_INDEX_MAGIC "BBTARIX1"
+/* Uncompressed bytes between access points. Seeking decompresses
+ * up to this much, each access point takes 32k of index */
+# define TAR_INDEX_SPAN  (4 * 1024 * 1024)
+# define TAR_INDEX_GZ    (BB_MMU && ENABLE_FEATURE_SEAMLESS_GZ)
+
+struct tar_index_hdr {
+	char magic[8];
+	uint64_t arch_size;   /* to detect stale index */
+	uint64_t arch_mtime;
+	uint32_t gzipped;
+	uint32_t unused;
+};
+struct tar_index_rec {
+	uint64_t out;  /* offset in uncompressed tar stream */
+	uint64_t in;   /* 'C': offset in .gz file, 'M': name length */
+	uint16_t wpos;
+	uint8_t bits;
+	char type;
+	uint32_t unused;
+};
+
+struct tar_index_ap {
+	gz_access_point_t ap;
+	off_t window_ofs;     /* window's position in index file */
+};
+
+struct tar_index {
+	int idx_fd;
+	int arch_fd;
+	smallint gzipped;
+	smallint building;
+	pid_t pid;            /* gunzip child */
+	off_t hdr_start;      /* where current member starts */
+	void FAST_FUNC (*action_header)(const file_header_t *);
+	struct tar_index_rec *ap_buf;
+	uint8_t *window;
+	unsigned ap_cnt;
+	struct tar_index_ap *aps;
+	unsigned member_cnt;
+	off_t *members;       /* offsets of members we want */
+};
+static struct tar_index *tar_idx;
+
+static struct tar_index *open_index(archive_handle_t *tar_handle,
+		const char *index_filename, int building)
+{
+	struct tar_index *ti;
+	struct tar_index_hdr hdr;
+	struct tar_index_rec rec;
+	struct stat st;
+	uint16_t magic;
+	int r;
+
+	tar_idx = ti = xzalloc(sizeof(*ti));
+	ti->building = building;
+	ti->arch_fd = tar_handle->src_fd;
+	xfstat(ti->arch_fd, &st, "archive");
+	if (!S_ISREG(st.st_mode))
+		bb_simple_error_msg_and_die("--index needs an existing archive file");
+	xread(ti->arch_fd, &magic, 2);
+	xlseek(ti->arch_fd, 0, SEEK_SET);
+
+	if (building) {
+		if (magic == GZIP_MAGIC) {
+			if (!TAR_INDEX_GZ)
+				goto unsupported;
+			ti->gzipped = 1;
+		} else
+		if (magic == BZIP2_MAGIC || magic == XZ_MAGIC1 || magic == COMPRESS_MAGIC) {
+ unsupported:
+			bb_simple_error_msg_and_die("can't index this compression format");
+		}
+		ti->idx_fd = xopen(index_filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND);
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TAR_INDEX_MAGIC, 8);
+		hdr.arch_size = st.st_size;
+		hdr.arch_mtime = st.st_mtime;
+		hdr.gzipped = ti->gzipped;
+		xwrite(ti->idx_fd, &hdr, sizeof(hdr));
+		return ti;
+	}
+
+	ti->idx_fd = xopen(index_filename, O_RDONLY);
+	if (full_read(ti->idx_fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+	 || memcmp(hdr.magic, TAR_INDEX_MAGIC, 8) != 0
+	) {
+		goto bad;
+	}
+	if (hdr.arch_size != (uint64_t)st.st_size
+	 || hdr.arch_mtime != (uint64_t)st.st_mtime
+	) {
+		bb_error_msg_and_die("index '%s' is out of date", index_filename);
+	}
+	ti->gzipped = hdr.gzipped;
+	if (ti->gzipped && !TAR_INDEX_GZ)
+		goto unsupported;
+
+	while ((r = full_read(ti->idx_fd, &rec, sizeof(rec))) == sizeof(rec)) {
+		if (rec.type == 'C') {
+			struct tar_index_ap *tap;
+
+			ti->aps = xrealloc_vector(ti->aps, 6, ti->ap_cnt);
+			tap = &ti->aps[ti->ap_cnt++];
+			tap->ap.out = rec.out;
+			tap->ap.in = rec.in;
+			tap->ap.bits = rec.bits;
+			tap->ap.wpos = rec.wpos;
+			tap->window_ofs = xlseek(ti->idx_fd, GZ_AP_WINDOW_SIZE, SEEK_CUR)
+						- GZ_AP_WINDOW_SIZE;
+		} else
+		if (rec.type == 'M' && rec.in <= 0xfff) {
+			file_header_t *file_header = tar_handle->file_header;
+
+			file_header->name = xzalloc(rec.in + 1);
+			xread(ti->idx_fd, file_header->name, rec.in);
+			/* Same decision get_header_tar() will make */
+			if (tar_handle->filter(tar_handle) == EXIT_SUCCESS) {
+				ti->members = xrealloc_vector(ti->members, 6, ti->member_cnt);
+				ti->members[ti->member_cnt++] = rec.out;
+			}
+			free(file_header->name);
+		} else
+			goto bad;
+	}
+	if (r != 0) {
+ bad:
+		bb_error_msg_and_die("index '%s' is corrupted", index_filename);
+	}
+	return ti;
+}
+
+/* Runs in gunzip child */
+static void FAST_FUNC index_access_point(const gz_access_point_t *ap)
+{
+	struct tar_index *ti = tar_idx;
+	struct tar_index_rec *rec = ti->ap_buf;
+
+	if (!rec)
+		ti->ap_buf = rec = xmalloc(sizeof(*rec) + GZ_AP_WINDOW_SIZE);
+	memset(rec, 0, sizeof(*rec));
+	rec->type = 'C';
+	rec->out = ap->out;
+	rec->in = ap->in;
+	rec->bits = ap->bits;
+	rec->wpos = ap->wpos;
+	memcpy(rec + 1, ap->window, GZ_AP_WINDOW_SIZE);
+	xwrite(ti->idx_fd, rec, sizeof(*rec) + GZ_AP_WINDOW_SIZE);
+}
+
+static void FAST_FUNC index_member(const file_header_t *file_header)
+{
+	struct tar_index *ti = tar_idx;
+	struct tar_index_rec *rec;
+	unsigned len = strlen(file_header->name);
+
+	rec = xzalloc(sizeof(*rec) + len);
+	rec->type = 'M';
+	rec->out = ti->hdr_start;
+	rec->in = len;
+	memcpy(rec + 1, file_header->name, len);
+	xwrite(ti->idx_fd, rec, sizeof(*rec) + len);
+	free(rec);
+
+	ti->action_header(file_header);
+}
+
+# if TAR_INDEX_GZ
+static void start_gunzip(archive_handle_t *tar_handle, struct tar_index *ti,
+		const gz_access_point_t *resume)
+{
+	struct fd_pair fd_pipe;
+
+	xpiped_pair(fd_pipe);
+	ti->pid = xfork();
+	if (ti->pid == 0) {
+		transformer_state_t xstate;
+
+		close(fd_pipe.rd);
+		init_transformer_state(&xstate);
+		xstate.src_fd = ti->arch_fd;
+		xstate.dst_fd = fd_pipe.wr;
+		xstate.gz_resume = resume;
+		if (resume) /* gunzip seeks to resume->in, not to the header */
+			xstate.signature_skipped = 2;
+		else
+			xlseek(ti->arch_fd, 0, SEEK_SET);
+		if (ti->building) {
+			xstate.gz_access_point = index_access_point;
+			xstate.gz_ap_span = TAR_INDEX_SPAN;
+		}
+		/* must be _exit! see fork_transformer() */
+		_exit(/*error if:*/ unpack_gz_stream(&xstate) < 0);
+	}
+	close(fd_pipe.wr);
+	tar_handle->src_fd = fd_pipe.rd;
+	tar_handle->seek = seek_by_read;
+	tar_handle->offset = resume ? resume->out : 0;
+}
+
+static void stop_gunzip(archive_handle_t *tar_handle, struct tar_index *ti)
+{
+	close(tar_handle->src_fd);
+	kill(ti->pid, SIGKILL);
+	safe_waitpid(ti->pid, NULL, 0);
+	ti->pid = 0;
+}
+
+/* Position decompressed stream at 'target' */
+static void gunzip_seek(archive_handle_t *tar_handle, struct tar_index *ti, off_t target)
+{
+	struct tar_index_ap *best = NULL;
+	unsigned lo = 0, hi = ti->ap_cnt;
+
+	/* Find last access point at or before target */
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (ti->aps[mid].ap.out <= target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo)
+		best = &ti->aps[lo - 1];
+
+	/* Reuse running decompressor unless it is past the target,
+	 * or restarting from an access point gets us closer */
+	if (!ti->pid
+	 || tar_handle->offset > target
+	 || (best && best->ap.out > tar_handle->offset)
+	) {
+		if (ti->pid)
+			stop_gunzip(tar_handle, ti);
+		if (best) {
+			if (!ti->window)
+				ti->window = xmalloc(GZ_AP_WINDOW_SIZE);
+			xlseek(ti->idx_fd, best->window_ofs, SEEK_SET);
+			xread(ti->idx_fd, ti->window, GZ_AP_WINDOW_SIZE);
+			best->ap.window = ti->window;
+		}
+		start_gunzip(tar_handle, ti, best ? &best->ap : NULL);
+	}
+	seek_by_read(tar_handle->src_fd, target - tar_handle->offset);
+	tar_handle->offset = target;
+}
+# else
+#  define start_gunzip(tar_handle, ti, resume) ((void)0)
+#  define gunzip_seek(tar_handle, ti, target)  ((void)0)
+#  define stop_gunzip(tar_handle, ti)          ((void)0)
+# endif
+
+/* tar -t --index */
+static void write_index(archive_handle_t *tar_handle, struct tar_index *ti)
+{
+	if (ti->gzipped)
+		start_gunzip(tar_handle, ti, NULL);
+	ti->action_header = tar_handle->action_header;
+	tar_handle->action_header = index_member;
+	for (;;) {
+		/* get_header_tar() aligns the offset */
+		ti->hdr_start = (tar_handle->offset + 511) & ~(off_t)511;
+		if (get_header_tar(tar_handle) != EXIT_SUCCESS)
+			break;
+		bb_got_signal = EXIT_SUCCESS;
+	}
+	/* Caller waits for gunzip child */
+}
+
+/* tar -x --index */
+static void extract_by_index(archive_handle_t *tar_handle, struct tar_index *ti)
+{
+	unsigned i;
+
+	for (i = 0; i < ti->member_cnt; i++) {
+		off_t target = ti->members[i];
+
+		if (ti->gzipped) {
+			gunzip_seek(tar_handle, ti, target);
+		} else {
+			xlseek(tar_handle->src_fd, target, SEEK_SET);
+			tar_handle->offset = target;
+		}
+		if (get_header_tar(tar_handle) == EXIT_SUCCESS)
+			bb_got_signal = EXIT_SUCCESS;
+	}
+	if (ti->pid) {
+		/* It still has the rest of the archive to decompress */
+		stop_gunzip(tar_handle, ti);
+		tar_handle->src_fd = ti->arch_fd;
+	}
+}
+#endif
+
 //usage:#define tar_trivial_usage
 //usage:	IF_FEATURE_TAR_CREATE("c|") "x|t [-"
 //usage:	IF_FEATURE_SEAMLESS_Z("Z")
@@ -832,6 +1156,13 @@ static llist_t *append_file_list_to_list(llist_t *list)
 //usage:	IF_FEATURE_TAR_TO_COMMAND(
 //usage:     "\n	--to-command COMMAND	Pipe files to COMMAND"
 //usage:	)
+//usage:	IF_FEATURE_TAR_INDEX(
+//usage:     "\n	--index FILE		With -t: write index of members to FILE"
+//usage:     "\n				With -x/-O: use it to seek to members"
+//usage:	)
+//usage:	IF_FEATURE_TAR_PARALLEL(
+//usage:     "\n	--writers N		Create files using N processes"
+//usage:	)
 //usage:	)
 //usage:
 //usage:#define tar_example_usage
@@ -858,6 +1189,8 @@ enum {
 	OPTBIT_NUMERIC_OWNER,
 	OPTBIT_NOPRESERVE_PERM,
 	OPTBIT_OVERWRITE,
+	IF_FEATURE_TAR_INDEX(OPTBIT_INDEX       ,)
+	IF_FEATURE_TAR_PARALLEL(OPTBIT_WRITERS  ,)
 #endif
 	OPT_TEST         = 1 << 0, // t
 	OPT_EXTRACT      = 1 << 1, // x
@@ -885,6 +1218,8 @@ enum {
 	OPT_NUMERIC_OWNER    = IF_FEATURE_TAR_LONG_OPTIONS((1 << OPTBIT_NUMERIC_OWNER  )) + 0, // numeric-owner
 	OPT_NOPRESERVE_PERM  = IF_FEATURE_TAR_LONG_OPTIONS((1 << OPTBIT_NOPRESERVE_PERM)) + 0, // no-same-permissions
 	OPT_OVERWRITE        = IF_FEATURE_TAR_LONG_OPTIONS((1 << OPTBIT_OVERWRITE      )) + 0, // overwrite
+	OPT_INDEX            = IF_FEATURE_TAR_INDEX(       (1 << OPTBIT_INDEX          )) + 0, // index
+	OPT_WRITERS          = IF_FEATURE_TAR_PARALLEL(    (1 << OPTBIT_WRITERS        )) + 0, // writers
 
 	OPT_ANY_COMPRESS = (OPT_BZIP2 | OPT_LZMA | OPT_GZIP | OPT_XZ | OPT_COMPRESS),
 };
@@ -940,6 +1275,12 @@ static const char tar_longopts[] ALIGN1 =
 	"no-same-permissions\0" No_argument       "\xfd"
 	/* on unpack, open with O_TRUNC and !O_EXCL */
 	"overwrite\0"           No_argument       "\xfe"
+# if ENABLE_FEATURE_TAR_INDEX
+	"index\0"               Required_argument "\xf7"
+# endif
+# if ENABLE_FEATURE_TAR_PARALLEL
+	"writers\0"             Required_argument "\xf6"
+# endif
 	/* --exclude takes next bit position in option mask, */
 	/* therefore we have to put it _after_ --no-same-permissions */
 # if ENABLE_FEATURE_TAR_FROM
@@ -963,6 +1304,13 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 	int verboseFlag = 0;
 #if ENABLE_FEATURE_TAR_LONG_OPTIONS && ENABLE_FEATURE_TAR_FROM
 	llist_t *excludes = NULL;
+#endif
+#if ENABLE_FEATURE_TAR_INDEX
+	const char *index_filename = NULL;
+	struct tar_index *tidx = NULL;
+#endif
+#if ENABLE_FEATURE_TAR_PARALLEL
+	const char *writers = NULL;
 #endif
 	INIT_G();
 
@@ -1045,6 +1393,8 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 		, &tar_handle->tar__strip_components // --strip-components
 #endif
 		IF_FEATURE_TAR_TO_COMMAND(, &(tar_handle->tar__to_command)) // --to-command
+		IF_FEATURE_TAR_INDEX(, &index_filename) // --index
+		IF_FEATURE_TAR_PARALLEL(, &writers) // --writers
 #if ENABLE_FEATURE_TAR_LONG_OPTIONS && ENABLE_FEATURE_TAR_FROM
 		, &excludes // --exclude
 #endif
@@ -1215,6 +1565,15 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 		}
 	}
 
+#if ENABLE_FEATURE_TAR_INDEX
+	if (opt & OPT_INDEX) {
+		if ((opt & OPT_CREATE) || LONE_DASH(tar_filename))
+			bb_simple_error_msg_and_die("--index needs an existing archive file");
+		/* Open it before -C DIR changes our idea of relative names */
+		tidx = open_index(tar_handle, index_filename, opt & OPT_TEST);
+	}
+#endif
+
 	if (base_dir)
 		xchdir(base_dir);
 
@@ -1250,7 +1609,7 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 	}
 #endif
 
-	if (opt & OPT_ANY_COMPRESS) {
+	if ((opt & OPT_ANY_COMPRESS) && !(opt & OPT_INDEX)) {
 		USE_FOR_MMU(IF_DESKTOP(long long) int FAST_FUNC (*xformer)(transformer_state_t *xstate);)
 		USE_FOR_NOMMU(const char *xformer_prog;)
 
@@ -1287,10 +1646,38 @@ int tar_main(int argc UNUSED_PARAM, char **argv)
 	 */
 	bb_got_signal = EXIT_FAILURE;
 
+#if ENABLE_FEATURE_TAR_PARALLEL
+	/* After forking decompressor: it must not hold our pipes open.
+	 * --index forks decompressors on the go, don't mix with it.
+	 */
+	if ((opt & OPT_WRITERS) && tar_handle->action_data == data_extract_all
+	 IF_FEATURE_TAR_INDEX(&& !tidx)
+	) {
+		start_extract_writers(tar_handle, xatou_range(writers, 1, 1024));
+	}
+#endif
+
+#if ENABLE_FEATURE_TAR_INDEX
+	if (tidx) {
+		if (opt & OPT_TEST)
+			write_index(tar_handle, tidx);
+		else
+			extract_by_index(tar_handle, tidx);
+	} else
+#endif
 	while (get_header_tar(tar_handle) == EXIT_SUCCESS)
 		bb_got_signal = EXIT_SUCCESS; /* saw at least one header, good */
 
+#if ENABLE_FEATURE_TAR_PARALLEL
+	/* Files must exist before we link to them */
+	if (tar_handle->tar__writers && stop_extract_writers(tar_handle))
+		xfunc_die(); /* writer already complained */
+#endif
 	create_links_from_list(tar_handle->link_placeholders);
+#if ENABLE_FEATURE_TAR_PARALLEL
+	if (tar_handle->tar__writers)
+		fixup_extracted_dirs(tar_handle);
+#endif
 
 	/* Check that every file that should have been extracted was */
 	while (tar_handle->accept) {
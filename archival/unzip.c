@@ -35,6 +35,16 @@
 //config:	you can reduce code size by unselecting this option.
 //config:	To support less trivial ZIPs, say Y.
 //config:
+//config:config FEATURE_UNZIP_PARALLEL
+//config:	bool "Support parallel extraction (-J N)"
+//config:	default y
+//config:	depends on FEATURE_UNZIP_CDF && !NOMMU && PLATFORM_POSIX
+//config:	help
+//config:	"unzip -J N" decompresses members in N processes.
+//config:	Central Directory gives location of every member,
+//config:	thus members can be unpacked independently.
+//config:	Speeds up extraction of large archives on SMP machines.
+//config:
 //config:config FEATURE_UNZIP_BZIP2
 //config:	bool "Support compression method 12 (bzip2)"
 //config:	default y
@@ -56,7 +66,7 @@
 //kbuild:lib-$(CONFIG_UNZIP) += unzip.o
 
 //usage:#define unzip_trivial_usage
-//usage:       "[-lnojpqK] FILE[.zip] [FILE]... [-x FILE]... [-d DIR]"
+//usage:       "[-lnojpqK] "IF_FEATURE_UNZIP_PARALLEL("[-J N] ")"FILE[.zip] [FILE]... [-x FILE]... [-d DIR]"
 //usage:#define unzip_full_usage "\n\n"
 //usage:       "Extract FILEs from ZIP archive\n"
 //usage:     "\n	-l	List contents (with -q for short form)"
@@ -69,6 +79,9 @@
 //usage:     "\n	-K	Do not clear SUID bit"
 //usage:     "\n	-x FILE	Exclude FILEs"
 //usage:     "\n	-d DIR	Extract into DIR"
+//usage:	IF_FEATURE_UNZIP_PARALLEL(
+//usage:     "\n	-J N	Extract using N processes"
+//usage:	)
 
 #include "libbb.h"
 #include "bb_archive.h"
@@ -468,6 +481,124 @@ static void unzip_extract(zip_header_t *zip, int dst_fd)
 	}
 }
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+/* Worker processes for -J N.
+ * Main process walks the Central Directory, prints names, handles
+ * overwrite prompts and creates files, then queues members here.
+ * Every worker has its own open file description of the archive,
+ * so they seek and read without disturbing each other.
+ * All workers read jobs from one pipe: a job is written and read
+ * in one go, and is not larger than PIPE_BUF, thus it's never split
+ * between readers. Idle worker picks next member.
+ */
+struct unzip_job {
+	off_t data_offset;
+	zip_header_t zip;
+	/* Longer names are extracted by main process */
+	char name[1024 - sizeof(off_t) - sizeof(zip_header_t)];
+};
+
+struct BUG_unzip_job {
+	char BUG_unzip_job_is_too_big[
+		sizeof(struct unzip_job) <= PIPE_BUF ? 1 : -1];
+};
+
+static void unzip_worker(int job_fd) NORETURN;
+static void unzip_worker(int job_fd)
+{
+	struct unzip_job job;
+
+	while (safe_read(job_fd, &job, sizeof(job)) == sizeof(job)) {
+		int dst_fd;
+
+		xlseek(zip_fd, job.data_offset, SEEK_SET);
+		/* Main process created it */
+		dst_fd = xopen(job.name, O_WRONLY | O_TRUNC | O_NOFOLLOW);
+		unzip_extract(&job.zip, dst_fd);
+		close(dst_fd);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+static int start_unzip_workers(int *src_fds, pid_t *pids, unsigned cnt)
+{
+	struct fd_pair job_pipe;
+	unsigned i;
+
+	xpiped_pair(job_pipe);
+# ifdef F_SETPIPE_SZ
+	fcntl(job_pipe.wr, F_SETPIPE_SZ, 256 * sizeof(struct unzip_job));
+# endif
+	/* Dead workers should be reported, not kill us */
+	signal(SIGPIPE, SIG_IGN);
+	fflush_all();
+	for (i = 0; i < cnt; i++) {
+		pids[i] = xfork();
+		if (pids[i] == 0) {
+			/* Child. src_fds[0..i-1] are already closed */
+			unsigned j;
+			for (j = i + 1; j < cnt; j++)
+				close(src_fds[j]);
+			close(job_pipe.wr);
+			xmove_fd(src_fds[i], zip_fd);
+			unzip_worker(job_pipe.rd);
+		}
+		close(src_fds[i]);
+	}
+	close(job_pipe.rd);
+	return job_pipe.wr;
+}
+
+static int stop_unzip_workers(int job_fd, pid_t *pids, unsigned cnt)
+{
+	unsigned i;
+	int err = 0;
+
+	close(job_fd); /* EOF tells workers to exit */
+	for (i = 0; i < cnt; i++) {
+		int status;
+		if (safe_waitpid(pids[i], &status, 0) < 0 || status != 0)
+			err = 1;
+	}
+	return err;
+}
+
+/* Returns 1 if member is queued (and dst_fd is closed),
+ * 0 if caller should extract it itself */
+static int queue_unzip_job(int *job_fd, pid_t *pids, unsigned cnt,
+		zip_header_t *zip, int dst_fd, const char *dst_fn)
+{
+	struct unzip_job job;
+	struct stat st;
+
+	/* Is it a file we already queued (repeated name, or an alias)?
+	 * Then two workers could write it at once, while the last
+	 * member must win. Let workers finish, go on without them.
+	 */
+	xfstat(dst_fd, &st, dst_fn);
+	if (is_in_ino_dev_hashtable(&st)) {
+		if (stop_unzip_workers(*job_fd, pids, cnt))
+			xfunc_die(); /* worker already complained */
+		*job_fd = -1;
+		/* Worker could write it after we truncated it on open */
+		if (ftruncate(dst_fd, 0) != 0)
+			bb_perror_msg_and_die("can't truncate '%s'", dst_fn);
+		return 0;
+	}
+	if (strlen(dst_fn) >= sizeof(job.name))
+		return 0;
+	add_to_ino_dev_hashtable(&st, NULL);
+	close(dst_fd);
+
+	memset(&job, 0, sizeof(job));
+	job.data_offset = xlseek(zip_fd, 0, SEEK_CUR);
+	job.zip = *zip;
+	strcpy(job.name, dst_fn);
+	xwrite(*job_fd, &job, sizeof(job));
+	return 1;
+}
+#endif
+
 static void my_fgets80(char *buf80)
 {
 	fflush_all();
@@ -517,6 +648,12 @@ int unzip_main(int argc, char **argv)
 	char *base_dir = NULL;
 #if ENABLE_FEATURE_UNZIP_CDF
 	llist_t *symlink_placeholders = NULL;
+#endif
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	unsigned workers = 0;
+	int *src_fds = NULL;
+	pid_t *pids = NULL;
+	int job_fd = -1;
 #endif
 	int i;
 	char key_buf[80]; /* must match size used by my_fgets80 */
@@ -569,7 +706,7 @@ int unzip_main(int argc, char **argv)
 // -X	restore user:group ownership
 	opts = 0;
 	/* '-' makes getopt return 1 for non-options */
-	while ((i = getopt(argc, argv, "-d:lnotpqxjvK")) != -1) {
+	while ((i = getopt(argc, argv, "-d:lnotpqxjvK" IF_FEATURE_UNZIP_PARALLEL("J:"))) != -1) {
 		switch (i) {
 		case 'd':  /* Extract to base directory */
 			base_dir = optarg;
@@ -617,6 +754,12 @@ int unzip_main(int argc, char **argv)
 			opts |= OPT_K;
 			break;
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+		case 'J':
+			workers = xatou_range(optarg, 1, 1024);
+			break;
+#endif
+
 		case 1:
 			if (!src_fn) {
 				/* The zip file */
@@ -684,6 +827,14 @@ int unzip_main(int argc, char **argv)
 			strcpy(ext, extn[i - 1]);
 		}
 		xmove_fd(src_fd, zip_fd);
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+		/* Open it for workers now, -d DIR may change our idea of src_fn */
+		if (workers) {
+			src_fds = xmalloc(workers * sizeof(src_fds[0]));
+			for (i = 0; i < workers; i++)
+				src_fds[i] = xopen(src_fn, O_RDONLY);
+		}
+#endif
 	}
 
 	/* Change dir if necessary */
@@ -736,6 +887,21 @@ int unzip_main(int argc, char **argv)
 	total_size = 0;
 	total_entries = 0;
 	cdf_offset = find_cdf_offset();	/* try to seek to the end, find CDE and CDF start */
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	/* Without CDF we would have to read through members anyway */
+	if (src_fds) {
+		if (cdf_offset != BAD_CDF_OFFSET
+		 && dst_fd != STDOUT_FILENO
+		 && !(opts & OPT_l)
+		) {
+			pids = xmalloc(workers * sizeof(pids[0]));
+			job_fd = start_unzip_workers(src_fds, pids, workers);
+		} else {
+			for (i = 0; i < workers; i++)
+				close(src_fds[i]);
+		}
+	}
+#endif
 	while (1) {
 		zip_header_t zip;
 		mode_t dir_mode = 0777;
@@ -1024,6 +1190,14 @@ int unzip_main(int argc, char **argv)
 				if (dst_fd != STDOUT_FILENO) /* not -p? */
 					unzip_extract_symlink(&symlink_placeholders, &zip, dst_fn);
 			} else
+#endif
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+			if (job_fd >= 0
+			 && dst_fd != STDOUT_FILENO
+			 && queue_unzip_job(&job_fd, pids, workers, &zip, dst_fd, dst_fn)
+			) {
+				/* File is created, worker will fill it */
+			} else
 #endif
 			{
 				unzip_extract(&zip, dst_fd);
@@ -1058,6 +1232,10 @@ int unzip_main(int argc, char **argv)
 		total_entries++;
 	}
 
+#if ENABLE_FEATURE_UNZIP_PARALLEL
+	if (job_fd >= 0 && stop_unzip_workers(job_fd, pids, workers))
+		xfunc_die(); /* worker already complained */
+#endif
 #if ENABLE_FEATURE_UNZIP_CDF
 	create_links_from_list(symlink_placeholders);
 #endif
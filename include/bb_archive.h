@@ -108,6 +108,9 @@ typedef struct archive_handle_t {
 # if ENABLE_FEATURE_TAR_SELINUX
 	char* tar__sctx[2];
 # endif
+# if ENABLE_FEATURE_TAR_PARALLEL
+	struct extract_writers *tar__writers;
+# endif
 #endif
 #if ENABLE_CPIO || ENABLE_RPM2CPIO || ENABLE_RPM
 	uoff_t cpio__blocks;
@@ -196,6 +199,15 @@ void data_skip(archive_handle_t *archive_handle) FAST_FUNC;
 void data_extract_all(archive_handle_t *archive_handle) FAST_FUNC;
 void data_extract_to_stdout(archive_handle_t *archive_handle) FAST_FUNC;
 void data_extract_to_command(archive_handle_t *archive_handle) FAST_FUNC;
+#if ENABLE_FEATURE_TAR_PARALLEL
+void start_extract_writers(archive_handle_t *archive_handle, unsigned cnt) FAST_FUNC;
+void queue_to_extract_writer(archive_handle_t *archive_handle,
+		const char *dst_name, uid_t uid, gid_t gid) FAST_FUNC;
+void defer_extracted_dir(archive_handle_t *archive_handle,
+		const char *dst_name, uid_t uid, gid_t gid) FAST_FUNC;
+int stop_extract_writers(archive_handle_t *archive_handle) FAST_FUNC;
+void fixup_extracted_dirs(archive_handle_t *archive_handle) FAST_FUNC;
+#endif
 
 void header_skip(const file_header_t *file_header) FAST_FUNC;
 void header_list(const file_header_t *file_header) FAST_FUNC;
@@ -227,6 +239,17 @@ const llist_t *find_list_entry2(const llist_t *list, const char *filename) FAST_
 /* A bit of bunzip2 internals are exposed for compressed help support: */
 char *unpack_bz2_data(const char *packed, int packed_len, int unpacked_len) FAST_FUNC;
 
+/* Point in a deflate stream where decompression can be restarted:
+ * block boundary plus the 32k of history preceding it */
+typedef struct gz_access_point_t {
+	off_t    in;      /* offset of compressed byte holding the next bit */
+	off_t    out;     /* offset in uncompressed data */
+	unsigned bits;    /* number of bits of byte 'in' already consumed */
+	unsigned wpos;    /* current position in window[] */
+	uint8_t  *window; /* GZ_AP_WINDOW_SIZE bytes */
+} gz_access_point_t;
+#define GZ_AP_WINDOW_SIZE 0x8000
+
 /* Meaning and direction (input/output) of the fields are transformer-specific */
 typedef struct transformer_state_t {
 	smallint signature_skipped; /* most often referenced member */
@@ -246,6 +269,13 @@ typedef struct transformer_state_t {
 	off_t    bytes_in;  /* used in unzip code only: needs to know packed size */
 	uint32_t crc32;
 	time_t   mtime;     /* gunzip code may set this on exit */
+#if ENABLE_FEATURE_TAR_INDEX
+	/* gunzip: report access points roughly every gz_ap_span output bytes */
+	void FAST_FUNC (*gz_access_point)(const gz_access_point_t *ap);
+	off_t    gz_ap_span;
+	/* gunzip: skip gzip header and start decompressing from here */
+	const gz_access_point_t *gz_resume;
+#endif
 
 	union {             /* if we read magic, it's saved here */
 		uint8_t b[8];
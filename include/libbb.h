@@ -1036,7 +1036,7 @@ struct tls_aes {
 };
 #define TLS_MAX_MAC_SIZE 32
 #define TLS_MAX_KEY_SIZE 32
-#define TLS_MAX_IV_SIZE   4
+#define TLS_MAX_IV_SIZE  12
 struct tls_handshake_data; /* opaque */
 typedef struct tls_state {
 	unsigned flags;
@@ -1044,7 +1044,7 @@ typedef struct tls_state {
 	int ofd;
 	int ifd;
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
 	smallint expecting_first_packet;
 #endif
 	uint16_t cipher_id;
@@ -1060,6 +1060,9 @@ typedef struct tls_state {
 	int     ofs_to_buffered;
 	int     buffered_size;
 	uint8_t *inbuf;
+	/* Decrypted data in inbuf not yet taken by tls_read_data() */
+	int     data_ofs;
+	int     data_len;
 
 	struct tls_handshake_data *hsd;
 
@@ -1070,7 +1073,7 @@ typedef struct tls_state {
 	//   number MUST be set to zero whenever a connection state is made the
 	//   active state.  Sequence numbers are of type uint64 and may not
 	//   exceed 2^64-1.
-	/*uint64_t read_seq64_be;*/
+	uint64_t read_seq64_be; /* used only by ChaCha20: AES-GCM has explicit nonce */
 	uint64_t write_seq64_be;
 
 	uint8_t *our_write_MAC_key;
@@ -1090,7 +1093,12 @@ typedef struct tls_state {
 	struct tls_aes aes_decrypt;
 	uint8_t H[16]; //used by AES_GCM
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	/* TLS 1.3 session tickets come after handshake */
+	char *session_file;
+	uint8_t resumption_secret[32];
+#endif
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
 	/* For ECDHE: server's ephemeral EC private key */
 	//uint8_t ecc_priv_key32[32];
 #endif
@@ -1103,11 +1111,22 @@ static inline tls_state_t *new_tls_state(void)
 	return tls;
 }
 void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni);
+/* Server's keys and certificates, parsed from a PEM file */
+struct tls_server_keys;
+struct tls_server_keys *tls_load_server_keys(const char *pem_filename) FAST_FUNC;
 void FAST_FUNC tls_handshake_as_server(tls_state_t *tls,
-	const char *pem_filename);
+	struct tls_server_keys *sk);
 #define TLSLOOP_EXIT_ON_LOCAL_EOF (1 << 0)
 #define TLS_NO_CHECK_CERTIFICATE (1 << 1)
 void tls_run_copy_loop(tls_state_t *tls, unsigned flags) FAST_FUNC;
+#if !ENABLE_FEATURE_TLS_SCHANNEL
+/* For programs which do their own I/O instead of tls_run_copy_loop() */
+int tls_read_data(tls_state_t *tls, void *buf, int size) FAST_FUNC;
+int tls_has_buffered_data(tls_state_t *tls) FAST_FUNC;
+void tls_write_data(tls_state_t *tls, const void *buf, int size) FAST_FUNC;
+void tls_send_close_notify(tls_state_t *tls) FAST_FUNC;
+void tls_free_state(tls_state_t *tls) FAST_FUNC;
+#endif
 
 
 void socket_want_pktinfo(int fd) FAST_FUNC;
@@ -1119,6 +1138,9 @@ ssize_t recv_from_to(int fd, void *buf, size_t len, int flags,
 		struct sockaddr *from,
 		struct sockaddr *to,
 		socklen_t sa_size) FAST_FUNC;
+/* msg_control buffer this big is enough for get_pktinfo_to() */
+#define PKTINFO_CMSG_SPACE 64
+void get_pktinfo_to(struct msghdr *msg, struct sockaddr *to) FAST_FUNC;
 
 uint16_t inet_cksum(const void *addr, int len) FAST_FUNC;
 int parse_pasv_epsv(char *buf) FAST_FUNC;
@@ -112,6 +112,53 @@ send_to_from(int fd, void *buf, size_t len, int flags,
 #endif
 }
 
+/* Retrieve destination IP of a packet received by recvmsg()
+ * (or recvmmsg()) with msg_control buffer set,
+ * from data requested by socket_want_pktinfo().
+ * Like in recv_from_to(), port# in 'to' is not set.
+ */
+void FAST_FUNC
+get_pktinfo_to(struct msghdr *msg UNUSED_PARAM, struct sockaddr *to UNUSED_PARAM)
+{
+#ifdef IP_PKTINFO
+	struct cmsghdr *cmsgptr;
+
+# define to4 ((struct sockaddr_in*)to)
+# define to6 ((struct sockaddr_in6*)to)
+	for (cmsgptr = CMSG_FIRSTHDR(msg);
+			cmsgptr != NULL;
+			cmsgptr = CMSG_NXTHDR(msg, cmsgptr)
+	) {
+		if (cmsgptr->cmsg_level == IPPROTO_IP
+		 && cmsgptr->cmsg_type == IP_PKTINFO
+		) {
+			const int IPI_ADDR_OFF = offsetof(struct in_pktinfo, ipi_addr);
+			to->sa_family = AF_INET;
+			/*# define pktinfo(cmsgptr) ( (struct in_pktinfo*)(CMSG_DATA(cmsgptr)) )*/
+			/*to4->sin_addr = pktinfo(cmsgptr)->ipi_addr; - may be unaligned */
+			memcpy(&to4->sin_addr, (char*)(CMSG_DATA(cmsgptr)) + IPI_ADDR_OFF, sizeof(to4->sin_addr));
+			/*to4->sin_port = 123; - this data is not supplied by kernel */
+			break;
+		}
+# if ENABLE_FEATURE_IPV6 && defined(IPV6_PKTINFO)
+		if (cmsgptr->cmsg_level == IPPROTO_IPV6
+		 && cmsgptr->cmsg_type == IPV6_PKTINFO
+		) {
+			const int IPI6_ADDR_OFF = offsetof(struct in6_pktinfo, ipi6_addr);
+			to->sa_family = AF_INET6;
+			/*#  define pktinfo(cmsgptr) ( (struct in6_pktinfo*)(CMSG_DATA(cmsgptr)) )*/
+			/*to6->sin6_addr = pktinfo(cmsgptr)->ipi6_addr; - may be unaligned */
+			memcpy(&to6->sin6_addr, (char*)(CMSG_DATA(cmsgptr)) + IPI6_ADDR_OFF, sizeof(to6->sin6_addr));
+			/*to6->sin6_port = 123; */
+			break;
+		}
+# endif
+	}
+# undef to4
+# undef to6
+#endif
+}
+
 /* NB: this will never set port# in 'to'!
  * _Only_ IP/IPv6 address part of 'to' is _maybe_ modified.
  * Typical usage is to preinit 'to' with "default" value
@@ -133,7 +180,6 @@ recv_from_to(int fd, void *buf, size_t len, int flags,
 		char cmsg6[CMSG_SPACE(sizeof(struct in6_pktinfo))];
 # endif
 	} u;
-	struct cmsghdr *cmsgptr;
 	struct msghdr msg;
 	ssize_t recv_length;
 
@@ -152,38 +198,8 @@ recv_from_to(int fd, void *buf, size_t len, int flags,
 	if (recv_length < 0)
 		return recv_length;
 
-# define to4 ((struct sockaddr_in*)to)
-# define to6 ((struct sockaddr_in6*)to)
 	/* Here we try to retrieve destination IP and memorize it */
-	for (cmsgptr = CMSG_FIRSTHDR(&msg);
-			cmsgptr != NULL;
-			cmsgptr = CMSG_NXTHDR(&msg, cmsgptr)
-	) {
-		if (cmsgptr->cmsg_level == IPPROTO_IP
-		 && cmsgptr->cmsg_type == IP_PKTINFO
-		) {
-			const int IPI_ADDR_OFF = offsetof(struct in_pktinfo, ipi_addr);
-			to->sa_family = AF_INET;
-			/*# define pktinfo(cmsgptr) ( (struct in_pktinfo*)(CMSG_DATA(cmsgptr)) )*/
-			/*to4->sin_addr = pktinfo(cmsgptr)->ipi_addr; - may be unaligned */
-			memcpy(&to4->sin_addr, (char*)(CMSG_DATA(cmsgptr)) + IPI_ADDR_OFF, sizeof(to4->sin_addr));
-			/*to4->sin_port = 123; - this data is not supplied by kernel */
-			break;
-		}
-# if ENABLE_FEATURE_IPV6 && defined(IPV6_PKTINFO)
-		if (cmsgptr->cmsg_level == IPPROTO_IPV6
-		 && cmsgptr->cmsg_type == IPV6_PKTINFO
-		) {
-			const int IPI6_ADDR_OFF = offsetof(struct in6_pktinfo, ipi6_addr);
-			to->sa_family = AF_INET6;
-			/*#  define pktinfo(cmsgptr) ( (struct in6_pktinfo*)(CMSG_DATA(cmsgptr)) )*/
-			/*to6->sin6_addr = pktinfo(cmsgptr)->ipi6_addr; - may be unaligned */
-			memcpy(&to6->sin6_addr, (char*)(CMSG_DATA(cmsgptr)) + IPI6_ADDR_OFF, sizeof(to6->sin6_addr));
-			/*to6->sin6_port = 123; */
-			break;
-		}
-# endif
-	}
+	get_pktinfo_to(&msg, to);
 	return recv_length;
 #endif
 }
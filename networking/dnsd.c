@@ -21,13 +21,22 @@
 //config:	default y
 //config:	help
 //config:	Small and static DNS server daemon.
+//config:
+//config:config FEATURE_DNSD_FORWARD
+//config:	bool "Forward and cache queries for unknown names"
+//config:	default y
+//config:	depends on DNSD
+//config:	help
+//config:	With -f or -F, queries dnsd can not answer from its config file
+//config:	are forwarded to other nameservers, answers are cached.
 
 //applet:IF_DNSD(APPLET(dnsd, BB_DIR_USR_SBIN, BB_SUID_DROP))
 
 //kbuild:lib-$(CONFIG_DNSD) += dnsd.o
 
 //usage:#define dnsd_trivial_usage
-//usage:       "[-dvs] [-c CONFFILE] [-t TTL_SEC] [-p PORT] [-i ADDR]"
+//usage:       "[-dvs"IF_FEATURE_DNSD_FORWARD("f")"] [-c CONFFILE] [-t TTL_SEC] [-p PORT] [-i ADDR]"
+//usage:	IF_FEATURE_DNSD_FORWARD(" [-F ADDR[:PORT]]...")
 //usage:#define dnsd_full_usage "\n\n"
 //usage:       "Small static DNS server daemon\n"
 //usage:     "\n	-c FILE	Config file"
@@ -40,9 +49,17 @@
 //usage:     "\n		to use /etc/resolv.conf with two nameserver lines:"
 //usage:     "\n			nameserver DNSD_SERVER"
 //usage:     "\n			nameserver NORMAL_DNS_SERVER"
+//usage:	IF_FEATURE_DNSD_FORWARD(
+//usage:     "\n	-f	Forward queries for unknown names to nameservers"
+//usage:     "\n		from /etc/resolv.conf, cache answers"
+//usage:     "\n	-F ADDR	Forward to this nameserver instead"
+//usage:	)
 
 #include "libbb.h"
 #include <syslog.h>
+#if ENABLE_FEATURE_DNSD_FORWARD
+# include <resolv.h>
+#endif
 
 //#define DEBUG 1
 #define DEBUG 0
@@ -80,13 +97,30 @@ struct type_and_class {
 /* element of known name, ip address and reversed ip address */
 struct dns_entry {
 	struct dns_entry *next;
+	struct dns_entry *name_next; /* hash chain by name */
+	struct dns_entry *ip_next;   /* hash chain by ip */
 	uint32_t ip;
 	char rip[IP_STRING_LEN]; /* length decimal reversed IP */
 	char name[1];
 };
+/* Config file entries, and their indexes */
+struct dns_conf {
+	struct dns_entry *entries;
+	struct dns_entry *wildcard; /* first "*" entry */
+	unsigned hash_mask;
+	struct dns_entry **by_name;
+	struct dns_entry **by_ip;
+};
+
+enum {
+	/* Queries received by one recvmmsg() */
+	RECV_BATCH = 16,
+};
 
 #define OPT_verbose (option_mask32 & 1)
 #define OPT_silent  (option_mask32 & 2)
+/* -f or -F */
+#define OPT_forward (ENABLE_FEATURE_DNSD_FORWARD && (option_mask32 & (3 << 7)))
 
 
 /*
@@ -109,18 +143,40 @@ static void undot(char *rip)
 	}
 }
 
+static int is_wildcard(const struct dns_entry *d)
+{
+	return d->name[0] == 1 && d->name[1] == '*';
+}
+
+/* Case-insensitive, to match strcasecmp() in table_lookup() */
+static unsigned hash_name(const char *name)
+{
+	unsigned h = 0;
+	while (*name)
+		h = h * 33 + (unsigned char)tolower(*name++);
+	return h ^ (h >> 16);
+}
+
+static unsigned hash_ip(uint32_t v32)
+{
+	v32 *= 0x9e3779b1;
+	return v32 ^ (v32 >> 16);
+}
+
 /*
  * Read hostname/IP records from file
  */
-static struct dns_entry *parse_conf_file(const char *fileconf)
+static void parse_conf_file(struct dns_conf *conf, const char *fileconf)
 {
 	char *token[2];
 	parser_t *parser;
-	struct dns_entry *m, *conf_data;
+	struct dns_entry *m;
 	struct dns_entry **nextp;
+	unsigned cnt, hsize;
 
-	conf_data = NULL;
-	nextp = &conf_data;
+	conf->entries = NULL;
+	nextp = &conf->entries;
+	cnt = 0;
 
 	parser = config_open(fileconf);
 	while (config_read(parser, token, 2, 2, "# \t", PARSE_NORMAL)) {
@@ -140,6 +196,7 @@ static struct dns_entry *parse_conf_file(const char *fileconf)
 		/*m->next = NULL;*/
 		*nextp = m;
 		nextp = &m->next;
+		cnt++;
 
 		m->name[0] = '.';
 		strcpy(m->name + 1, token[0]);
@@ -156,31 +213,78 @@ static struct dns_entry *parse_conf_file(const char *fileconf)
 		undot(m->rip);
 	}
 	config_close(parser);
-	return conf_data;
+
+	/* Index entries. The first matching entry in the file wins:
+	 * only the first entry with a given name or IP is indexed,
+	 * names after the first wildcard are never used for A queries.
+	 */
+	hsize = 16;
+	while (hsize < cnt)
+		hsize <<= 1;
+	conf->hash_mask = hsize - 1;
+	conf->by_name = xzalloc(hsize * sizeof(conf->by_name[0]));
+	conf->by_ip = xzalloc(hsize * sizeof(conf->by_ip[0]));
+	conf->wildcard = NULL;
+	for (m = conf->entries; m; m = m->next) {
+		struct dns_entry **pp;
+
+		if (is_wildcard(m)) {
+			if (!conf->wildcard)
+				conf->wildcard = m;
+			continue; /* wildcards are not used for PTR queries */
+		}
+		if (!conf->wildcard) {
+			pp = &conf->by_name[hash_name(m->name) & conf->hash_mask];
+			while (*pp && strcasecmp((*pp)->name, m->name) != 0)
+				pp = &(*pp)->name_next;
+			if (!*pp)
+				*pp = m;
+		}
+		pp = &conf->by_ip[hash_ip(m->ip) & conf->hash_mask];
+		while (*pp && (*pp)->ip != m->ip)
+			pp = &(*pp)->ip_next;
+		if (!*pp)
+			*pp = m;
+	}
+}
+
+/* "\1""4\1""3\1""2\1""1\7in-addr\4arpa" -> 1.2.3.4 */
+static int ptr_query_to_ip(const char *q, uint32_t *ip)
+{
+	uint32_t v32 = 0;
+	unsigned i;
+
+	for (i = 0; i < 4; i++) {
+		unsigned len = (unsigned char)*q++;
+		unsigned octet = 0;
+
+		if (len == 0 || len > 3)
+			return 0;
+		while (len--) {
+			if (!isdigit(*q))
+				return 0;
+			octet = octet * 10 + (*q++ - '0');
+		}
+		if (octet > 255)
+			return 0;
+		v32 |= octet << (i * 8);
+	}
+	*ip = htonl(v32);
+	return 1;
 }
 
 /*
  * Look query up in dns records and return answer if found.
  */
-static char *table_lookup(struct dns_entry *d,
+static char *table_lookup(struct dns_conf *conf,
 		uint16_t type,
 		char* query_string)
 {
-	while (d) {
-		unsigned len = d->name[0];
-		/* d->name[len] is the last (non NUL) char */
-#if DEBUG
-		char *p, *q;
-		q = query_string + 1;
-		p = d->name + 1;
-		fprintf(stderr, "%d/%d p:%s q:%s %d\n",
-			(int)strlen(p), len,
-			p, q, (int)strlen(q)
-		);
-#endif
-		if (type == htons(REQ_A)) {
-			/* search by host name */
-			if (len != 1 || d->name[1] != '*') {
+	struct dns_entry *d;
+	uint32_t ip;
+
+	if (type == htons(REQ_A)) {
+		/* search by host name */
 /* we are lax, hope no name component is ever >64 so that length
  * (which will be represented as 'A','B'...) matches a lowercase letter.
  * Actually, I think false matches are hard to construct.
@@ -190,31 +294,37 @@ static char *table_lookup(struct dns_entry *d,
  * [65+32]<65 same chars>1   <31 same chars>NUL
  * This example seems to be the minimal case when false match occurs.
  */
-				if (strcasecmp(d->name, query_string) != 0)
-					goto next;
-			}
-			return (char *)&d->ip;
+		d = conf->by_name[hash_name(query_string) & conf->hash_mask];
+		while (d && strcasecmp(d->name, query_string) != 0)
+			d = d->name_next;
+		if (!d)
+			d = conf->wildcard;
+		if (!d)
+			return NULL;
 #if DEBUG
-			fprintf(stderr, "Found IP:%x\n", (int)d->ip);
+		fprintf(stderr, "Found IP:%x\n", (int)d->ip);
 #endif
-			return 0;
-		}
-		/* search by IP-address */
-		if ((len != 1 || d->name[1] != '*')
-		/* we assume (do not check) that query_string
-		 * ends in ".in-addr.arpa" */
-		 && is_prefixed_with(query_string, d->rip)
-		) {
-#if DEBUG
-			fprintf(stderr, "Found name:%s\n", d->name);
-#endif
-			return d->name;
-		}
- next:
-		d = d->next;
+		return (char *)&d->ip;
 	}
 
-	return NULL;
+	/* search by IP-address */
+	if (!ptr_query_to_ip(query_string, &ip))
+		return NULL;
+	d = conf->by_ip[hash_ip(ip) & conf->hash_mask];
+	while (d && d->ip != ip)
+		d = d->ip_next;
+	/* "\2""04..." is not our IP: check that labels are the same */
+	if (!d
+	/* we assume (do not check) that query_string
+	 * ends in ".in-addr.arpa" */
+	 || !is_prefixed_with(query_string, d->rip)
+	) {
+		return NULL;
+	}
+#if DEBUG
+	fprintf(stderr, "Found name:%s\n", d->name);
+#endif
+	return d->name;
 }
 
 /*
@@ -377,7 +487,7 @@ Domain name in a message can be represented as either:
    - a pointer
    - a sequence of labels ending with a pointer
  */
-static int process_packet(struct dns_entry *conf_data,
+static int process_packet(struct dns_conf *conf,
 		uint32_t conf_ttl,
 		uint8_t *buf,
 		unsigned buflen)
@@ -438,11 +548,13 @@ static int process_packet(struct dns_entry *conf_data,
 		/* we can't handle this query type */
 //TODO: happens all the time with REQ_AAAA (0x1c) requests - implement those?
 		err_msg = "type is !REQ_A and !REQ_PTR";
+		if (OPT_forward)
+			return -1;
 		goto empty_packet;
 	}
 
 	/* look up the name */
-	answstr = table_lookup(conf_data, type, query_string);
+	answstr = table_lookup(conf, type, query_string);
 #if DEBUG
 	/* Shows lengths instead of dots, unusable for !DEBUG */
 	bb_info_msg("'%s'->'%s'", query_string, answstr);
@@ -459,6 +571,8 @@ static int process_packet(struct dns_entry *conf_data,
 		 * AA = 1 "Authoritative Answer"
 		 * RCODE = 3 "Name Error" */
 		err_msg = "name is not found";
+		if (OPT_forward)
+			return -1;
 		outr_flags = htons(0x8000 | 0x0400 | 3);
 		goto empty_packet;
 	}
@@ -504,26 +618,588 @@ static int process_packet(struct dns_entry *conf_data,
 	return answb - buf;
 }
 
+#if ENABLE_FEATURE_DNSD_FORWARD
+enum {
+	CACHE_SIZE = 1024,      /* cached answers, power of 2 */
+	MAX_PENDING = 256,      /* queries waiting for upstream answer */
+	MAX_CACHE_TTL = 24 * 60 * 60,
+	FWD_TIMEOUT_MS = 1000,  /* then try next server */
+	FWD_TRIES = 2,          /* times we go through the server list */
+	NUM_RANDOM_IDS = 64,    /* read from /dev/urandom at once */
+	MAX_KEY_LEN = 255 + 4,  /* query name, type and class */
+	RCODE_SERVFAIL = 2,
+};
+
+/* Answer from upstream server */
+struct cache_entry {
+	struct cache_entry *hash_next;
+	struct cache_entry *lru_prev, *lru_next;
+	unsigned stored;  /* monotonic_sec() */
+	unsigned expires;
+	unsigned key_len, resp_len;
+	uint8_t data[];   /* key, then answer */
+};
+
+/* Client waiting for the answer */
+struct waiter {
+	struct waiter *next;
+	len_and_sockaddr *from, *to;
+	uint8_t query[]; /* header and question */
+};
+
+/* Query forwarded to upstream server */
+struct pending {
+	struct pending *next;
+	struct waiter *waiters;
+	unsigned long long deadline;
+	int fd;           /* new socket (and source port) for every try */
+	uint16_t id;
+	uint8_t server;
+	uint8_t tries;
+	unsigned key_len;
+	uint8_t key[MAX_KEY_LEN];
+};
+
+struct globals {
+	len_and_sockaddr **server;
+	unsigned num_servers;
+	int urandom_fd;
+	unsigned random_ids_left;
+	uint16_t random_ids[NUM_RANDOM_IDS];
+	unsigned lsa_size;
+	struct pollfd *pfd;
+	struct pending *pending;
+	unsigned num_pending;
+	unsigned num_cached;
+	struct cache_entry *lru_head; /* most recently used */
+	struct cache_entry *lru_tail;
+	struct cache_entry *cache[CACHE_SIZE];
+} FIX_ALIASING;
+#define G (*ptr_to_globals)
+
+/* Lowercased query name, type and class */
+static void make_key(uint8_t *key, const uint8_t *question, unsigned key_len)
+{
+	unsigned i;
+	for (i = 0; i < key_len - 4; i++)
+		key[i] = tolower(question[i]);
+	memcpy(key + i, question + i, 4);
+}
+
+static unsigned hash_key(const uint8_t *key, unsigned key_len)
+{
+	unsigned h = 0;
+	while (key_len--)
+		h = h * 33 + *key++;
+	return (h ^ (h >> 16)) & (CACHE_SIZE - 1);
+}
+
+static void lru_unlink(struct cache_entry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		G.lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		G.lru_tail = e->lru_prev;
+}
+
+static void lru_push(struct cache_entry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = G.lru_head;
+	if (G.lru_head)
+		G.lru_head->lru_prev = e;
+	else
+		G.lru_tail = e;
+	G.lru_head = e;
+}
+
+static void cache_remove(struct cache_entry *e)
+{
+	struct cache_entry **pp = &G.cache[hash_key(e->data, e->key_len)];
+	while (*pp != e)
+		pp = &(*pp)->hash_next;
+	*pp = e->hash_next;
+	lru_unlink(e);
+	G.num_cached--;
+	free(e);
+}
+
+static struct cache_entry *cache_find(const uint8_t *key, unsigned key_len)
+{
+	struct cache_entry *e;
+
+	for (e = G.cache[hash_key(key, key_len)]; e; e = e->hash_next) {
+		if (e->key_len == key_len && memcmp(e->data, key, key_len) == 0) {
+			if ((int)(monotonic_sec() - e->expires) >= 0) {
+				cache_remove(e);
+				return NULL;
+			}
+			lru_unlink(e);
+			lru_push(e);
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* How long the answer can be cached, 0: not at all */
+static unsigned answer_ttl(const uint8_t *resp, unsigned len)
+{
+	ns_msg handle;
+	ns_rr rr;
+	unsigned ttl = MAX_CACHE_TTL;
+	int sect, i, cnt;
+
+	if (resp[2] & 0x02) /* TC: truncated */
+		return 0;
+	i = resp[3] & 0xf;
+	if (i != 0 && i != 3) /* RCODE not "success" or "name error" */
+		return 0;
+	if (ns_initparse(resp, len, &handle) != 0)
+		return 0;
+	cnt = 0;
+	for (sect = ns_s_an; sect <= ns_s_ns; sect++) {
+		for (i = 0; i < ns_msg_count(handle, sect); i++) {
+			unsigned t;
+
+			if (ns_parserr(&handle, sect, i, &rr) != 0)
+				return 0;
+			t = ns_rr_ttl(rr);
+			if (ns_rr_type(rr) == ns_t_soa
+			 && ns_msg_count(handle, ns_s_an) == 0
+			 && ns_rr_rdlen(rr) >= 4
+			) {
+				/* Negative answer lives for SOA MINIMUM (RFC 2308) */
+				unsigned minimum = ns_get32(ns_rr_rdata(rr) + ns_rr_rdlen(rr) - 4);
+				if (t > minimum)
+					t = minimum;
+			}
+			if (ttl > t)
+				ttl = t;
+			cnt++;
+		}
+	}
+	/* Negative answer without SOA is not cached */
+	return cnt ? ttl : 0;
+}
+
+static void cache_store(const uint8_t *key, unsigned key_len,
+		const uint8_t *resp, unsigned resp_len)
+{
+	struct cache_entry *e;
+	unsigned ttl, h;
+
+	ttl = answer_ttl(resp, resp_len);
+	if (ttl == 0)
+		return;
+
+	e = cache_find(key, key_len);
+	if (e)
+		cache_remove(e);
+	if (G.num_cached >= CACHE_SIZE)
+		cache_remove(G.lru_tail);
+
+	e = xmalloc(sizeof(*e) + key_len + resp_len);
+	e->stored = monotonic_sec();
+	e->expires = e->stored + ttl;
+	e->key_len = key_len;
+	e->resp_len = resp_len;
+	memcpy(e->data, key, key_len);
+	memcpy(e->data + key_len, resp, resp_len);
+	h = hash_key(key, key_len);
+	e->hash_next = G.cache[h];
+	G.cache[h] = e;
+	lru_push(e);
+	G.num_cached++;
+}
+
+/* Cached answer is AGE seconds old: decrease TTLs */
+static void age_answer(uint8_t *resp, unsigned len, unsigned age)
+{
+	ns_msg handle;
+	ns_rr rr;
+	int sect, i;
+
+	if (ns_initparse(resp, len, &handle) != 0)
+		return;
+	for (sect = ns_s_an; sect < ns_s_max; sect++) {
+		for (i = 0; i < ns_msg_count(handle, sect); i++) {
+			uint8_t *ttlp;
+			unsigned ttl;
+
+			if (ns_parserr(&handle, sect, i, &rr) != 0)
+				return;
+			if (ns_rr_type(rr) == 41) /* OPT pseudo-RR has no TTL */
+				continue;
+			/* TTL and RDLENGTH precede RDATA */
+			ttlp = (uint8_t *)ns_rr_rdata(rr) - 6;
+			ttl = ns_get32(ttlp);
+			ns_put32(ttl > age ? ttl - age : 0, ttlp);
+		}
+	}
+}
+
+/* Send RESP (or SERVFAIL if it's NULL) to the client */
+static void reply_to(int udps, const uint8_t *query, unsigned key_len,
+		const uint8_t *resp, unsigned resp_len, unsigned age,
+		len_and_sockaddr *from, len_and_sockaddr *to)
+{
+	uint8_t buf[MAX_PACK_LEN];
+
+	if (!resp) {
+		if (OPT_silent)
+			return;
+		resp_len = sizeof(struct dns_head) + key_len;
+		memcpy(buf, query, resp_len);
+		/* QR = 1 "response", RD copied, RA = 1, RCODE */
+		buf[2] = 0x80 | (buf[2] & 0x01);
+		buf[3] = 0x80 | RCODE_SERVFAIL;
+		memset(buf + 6, 0, 6); /* no answers */
+	} else {
+		memcpy(buf, resp, resp_len);
+		/* Client's ID, and name in the same case as in the query:
+		 * some resolvers randomize case as a protection against spoofing */
+		memcpy(buf, query, 2);
+		memcpy(buf + sizeof(struct dns_head), query + sizeof(struct dns_head), key_len - 4);
+		if (age)
+			age_answer(buf, resp_len, age);
+	}
+	/* main loop does not set from->len */
+	send_to_from(udps, buf, resp_len, 0, &from->u.sa, &to->u.sa, G.lsa_size - LSA_LEN_SIZE);
+}
+
+/* Query ID and source port are all that protect us
+ * from spoofed answers, both must be unpredictable */
+static uint16_t random_id(void)
+{
+	if (G.random_ids_left == 0) {
+		xread(G.urandom_fd, G.random_ids, sizeof(G.random_ids));
+		G.random_ids_left = NUM_RANDOM_IDS;
+	}
+	return G.random_ids[--G.random_ids_left];
+}
+
+static void send_upstream(struct pending *p)
+{
+	uint8_t q[sizeof(struct dns_head) + MAX_KEY_LEN];
+	const len_and_sockaddr *sa = G.server[p->server];
+
+	p->deadline = monotonic_ms() + FWD_TIMEOUT_MS;
+	p->tries++;
+	/* Fresh socket: the kernel picks a random ephemeral port for it */
+	if (p->fd >= 0)
+		close(p->fd);
+	p->fd = socket(sa->u.sa.sa_family, SOCK_DGRAM, 0);
+	if (p->fd < 0) {
+		bb_simple_perror_msg("socket");
+		return; /* will retry on timeout */
+	}
+	/* Connected socket receives only what the server sends */
+	if (connect(p->fd, &sa->u.sa, sa->len) != 0) {
+		close(p->fd);
+		p->fd = -1;
+		return;
+	}
+	p->id = random_id();
+	memset(q, 0, sizeof(struct dns_head));
+	q[0] = p->id >> 8;
+	q[1] = p->id;
+	q[2] = 0x01; /* RD: recursion desired */
+	q[5] = 1; /* one question */
+	memcpy(q + sizeof(struct dns_head), p->key, p->key_len);
+	send(p->fd, q, sizeof(struct dns_head) + p->key_len, MSG_DONTWAIT);
+}
+
+/* Answer all waiting clients, forget the query */
+static void finish_pending(int udps, struct pending *p, const uint8_t *resp, unsigned resp_len)
+{
+	struct pending **pp = &G.pending;
+
+	while (*pp != p)
+		pp = &(*pp)->next;
+	*pp = p->next;
+	G.num_pending--;
+
+	while (p->waiters) {
+		struct waiter *w = p->waiters;
+		p->waiters = w->next;
+		reply_to(udps, w->query, p->key_len, resp, resp_len, 0, w->from, w->to);
+		free(w);
+	}
+	if (p->fd >= 0)
+		close(p->fd);
+	free(p);
+}
+
+/* Query BUF is not for us: answer from cache, or ask upstream */
+static void forward_query(int udps, const uint8_t *buf, len_and_sockaddr *from, len_and_sockaddr *to)
+{
+	const uint8_t *question = buf + sizeof(struct dns_head);
+	uint8_t key[MAX_KEY_LEN];
+	unsigned key_len;
+	struct cache_entry *e;
+	struct pending *p;
+	struct waiter *w;
+
+	/* process_packet() checked that the question is there */
+	key_len = strlen((char *)question) + 1 + 4;
+	if (key_len > MAX_KEY_LEN)
+		return;
+	make_key(key, question, key_len);
+
+	e = cache_find(key, key_len);
+	if (e) {
+		if (OPT_verbose)
+			bb_simple_info_msg("returning cached reply");
+		reply_to(udps, buf, key_len, e->data + key_len, e->resp_len,
+			monotonic_sec() - e->stored, from, to);
+		return;
+	}
+
+	/* Already asked upstream? */
+	for (p = G.pending; p; p = p->next)
+		if (p->key_len == key_len && memcmp(p->key, key, key_len) == 0)
+			break;
+	if (!p) {
+		if (G.num_pending >= MAX_PENDING) {
+			bb_simple_error_msg("too many queries in flight, dropping");
+			return;
+		}
+		p = xzalloc(sizeof(*p));
+		p->fd = -1;
+		p->key_len = key_len;
+		memcpy(p->key, key, key_len);
+		p->next = G.pending;
+		G.pending = p;
+		G.num_pending++;
+		if (OPT_verbose)
+			bb_simple_info_msg("forwarding query");
+		send_upstream(p);
+	}
+
+	w = xzalloc(sizeof(*w) + sizeof(struct dns_head) + key_len + 2 * G.lsa_size);
+	memcpy(w->query, buf, sizeof(struct dns_head) + key_len);
+	w->from = (void *)(w->query + sizeof(struct dns_head) + key_len);
+	w->to = (void *)((char *)w->from + G.lsa_size);
+	memcpy(w->from, from, G.lsa_size);
+	memcpy(w->to, to, G.lsa_size);
+	w->next = p->waiters;
+	p->waiters = w;
+}
+
+static void recv_upstream(int udps, struct pending *p)
+{
+	uint8_t resp[MAX_PACK_LEN + 1];
+	int n;
+	unsigned i;
+
+	n = recv(p->fd, resp, sizeof(resp), MSG_DONTWAIT);
+	if (n < (int)sizeof(struct dns_head) || n > MAX_PACK_LEN)
+		return;
+	if (!(resp[2] & 0x80) /* not a response? */
+	 || resp[4] != 0 || resp[5] != 1 /* not one question? */
+	) {
+		return;
+	}
+	if (((resp[0] << 8) | resp[1]) != p->id
+	 || n < (int)sizeof(struct dns_head) + (int)p->key_len
+	) {
+		return;
+	}
+	/* Is it an answer to our question? */
+	for (i = 0; i < p->key_len; i++) {
+		uint8_t c = resp[sizeof(struct dns_head) + i];
+		if (i < p->key_len - 4)
+			c = tolower(c);
+		if (c != p->key[i])
+			return;
+	}
+	cache_store(p->key, p->key_len, resp, n);
+	finish_pending(udps, p, resp, n);
+}
+
+static void retry_pending(int udps)
+{
+	unsigned long long now = monotonic_ms();
+	struct pending *p, *next;
+
+	for (p = G.pending; p; p = next) {
+		next = p->next;
+		if ((long long)(p->deadline - now) > 0)
+			continue;
+		if (p->tries >= G.num_servers * FWD_TRIES) {
+			bb_simple_error_msg("no answer from nameservers");
+			finish_pending(udps, p, NULL, 0);
+			continue;
+		}
+		/* Like libc resolver, go round the list: a dead server
+		 * does not delay the answer by more than one timeout */
+		p->server = (p->server + 1) % G.num_servers;
+		send_upstream(p);
+	}
+}
+
+/* Wait for queries, meanwhile process answers from upstream */
+static void wait_for_queries(int udps)
+{
+	for (;;) {
+		int timeout = -1;
+		unsigned i, n;
+		struct pending *p, *next;
+
+		G.pfd[0].fd = udps;
+		G.pfd[0].events = POLLIN;
+		n = 1;
+		if (G.pending) {
+			unsigned long long now = monotonic_ms();
+
+			timeout = INT_MAX;
+			for (p = G.pending; p; p = p->next) {
+				long long t = p->deadline - now;
+				if (t < 0)
+					t = 0;
+				if (timeout > t)
+					timeout = t;
+				G.pfd[n].fd = p->fd; /* poll ignores -1 */
+				G.pfd[n].events = POLLIN;
+				n++;
+			}
+		}
+		if (poll(G.pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			bb_simple_perror_msg_and_die("poll");
+		}
+		/* List is in pfd[] order. recv_upstream() may free p */
+		i = 1;
+		for (p = G.pending; p; p = next) {
+			next = p->next;
+			if (G.pfd[i++].revents)
+				recv_upstream(udps, p);
+		}
+		retry_pending(udps);
+		if (G.pfd[0].revents)
+			return;
+	}
+}
+
+static void add_server(const char *addr, const len_and_sockaddr *lsa)
+{
+	len_and_sockaddr *sa;
+
+	sa = xhost2sockaddr(addr, 53);
+	/* Do not forward to ourself */
+	if (get_nport(&sa->u.sa) == get_nport(&lsa->u.sa)) {
+		char *a = xmalloc_sockaddr2dotted_noport(&sa->u.sa);
+		char *l = xmalloc_sockaddr2dotted_noport(&lsa->u.sa);
+		int loop = (strcmp(a, l) == 0
+			|| (is_prefixed_with(a, "127.") && strcmp(l, "0.0.0.0") == 0)
+		);
+		free(a);
+		free(l);
+		if (loop) {
+			bb_error_msg("nameserver %s is ourself, skipping", addr);
+			free(sa);
+			return;
+		}
+	}
+	G.server = xrealloc_vector(G.server, 2, G.num_servers);
+	G.server[G.num_servers++] = sa;
+}
+
+static void init_forwarding(llist_t *servers, const len_and_sockaddr *lsa)
+{
+	SET_PTR_TO_GLOBALS(xzalloc(sizeof(G)));
+	G.lsa_size = LSA_LEN_SIZE + lsa->len;
+	G.urandom_fd = xopen("/dev/urandom", O_RDONLY);
+
+	if (servers) {
+		while (servers)
+			add_server(llist_pop(&servers), lsa);
+	} else {
+		parser_t *parser = config_open("/etc/resolv.conf");
+		char *token[2];
+		while (config_read(parser, token, 2, 2, "# \t", PARSE_NORMAL))
+			if (strcmp(token[0], "nameserver") == 0)
+				add_server(token[1], lsa);
+		config_close(parser);
+	}
+	if (G.num_servers == 0)
+		bb_simple_error_msg_and_die("no nameservers to forward to");
+	G.pfd = xzalloc((MAX_PENDING + 1) * sizeof(G.pfd[0]));
+}
+#else
+# define forward_query(...) ((void)0)
+#endif
+
+#if defined(MSG_WAITFORONE)
+/* Receive up to RECV_BATCH queries with one syscall */
+struct recv_batch {
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+	char cmsg[RECV_BATCH][PKTINFO_CMSG_SPACE] ALIGNED(sizeof(long));
+	uint8_t buf[RECV_BATCH][MAX_PACK_LEN + 1] ALIGN4;
+	len_and_sockaddr *from[RECV_BATCH];
+};
+
+static int recv_queries(int fd, struct recv_batch *b, unsigned lsa_len, int flags)
+{
+	int i, n;
+
+	for (i = 0; i < RECV_BATCH; i++) {
+		struct msghdr *h = &b->msgs[i].msg_hdr;
+		b->iov[i].iov_base = b->buf[i];
+		b->iov[i].iov_len = MAX_PACK_LEN + 1;
+		h->msg_name = &b->from[i]->u.sa;
+		h->msg_namelen = lsa_len;
+		h->msg_iov = &b->iov[i];
+		h->msg_iovlen = 1;
+		h->msg_control = b->cmsg[i];
+		h->msg_controllen = PKTINFO_CMSG_SPACE;
+		h->msg_flags = 0;
+	}
+	/* Block for the first one, take what is queued after it */
+	n = recvmmsg(fd, b->msgs, RECV_BATCH, MSG_WAITFORONE | flags, NULL);
+	if (n < 0 && errno != EINTR && errno != EAGAIN)
+		bb_simple_perror_msg_and_die("recvmmsg");
+	return n;
+}
+#endif
+
 int dnsd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int dnsd_main(int argc UNUSED_PARAM, char **argv)
 {
 	const char *listen_interface = "0.0.0.0";
 	const char *fileconf = "/etc/dnsd.conf";
-	struct dns_entry *conf_data;
+	struct dns_conf conf;
 	uint32_t conf_ttl = DEFAULT_TTL;
 	char *sttl, *sport;
+	IF_FEATURE_DNSD_FORWARD(llist_t *servers = NULL;)
 	len_and_sockaddr *lsa, *from, *to;
 	unsigned lsa_size;
 	int udps, opts;
 	uint16_t port = 53;
+#if defined(MSG_WAITFORONE)
+	struct recv_batch *batch;
+#else
 	/* Ensure buf is 32bit aligned (we need 16bit, but 32bit can't hurt) */
-	uint8_t buf[MAX_PACK_LEN + 1] ALIGN4;
+	uint8_t buffer[MAX_PACK_LEN + 1] ALIGN4;
+#endif
 
-	opts = getopt32(argv, "vsi:c:t:p:d", &listen_interface, &fileconf, &sttl, &sport);
+	opts = getopt32(argv, "vsi:c:t:p:d" IF_FEATURE_DNSD_FORWARD("fF:*"),
+			&listen_interface, &fileconf, &sttl, &sport
+			IF_FEATURE_DNSD_FORWARD(, &servers)
+	);
 	//if (opts & (1 << 0)) // -v
 	//if (opts & (1 << 1)) // -s
 	//if (opts & (1 << 2)) // -i
 	//if (opts & (1 << 3)) // -c
+	//if (opts & (1 << 7)) // -f
+	//if (opts & (1 << 8)) // -F
 	if (opts & (1 << 4)) // -t
 		conf_ttl = xatou_range(sttl, 1, 0xffffffff);
 	if (opts & (1 << 5)) // -p
@@ -534,42 +1210,81 @@ int dnsd_main(int argc UNUSED_PARAM, char **argv)
 		logmode = LOGMODE_SYSLOG;
 	}
 
-	conf_data = parse_conf_file(fileconf);
+	parse_conf_file(&conf, fileconf);
 
 	lsa = xdotted2sockaddr(listen_interface, port);
 	udps = xsocket(lsa->u.sa.sa_family, SOCK_DGRAM, 0);
 	xbind(udps, &lsa->u.sa, lsa->len);
 	socket_want_pktinfo(udps); /* needed for recv_from_to to work */
 	lsa_size = LSA_LEN_SIZE + lsa->len;
-	from = xzalloc(lsa_size);
 	to = xzalloc(lsa_size);
+#if defined(MSG_WAITFORONE)
+	batch = xzalloc(sizeof(*batch));
+	{
+		int i;
+		for (i = 0; i < RECV_BATCH; i++)
+			batch->from[i] = xzalloc(lsa_size);
+	}
+#else
+	from = xzalloc(lsa_size);
+#endif
 
 	{
 		char *p = xmalloc_sockaddr2dotted(&lsa->u.sa);
 		bb_info_msg("accepting UDP packets on %s", p);
 		free(p);
 	}
+#if ENABLE_FEATURE_DNSD_FORWARD
+	if (OPT_forward)
+		init_forwarding(servers, lsa);
+#endif
 
+	/* Try to get *DEST* address (to which of our addresses
+	 * this query was directed), and reply from the same address.
+	 * Or else we can exhibit usual UDP ugliness:
+	 * [ip1.multihomed.ip2] <=  query to ip1  <= peer
+	 * [ip1.multihomed.ip2] => reply from ip2 => peer (confused) */
 	while (1) {
+		uint8_t *buf;
 		int r;
-		/* Try to get *DEST* address (to which of our addresses
-		 * this query was directed), and reply from the same address.
-		 * Or else we can exhibit usual UDP ugliness:
-		 * [ip1.multihomed.ip2] <=  query to ip1  <= peer
-		 * [ip1.multihomed.ip2] => reply from ip2 => peer (confused) */
-		memcpy(to, lsa, lsa_size);
-		r = recv_from_to(udps, buf, MAX_PACK_LEN + 1, 0, &from->u.sa, &to->u.sa, lsa->len);
-		if (r < 12 || r > MAX_PACK_LEN) {
-			bb_error_msg("packet size %d, ignored", r);
-			continue;
+#if defined(MSG_WAITFORONE)
+		int i, n;
+
+#if ENABLE_FEATURE_DNSD_FORWARD
+		if (OPT_forward)
+			wait_for_queries(udps);
+#endif
+		n = recv_queries(udps, batch, lsa->len, OPT_forward ? MSG_DONTWAIT : 0);
+		for (i = 0; i < n; i++) {
+			buf = batch->buf[i];
+			r = batch->msgs[i].msg_len;
+			from = batch->from[i];
+			memcpy(to, lsa, lsa_size);
+			get_pktinfo_to(&batch->msgs[i].msg_hdr, &to->u.sa);
+#else
+		{
+# if ENABLE_FEATURE_DNSD_FORWARD
+			if (OPT_forward)
+				wait_for_queries(udps);
+# endif
+			buf = buffer;
+			memcpy(to, lsa, lsa_size);
+			r = recv_from_to(udps, buf, MAX_PACK_LEN + 1, 0, &from->u.sa, &to->u.sa, lsa->len);
+#endif
+			if (r < 12 || r > MAX_PACK_LEN) {
+				bb_error_msg("packet size %d, ignored", r);
+				continue;
+			}
+			if (OPT_verbose)
+				bb_simple_info_msg("got UDP packet");
+			buf[r] = '\0'; /* paranoia */
+			r = process_packet(&conf, conf_ttl, buf, r);
+			if (r < 0) /* not ours, forward it */
+				forward_query(udps, buf, from, to);
+			if (r <= 0)
+				continue;
+			send_to_from(udps, buf, r, 0, &from->u.sa, &to->u.sa, lsa->len);
 		}
-		if (OPT_verbose)
-			bb_simple_info_msg("got UDP packet");
-		buf[r] = '\0'; /* paranoia */
-		r = process_packet(conf_data, conf_ttl, buf, r);
-		if (r <= 0)
-			continue;
-		send_to_from(udps, buf, r, 0, &from->u.sa, &to->u.sa, lsa->len);
 	}
 	return 0;
 }
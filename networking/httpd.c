@@ -221,6 +221,18 @@
 //config:	Makes httpd send files using GZIP content encoding if the
 //config:	client supports it and a pre-compressed <file>.gz exists.
 //config:
+//config:config FEATURE_HTTPD_GZIP_DYNAMIC
+//config:	bool "Compress responses on the fly"
+//config:	default y
+//config:	depends on FEATURE_HTTPD_GZIP && PLATFORM_POSIX
+//config:	help
+//config:	If there is no <file>.gz, compress text files larger than 1k,
+//config:	and text output of CGI scripts, by running gzip (the applet,
+//config:	if it is built in). Compressed data is streamed to the client
+//config:	as gzip produces it. With -P NUM and FEATURE_HTTPD_CACHE,
+//config:	a compressed copy of files up to 4 Mbytes is also written
+//config:	to $TMPDIR, and later requests are served from it.
+//config:
 //config:config FEATURE_HTTPD_ETAG
 //config:	bool "Support caching via ETag header"
 //config:	default y
@@ -252,6 +264,45 @@
 //config:	RFC2616 says that server MUST add Date header to response.
 //config:	But it is almost useless and can be omitted.
 //config:
+//config:config FEATURE_HTTPD_KEEPALIVE
+//config:	bool "Support persistent connections"
+//config:	default y
+//config:	depends on HTTPD && PLATFORM_POSIX
+//config:	help
+//config:	Serve more than one request per connection (HTTP/1.1
+//config:	keep-alive, also pipelined requests) when files are sent.
+//config:	Saves a fork and a TCP handshake per request.
+//config:	CGI, proxy and error responses still close the connection.
+//config:
+//config:config FEATURE_HTTPD_PREFORK
+//config:	bool "Enable -P NUM option (pool of worker processes)"
+//config:	default y
+//config:	depends on HTTPD && !NOMMU && PLATFORM_POSIX
+//config:	help
+//config:	With -P NUM, NUM long-lived processes accept connections
+//config:	and serve them one after another, instead of forking
+//config:	a process per connection. CGI and proxy requests are
+//config:	still handed over to a forked process.
+//config:
+//config:config FEATURE_HTTPD_SSL
+//config:	bool "Support HTTPS (-S PEMFILE)"
+//config:	default y
+//config:	depends on HTTPD && PLATFORM_POSIX && !FEATURE_TLS_SCHANNEL
+//config:	select TLS
+//config:	help
+//config:	Terminate TLS in httpd itself. PEMFILE has the key
+//config:	and certificate chain, in the same format as ssl_server -f.
+//config:
+//config:config FEATURE_HTTPD_CACHE
+//config:	bool "Cache open files and their headers"
+//config:	default y
+//config:	depends on FEATURE_HTTPD_KEEPALIVE || FEATURE_HTTPD_PREFORK
+//config:	help
+//config:	A process serving many requests (-P NUM workers, persistent
+//config:	connections) keeps recently sent files open, together with
+//config:	their headers, and small files in memory. Entries are
+//config:	checked against file's inode, size and mtime.
+//config:
 //config:config FEATURE_HTTPD_ACL_IP
 //config:	bool "ACL IP"
 //config:	default y
@@ -275,7 +326,9 @@
 //usage:	IF_NOT_PLATFORM_MINGW32(
 //usage:       " [-M MAXCONN]"
 //usage:	IF_FEATURE_HTTPD_CGI(" [-K KILLSEC]")
+//usage:	IF_FEATURE_HTTPD_PREFORK(" [-P NUM]")
 //usage:	)
+//usage:	IF_FEATURE_HTTPD_SSL(" [-S PEMFILE]")
 //usage:	IF_FEATURE_HTTPD_SETUID(" [-u USER[:GRP]]")
 //usage:	IF_FEATURE_HTTPD_BASIC_AUTH(" [-r REALM]")
 //usage:       " [-h HOME]\n"
@@ -292,7 +345,11 @@
 //usage:     "\n	-M NUM		Pause if NUM connections are open (default 256)"
 //usage:	IF_FEATURE_HTTPD_CGI(
 //usage:     "\n	-K NUM		Kill CGIs after NUM seconds")
+//usage:	IF_FEATURE_HTTPD_PREFORK(
+//usage:     "\n	-P NUM		Serve connections by NUM long-lived processes")
 //usage:	)
+//usage:	IF_FEATURE_HTTPD_SSL(
+//usage:     "\n	-S PEMFILE	Speak HTTPS, with key and certificate(s) from PEMFILE")
 //usage:	IF_FEATURE_HTTPD_SETUID(
 //usage:     "\n	-u USER[:GRP]	Set uid/gid after binding to port")
 //usage:	IF_FEATURE_HTTPD_BASIC_AUTH(
@@ -335,6 +392,7 @@
  *   Thus, they can detect that the download is incomplete.
  */
 #define HEADER_READ_TIMEOUT 30
+#define KEEPALIVE_TIMEOUT   5
 #define DATA_WRITE_TIMEOUT  60
 #define DATA_READ_TIMEOUT   60
 
@@ -355,6 +413,9 @@
 #if ENABLE_FEATURE_USE_SENDFILE
 # include <sys/sendfile.h>
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+# include <netinet/tcp.h>
+#endif
 
 /* see sys/netinet6/in6.h */
 #if defined(__FreeBSD__)
@@ -370,6 +431,16 @@
 #endif
 
 #define IOBUF_SIZE 8192
+/* Files up to this size are sent from memory by FEATURE_HTTPD_CACHE */
+#define CACHE_BODY_MAX 4096
+#define CACHE_SIZE     64 /* power of 2 */
+/* Smaller files are not worth compressing by FEATURE_HTTPD_GZIP_DYNAMIC */
+#define GZIP_MIN_SIZE  1024
+/* Larger files are compressed every time, without keeping a copy */
+#define GZIP_CACHE_MAX (4*1024*1024)
+/* Compressed copies are only worth keeping in long-lived workers */
+#define GZIP_CACHE (ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC \
+		&& ENABLE_FEATURE_HTTPD_CACHE && ENABLE_FEATURE_HTTPD_PREFORK)
 #define MAX_HTTP_HEADERS_SIZE (32*1024)
 
 #define STR1(s) #s
@@ -401,6 +472,22 @@ typedef struct Htaccess_IP {
 } Htaccess_IP;
 #endif
 
+typedef struct file_cache {
+	char *name;
+	char *body;             /* NULL if file is not small */
+	const char *mime_type;
+	off_t size;
+	time_t mtime;
+	ino_t ino;
+	int fd;
+#if GZIP_CACHE
+	int gz_fd;              /* 0: not compressed yet, -1: not compressible */
+	off_t gz_size;
+#endif
+	unsigned hdr_len;
+	char hdrs[1];           /* sprintf_file_headers() result */
+} file_cache;
+
 /* Must have "next" as a first member */
 typedef struct Htaccess_Proxy {
 	struct Htaccess_Proxy *next;
@@ -507,6 +594,9 @@ struct globals {
 	smallint accept_gzip;
 	smallint content_gzip;
 #endif
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	smallint gz_stream;     /* file is compressed as we send it */
+#endif
 #if ENABLE_FEATURE_HTTPD_CGI
 	smallint cgi_output;
 #endif
@@ -518,9 +608,41 @@ struct globals {
 # endif
 #endif
 	int verbose;            /* must be int (used by getopt32) */
+#if ENABLE_FEATURE_HTTPD_SSL
+	struct tls_server_keys *ssl_keys; /* non-NULL: -S PEMFILE given */
+	tls_state_t *tls;       /* non-NULL: connection is HTTPS */
+#endif
 	time_t last_mod;
 #if ENABLE_FEATURE_HTTPD_ETAG
 	char *if_none_match;
+	/* Not in hdr_buf: it may hold the next pipelined request */
+	char etag[sizeof("\"%llx-%llx-gz\"") + 2 * 2 * sizeof(long long)];
+#endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	smallint keep_alive;
+	smallint http11;        /* client can take chunked encoding */
+	sigjmp_buf next_request;
+#endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE || ENABLE_FEATURE_HTTPD_PREFORK
+	smallint conf_changed;  /* subdir httpd.conf was loaded */
+	int file_fd;            /* if > 0, closed by reset_request_state() */
+#endif
+#if GZIP_CACHE
+	int gz_tmp_fd;          /* same, compressed copy being written */
+#endif
+#if ENABLE_FEATURE_HTTPD_CACHE
+	ino_t file_ino;
+	file_cache *cached;     /* entry of the file being sent */
+	const char *cached_body;
+	file_cache *file_cache[CACHE_SIZE];
+#endif
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	smallint in_worker;
+	volatile smallint worker_exit;
+	int listen_fd;
+	int prefork_cnt;
+	pid_t *worker_pid;
+	sigjmp_buf next_connection;
 #endif
 	char *rmt_ip_str;       /* for $REMOTE_ADDR and $REMOTE_PORT */
 	const char *bind_addr_or_port;
@@ -534,6 +656,7 @@ struct globals {
 	const char *found_moved_temporarily;
 #if ENABLE_FEATURE_HTTPD_ACL_IP
 	Htaccess_IP *ip_a_d;    /* config allow/deny lines */
+	unsigned remote_ip;
 #endif
 
 #if !ENABLE_PLATFORM_MINGW32
@@ -579,13 +702,9 @@ struct globals {
 
 /* We also use the common buffer as a global buffer:
  * = as input buffer for request line, headers, and POSTDATA
- * = when retrieving ordinary file (not CGI, proxy, etc), we generate and store file's etag
  */
 #define        hdr_buf bb_common_bufsiz1
 #define sizeof_hdr_buf COMMON_BUFSIZE
-#if ENABLE_FEATURE_HTTPD_ETAG
-#define        etag    bb_common_bufsiz1
-#endif
 };
 #define G (*OFFSET_PTR_TO_GLOBALS)
 #define verbose           (G.verbose          )
@@ -602,6 +721,9 @@ struct globals {
 # define accept_gzip      0
 # define content_gzip     0
 #endif
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+# define gz_stream        (G.gz_stream        )
+#endif
 #define bind_addr_or_port (G.bind_addr_or_port)
 #define g_query           (G.g_query          )
 #define opt_c_configFile  (G.opt_c_configFile )
@@ -633,6 +755,12 @@ enum {
 #define http_error_page   (G.http_error_page  )
 #define proxy             (G.proxy            )
 #define iobuf             (G.iobuf            )
+#define etag              (G.etag             )
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+# define keep_alive       (G.keep_alive       )
+#else
+# define keep_alive       0
+#endif
 #define INIT_G() do { \
 	setup_common_bufsiz(); \
 	SET_OFFSET_PTR_TO_GLOBALS(xzalloc(sizeof(G))); \
@@ -1165,21 +1293,109 @@ static int openServer(void)
  * the other might signal that connection is reset, not closed normally
  * (usually RST is sent if there is unsent buffered data in the socket buffer).
  */
+static void connection_done_and_exit(void) NORETURN;
+static void connection_done_and_exit(void)
+{
+#if ENABLE_FEATURE_HTTPD_PREFORK
+	if (G.in_worker)
+		siglongjmp(G.next_connection, 1);
+#endif
+	_exit_SUCCESS();
+}
 static void log_and_exit(void) NORETURN;
 static void log_and_exit(void)
 {
 	if (VERBOSE_3)
 		bb_simple_error_msg("closed");
-	_exit_SUCCESS();
+	connection_done_and_exit();
 }
 static void send_EOF_and_exit(void) NORETURN;
 static void send_EOF_and_exit(void)
 {
+#if ENABLE_FEATURE_HTTPD_SSL
+	if (G.tls)
+		tls_send_close_notify(G.tls);
+#endif
 	/* This makes sure on TCP level, the connection is closed with FIN, not RST */
 	shutdown(STDOUT_FILENO, SHUT_WR);
 	log_and_exit();
 }
 
+/* Read from / write to the peer. With HTTPS, these go through TLS */
+static ssize_t net_read(void *buf, size_t size)
+{
+#if ENABLE_FEATURE_HTTPD_SSL
+	if (G.tls)
+		return tls_read_data(G.tls, buf, size);
+#endif
+	return safe_read(STDIN_FILENO, buf, size);
+}
+static ssize_t net_write(const void *buf, size_t size)
+{
+#if ENABLE_FEATURE_HTTPD_SSL
+	if (G.tls) {
+		tls_write_data(G.tls, buf, size); /* dies on errors */
+		return size;
+	}
+#endif
+	return full_write(STDOUT_FILENO, buf, size);
+}
+/* Is there data poll() on STDIN_FILENO can't see? */
+static ALWAYS_INLINE int net_has_buffered_data(void)
+{
+#if ENABLE_FEATURE_HTTPD_SSL
+	if (G.tls)
+		return tls_has_buffered_data(G.tls);
+#endif
+	return 0;
+}
+
+#if ENABLE_FEATURE_HTTPD_DATE || ENABLE_FEATURE_HTTPD_LAST_MODIFIED
+static const char RFC1123FMT[] ALIGN1 = "%a, %d %b %Y %H:%M:%S GMT";
+/* Fixed size 29-byte string. Example: Sun, 06 Nov 1994 08:49:37 GMT */
+#endif
+
+/*
+ * Headers describing the file being sent.
+ * Returns their length.
+ */
+static unsigned sprintf_file_headers(char *buf)
+{
+	char *p = buf;
+#if ENABLE_FEATURE_HTTPD_LAST_MODIFIED
+	char date_str[40];
+	struct tm tm;
+
+	strftime(date_str, sizeof(date_str), RFC1123FMT, gmtime_r(&last_mod, &tm));
+#endif
+#if ENABLE_FEATURE_HTTPD_RANGES
+	p = stpcpy(p, "Accept-Ranges: bytes\r\n");
+#endif
+#if ENABLE_FEATURE_HTTPD_LAST_MODIFIED
+	p += sprintf(p, "Last-Modified: %s\r\n", date_str);
+#endif
+#if ENABLE_FEATURE_HTTPD_ETAG
+	p += sprintf(p, "ETag: %s\r\n", etag);
+#endif
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	if (gz_stream) {
+		/* Length is known only when gzip is done. HTTP/1.1 client
+		 * gets chunks, otherwise the connection is closed after body */
+		if (IF_FEATURE_HTTPD_KEEPALIVE(keep_alive) IF_NOT_FEATURE_HTTPD_KEEPALIVE(0))
+			p = stpcpy(p, "Transfer-Encoding: chunked\r\n");
+		return p - buf;
+	}
+#endif
+	/* Because of 4.4 (5), we can forgo sending of "Content-Length"
+	 * since we close connection afterwards, but it helps clients
+	 * to e.g. estimate download times, show progress bars etc.
+	 * Theoretically we should not send it if page is compressed,
+	 * but de-facto standard is to send it (see comment below).
+	 */
+	p += sprintf(p, "Content-Length: %"OFF_FMT"u\r\n", file_size);
+	return p - buf;
+}
+
 /*
  * Create and send HTTP response headers.
  * The arguments are combined and sent as one write operation.  Note that
@@ -1189,9 +1405,7 @@ static void send_EOF_and_exit(void)
  */
 static void send_headers(unsigned responseNum)
 {
-#if ENABLE_FEATURE_HTTPD_DATE || ENABLE_FEATURE_HTTPD_LAST_MODIFIED
-	static const char RFC1123FMT[] ALIGN1 = "%a, %d %b %Y %H:%M:%S GMT";
-	/* Fixed size 29-byte string. Example: Sun, 06 Nov 1994 08:49:37 GMT */
+#if ENABLE_FEATURE_HTTPD_DATE
 	char date_str[40]; /* using a bit larger buffer to paranoia reasons */
 	struct tm tm;
 #endif
@@ -1233,11 +1447,12 @@ static void send_headers(unsigned responseNum)
 #if ENABLE_FEATURE_HTTPD_DATE
 			"Date: %s\r\n"
 #endif
-			"Connection: close\r\n",
+			"Connection: %s\r\n",
 			responseNum, responseString
 #if ENABLE_FEATURE_HTTPD_DATE
 			, date_str
 #endif
+			, keep_alive ? "keep-alive" : "close"
 		);
 	}
 
@@ -1283,16 +1498,13 @@ static void send_headers(unsigned responseNum)
 			iobuf[len] = '\0';
 			fprintf(stderr, "headers: '%s'\n", iobuf);
 		}
-		full_write(STDOUT_FILENO, iobuf, len);
+		net_write(iobuf, len);
 		dbg("writing error page: '%s'\n", error_page);
 		return send_file_and_exit(error_page, SEND_BODY);
 	}
 #endif
 
 	if (file_size != -1) {    /* file */
-#if ENABLE_FEATURE_HTTPD_LAST_MODIFIED
-		strftime(date_str, sizeof(date_str), RFC1123FMT, gmtime_r(&last_mod, &tm));
-#endif
 #if ENABLE_FEATURE_HTTPD_RANGES
 		if (responseNum == HTTP_PARTIAL_CONTENT) {
 			len += sprintf(iobuf + len,
@@ -1333,32 +1545,13 @@ static void send_headers(unsigned responseNum)
 // (NB: standards do not define "Transfer-Length:" _header_,
 // transfer-length above is just a concept).
 
-		len += sprintf(iobuf + len,
-#if ENABLE_FEATURE_HTTPD_RANGES
-			"Accept-Ranges: bytes\r\n"
-#endif
-#if ENABLE_FEATURE_HTTPD_LAST_MODIFIED
-			"Last-Modified: %s\r\n"
+#if ENABLE_FEATURE_HTTPD_CACHE
+		if (G.cached && !content_gzip && responseNum == HTTP_OK) {
+			memcpy(iobuf + len, G.cached->hdrs, G.cached->hdr_len);
+			len += G.cached->hdr_len;
+		} else
 #endif
-#if ENABLE_FEATURE_HTTPD_ETAG
-			"ETag: %s\r\n"
-#endif
-
-	/* Because of 4.4 (5), we can forgo sending of "Content-Length"
-	 * since we close connection afterwards, but it helps clients
-	 * to e.g. estimate download times, show progress bars etc.
-	 * Theoretically we should not send it if page is compressed,
-	 * but de-facto standard is to send it (see comment below).
-	 */
-			"Content-Length: %"OFF_FMT"u\r\n",
-#if ENABLE_FEATURE_HTTPD_LAST_MODIFIED
-				date_str,
-#endif
-#if ENABLE_FEATURE_HTTPD_ETAG
-				etag,
-#endif
-				file_size
-		);
+			len += sprintf_file_headers(iobuf + len);
 	}
 
 	/* This should be "Transfer-Encoding", not "Content-Encoding":
@@ -1371,7 +1564,9 @@ static void send_headers(unsigned responseNum)
 	 * https://bugs.chromium.org/p/chromium/issues/detail?id=94730
 	 */
 	if (content_gzip)
-		len += sprintf(iobuf + len, "Content-Encoding: gzip\r\n");
+		len += sprintf(iobuf + len, "Content-Encoding: gzip\r\n"
+				IF_FEATURE_HTTPD_GZIP_DYNAMIC("Vary: Accept-Encoding\r\n")
+		);
 
 	iobuf[len++] = '\r';
 	iobuf[len++] = '\n';
@@ -1390,7 +1585,14 @@ static void send_headers(unsigned responseNum)
 		iobuf[len] = '\0';
 		fprintf(stderr, "headers: '%s'\n", iobuf);
 	}
-	if (full_write(STDOUT_FILENO, iobuf, len) != len) {
+#if ENABLE_FEATURE_HTTPD_CACHE
+	/* Small file goes in the same write */
+	if (G.cached_body && responseNum == HTTP_OK) {
+		memcpy(iobuf + len, G.cached_body, file_size);
+		len += file_size;
+	}
+#endif
+	if (net_write(iobuf, len) != len) {
 		if (VERBOSE_1)
 			bb_simple_perror_msg("write error");
 		log_and_exit();
@@ -1400,12 +1602,27 @@ static void send_headers(unsigned responseNum)
 static void send_headers_and_exit(int responseNum) NORETURN;
 static void send_headers_and_exit(int responseNum)
 {
+	IF_FEATURE_HTTPD_KEEPALIVE(keep_alive = 0;)
 	IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
 	file_size = -1; /* no Last-Modified:, ETag:, Content-Length: */
 	send_headers(responseNum);
 	send_EOF_and_exit();
 }
 
+/*
+ * Response is complete. Close the connection,
+ * or go back to handle_incoming_and_exit() to read the next request.
+ */
+static void response_done_and_exit(void) NORETURN;
+static void response_done_and_exit(void)
+{
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	if (keep_alive)
+		siglongjmp(G.next_request, 1);
+#endif
+	send_EOF_and_exit();
+}
+
 /*
  * Read from the socket until '\n' or EOF.
  * Data is returned in iobuf[].
@@ -1439,7 +1656,7 @@ static unsigned get_line(void)
 			}
 			alarm(HEADER_READ_TIMEOUT);
 #endif
-			hdr_cnt = safe_read(STDIN_FILENO, hdr_buf, sizeof_hdr_buf);
+			hdr_cnt = net_read(hdr_buf, sizeof_hdr_buf);
 			if (hdr_cnt <= 0)
 				goto ret;
 			hdr_ptr = hdr_buf;
@@ -1470,6 +1687,253 @@ static unsigned get_line(void)
 	return count;
 }
 
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+static int is_compressible(const char *mime_type)
+{
+	static const char gzip_types[] ALIGN1 =
+		"text/\0"
+		"application/javascript\0"
+		"application/json\0"
+		"application/xml\0"
+		"image/svg+xml\0"
+	;
+	const char *s;
+
+	/* find_mime_type() found nothing */
+	if (!mime_type)
+		return 0;
+	for (s = gzip_types; *s; s += strlen(s) + 1) {
+		if (strncasecmp(mime_type, s, strlen(s)) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * Run gzip with stdin from in_fd, stdout to out_fd.
+ * Returns its pid, or 0 if it can't be started.
+ */
+static pid_t spawn_gzip(int in_fd, int out_fd)
+{
+	volatile int exec_errno = 0;
+	pid_t pid;
+
+	pid = vfork();
+	if (pid < 0) {
+		bb_simple_perror_msg("vfork");
+		return 0;
+	}
+	if (pid == 0) {
+		/* child */
+		xmove_fd(in_fd, STDIN_FILENO);
+		if (out_fd != STDOUT_FILENO)
+			xmove_fd(out_fd, STDOUT_FILENO);
+		BB_EXECLP("gzip", "gzip", (char *)NULL);
+		exec_errno = errno;
+		_exit_FAILURE();
+	}
+	if (exec_errno) {
+		errno = exec_errno;
+		bb_simple_perror_msg("can't execute 'gzip'");
+		return 0;
+	}
+	return pid;
+}
+
+/*
+ * Start gzip compressing fd (from the start) into a pipe.
+ * Returns read end of the pipe, or -1.
+ */
+static int start_gzip_stream(int fd)
+{
+	struct fd_pair gz;
+
+	xpiped_pair(gz);
+	close_on_exec_on(gz.rd);
+	lseek(fd, 0, SEEK_SET);
+	if (!spawn_gzip(fd, gz.wr)) {
+		close(gz.rd);
+		gz.rd = -1;
+	}
+	close(gz.wr);
+	return gz.rd;
+}
+
+# if GZIP_CACHE
+/* Unlinked temporary file for the compressed copy of the file */
+static int gzip_cache_tmpfile(void)
+{
+	const char *tmpdir = getenv("TMPDIR");
+	char *name = concat_path_file(tmpdir ? tmpdir : "/tmp", "httpd.XXXXXX");
+	int fd = mkstemp(name);
+
+	if (fd >= 0) {
+		unlink(name);
+		close_on_exec_on(fd);
+	}
+	free(name);
+	return fd;
+}
+# endif
+
+/*
+ * Relay gzip output to the client, and exit.
+ * With keep-alive, it is sent in chunks.
+ */
+static void send_gzip_stream_and_exit(int gz_fd) NORETURN;
+static void send_gzip_stream_and_exit(int gz_fd)
+{
+	/* gzip ends with ISIZE, length of input (mod 2^32), little-endian.
+	 * We don't get gzip's exit code, use it to see that all went well */
+	uint8_t tail[4];
+	uint32_t isize;
+	ssize_t count;
+# if GZIP_CACHE
+	off_t gz_size = 0;
+# endif
+
+	memset(tail, 0, sizeof(tail));
+	/* Leave room for "XXXX\r\n" before data and "\r\n" after it */
+	while ((count = safe_read(gz_fd, iobuf + 6, IOBUF_SIZE - 8)) > 0) {
+		char *p = iobuf + 6;
+		size_t len = count;
+
+		if (count >= 4) {
+			memcpy(tail, p + count - 4, 4);
+		} else {
+			memmove(tail, tail + count, 4 - count);
+			memcpy(tail + 4 - count, p, count);
+		}
+# if GZIP_CACHE
+		if (G.gz_tmp_fd > 0) {
+			if (full_write(G.gz_tmp_fd, p, count) != count) {
+				close(G.gz_tmp_fd);
+				G.gz_tmp_fd = 0;
+			}
+			gz_size += count;
+		}
+# endif
+# if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		if (keep_alive) {
+			char hex[8];
+			sprintf(hex, "%04x\r\n", (unsigned)count);
+			p -= 6;
+			memcpy(p, hex, 6);
+			p[len + 6] = '\r';
+			p[len + 7] = '\n';
+			len += 8;
+		}
+# endif
+		if (net_write(p, len) != len) {
+			if (VERBOSE_1)
+				bb_simple_perror_msg("write error");
+			log_and_exit();
+		}
+	}
+	move_from_unaligned32(isize, tail);
+	if (count < 0 || SWAP_LE32(isize) != (uint32_t)file_size) {
+		/* Client will see that the response is incomplete */
+		if (VERBOSE_1)
+			bb_simple_error_msg("gzip failed");
+		log_and_exit();
+	}
+# if GZIP_CACHE
+	if (G.gz_tmp_fd > 0) {
+		if (gz_size < file_size) {
+			G.cached->gz_fd = G.gz_tmp_fd;
+			G.cached->gz_size = gz_size;
+		} else {
+			close(G.gz_tmp_fd);
+			G.cached->gz_fd = -1; /* compression does not help */
+		}
+		G.gz_tmp_fd = 0;
+	}
+# endif
+# if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	if (keep_alive)
+		net_write("0\r\n\r\n", 5);
+# endif
+	response_done_and_exit();
+}
+
+# if ENABLE_FEATURE_HTTPD_CGI
+/*
+ * Length of CGI headers in iobuf[0..cnt), up to the empty line,
+ * or -1 if the empty line is not there yet.
+ */
+static int cgi_hdr_len(int cnt)
+{
+	char *p = iobuf;
+	char *end = iobuf + cnt;
+
+	while (1) {
+		char *eol = memchr(p, '\n', end - p);
+		if (!eol)
+			return -1;
+		if (eol == p || (eol == p + 1 && *p == '\r'))
+			return p - iobuf;
+		p = eol + 1;
+	}
+}
+
+/*
+ * If CGI output in iobuf[0..*cnt) is a compressible 200 response,
+ * send its headers with "Content-Encoding: gzip" added, start gzip
+ * writing to the peer, move the start of the body to iobuf[0]
+ * and return the pipe to gzip. Otherwise, return STDOUT_FILENO.
+ */
+static int cgi_start_gzip(int *cnt, pid_t *pid)
+{
+	static const char gz_hdrs[] ALIGN1 =
+		"Content-Encoding: gzip\r\n"
+		"Vary: Accept-Encoding\r\n";
+	struct fd_pair gz;
+	char *p, *end;
+	int hdr_len;
+	int compressible;
+
+	hdr_len = cgi_hdr_len(*cnt);
+	if (hdr_len <= 0)
+		return STDOUT_FILENO;
+	/* Only 200 has a body worth compressing */
+	if (is_prefixed_with(iobuf, "HTTP/") && strncmp(iobuf + 8, " 200", 4) != 0)
+		return STDOUT_FILENO;
+	compressible = 0;
+	end = iobuf + hdr_len;
+	for (p = iobuf; p < end; p = strchr(p, '\n') + 1) {
+		/* Content-Length would not match the gzipped body */
+		if (STRNCASECMP(p, "Content-Encoding:") == 0
+		 || STRNCASECMP(p, "Content-Length:") == 0
+		 || STRNCASECMP(p, "Location:") == 0
+		) {
+			return STDOUT_FILENO;
+		}
+		if (STRNCASECMP(p, "Content-Type:") == 0)
+			compressible = is_compressible(skip_whitespace(p + sizeof("Content-Type:")-1));
+	}
+	if (!compressible)
+		return STDOUT_FILENO;
+
+	xpiped_pair(gz);
+	close_on_exec_on(gz.wr); /* else gzip never sees EOF */
+	*pid = spawn_gzip(gz.rd, STDOUT_FILENO);
+	close(gz.rd);
+	if (!*pid) {
+		close(gz.wr);
+		return STDOUT_FILENO;
+	}
+	full_write(STDOUT_FILENO, iobuf, hdr_len);
+	full_write(STDOUT_FILENO, gz_hdrs, sizeof(gz_hdrs) - 1);
+	/* Empty line goes to the peer, uncompressed */
+	p = end + (*end == '\r' ? 2 : 1);
+	full_write(STDOUT_FILENO, "\r\n", 2);
+	*cnt = iobuf + *cnt - p;
+	memmove(iobuf, p, *cnt);
+	return gz.wr;
+}
+# endif
+#endif
+
 #if ENABLE_FEATURE_HTTPD_CGI || ENABLE_FEATURE_HTTPD_PROXY
 static void log_cgi_status(const char *pfx, const char *st, unsigned len)
 {
@@ -1487,6 +1951,10 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 	struct pollfd pfd[3];
 	int out_cnt;
 	int count;
+	int out_fd = STDOUT_FILENO; /* or pipe to gzip */
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	pid_t gz_pid = 0;
+#endif
 
 	/* iobuf is used for CGI -> network data,
 	 * hdr_buf is for network -> CGI data (POSTDATA) */
@@ -1503,6 +1971,11 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 	//}
 	G.POST_len -= hdr_cnt;
 	//bb_error_msg("G.POST_len:%d", G.POST_len);
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC && ENABLE_FEATURE_HTTPD_SSL
+	/* gzip would write to the socket, bypassing TLS */
+	if (G.tls)
+		accept_gzip = 0;
+#endif
 
 	/* If it's really CGI, we buffer a bit of initial CGI output and handle "Status:" etc */
 	/* If it's proxying, then no buffering/conversion is needed (out_cnt set to -1)*/
@@ -1560,6 +2033,12 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 		}
 
 		/* Now wait on the set of sockets */
+		if (pfd[0].fd == 0 && hdr_cnt <= 0 && net_has_buffered_data()) {
+			/* Decrypted POSTDATA is waiting, poll() won't see it */
+			pfd[0].revents = POLLIN;
+			pfd[FROM_CGI].revents = 0;
+			count = 1;
+		} else
 		/* Poll whether TO_CGI is ready to accept writes *only* if we have some POSTDATA to give to it */
 		count = safe_poll(pfd, hdr_cnt > 0 ? TO_CGI+1 : FROM_CGI+1, -1);
 
@@ -1605,7 +2084,7 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 			 */
 			//count = G.POST_len > (int)sizeof_hdr_buf ? (int)sizeof_hdr_buf : G.POST_len;
 			//count = safe_read(STDIN_FILENO, hdr_buf, count);
-			count = safe_read(STDIN_FILENO, hdr_buf, sizeof_hdr_buf);
+			count = net_read(hdr_buf, sizeof_hdr_buf);
 			if (count > 0) {
 				hdr_cnt = count;
 				hdr_ptr = hdr_buf;
@@ -1632,8 +2111,8 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 				 * CGI may output a few first bytes and then wait
 				 * for POSTDATA without closing stdout.
 				 * With full_read we may wait here forever. */
-				count = safe_read(fromCgi_rd, iobuf + out_cnt, IOBUF_SIZE - 16);
-// "- 16" is important, out_cnt can be up to 9
+				count = safe_read(fromCgi_rd, iobuf + out_cnt, IOBUF_SIZE - 16 - out_cnt);
+// "- 16" is important, "Status: " rewrite below grows the data
 				if (count <= 0) {
 					/* EOF (or error, and out_cnt=0..7
 					 * send "HTTP/1.1 200 OK\r\n", then send received 0..7 bytes */
@@ -1643,6 +2122,11 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 				}
 				out_cnt += count;
 				count = 0;
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+				/* To decide on compression, we need to see all headers */
+				if (accept_gzip && cgi_hdr_len(out_cnt) < 0 && out_cnt < IOBUF_SIZE / 2)
+					continue;
+#endif
 				if (out_cnt >= 10) {
 //FIXME: "Status: " is not required to be the first header! It can be anywhere!
 					uint64_t str8 = *(uint64_t*)iobuf;
@@ -1662,7 +2146,7 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 					else
 					if (str8 == PACK64_LITERAL_STR("Location") && iobuf[8] == ':' && iobuf[9] == ' ') {
 #define HTTP_302 "HTTP/1.1 302 Found\r\n"
-						if (full_write(STDOUT_FILENO, HTTP_302, sizeof(HTTP_302)-1) != sizeof(HTTP_302)-1)
+						if (net_write(HTTP_302, sizeof(HTTP_302)-1) != sizeof(HTTP_302)-1)
 							break;
 						if (verbose)
 							log_cgi_status("redirect", iobuf + 10, out_cnt - 10);
@@ -1673,7 +2157,7 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 					if (str8 != PACK64_LITERAL_STR(HTTP_200)) {
  write_HTTP_200_OK:
 						/* no, send "HTTP/1.1 200 OK\r\n" ourself */
-						if (full_write(STDOUT_FILENO, HTTP_200, sizeof(HTTP_200)-1) != sizeof(HTTP_200)-1)
+						if (net_write(HTTP_200, sizeof(HTTP_200)-1) != sizeof(HTTP_200)-1)
 							break;
 						if (verbose)
 							bb_error_msg("cgi response:%u", 200);
@@ -1686,15 +2170,36 @@ static NOINLINE void cgi_io_loop_and_exit(int fromCgi_rd, int toCgi_wr)
 					 */
 					count = out_cnt;
 					out_cnt = -1; /* buffering off */
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+					if (accept_gzip) {
+						/* Don't let gzip hold CGI's stdin open */
+						if (toCgi_wr)
+							close_on_exec_on(toCgi_wr);
+						out_fd = cgi_start_gzip(&count, &gz_pid);
+					}
+#endif
 				}
 			} else {
 				count = safe_read(fromCgi_rd, iobuf, IOBUF_SIZE);
-				if (count <= 0)
-					send_EOF_and_exit();  /* EOF (or error) */
+				if (count <= 0) {
+					/* EOF (or error) */
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+					if (out_fd != STDOUT_FILENO) {
+						/* Let gzip finish sending */
+						close(out_fd);
+						safe_waitpid(gz_pid, NULL, 0);
+					}
+#endif
+					send_EOF_and_exit();
+				}
 			}
 			IF_FEATURE_HTTPD_CGI(G.cgi_output = 1;)
 //FIXME: many (most?) servers translate bare "\n" to "\r\n", only in the headers, not body (the part after empty line)
-			if (full_write(STDOUT_FILENO, iobuf, count) != count)
+			if (out_fd == STDOUT_FILENO) {
+				if (net_write(iobuf, count) != count)
+					break;
+			} else
+			if (full_write(out_fd, iobuf, count) != count)
 				break;
 			dbg("cgi read %d bytes: '%.*s'\n", count, count, iobuf);
 		} /* if (pfd[FROM_CGI].revents) */
@@ -1835,6 +2340,10 @@ static void send_cgi_and_exit(
 	putenv((char*)"SERVER_SOFTWARE=busybox httpd/"BB_VER);
 	putenv((char*)"SERVER_PROTOCOL=HTTP/1.1");
 	putenv((char*)"GATEWAY_INTERFACE=CGI/1.1");
+#if ENABLE_FEATURE_HTTPD_SSL
+	if (G.tls)
+		putenv((char*)"HTTPS=on");
+#endif
 	/* Having _separate_ variables for IP and port defeats
 	 * the purpose of having socket abstraction. Which "port"
 	 * are you using on Unix domain socket?
@@ -1998,60 +2507,11 @@ static void send_cgi_and_exit(
 #endif          /* FEATURE_HTTPD_CGI */
 
 /*
- * Send a file response to a HTTP request, and exit
- *
- * Parameters:
- * const char *url  The requested URL (with leading /).
- * what             What to send (headers/body/both).
+ * Set found_mime_type by the suffix of url
  */
-static NOINLINE void send_file_and_exit(const char *url, int what)
+static void find_mime_type(const char *url)
 {
 	const char *suffix;
-	int fd;
-	ssize_t count;
-
-#if ENABLE_FEATURE_HTTPD_GZIP
-	if (accept_gzip) {
-		/* does <url>.gz exist? Then use it instead */
-		char *gzurl = xasprintf("%s.gz", url);
-		fd = open(gzurl, O_RDONLY);
-		free(gzurl);
-		if (fd != -1) {
-			struct stat sb;
-			fstat(fd, &sb);
-			file_size = sb.st_size;
-			last_mod = sb.st_mtime;
-			content_gzip = 1;
-		} else {
-			fd = open(url, O_RDONLY);
-		}
-	} else
-#endif
-	{
-		fd = open(url, O_RDONLY);
-		/* file_size and last_mod are already populated */
-	}
-	if (fd < 0) {
-		dbg("can't open '%s'\n", url);
-		/* Error pages are sent by using send_file_and_exit(SEND_BODY).
-		 * IOW: it is unsafe to call send_headers_and_exit
-		 * if "what" is SEND_BODY! Can recurse! */
-		if (what != SEND_BODY)
-			send_headers_and_exit(HTTP_NOT_FOUND);
-		send_EOF_and_exit();
-	}
-#if ENABLE_FEATURE_HTTPD_ETAG
-	/* ETag is "hex(last_mod)-hex(file_size)" e.g. "5e132e20-417" */
-	sprintf(etag, "\"%"LL_FMT"x-%"LL_FMT"x\"", (unsigned long long)last_mod, (unsigned long long)file_size);
-
-	if (G.if_none_match) {
-		dbg("If-None-Match:'%s' file's ETag:'%s'\n", G.if_none_match, etag);
-		/* Weak ETag comparision.
-		 * If-None-Match may have many ETags but they are quoted so we can use simple substring search */
-		if (strstr(G.if_none_match, etag))
-			send_headers_and_exit(HTTP_NOT_MODIFIED);
-	}
-#endif
 
 	/* If not found, default is to not send "Content-type:" */
 	/*found_mime_type = NULL; - already is */
@@ -2117,6 +2577,251 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 			}
 		}
 	}
+}
+
+#if ENABLE_FEATURE_HTTPD_ETAG
+static void set_etag(void)
+{
+	/* ETag is "hex(last_mod)-hex(file_size)" e.g. "5e132e20-417" */
+	sprintf(etag, "\"%"LL_FMT"x-%"LL_FMT"x\"", (unsigned long long)last_mod, (unsigned long long)file_size);
+}
+#endif
+
+#if ENABLE_FEATURE_HTTPD_CACHE
+/*
+ * Find url in the cache, or open it and add it to the cache.
+ * Entry is valid if file's inode, size and mtime
+ * (stat()ed by handle_request_and_exit()) are the same.
+ * Returns NULL if url can't be opened.
+ */
+static file_cache *get_cached_file(const char *url)
+{
+	file_cache **pp;
+	file_cache *c;
+	struct stat sb;
+	unsigned hash;
+	const char *p;
+	int fd;
+	unsigned len;
+
+	hash = 0;
+	for (p = url; *p; p++)
+		hash = hash * 31 + (unsigned char)*p;
+	pp = &G.file_cache[hash & (CACHE_SIZE - 1)];
+	c = *pp;
+	if (c) {
+		if (c->ino == G.file_ino
+		 && c->size == file_size
+		 && c->mtime == last_mod
+		 && strcmp(c->name, url) == 0
+		) {
+			return c;
+		}
+		/* Changed file, or other file with the same hash */
+		close(c->fd);
+#if GZIP_CACHE
+		if (c->gz_fd > 0)
+			close(c->gz_fd);
+#endif
+		free(c->body);
+		free(c->name);
+		free(c);
+		*pp = NULL;
+	}
+
+	fd = open(url, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	/* Describe what we actually opened */
+	fstat(fd, &sb);
+	file_size = sb.st_size;
+	last_mod = sb.st_mtime;
+	find_mime_type(url);
+	IF_FEATURE_HTTPD_ETAG(set_etag();)
+	len = sprintf_file_headers(iobuf);
+
+	c = xzalloc(sizeof(*c) + len);
+	c->name = xstrdup(url);
+	c->mime_type = found_mime_type;
+	c->size = sb.st_size;
+	c->mtime = sb.st_mtime;
+	c->ino = sb.st_ino;
+	c->fd = fd;
+	c->hdr_len = len;
+	memcpy(c->hdrs, iobuf, len);
+	if (sb.st_size <= CACHE_BODY_MAX) {
+		c->body = xmalloc(sb.st_size + 1);
+		if (full_read(fd, c->body, sb.st_size) != sb.st_size) {
+			free(c->body);
+			c->body = NULL;
+		}
+	}
+	*pp = c;
+	return c;
+}
+#endif
+
+static int open_file(const char *url, int what UNUSED_PARAM)
+{
+	int fd;
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (what & SEND_HEADERS) {
+		/* Not an error page */
+		G.cached = get_cached_file(url);
+		if (!G.cached)
+			return -1;
+		fd = G.cached->fd;
+		/* Previous response moved it */
+		lseek(fd, 0, SEEK_SET);
+		return fd;
+	}
+#endif
+	fd = open(url, O_RDONLY);
+	/* file_size and last_mod are already populated */
+	return fd;
+}
+
+/*
+ * Send a file response to a HTTP request, and exit
+ *
+ * Parameters:
+ * const char *url  The requested URL (with leading /).
+ * what             What to send (headers/body/both).
+ */
+static NOINLINE void send_file_and_exit(const char *url, int what)
+{
+	int fd;
+	ssize_t count;
+	off_t left;
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	smallint gz_dynamic;
+#endif
+
+#if ENABLE_FEATURE_HTTPD_GZIP
+	fd = -1;
+	if (accept_gzip) {
+		/* does <url>.gz exist? Then use it instead */
+		char *gzurl = xasprintf("%s.gz", url);
+		fd = open(gzurl, O_RDONLY);
+		free(gzurl);
+		if (fd != -1) {
+			struct stat sb;
+			fstat(fd, &sb);
+			file_size = sb.st_size;
+			last_mod = sb.st_mtime;
+			content_gzip = 1;
+		}
+	}
+	if (fd < 0)
+#endif
+		fd = open_file(url, what);
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE || ENABLE_FEATURE_HTTPD_PREFORK
+	/* We may not exit after this response, the fd must not leak.
+	 * (Cached fd stays open) */
+	if (!IF_FEATURE_HTTPD_CACHE(G.cached) IF_NOT_FEATURE_HTTPD_CACHE(0))
+		G.file_fd = fd;
+#endif
+	if (fd < 0) {
+		dbg("can't open '%s'\n", url);
+		/* Error pages are sent by using send_file_and_exit(SEND_BODY).
+		 * IOW: it is unsafe to call send_headers_and_exit
+		 * if "what" is SEND_BODY! Can recurse! */
+		if (what != SEND_BODY)
+			send_headers_and_exit(HTTP_NOT_FOUND);
+		send_EOF_and_exit();
+	}
+
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (G.cached)
+		found_mime_type = G.cached->mime_type;
+	else
+#endif
+		find_mime_type(url);
+
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	gz_dynamic = (accept_gzip && !content_gzip
+		&& (what & SEND_HEADERS)
+		&& range_start < 0 /* ranges win over compression */
+		&& file_size >= GZIP_MIN_SIZE
+		&& is_compressible(found_mime_type)
+# if GZIP_CACHE
+		&& !(G.cached && G.cached->gz_fd < 0)
+# endif
+	);
+#endif
+#if ENABLE_FEATURE_HTTPD_ETAG
+	set_etag();
+# if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	/* Compressed variant needs its own ETag, and we want
+	 * to know it before we spend time compressing */
+	if (gz_dynamic)
+		strcpy(strrchr(etag, '"'), "-gz\"");
+# endif
+
+	if (G.if_none_match) {
+		dbg("If-None-Match:'%s' file's ETag:'%s'\n", G.if_none_match, etag);
+		/* Weak ETag comparision.
+		 * If-None-Match may have many ETags but they are quoted so we can use simple substring search */
+		if (strstr(G.if_none_match, etag)) {
+			if (!keep_alive)
+				send_headers_and_exit(HTTP_NOT_MODIFIED);
+			/* 304 has no body, connection can be reused */
+			IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
+			file_size = -1;
+			send_headers(HTTP_NOT_MODIFIED);
+			response_done_and_exit();
+		}
+	}
+#endif
+
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	if (gz_dynamic) {
+		int gz_fd = 0;
+# if GZIP_CACHE
+		if (G.cached && G.cached->gz_fd > 0) {
+			/* Compressed by an earlier request */
+			fd = G.cached->gz_fd;
+			lseek(fd, 0, SEEK_SET);
+			file_size = G.cached->gz_size;
+			content_gzip = 1;
+		} else
+# endif
+		/* Start gzip before we send headers: if it fails,
+		 * we still can send the file uncompressed */
+		if (!(what & SEND_BODY) || (gz_fd = start_gzip_stream(fd)) >= 0) {
+			content_gzip = 1;
+			gz_stream = 1;
+# if ENABLE_FEATURE_HTTPD_KEEPALIVE
+			/* HTTP/1.0 client does not know chunks */
+			if (!G.http11)
+				keep_alive = 0;
+# endif
+# if GZIP_CACHE
+			/* Keep a copy only if a long-lived worker can reuse it */
+			if (gz_fd > 0 && G.in_worker && G.cached
+			 && file_size <= GZIP_CACHE_MAX
+			) {
+				G.gz_tmp_fd = gzip_cache_tmpfile();
+				if (G.gz_tmp_fd < 0)
+					G.gz_tmp_fd = 0;
+			}
+# endif
+		}
+# if ENABLE_FEATURE_HTTPD_ETAG
+		else
+			set_etag(); /* back to plain file's ETag */
+# endif
+		if (gz_fd > 0) {
+# if ENABLE_FEATURE_HTTPD_KEEPALIVE || ENABLE_FEATURE_HTTPD_PREFORK
+			/* Plain file is not needed anymore. (Cached fd stays open) */
+			if (G.file_fd > 0)
+				close(G.file_fd);
+			G.file_fd = gz_fd;
+# endif
+			fd = gz_fd;
+		}
+	}
+#endif
 
 	dbg("sending file '%s' content-type:%s\n", url, found_mime_type);
 
@@ -2142,9 +2847,27 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 			what = SEND_BODY;
 		}
 	}
+#endif
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (G.cached && !content_gzip && what == SEND_HEADERS + SEND_BODY)
+		G.cached_body = G.cached->body;
 #endif
 	if (what & SEND_HEADERS)
 		send_headers(HTTP_OK);
+	if (!(what & SEND_BODY)) {
+		/* HEAD */
+		response_done_and_exit();
+	}
+#if ENABLE_FEATURE_HTTPD_CACHE
+	if (G.cached_body) /* send_headers() has sent it */
+		response_done_and_exit();
+#endif
+#if ENABLE_FEATURE_HTTPD_GZIP_DYNAMIC
+	if (gz_stream)
+		send_gzip_stream_and_exit(fd);
+#endif
+	/* send_headers() converted it to the length of the body */
+	left = file_size;
 
 	/* Sending BODY */
 #if ENABLE_FEATURE_USE_SENDFILE
@@ -2157,7 +2880,8 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 # else
 		offset = 0;
 # endif
-		while (1) {
+		/* No sendfile() if data is to be encrypted */
+		while (!IF_FEATURE_HTTPD_SSL(G.tls) IF_NOT_FEATURE_HTTPD_SSL(0)) {
 			/* sz is rounded down to 64k */
 			ssize_t sz = MAXINT(ssize_t) - 0xffff;
 			IF_FEATURE_HTTPD_RANGES(if (sz > range_len) sz = range_len;)
@@ -2174,16 +2898,17 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 				}
 				log_and_exit();
 			}
+			left -= count;
 			IF_FEATURE_HTTPD_RANGES(range_len -= count;)
 			if (count == 0 || range_len == 0)
-				send_EOF_and_exit();
+				goto done;
 		}
 	}
 #endif
 	while ((count = safe_read(fd, iobuf, IOBUF_SIZE)) > 0) {
 		ssize_t n;
 		IF_FEATURE_HTTPD_RANGES(if (count > range_len) count = range_len;)
-		n = full_write(STDOUT_FILENO, iobuf, count);
+		n = net_write(iobuf, count);
 		if (count != n) {
 			if (VERBOSE_1 && n < 0) {
 				if (errno == EAGAIN)
@@ -2193,6 +2918,7 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 			}
 			break;
 		}
+		left -= count;
 		IF_FEATURE_HTTPD_RANGES(range_len -= count;)
 		if (range_len == 0)
 			break;
@@ -2201,7 +2927,11 @@ static NOINLINE void send_file_and_exit(const char *url, int what)
 		if (VERBOSE_1)
 			bb_simple_perror_msg("read error");
 	}
-	send_EOF_and_exit();
+ IF_FEATURE_USE_SENDFILE(done:)
+	/* If file has shrunk, client is waiting for the rest. Don't keep it waiting */
+	if (left != 0)
+		send_EOF_and_exit();
+	response_done_and_exit();
 }
 
 #if ENABLE_FEATURE_HTTPD_ACL_IP
@@ -2511,19 +3241,77 @@ static void prepare_write_timeout(void)
 	/* this is less expensive than arming alarm() before every write */
 }
 
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE || ENABLE_FEATURE_HTTPD_PREFORK
+/* Forget what previous request in this process has set */
+static void reset_request_state(void)
+{
+	/* (0 is the connection, never a file) */
+	if (G.file_fd > 0) {
+		close(G.file_fd);
+		G.file_fd = 0;
+	}
+	IF_FEATURE_HTTPD_CACHE(G.cached = NULL;)
+	IF_FEATURE_HTTPD_CACHE(G.cached_body = NULL;)
+	found_mime_type = NULL;
+	found_moved_temporarily = NULL;
+	g_query = NULL;
+	file_size = -1;
+	IF_FEATURE_HTTPD_RANGES(range_start = -1;)
+	IF_FEATURE_HTTPD_RANGES(range_end = 0;)
+	IF_FEATURE_HTTPD_GZIP(accept_gzip = 0;)
+	IF_FEATURE_HTTPD_GZIP(content_gzip = 0;)
+	IF_FEATURE_HTTPD_GZIP_DYNAMIC(gz_stream = 0;)
+# if GZIP_CACHE
+	if (G.gz_tmp_fd > 0) {
+		close(G.gz_tmp_fd);
+		G.gz_tmp_fd = 0;
+	}
+# endif
+# if ENABLE_FEATURE_HTTPD_ETAG
+	free(G.if_none_match);
+	G.if_none_match = NULL;
+# endif
+# if ENABLE_FEATURE_HTTPD_BASIC_AUTH
+	free(remoteuser);
+	remoteuser = NULL;
+# endif
+}
+#endif
+
+#if ENABLE_FEATURE_HTTPD_PREFORK \
+ && (ENABLE_FEATURE_HTTPD_CGI || ENABLE_FEATURE_HTTPD_PROXY)
+/* CGI and proxy code does putenv(), opens fds and exits,
+ * it can't run in a worker. Fork a process to handle
+ * the rest of this connection, worker goes on to the next one.
+ */
+static void leave_worker(void)
+{
+	pid_t pid;
+
+	if (!G.in_worker)
+		return;
+	pid = fork();
+	if (pid < 0)
+		send_headers_and_exit(HTTP_INTERNAL_SERVER_ERROR);
+	if (pid > 0)
+		connection_done_and_exit();
+	G.in_worker = 0;
+	close(G.listen_fd);
+}
+#else
+# define leave_worker() ((void)0)
+#endif
+
 /*
  * Handle an incoming http request and exit.
  */
-static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr) NORETURN;
-static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
+static void handle_request_and_exit(void) NORETURN;
+static void handle_request_and_exit(void)
 {
 	struct stat sb;
 	char *urlcopy;
 	char *urlp;
 	char *tptr;
-#if ENABLE_FEATURE_HTTPD_ACL_IP
-	unsigned remote_ip;
-#endif
 #if ENABLE_FEATURE_HTTPD_CGI
 	unsigned total_headers_len;
 	unsigned un;
@@ -2546,43 +3334,10 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 #if ENABLE_FEATURE_HTTPD_BASIC_AUTH
 	smallint authorized = -1;
 #endif
-	char *HTTP_slash;
-
-	if (ENABLE_FEATURE_HTTPD_CGI || DEBUG || verbose) {
-		/* NB: can be NULL (user runs httpd -i by hand?) */
-		rmt_ip_str = xmalloc_sockaddr2dotted(&fromAddr->u.sa);
-	}
-	if (verbose) {
-		/* this trick makes -v logging much simpler */
-		if (rmt_ip_str)
-			applet_name = rmt_ip_str;
-		if (VERBOSE_3)
-			bb_simple_error_msg("connected");
-	}
-#if ENABLE_FEATURE_HTTPD_ACL_IP
-	remote_ip = 0;
-	if (fromAddr->u.sa.sa_family == AF_INET) {
-		remote_ip = ntohl(fromAddr->u.sin.sin_addr.s_addr);
-	}
-# if ENABLE_FEATURE_IPV6
-#  if !ENABLE_PLATFORM_MINGW32
-	if (fromAddr->u.sa.sa_family == AF_INET6
-	 && fromAddr->u.sin6.sin6_addr.s6_addr32[0] == 0
-	 && fromAddr->u.sin6.sin6_addr.s6_addr32[1] == 0
-	 && ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[2]) == 0xffff)
-		remote_ip = ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[3]);
-#  else
-	if (fromAddr->u.sa.sa_family == AF_INET6
-	 && fromAddr->u.sin6.sin6_addr.s6_words[0] == 0
-	 && fromAddr->u.sin6.sin6_addr.s6_words[1] == 0
-	 && fromAddr->u.sin6.sin6_addr.s6_words[2] == 0
-	 && fromAddr->u.sin6.sin6_addr.s6_words[3] == 0
-	 && ntohl(*(uint32_t *)(fromAddr->u.sin6.sin6_addr.s6_words+4)) == 0xffff)
-		remote_ip = ntohl(*(uint32_t *)(fromAddr->u.sin6.sin6_addr.s6_words+6));
-#  endif
-# endif
-	if_ip_denied_send_HTTP_FORBIDDEN_and_exit(remote_ip);
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	smallint has_body = 0;
 #endif
+	char *HTTP_slash;
 
 #if !ENABLE_PLATFORM_MINGW32
 	/* Limit how long we expect clients to be sending headers */
@@ -2602,7 +3357,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		 * just close the socket.
 		 */
 		//send_headers_and_exit(HTTP_BAD_REQUEST);
-		_exit_SUCCESS();
+		connection_done_and_exit();
 	}
 	dbg("Request:'%s'\n", iobuf);
 
@@ -2620,6 +3375,11 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 	if (!HTTP_slash || strncmp(HTTP_slash + 1, HTTP_200, 5) != 0)
 		send_headers_and_exit(HTTP_BAD_REQUEST);
 	*HTTP_slash++ = '\0';
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* HTTP/1.1 connections are persistent unless "Connection: close" */
+	keep_alive = (strcmp(HTTP_slash, "HTTP/1.1") == 0);
+	G.http11 = keep_alive;
+#endif
 
 #if ENABLE_FEATURE_HTTPD_PROXY
 	proxy_entry = find_proxy_entry(urlp);
@@ -2629,6 +3389,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 
 		if (VERBOSE_2)
 			bb_error_msg("proxy:%s", urlp);
+		leave_worker();
 		lsa = host2sockaddr(proxy_entry->host_port, 80);
 		if (!lsa)
 			send_headers_and_exit(HTTP_INTERNAL_SERVER_ERROR);
@@ -2746,8 +3507,12 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 		/* have path1/path2 */
 		*tptr = '\0';
 		/* may have subdir config */
-		if (parse_conf(urlcopy + 1, SUBDIR_PARSE) == 0)
-			if_ip_denied_send_HTTP_FORBIDDEN_and_exit(remote_ip);
+		if (parse_conf(urlcopy + 1, SUBDIR_PARSE) == 0) {
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE || ENABLE_FEATURE_HTTPD_PREFORK
+			G.conf_changed = 1;
+#endif
+			if_ip_denied_send_HTTP_FORBIDDEN_and_exit(G.remote_ip);
+		}
 		*tptr = '/';
 	}
 
@@ -2780,7 +3545,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			 * Work around it by making a deep copy.
 			 */
 			if (ENABLE_FEATURE_HTTPD_CGI)
-				g_query = xstrdup(g_query); /* ok for NULL too */
+				g_query = auto_string(xstrdup(g_query)); /* ok for NULL too */
 			strcpy(urlp, index_page);
 		}
 		if (stat(tptr, &sb) == 0) {
@@ -2805,6 +3570,7 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
  IF_FEATURE_HTTPD_CGI(exists:)
 				file_size = sb.st_size;
 				last_mod = sb.st_mtime;
+				IF_FEATURE_HTTPD_CACHE(G.file_ino = sb.st_ino;)
 			}
 		}
 #if ENABLE_FEATURE_HTTPD_CGI
@@ -2825,6 +3591,9 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 
 #if ENABLE_FEATURE_HTTPD_CGI
 	total_headers_len = 0;
+	/* CGI gets headers via putenv() */
+	if (cgi_type != CGI_NONE)
+		leave_worker();
 #endif
 
 	/* Read until blank line */
@@ -2839,6 +3608,18 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			send_headers_and_exit(HTTP_ENTITY_TOO_LARGE);
 #endif
 		dbg("header:'%s'\n", iobuf);
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		/* Only a CGI reads request body (and maybe not all of it).
+		 * If we'd keep the connection, the rest of the body
+		 * would be taken for the next request */
+		if (STRNCASECMP(iobuf, "Transfer-Encoding:") == 0)
+			has_body = 1;
+		if (STRNCASECMP(iobuf, "Content-Length:") == 0) {
+			tptr = skip_whitespace(iobuf + sizeof("Content-Length:") - 1);
+			if (strcmp(tptr, "0") != 0)
+				has_body = 1;
+		}
+#endif
 #if ENABLE_FEATURE_HTTPD_CGI
 		/* Only POST needs to know POST_length */
 		if (prequest == request_POST && STRNCASECMP(iobuf, "Content-Length:") == 0) {
@@ -2905,6 +3686,16 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 			continue;
 		}
 #endif
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+		if (STRNCASECMP(iobuf, "Connection:") == 0) {
+			tptr = skip_whitespace(iobuf + sizeof("Connection:") - 1);
+			if (strcasestr(tptr, "close"))
+				keep_alive = 0;
+			else if (strcasestr(tptr, "keep-alive"))
+				keep_alive = 1;
+			/* no "continue": CGI wants to see it too */
+		}
+#endif
 #if ENABLE_FEATURE_HTTPD_ETAG
 		if (STRNCASECMP(iobuf, "If-None-Match:") == 0) {
 			free(G.if_none_match);
@@ -2944,6 +3735,11 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 
 	/* We are done reading headers, disable header timeout */
 	prepare_write_timeout();
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* Subdir's httpd.conf changed the config for this process */
+	if (G.conf_changed || has_body)
+		keep_alive = 0;
+#endif
 
 #if !ENABLE_PLATFORM_MINGW32
 	if (strcmp(bb_basename(urlcopy), HTTPD_CONF) == 0) {
@@ -2995,6 +3791,82 @@ static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
 	);
 }
 
+/*
+ * Handle an incoming http connection and exit.
+ */
+static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr) NORETURN;
+static void handle_incoming_and_exit(const len_and_sockaddr *fromAddr)
+{
+	if (ENABLE_FEATURE_HTTPD_CGI || DEBUG || verbose) {
+		/* NB: can be NULL (user runs httpd -i by hand?) */
+		rmt_ip_str = xmalloc_sockaddr2dotted(&fromAddr->u.sa);
+	}
+	if (verbose) {
+		/* this trick makes -v logging much simpler */
+		if (rmt_ip_str)
+			applet_name = rmt_ip_str;
+		if (VERBOSE_3)
+			bb_simple_error_msg("connected");
+	}
+#if ENABLE_FEATURE_HTTPD_ACL_IP
+	G.remote_ip = 0;
+	if (fromAddr->u.sa.sa_family == AF_INET) {
+		G.remote_ip = ntohl(fromAddr->u.sin.sin_addr.s_addr);
+	}
+# if ENABLE_FEATURE_IPV6
+#  if !ENABLE_PLATFORM_MINGW32
+	if (fromAddr->u.sa.sa_family == AF_INET6
+	 && fromAddr->u.sin6.sin6_addr.s6_addr32[0] == 0
+	 && fromAddr->u.sin6.sin6_addr.s6_addr32[1] == 0
+	 && ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[2]) == 0xffff)
+		G.remote_ip = ntohl(fromAddr->u.sin6.sin6_addr.s6_addr32[3]);
+#  else
+	if (fromAddr->u.sa.sa_family == AF_INET6
+	 && fromAddr->u.sin6.sin6_addr.s6_words[0] == 0
+	 && fromAddr->u.sin6.sin6_addr.s6_words[1] == 0
+	 && fromAddr->u.sin6.sin6_addr.s6_words[2] == 0
+	 && fromAddr->u.sin6.sin6_addr.s6_words[3] == 0
+	 && ntohl(*(uint32_t *)(fromAddr->u.sin6.sin6_addr.s6_words+4)) == 0xffff)
+		G.remote_ip = ntohl(*(uint32_t *)(fromAddr->u.sin6.sin6_addr.s6_words+6));
+#  endif
+# endif
+	if_ip_denied_send_HTTP_FORBIDDEN_and_exit(G.remote_ip);
+#endif
+
+#if ENABLE_FEATURE_HTTPD_SSL
+	if (G.ssl_keys) {
+		tls_state_t *tls = new_tls_state();
+		tls->ifd = STDIN_FILENO;
+		tls->ofd = STDOUT_FILENO;
+		alarm(HEADER_READ_TIMEOUT);
+		/* This can die on errors */
+		tls_handshake_as_server(tls, G.ssl_keys);
+		G.tls = tls;
+	}
+#endif
+
+#if ENABLE_FEATURE_HTTPD_KEEPALIVE
+	/* Headers and body are separate writes. Without this, Nagle
+	 * holds the body until client ACKs headers, and client delays
+	 * the ACK: every request on a reused connection waits ~40ms */
+	setsockopt_1(STDOUT_FILENO, IPPROTO_TCP, TCP_NODELAY);
+	if (sigsetjmp(G.next_request, 0)) {
+		/* Response is sent. Wait for the next request,
+		 * unless client has already sent it */
+		if (hdr_cnt <= 0 && !net_has_buffered_data()) {
+			struct pollfd pfd;
+
+			pfd.fd = STDIN_FILENO;
+			pfd.events = POLLIN;
+			if (safe_poll(&pfd, 1, KEEPALIVE_TIMEOUT * 1000) <= 0)
+				log_and_exit();
+		}
+		reset_request_state();
+	}
+#endif
+	handle_request_and_exit();
+}
+
 #if !ENABLE_PLATFORM_MINGW32
 static int count_children(void)
 {
@@ -3048,6 +3920,120 @@ static int throttle_if_conn_limit(void)
 }
 #endif
 
+#if ENABLE_FEATURE_HTTPD_PREFORK
+/* Let workers finish their connections and exit */
+static void stop_workers(void)
+{
+	int i;
+
+	if (!G.worker_pid)
+		return;
+	for (i = 0; i < G.prefork_cnt; i++)
+		if (G.worker_pid[i] > 0)
+			kill(G.worker_pid[i], SIGHUP);
+}
+
+static void prefork_exit_handler(int sig)
+{
+	stop_workers();
+	kill_myself_with_sig(sig);
+}
+
+static void worker_sighup_handler(int sig UNUSED_PARAM)
+{
+	/* Config is reloaded: finish this connection and exit,
+	 * parent starts a new worker */
+	G.worker_exit = 1;
+}
+
+static void httpd_worker(int server_socket) NORETURN;
+static void httpd_worker(int server_socket)
+{
+	const char *name = applet_name;
+
+	/* Auto-reap CGI children, like the parent does in -P-less mode */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGALRM, sigalrm_handler);
+	bb_signals(0 + (1 << SIGTERM) + (1 << SIGINT), SIG_DFL);
+	/* Interrupt accept() */
+	signal_no_SA_RESTART_empty_mask(SIGHUP, worker_sighup_handler);
+	G.in_worker = 1;
+	G.listen_fd = server_socket;
+
+	if (sigsetjmp(G.next_connection, 1)) {
+		/* We are back from connection_done_and_exit() */
+		close(STDIN_FILENO);
+		close(STDOUT_FILENO);
+		alarm(0);
+		/* Subdir's httpd.conf changed our config, get a fresh worker */
+		if (G.conf_changed)
+			_exit_SUCCESS();
+		free(rmt_ip_str);
+		rmt_ip_str = NULL;
+#if ENABLE_FEATURE_HTTPD_SSL
+		if (G.tls) {
+			tls_free_state(G.tls);
+			G.tls = NULL;
+		}
+#endif
+		applet_name = name;
+		hdr_cnt = 0;
+		reset_request_state();
+	}
+	while (1) {
+		int n;
+		len_and_sockaddr fromAddr;
+
+		if (G.worker_exit)
+			_exit_SUCCESS();
+		fromAddr.len = LSA_SIZEOF_SA;
+		n = accept(server_socket, &fromAddr.u.sa, &fromAddr.len);
+		if (n < 0)
+			continue;
+		setsockopt_keepalive(n);
+		xmove_fd(n, 0);
+		xdup2(0, 1);
+		handle_incoming_and_exit(&fromAddr);
+	}
+}
+
+/*
+ * Start -P NUM workers, restart them when they exit.
+ * Never returns.
+ */
+static void mini_httpd_prefork(int server_socket) NORETURN;
+static void mini_httpd_prefork(int server_socket)
+{
+	/* We want to know when workers die */
+	signal(SIGCHLD, SIG_DFL);
+	bb_signals(0 + (1 << SIGTERM) + (1 << SIGINT), prefork_exit_handler);
+	G.worker_pid = xzalloc(G.prefork_cnt * sizeof(G.worker_pid[0]));
+	while (1) {
+		pid_t pid;
+		int i;
+
+		for (i = 0; i < G.prefork_cnt; i++) {
+			if (G.worker_pid[i] > 0)
+				continue;
+			pid = fork();
+			if (pid == 0)
+				httpd_worker(server_socket);
+			if (pid < 0) {
+				bb_simple_perror_msg("fork");
+				sleep1();
+				break;
+			}
+			G.worker_pid[i] = pid;
+		}
+		pid = safe_waitpid(-1, NULL, 0);
+		for (i = 0; i < G.prefork_cnt; i++) {
+			if (G.worker_pid[i] == pid)
+				G.worker_pid[i] = 0;
+		}
+	}
+}
+#endif
+
 /*
  * The main http server function.
  * Given a socket, listen for new connections and farm out
@@ -3244,6 +4230,8 @@ static void sighup_handler(int sig UNUSED_PARAM)
 	if (G.parent_pid == getpid()) {
 		int sv = errno;
 		parse_conf(DEFAULT_PATH_HTTPD_CONF, SIGNALED_PARSE);
+		/* Workers have the old config, replace them */
+		IF_FEATURE_HTTPD_PREFORK(stop_workers();)
 		errno = sv;
 	}
 }
@@ -3287,6 +4275,7 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 	IF_FEATURE_HTTPD_SETUID(const char *s_ugid = NULL;)
 	IF_FEATURE_HTTPD_SETUID(struct bb_uidgid_t ugid;)
 	IF_FEATURE_HTTPD_AUTH_MD5(const char *pass;)
+	IF_FEATURE_HTTPD_SSL(const char *ssl_pem = NULL;)
 	IF_PLATFORM_MINGW32(int fd;)
 #if 0 // PACK64_LITERAL_STR test
 	char testing[16] = "Status: ";
@@ -3316,6 +4305,8 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 			IF_FEATURE_HTTPD_SETUID("u:")
 			IF_NOT_PLATFORM_MINGW32("p:M:+K:+ifv")
 			IF_PLATFORM_MINGW32("p:I:+fv")
+			IF_FEATURE_HTTPD_PREFORK("P:+")
+			IF_FEATURE_HTTPD_SSL("S:")
 			"\0"
 			/* -v counts, -i implies -f */
 			IF_NOT_PLATFORM_MINGW32("vv:if",)
@@ -3331,6 +4322,8 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 			IF_NOT_PLATFORM_MINGW32(
 			, IF_FEATURE_HTTPD_CGI(&G.cgi_kill_timeout) IF_NOT_FEATURE_HTTPD_CGI(NULL)
 			)
+			IF_FEATURE_HTTPD_PREFORK(, &G.prefork_cnt)
+			IF_FEATURE_HTTPD_SSL(, &ssl_pem)
 			, &verbose
 		);
 	if (opt & OPT_DECODE_URL) {
@@ -3383,6 +4376,13 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 #endif
 		xchdir(home_httpd);
 
+#if ENABLE_FEATURE_HTTPD_SSL
+	/* Key file is usually readable only by root: read it
+	 * before we drop privileges. Children inherit parsed keys */
+	if (ssl_pem)
+		G.ssl_keys = tls_load_server_keys(ssl_pem);
+#endif
+
 	if (!(opt & OPT_INETD)) {
 #if !ENABLE_PLATFORM_MINGW32
 		G.parent_pid = getpid();
@@ -3465,6 +4465,10 @@ int httpd_main(int argc UNUSED_PARAM, char **argv)
 #if BB_MMU
 	if (!(opt & OPT_FOREGROUND))
 		bb_daemonize(0); /* don't change current directory */
+# if ENABLE_FEATURE_HTTPD_PREFORK
+	if (G.prefork_cnt > 0)
+		mini_httpd_prefork(server_socket); /* never returns */
+# endif
 	mini_httpd(server_socket); /* never returns */
 #else
 	mini_httpd_nommu(server_socket, argc, argv); /* never returns */
@@ -213,6 +213,16 @@
 //config:		chargen stream tcp nowait root internal
 //config:		chargen dgram  udp wait   root internal
 //config:
+//config:config FEATURE_INETD_EPOLL
+//config:	bool "Use epoll"
+//config:	default y
+//config:	depends on INETD
+//config:	help
+//config:	Wait for connections with epoll instead of select.
+//config:	The cost of a wakeup does not grow with the number
+//config:	of services, and listening sockets are not limited
+//config:	to FD_SETSIZE (1024) descriptors.
+//config:
 //config:config FEATURE_INETD_RPC
 //config:	bool "Support RPC services"
 //config:	default n  # very rarely used, and needs Sun RPC support in libc
@@ -234,11 +244,15 @@
 //usage:     "\n	-R N	Pause services after N connects/min"
 //usage:     "\n		(default 0 - disabled)"
 //usage:     "\n	Default CONFFILE is /etc/inetd.conf"
+//usage:     "\n	SIGUSR1 logs per-service request counts"
 
 #include <syslog.h>
 #include <sys/resource.h> /* setrlimit */
 #include <sys/socket.h> /* un.h may need this */
 #include <sys/un.h>
+#if ENABLE_FEATURE_INETD_EPOLL
+# include <sys/epoll.h>
+#endif
 
 #include "libbb.h"
 #include "common_bufsiz.h"
@@ -265,6 +279,7 @@
 
 #define CNT_INTERVAL    60      /* servers in CNT_INTERVAL sec. */
 #define RETRYTIME       60      /* retry after bind or server fail */
+#define ACCEPT_BATCH    16      /* "nowait" connects accepted per wakeup */
 
 // TODO: explain, or get rid of setrlimit games
 
@@ -314,6 +329,9 @@ typedef struct servtab_t {
 	unsigned se_max;                      /* allowed instances per minute */
 	unsigned se_count;                    /* number started since se_time */
 	unsigned se_time;                     /* when we started counting */
+	unsigned se_served;                   /* requests handled, for SIGUSR1 */
+	unsigned se_served_reported;          /* se_served at last SIGUSR1 */
+	unsigned se_paused;                   /* times paused by -R limit */
 	char *se_user;                        /* user name to run as */
 	char *se_group;                       /* group name to run as, can be NULL */
 #ifdef INETD_BUILTINS_ENABLED
@@ -385,11 +403,19 @@ struct globals {
 	struct rlimit rlim_ofile;
 	servtab_t *serv_list;
 	int global_queuelen;
+#if ENABLE_FEATURE_INETD_EPOLL
+	int epoll_fd;
+	/* listening fd -> its servtab, NULL if not in epoll set */
+	unsigned fd2sep_size;
+	servtab_t **fd2sep;
+#else
 	int maxsock;         /* max fd# in allsock, -1: unknown */
 	/* whenever maxsock grows, prev_maxsock is set to new maxsock,
 	 * but if maxsock is set to -1, prev_maxsock is not changed */
 	int prev_maxsock;
+#endif
 	unsigned max_concurrency;
+	unsigned stats_time; /* when SIGUSR1 stats were last logged */
 	smallint alarm_armed;
 	uid_t real_uid; /* user ID who ran us */
 	const char *config_filename;
@@ -400,7 +426,12 @@ struct globals {
 	char *ring_pos;
 	char ring[128];
 #endif
+#if !ENABLE_FEATURE_INETD_EPOLL
 	fd_set allsock;
+#endif
+	struct sigaction saved_pipe_handler;
+	/* Mask without SIGUSR1: we wait with it, children run with it */
+	sigset_t wait_sigmask;
 	/* Used in next_line(), and as scratch read buffer */
 	char line[256];          /* _at least_ 256, see LINE_SIZE */
 } FIX_ALIASING;
@@ -536,7 +567,8 @@ static void bump_nofile(void)
 	/* Never fails under Linux (except if you pass it bad arguments) */
 	getrlimit(RLIMIT_NOFILE, &rl);
 	rl.rlim_cur = MIN(rl.rlim_max, rl.rlim_cur + FD_CHUNK);
-	rl.rlim_cur = MIN(FD_SETSIZE, rl.rlim_cur + FD_CHUNK);
+	if (!ENABLE_FEATURE_INETD_EPOLL)
+		rl.rlim_cur = MIN(FD_SETSIZE, rl.rlim_cur + FD_CHUNK);
 	if (rl.rlim_cur <= rlim_ofile_cur) {
 		bb_error_msg("can't extend file limit, max = %d",
 						(int) rl.rlim_cur);
@@ -551,8 +583,51 @@ static void bump_nofile(void)
 	rlim_ofile_cur = rl.rlim_cur;
 }
 
-static void remove_fd_from_set(int fd)
+#if ENABLE_FEATURE_INETD_EPOLL
+/* Events carry the fd, not the servtab pointer: SIGHUP handler
+ * may free servtabs while we look at a batch of returned events */
+static void remove_fd_from_set(servtab_t *sep)
 {
+	int fd = sep->se_fd;
+
+	if (fd >= 0) {
+		epoll_ctl(G.epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+		if ((unsigned)fd < G.fd2sep_size)
+			G.fd2sep[fd] = NULL;
+		dbg("stopped listening on fd:%d\n", fd);
+	}
+}
+
+static void add_fd_to_set(servtab_t *sep)
+{
+	int fd = sep->se_fd;
+
+	if (fd >= 0) {
+		struct epoll_event ev;
+
+		if ((unsigned)fd >= G.fd2sep_size) {
+			unsigned size = (fd | 63) + 1;
+			G.fd2sep = xrealloc(G.fd2sep, size * sizeof(G.fd2sep[0]));
+			memset(G.fd2sep + G.fd2sep_size, 0,
+				(size - G.fd2sep_size) * sizeof(G.fd2sep[0]));
+			G.fd2sep_size = size;
+		}
+		G.fd2sep[fd] = sep;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		/* EEXIST is ok: reread_config_file() re-adds "nowait" fds */
+		epoll_ctl(G.epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		dbg("started listening on fd:%d\n", fd);
+		if ((rlim_t)fd > rlim_ofile_cur - FD_MARGIN)
+			bump_nofile();
+	}
+}
+#else
+static void remove_fd_from_set(servtab_t *sep)
+{
+	int fd = sep->se_fd;
+
 	if (fd >= 0) {
 		FD_CLR(fd, &allsock);
 		dbg("stopped listening on fd:%d\n", fd);
@@ -561,8 +636,10 @@ static void remove_fd_from_set(int fd)
 	}
 }
 
-static void add_fd_to_set(int fd)
+static void add_fd_to_set(servtab_t *sep)
 {
+	int fd = sep->se_fd;
+
 	if (fd >= 0) {
 		FD_SET(fd, &allsock);
 		dbg("started listening on fd:%d\n", fd);
@@ -592,6 +669,19 @@ static void recalculate_maxsock(void)
 	if ((rlim_t)maxsock > rlim_ofile_cur - FD_MARGIN)
 		bump_nofile();
 }
+#endif
+
+/* "nowait" stream services accept connects until EAGAIN.
+ * "wait" ones give the listening socket to the server: keep it blocking */
+static void set_accept_mode(servtab_t *sep)
+{
+	if (sep->se_fd >= 0 && sep->se_socktype == SOCK_STREAM) {
+		if (sep->se_wait)
+			ndelay_off(sep->se_fd);
+		else
+			ndelay_on(sep->se_fd);
+	}
+}
 
 static void prepare_socket_fd(servtab_t *sep)
 {
@@ -653,8 +743,9 @@ static void prepare_socket_fd(servtab_t *sep)
 		dbg("new sep->se_fd:%d (!stream)\n", fd);
 	}
 
-	add_fd_to_set(fd);
 	sep->se_fd = fd;
+	set_accept_mode(sep);
+	add_fd_to_set(sep);
 }
 
 static int reopen_config_file(void)
@@ -1008,9 +1099,10 @@ static void reread_config_file(int sig UNUSED_PARAM)
 				 * for a child (and not accepting connects).
 				 * Stop waiting, start listening again.
 				 * (if it's not true, this op is harmless) */
-				add_fd_to_set(sep->se_fd);
+				add_fd_to_set(sep);
 			}
 			sep->se_wait = cp->se_wait;
+			set_accept_mode(sep);
 			sep->se_max = cp->se_max;
 			/* string fields need more love - we don't want to leak them */
 #define SWAP(type, a, b) do { type c = (type)a; a = (type)b; b = (type)c; } while (0)
@@ -1093,7 +1185,7 @@ static void reread_config_file(int sig UNUSED_PARAM)
 		 || lsa->len != sep->se_lsa->len
 		 || memcmp(&lsa->u.sa, &sep->se_lsa->u.sa, lsa->len) != 0
 		) {
-			remove_fd_from_set(sep->se_fd);
+			remove_fd_from_set(sep);
 			maybe_close(sep->se_fd);
 			free(sep->se_lsa);
 			sep->se_lsa = lsa;
@@ -1120,7 +1212,7 @@ static void reread_config_file(int sig UNUSED_PARAM)
 			continue;
 		}
 		*sepp = sep->se_next;
-		remove_fd_from_set(sep->se_fd);
+		remove_fd_from_set(sep);
 		maybe_close(sep->se_fd);
 #if ENABLE_FEATURE_INETD_RPC
 		if (is_rpc_service(sep))
@@ -1159,7 +1251,7 @@ static void reap_child(int sig UNUSED_PARAM)
 				bb_error_msg("%s: exit signal %u",
 						sep->se_program, WTERMSIG(status));
 			sep->se_wait = 1;
-			add_fd_to_set(sep->se_fd);
+			add_fd_to_set(sep);
 			break;
 		}
 	}
@@ -1211,17 +1303,293 @@ static void clean_up_and_exit(int sig UNUSED_PARAM)
 	exit_SUCCESS();
 }
 
-int inetd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
-int inetd_main(int argc UNUSED_PARAM, char **argv)
+/* SIGUSR1: log what services did since the previous report */
+static void log_stats(void)
+{
+	servtab_t *sep;
+	unsigned now = monotonic_sec();
+	unsigned secs = now - G.stats_time;
+	sigset_t omask;
+
+	G.stats_time = now;
+	if (secs == 0)
+		secs = 1;
+	/* SIGHUP handler frees servtabs */
+	block_CHLD_HUP_ALRM(&omask);
+	for (sep = serv_list; sep; sep = sep->se_next) {
+		unsigned n = sep->se_served - sep->se_served_reported;
+
+		sep->se_served_reported = sep->se_served;
+		bb_info_msg("%s/%s: %u requests, %u in last %u s (%u/s), paused %u times%s",
+				sep->se_service, sep->se_proto,
+				sep->se_served, n, secs, n / secs,
+				sep->se_paused, sep->se_fd < 0 ? ", not listening" : "");
+	}
+	restore_sigmask(&omask);
+}
+
+/* Run the server for one request (connection or datagram) to sep,
+ * or serve it ourself if it's a builtin service.
+ * Returns 0 if no request was taken, or service was paused */
+static int handle_request(servtab_t *sep)
 {
-	struct sigaction sa, saved_pipe_handler;
-	servtab_t *sep, *sep2;
+	servtab_t *sep2;
 	struct passwd *pwd;
 	struct group *grp = grp; /* for compiler */
-	int opt;
+	int ctrl, accepted_fd, new_udp_fd;
 	pid_t pid;
 	sigset_t omask;
 
+	dbg("ready fd:%d\n", sep->se_fd);
+	ctrl = sep->se_fd;
+	accepted_fd = -1;
+	new_udp_fd = -1;
+	if (!sep->se_wait) {
+		if (sep->se_socktype == SOCK_STREAM) {
+			ctrl = accepted_fd = accept(sep->se_fd, NULL, NULL);
+			dbg("accepted_fd:%d\n", accepted_fd);
+			if (ctrl < 0) {
+				/* EAGAIN: we took all queued connects */
+				if (errno != EINTR && errno != EAGAIN)
+					bb_perror_msg("accept (for %s)", sep->se_service);
+				return 0;
+			}
+		}
+		/* "nowait" udp */
+		if (sep->se_socktype == SOCK_DGRAM
+		 && sep->se_family != AF_UNIX
+		) {
+/* How udp "nowait" works:
+ * child peeks at (received and buffered by kernel) UDP packet,
+ * performs connect() on the socket so that it is linked only
+ * to this peer. But this also affects parent, because descriptors
+ * are shared after fork() a-la dup(). When parent performs
+ * select()/epoll_wait(), it will see this descriptor connected to the peer (!)
+ * and still readable, will act on it and mess things up
+ * (can create many copies of same child, etc).
+ * Parent must create and use new socket instead. */
+			new_udp_fd = socket(sep->se_family, SOCK_DGRAM, 0);
+			dbg("new_udp_fd:%d\n", new_udp_fd);
+			if (new_udp_fd < 0) { /* error: eat packet, forget about it */
+ udp_err:
+				recv(sep->se_fd, line, LINE_SIZE, MSG_DONTWAIT);
+				return 0;
+			}
+			setsockopt_reuseaddr(new_udp_fd);
+			/* TODO: better do bind after fork in parent,
+			 * so that we don't have two wildcard bound sockets
+			 * even for a brief moment? */
+			if (bind(new_udp_fd, &sep->se_lsa->u.sa, sep->se_lsa->len) < 0) {
+				dbg("bind(new_udp_fd) failed\n");
+				close(new_udp_fd);
+				goto udp_err;
+			}
+			dbg("bind(new_udp_fd) succeeded\n");
+		}
+	}
+
+	block_CHLD_HUP_ALRM(&omask);
+	sep->se_served++;
+	pid = 0;
+#ifdef INETD_BUILTINS_ENABLED
+	/* do we need to fork? */
+	if (sep->se_builtin == NULL
+	 || (sep->se_socktype == SOCK_STREAM
+	     && sep->se_builtin->bi_fork))
+#endif
+	{
+		if (sep->se_max != 0) {
+			if (++sep->se_count == 1)
+				sep->se_time = monotonic_sec();
+			else if (sep->se_count >= sep->se_max) {
+				unsigned now = monotonic_sec();
+				/* did we accumulate se_max connects too quickly? */
+				if (now - sep->se_time <= CNT_INTERVAL) {
+					bb_error_msg("%s/%s: too many connections, pausing",
+							sep->se_service, sep->se_proto);
+					remove_fd_from_set(sep);
+					close(sep->se_fd);
+					sep->se_fd = -1;
+					sep->se_count = 0;
+					sep->se_paused++;
+					rearm_alarm(); /* will revive it in RETRYTIME sec */
+					restore_sigmask(&omask);
+					maybe_close(new_udp_fd);
+					maybe_close(accepted_fd);
+					return 0;
+				}
+				sep->se_count = 0;
+			}
+		}
+		/* on NOMMU, streamed chargen
+		 * builtin wouldn't work, but it is
+		 * not allowed on NOMMU (ifdefed out) */
+#ifdef INETD_BUILTINS_ENABLED
+		if (BB_MMU && sep->se_builtin)
+			pid = fork();
+		else
+#endif
+			pid = vfork();
+
+		if (pid < 0) { /* fork error */
+			bb_simple_perror_msg("vfork"+1);
+			sleep1();
+			restore_sigmask(&omask);
+			maybe_close(new_udp_fd);
+			maybe_close(accepted_fd);
+			return 0;
+		}
+		if (pid == 0)
+			pid--; /* -1: "we did fork and we are child" */
+	}
+	/* if pid == 0 here, we didn't fork */
+
+	if (pid > 0) { /* parent */
+		if (sep->se_wait) {
+			/* wait: we passed socket to child,
+			 * will wait for child to terminate */
+			sep->se_wait = pid;
+			remove_fd_from_set(sep);
+		}
+		if (new_udp_fd >= 0) {
+			/* udp nowait: child connected the socket,
+			 * we created and will use new, unconnected one */
+#if ENABLE_FEATURE_INETD_EPOLL
+			/* epoll watches the socket, not fd#: after
+			 * dup2 over it, child's socket would stay in the set */
+			remove_fd_from_set(sep);
+			xmove_fd(new_udp_fd, sep->se_fd);
+			add_fd_to_set(sep);
+#else
+			xmove_fd(new_udp_fd, sep->se_fd);
+#endif
+			dbg("moved new_udp_fd:%d to sep->se_fd:%d\n", new_udp_fd, sep->se_fd);
+		}
+		restore_sigmask(&omask);
+		maybe_close(accepted_fd);
+		return 1;
+	}
+
+	/* we are either child or didn't fork at all */
+#ifdef INETD_BUILTINS_ENABLED
+	if (sep->se_builtin) {
+		if (pid) { /* "pid" is -1: we did fork */
+			close(sep->se_fd); /* listening socket */
+			dbg("closed sep->se_fd:%d\n", sep->se_fd);
+			logmode = LOGMODE_NONE; /* make xwrite etc silent */
+		}
+		restore_sigmask(pid ? &G.wait_sigmask : &omask);
+		if (sep->se_socktype == SOCK_STREAM)
+			sep->se_builtin->bi_stream_fn(ctrl, sep);
+		else
+			sep->se_builtin->bi_dgram_fn(ctrl, sep);
+		if (pid) /* we did fork */
+			_exit_FAILURE();
+		maybe_close(accepted_fd);
+		return 1;
+	}
+#endif
+	/* child */
+	setsid();
+	/* "nowait" udp */
+	if (new_udp_fd >= 0) {
+		len_and_sockaddr *lsa;
+		int r;
+
+		close(new_udp_fd);
+		dbg("closed new_udp_fd:%d\n", new_udp_fd);
+		lsa = xzalloc_lsa(sep->se_family);
+		/* peek at the packet and remember peer addr */
+		r = recvfrom(ctrl, NULL, 0, MSG_PEEK|MSG_DONTWAIT,
+			&lsa->u.sa, &lsa->len);
+		if (r < 0)
+			goto do_exit1;
+		/* make this socket "connected" to peer addr:
+		 * only packets from this peer will be recv'ed,
+		 * and bare write()/send() will work on it */
+		connect(ctrl, &lsa->u.sa, lsa->len);
+		dbg("connected ctrl:%d to remote peer\n", ctrl);
+		free(lsa);
+	}
+	/* prepare env and exec program */
+	pwd = getpwnam(sep->se_user);
+	if (pwd == NULL) {
+		bb_error_msg("%s: no such %s", sep->se_user, "user");
+		goto do_exit1;
+	}
+	if (sep->se_group && (grp = getgrnam(sep->se_group)) == NULL) {
+		bb_error_msg("%s: no such %s", sep->se_group, "group");
+		goto do_exit1;
+	}
+	if (real_uid != 0 && real_uid != pwd->pw_uid) {
+		/* a user running private inetd */
+		bb_simple_error_msg("non-root must run services as himself");
+		goto do_exit1;
+	}
+	if (pwd->pw_uid != real_uid) {
+		if (sep->se_group)
+			pwd->pw_gid = grp->gr_gid;
+		/* initgroups, setgid, setuid: */
+		change_identity(pwd);
+	} else if (sep->se_group) {
+		xsetgid(grp->gr_gid);
+		setgroups(1, &grp->gr_gid);
+	}
+	if (rlim_ofile.rlim_cur != rlim_ofile_cur)
+		if (setrlimit(RLIMIT_NOFILE, &rlim_ofile) < 0)
+			bb_simple_perror_msg("setrlimit");
+
+	/* closelog(); - WRONG. we are after vfork,
+	 * this may confuse syslog() internal state.
+	 * Let's hope libc sets syslog fd to CLOEXEC...
+	 */
+	xmove_fd(ctrl, STDIN_FILENO);
+	xdup2(STDIN_FILENO, STDOUT_FILENO);
+	dbg("moved ctrl:%d to fd 0,1[,2]\n", ctrl);
+	/* manpages of inetd I managed to find either say
+	 * that stderr is also redirected to the network,
+	 * or do not talk about redirection at all (!) */
+	if (!sep->se_wait) /* only for usual "tcp nowait" */
+		xdup2(STDIN_FILENO, STDERR_FILENO);
+	/* NB: among others, this loop closes listening sockets
+	 * for nowait stream children */
+	for (sep2 = serv_list; sep2; sep2 = sep2->se_next)
+		if (sep2->se_fd != ctrl)
+			maybe_close(sep2->se_fd);
+	sigaction_set(SIGPIPE, &G.saved_pipe_handler);
+	restore_sigmask(&G.wait_sigmask);
+	dbg("execing:'%s'\n", sep->se_program);
+	BB_EXECVP(sep->se_program, sep->se_argv);
+	bb_perror_msg("can't execute '%s'", sep->se_program);
+ do_exit1:
+	/* eat packet in udp case */
+	if (sep->se_socktype != SOCK_STREAM)
+		recv(0, line, LINE_SIZE, MSG_DONTWAIT);
+	_exit_FAILURE();
+}
+
+static void handle_ready_fd(servtab_t *sep)
+{
+	unsigned n = ACCEPT_BATCH;
+
+	/* "nowait" stream: take all queued connects, not just one.
+	 * After ACCEPT_BATCH of them give other services a chance */
+	while (handle_request(sep)
+	 && !sep->se_wait && sep->se_socktype == SOCK_STREAM
+	 && --n != 0
+	) {
+		continue;
+	}
+}
+
+int inetd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
+int inetd_main(int argc UNUSED_PARAM, char **argv)
+{
+	struct sigaction sa;
+	sigset_t usr1;
+	servtab_t *sep;
+	int opt;
+
 	INIT_G();
 
 	real_uid = getuid();
@@ -1284,16 +1652,61 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 	sigaction_set(SIGTERM, &sa);
 	sa.sa_handler = clean_up_and_exit;
 	sigaction_set(SIGINT, &sa);
+	sa.sa_handler = record_signo;
+	sigaction_set(SIGUSR1, &sa);
 	sa.sa_handler = SIG_IGN;
-	sigaction(SIGPIPE, &sa, &saved_pipe_handler);
-
+	sigaction(SIGPIPE, &sa, &G.saved_pipe_handler);
+	/* SIGUSR1 is let in only while we sleep in epoll_pwait/pselect.
+	 * If it came after we checked bb_got_signal but before we
+	 * went to sleep, stats would wait for the next connection */
+	sigemptyset(&usr1);
+	sigaddset(&usr1, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &usr1, &G.wait_sigmask);
+
+#if ENABLE_FEATURE_INETD_EPOLL
+	G.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (G.epoll_fd < 0)
+		bb_simple_perror_msg_and_die("epoll_create1");
+#endif
+	G.stats_time = monotonic_sec();
 	reread_config_file(SIGHUP); /* load config from file */
 
 	for (;;) {
+#if ENABLE_FEATURE_INETD_EPOLL
+		struct epoll_event ev[16];
+		int ready_fd_cnt, i;
+#else
 		int ready_fd_cnt;
-		int ctrl, accepted_fd, new_udp_fd;
 		fd_set readable;
+#endif
+
+		if (bb_got_signal) {
+			bb_got_signal = 0;
+			log_stats();
+		}
+#if ENABLE_FEATURE_INETD_EPOLL
+		ready_fd_cnt = epoll_pwait(G.epoll_fd, ev, ARRAY_SIZE(ev), -1, &G.wait_sigmask);
+		if (ready_fd_cnt < 0) {
+			if (errno != EINTR) {
+				bb_simple_perror_msg("epoll_pwait");
+				sleep1();
+			}
+			continue;
+		}
+		dbg("ready_fd_cnt:%d\n", ready_fd_cnt);
+
+		for (i = 0; i < ready_fd_cnt; i++) {
+			int fd = ev[i].data.fd;
 
+			sep = NULL;
+			if ((unsigned)fd < G.fd2sep_size)
+				sep = G.fd2sep[fd];
+			/* signal handler could have closed it */
+			if (!sep || sep->se_fd != fd)
+				continue;
+			handle_ready_fd(sep);
+		}
+#else
 		if (maxsock < 0)
 			recalculate_maxsock();
 
@@ -1301,10 +1714,10 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 		/* if there are no fds to wait on, we will block
 		 * until signal wakes us up (maxsock == 0, but readable
 		 * never contains fds 0 and 1...) */
-		ready_fd_cnt = select(maxsock + 1, &readable, NULL, NULL, NULL);
+		ready_fd_cnt = pselect(maxsock + 1, &readable, NULL, NULL, NULL, &G.wait_sigmask);
 		if (ready_fd_cnt < 0) {
 			if (errno != EINTR) {
-				bb_simple_perror_msg("select");
+				bb_simple_perror_msg("pselect");
 				sleep1();
 			}
 			continue;
@@ -1314,224 +1727,10 @@ int inetd_main(int argc UNUSED_PARAM, char **argv)
 		for (sep = serv_list; ready_fd_cnt && sep; sep = sep->se_next) {
 			if (sep->se_fd == -1 || !FD_ISSET(sep->se_fd, &readable))
 				continue;
-
-			dbg("ready fd:%d\n", sep->se_fd);
 			ready_fd_cnt--;
-			ctrl = sep->se_fd;
-			accepted_fd = -1;
-			new_udp_fd = -1;
-			if (!sep->se_wait) {
-				if (sep->se_socktype == SOCK_STREAM) {
-					ctrl = accepted_fd = accept(sep->se_fd, NULL, NULL);
-					dbg("accepted_fd:%d\n", accepted_fd);
-					if (ctrl < 0) {
-						if (errno != EINTR)
-							bb_perror_msg("accept (for %s)", sep->se_service);
-						continue;
-					}
-				}
-				/* "nowait" udp */
-				if (sep->se_socktype == SOCK_DGRAM
-				 && sep->se_family != AF_UNIX
-				) {
-/* How udp "nowait" works:
- * child peeks at (received and buffered by kernel) UDP packet,
- * performs connect() on the socket so that it is linked only
- * to this peer. But this also affects parent, because descriptors
- * are shared after fork() a-la dup(). When parent performs
- * select(), it will see this descriptor connected to the peer (!)
- * and still readable, will act on it and mess things up
- * (can create many copies of same child, etc).
- * Parent must create and use new socket instead. */
-					new_udp_fd = socket(sep->se_family, SOCK_DGRAM, 0);
-					dbg("new_udp_fd:%d\n", new_udp_fd);
-					if (new_udp_fd < 0) { /* error: eat packet, forget about it */
- udp_err:
-						recv(sep->se_fd, line, LINE_SIZE, MSG_DONTWAIT);
-						continue;
-					}
-					setsockopt_reuseaddr(new_udp_fd);
-					/* TODO: better do bind after fork in parent,
-					 * so that we don't have two wildcard bound sockets
-					 * even for a brief moment? */
-					if (bind(new_udp_fd, &sep->se_lsa->u.sa, sep->se_lsa->len) < 0) {
-						dbg("bind(new_udp_fd) failed\n");
-						close(new_udp_fd);
-						goto udp_err;
-					}
-					dbg("bind(new_udp_fd) succeeded\n");
-				}
-			}
-
-			block_CHLD_HUP_ALRM(&omask);
-			pid = 0;
-#ifdef INETD_BUILTINS_ENABLED
-			/* do we need to fork? */
-			if (sep->se_builtin == NULL
-			 || (sep->se_socktype == SOCK_STREAM
-			     && sep->se_builtin->bi_fork))
-#endif
-			{
-				if (sep->se_max != 0) {
-					if (++sep->se_count == 1)
-						sep->se_time = monotonic_sec();
-					else if (sep->se_count >= sep->se_max) {
-						unsigned now = monotonic_sec();
-						/* did we accumulate se_max connects too quickly? */
-						if (now - sep->se_time <= CNT_INTERVAL) {
-							bb_error_msg("%s/%s: too many connections, pausing",
-									sep->se_service, sep->se_proto);
-							remove_fd_from_set(sep->se_fd);
-							close(sep->se_fd);
-							sep->se_fd = -1;
-							sep->se_count = 0;
-							rearm_alarm(); /* will revive it in RETRYTIME sec */
-							restore_sigmask(&omask);
-							maybe_close(new_udp_fd);
-							maybe_close(accepted_fd);
-							continue; /* -> check next fd in fd set */
-						}
-						sep->se_count = 0;
-					}
-				}
-				/* on NOMMU, streamed chargen
-				 * builtin wouldn't work, but it is
-				 * not allowed on NOMMU (ifdefed out) */
-#ifdef INETD_BUILTINS_ENABLED
-				if (BB_MMU && sep->se_builtin)
-					pid = fork();
-				else
-#endif
-					pid = vfork();
-
-				if (pid < 0) { /* fork error */
-					bb_simple_perror_msg("vfork"+1);
-					sleep1();
-					restore_sigmask(&omask);
-					maybe_close(new_udp_fd);
-					maybe_close(accepted_fd);
-					continue; /* -> check next fd in fd set */
-				}
-				if (pid == 0)
-					pid--; /* -1: "we did fork and we are child" */
-			}
-			/* if pid == 0 here, we didn't fork */
-
-			if (pid > 0) { /* parent */
-				if (sep->se_wait) {
-					/* wait: we passed socket to child,
-					 * will wait for child to terminate */
-					sep->se_wait = pid;
-					remove_fd_from_set(sep->se_fd);
-				}
-				if (new_udp_fd >= 0) {
-					/* udp nowait: child connected the socket,
-					 * we created and will use new, unconnected one */
-					xmove_fd(new_udp_fd, sep->se_fd);
-					dbg("moved new_udp_fd:%d to sep->se_fd:%d\n", new_udp_fd, sep->se_fd);
-				}
-				restore_sigmask(&omask);
-				maybe_close(accepted_fd);
-				continue; /* -> check next fd in fd set */
-			}
-
-			/* we are either child or didn't fork at all */
-#ifdef INETD_BUILTINS_ENABLED
-			if (sep->se_builtin) {
-				if (pid) { /* "pid" is -1: we did fork */
-					close(sep->se_fd); /* listening socket */
-					dbg("closed sep->se_fd:%d\n", sep->se_fd);
-					logmode = LOGMODE_NONE; /* make xwrite etc silent */
-				}
-				restore_sigmask(&omask);
-				if (sep->se_socktype == SOCK_STREAM)
-					sep->se_builtin->bi_stream_fn(ctrl, sep);
-				else
-					sep->se_builtin->bi_dgram_fn(ctrl, sep);
-				if (pid) /* we did fork */
-					_exit_FAILURE();
-				maybe_close(accepted_fd);
-				continue; /* -> check next fd in fd set */
-			}
+			handle_ready_fd(sep);
+		}
 #endif
-			/* child */
-			setsid();
-			/* "nowait" udp */
-			if (new_udp_fd >= 0) {
-				len_and_sockaddr *lsa;
-				int r;
-
-				close(new_udp_fd);
-				dbg("closed new_udp_fd:%d\n", new_udp_fd);
-				lsa = xzalloc_lsa(sep->se_family);
-				/* peek at the packet and remember peer addr */
-				r = recvfrom(ctrl, NULL, 0, MSG_PEEK|MSG_DONTWAIT,
-					&lsa->u.sa, &lsa->len);
-				if (r < 0)
-					goto do_exit1;
-				/* make this socket "connected" to peer addr:
-				 * only packets from this peer will be recv'ed,
-				 * and bare write()/send() will work on it */
-				connect(ctrl, &lsa->u.sa, lsa->len);
-				dbg("connected ctrl:%d to remote peer\n", ctrl);
-				free(lsa);
-			}
-			/* prepare env and exec program */
-			pwd = getpwnam(sep->se_user);
-			if (pwd == NULL) {
-				bb_error_msg("%s: no such %s", sep->se_user, "user");
-				goto do_exit1;
-			}
-			if (sep->se_group && (grp = getgrnam(sep->se_group)) == NULL) {
-				bb_error_msg("%s: no such %s", sep->se_group, "group");
-				goto do_exit1;
-			}
-			if (real_uid != 0 && real_uid != pwd->pw_uid) {
-				/* a user running private inetd */
-				bb_simple_error_msg("non-root must run services as himself");
-				goto do_exit1;
-			}
-			if (pwd->pw_uid != real_uid) {
-				if (sep->se_group)
-					pwd->pw_gid = grp->gr_gid;
-				/* initgroups, setgid, setuid: */
-				change_identity(pwd);
-			} else if (sep->se_group) {
-				xsetgid(grp->gr_gid);
-				setgroups(1, &grp->gr_gid);
-			}
-			if (rlim_ofile.rlim_cur != rlim_ofile_cur)
-				if (setrlimit(RLIMIT_NOFILE, &rlim_ofile) < 0)
-					bb_simple_perror_msg("setrlimit");
-
-			/* closelog(); - WRONG. we are after vfork,
-			 * this may confuse syslog() internal state.
-			 * Let's hope libc sets syslog fd to CLOEXEC...
-			 */
-			xmove_fd(ctrl, STDIN_FILENO);
-			xdup2(STDIN_FILENO, STDOUT_FILENO);
-			dbg("moved ctrl:%d to fd 0,1[,2]\n", ctrl);
-			/* manpages of inetd I managed to find either say
-			 * that stderr is also redirected to the network,
-			 * or do not talk about redirection at all (!) */
-			if (!sep->se_wait) /* only for usual "tcp nowait" */
-				xdup2(STDIN_FILENO, STDERR_FILENO);
-			/* NB: among others, this loop closes listening sockets
-			 * for nowait stream children */
-			for (sep2 = serv_list; sep2; sep2 = sep2->se_next)
-				if (sep2->se_fd != ctrl)
-					maybe_close(sep2->se_fd);
-			sigaction_set(SIGPIPE, &saved_pipe_handler);
-			restore_sigmask(&omask);
-			dbg("execing:'%s'\n", sep->se_program);
-			BB_EXECVP(sep->se_program, sep->se_argv);
-			bb_perror_msg("can't execute '%s'", sep->se_program);
- do_exit1:
-			/* eat packet in udp case */
-			if (sep->se_socktype != SOCK_STREAM)
-				recv(0, line, LINE_SIZE, MSG_DONTWAIT);
-			_exit_FAILURE();
-		} /* for (sep = servtab...) */
 	} /* for (;;) */
 }
 
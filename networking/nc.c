@@ -45,6 +45,16 @@
 //config:	The code is about 2.5k bigger. It enables
 //config:	-s ADDR, -n, -u, -v, -o FILE, -z options, but loses
 //config:	busybox-specific extensions: -f FILE.
+//config:
+//config:config NC_SPLICE
+//config:	bool "Zero-copy relay mode (-Z)"
+//config:	default y
+//config:	depends on NC_110_COMPAT && PLATFORM_POSIX
+//config:	help
+//config:	"nc -Z" moves data between the socket and stdin/stdout
+//config:	with splice() through a pipe, without copying it
+//config:	to userspace. Faster for bulk transfers of files.
+//config:	Falls back to read/write if descriptors don't support splice.
 
 //applet:IF_NC(APPLET(nc, BB_DIR_USR_BIN, BB_SUID_DROP))
 //                 APPLET_ODDNAME:name    main location        suid_type     help
@@ -90,6 +90,9 @@
 //usage:     "\n	-o FILE	Hex dump traffic"
 //usage:     "\n	-z	Zero-I/O mode (scanning)"
 //usage:	)
+//usage:	IF_NC_SPLICE(
+//usage:     "\n	-Z	Relay data with splice(), no copying"
+//usage:	)
 //usage:#endif
 
 /*   "\n	-r		Randomize local and remote ports" */
@@ -129,6 +132,9 @@ struct globals {
 	unsigned wrote_net;          /* total net bytes */
 #endif
 	char *proggie0saved;
+#if ENABLE_NC_SPLICE
+	unsigned long long relay_start_us;
+#endif
 	/* ouraddr is never NULL and goes through three states as we progress:
 	 1 - local address before bind (IP/port possibly zero)
 	 2 - local address after bind (port is nonzero)
@@ -180,6 +186,7 @@ enum {
 	OPT_i = (1 << (7+2*ENABLE_NC_SERVER)) * ENABLE_NC_EXTRA,
 	OPT_o = (1 << (8+2*ENABLE_NC_SERVER)) * ENABLE_NC_EXTRA,
 	OPT_z = (1 << (9+2*ENABLE_NC_SERVER)) * ENABLE_NC_EXTRA,
+	OPT_Z = (1 << (7+2*ENABLE_NC_SERVER+3*ENABLE_NC_EXTRA)) * ENABLE_NC_SPLICE,
 };
 
 #define o_nflag   (option_mask32 & OPT_n)
@@ -192,6 +199,7 @@ enum {
 #define o_ofile   0
 #define o_zero    0
 #endif
+#define o_splice  (option_mask32 & OPT_Z)
 
 /* Debug: squirt whatever message and sleep a bit so we can see it go by. */
 /* Beware: writes to stdOUT... */
@@ -584,6 +592,188 @@ static void oprint(int direction, unsigned char *p, unsigned bc)
 void oprint(int direction, unsigned char *p, unsigned bc);
 #endif
 
+#if ENABLE_NC_SPLICE
+enum {
+	SPLICE_PIPE_SZ = 1024 * 1024,
+	SPLICE_SOCKBUF = 4 * 1024 * 1024,
+};
+
+/* Fixed buffer size turns off TCP autotuning. Do it only if
+ * net.core.[rw]mem_max doesn't cap it below what we ask for */
+static void set_big_sockbuf(const char *max_file, int opt)
+{
+	char buf[sizeof(int)*3 + 2];
+	ssize_t n;
+
+	n = open_read_close(max_file, buf, sizeof(buf) - 1);
+	if (n > 0) {
+		buf[n] = '\0';
+		if (atoi(buf) >= SPLICE_SOCKBUF)
+			setsockopt_SOL_SOCKET_int(netfd, opt, SPLICE_SOCKBUF);
+	}
+}
+
+/* Move data between fds through pipes, kernel-side:
+ * stdin -> pipes[0] -> net, net -> pipes[1] -> stdout.
+ * Writes to net are nonblocking, data which did not fit stays
+ * in the pipe, and we keep reading net meanwhile: if both ends
+ * send a lot, they don't deadlock with full socket buffers.
+ * Returns exit status, or -1 if splice() is not supported
+ * for these fds. Some data may be moved by then: pipes are drained,
+ * readwrite() continues from where we stopped.
+ */
+static int splicerw(void)
+{
+	int pipes[2][2];
+	unsigned pend[2];
+	unsigned pipesz;
+	unsigned netretry;
+	unsigned fds_open;
+	int ret;
+	int i;
+	struct pollfd pfds[4];
+
+	/* [0],[1]: input of pipes[0],[1]. [2],[3]: their output */
+	pfds[0].fd = STDIN_FILENO;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = netfd;
+	pfds[1].events = POLLIN;
+	pfds[2].events = POLLOUT;
+	pfds[3].events = POLLOUT;
+
+	xpipe(pipes[0]);
+	xpipe(pipes[1]);
+	/* Bigger pipe means fewer syscalls per byte. Not fatal if we are
+	 * not allowed to (exceeds /proc/sys/fs/pipe-max-size) */
+	pipesz = SPLICE_PIPE_SZ;
+	if (fcntl(pipes[0][1], F_SETPIPE_SZ, pipesz) < 0
+	 || fcntl(pipes[1][1], F_SETPIPE_SZ, pipesz) < 0
+	) {
+		pipesz = 64 * 1024; /* default size */
+	}
+	ndelay_on(netfd);
+
+	pend[0] = pend[1] = 0;
+	fds_open = 2;
+	netretry = 2;
+	ret = 0;
+	while (fds_open || pend[0] || pend[1]) {
+		int rr;
+		int poll_tmout_ms;
+
+		/* Inputs are polled only while their pipe is empty */
+		pfds[2].fd = pend[0] ? netfd : -1;
+		pfds[3].fd = pend[1] ? STDOUT_FILENO : -1;
+		poll_tmout_ms = -1;
+		if (o_wait) {
+			poll_tmout_ms = INT_MAX;
+			if (o_wait < INT_MAX / 1000)
+				poll_tmout_ms = o_wait * 1000;
+		}
+		rr = poll(pfds, 4, poll_tmout_ms);
+		if (rr < 0) {
+			if (errno == EINTR)
+				continue;
+			holler_perror("poll");
+			ret = 1;
+			break;
+		}
+		if (rr == 0) {
+			/* same as in readwrite() */
+			if (!pfds[0].revents) {
+				netretry--;
+				if (!netretry) {
+					if (o_verbose > 1)
+						fprintf(stderr, "net timeout\n");
+					break;
+				}
+			}
+			continue;
+		}
+
+		for (i = 1; i >= 0; i--) { /* net first */
+			int *p = pipes[i];
+			int to = i ? STDOUT_FILENO : netfd;
+			ssize_t n;
+
+			if (pfds[i].revents) {
+				n = splice(pfds[i].fd, NULL, p[1], NULL, pipesz,
+						SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (n > 0) {
+					pend[i] = n;
+					pfds[i].fd = -1;
+				} else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+					if (n < 0) {
+						if (errno == EINVAL || errno == ENOSYS)
+							goto unsupported;
+						if (i && o_verbose > 1)
+							bb_simple_perror_msg("net read");
+					}
+					pfds[i].fd = -1;
+					pfds[i].events = 0; /* marks EOF */
+					fds_open--;
+					if (i == 0 && !pend[0]) {
+						/* Let peer know we have no more data */
+						shutdown(netfd, SHUT_WR);
+					}
+				}
+			}
+			if (!pend[i])
+				continue;
+			n = splice(p[0], NULL, to, NULL, pend[i],
+					SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				if (errno == EINVAL || errno == ENOSYS)
+					goto unsupported;
+				holler_perror("splice");
+				ret = 1;
+				goto done;
+			}
+			pend[i] -= n;
+			if (i)
+				wrote_out += n;
+			else
+				wrote_net += n;
+			if (!pend[i]) {
+				if (pfds[i].events)
+					pfds[i].fd = i ? netfd : STDIN_FILENO;
+				else if (i == 0)
+					shutdown(netfd, SHUT_WR);
+			}
+		}
+	}
+	close(netfd);
+	goto done;
+
+ unsupported:
+	/* Write out what's in the pipes the usual way */
+	ndelay_off(netfd);
+	for (i = 0; i < 2; i++) {
+		char *buf = i ? bigbuf_net : bigbuf_in;
+		while (pend[i]) {
+			ssize_t n = safe_read(pipes[i][0], buf, MIN(pend[i], BIGSIZ));
+			if (n <= 0)
+				break;
+			full_write(i ? STDOUT_FILENO : netfd, buf, n);
+			pend[i] -= n;
+			if (i)
+				wrote_out += n;
+			else
+				wrote_net += n;
+		}
+	}
+	ret = -1;
+ done:
+	close(pipes[0][0]);
+	close(pipes[0][1]);
+	close(pipes[1][0]);
+	close(pipes[1][1]);
+	return ret;
+}
+#endif
+
 /* readwrite:
  handle stdin/stdout/network I/O.  Bwahaha!! -- the i/o loop from hell.
  In this instance, return what might become our exit status. */
@@ -595,8 +785,19 @@ static int readwrite(void)
 	unsigned rnleft;
 	unsigned netretry;              /* net-read retry counter */
 	unsigned fds_open;
+	int rr;
 
 	struct pollfd pfds[2];
+
+#if ENABLE_NC_SPLICE
+	if (o_splice) {
+		G.relay_start_us = monotonic_us();
+		rr = splicerw();
+		if (rr >= 0)
+			return rr;
+		/* else fds don't do splice(), copy the rest */
+	}
+#endif
 	pfds[0].fd = STDIN_FILENO;
 	pfds[0].events = POLLIN;
 	pfds[1].fd = netfd;
@@ -611,7 +812,6 @@ static int readwrite(void)
 	/* and now the big ol' shoveling loop ... */
 	/* nc 1.10 has "while (FD_ISSET(netfd)" here */
 	while (fds_open) {
-		int rr;
 		int poll_tmout_ms;
 		unsigned wretry = 8200;               /* net-write sanity counter */
 
@@ -776,7 +976,7 @@ int nc_main(int argc UNUSED_PARAM, char **argv)
 		if (proggie[0][0] == '-') {
 			char *optpos = *proggie + 1;
 			/* Skip all valid opts w/o params */
-			optpos = optpos + strspn(optpos, "nuv"IF_NC_SERVER("lk")IF_NC_EXTRA("z"));
+			optpos = optpos + strspn(optpos, "nuv"IF_NC_SERVER("lk")IF_NC_EXTRA("z")IF_NC_SPLICE("Z"));
 			if (*optpos == 'e' && !optpos[1]) {
 				*optpos = '\0';
 				proggie++;
@@ -792,7 +992,7 @@ int nc_main(int argc UNUSED_PARAM, char **argv)
 	// -g -G -t -r deleted, unimplemented -a deleted too
 	getopt32(argv, "^"
 		"np:s:ubvw:+"/* -w N */ IF_NC_SERVER("lk")
-		IF_NC_EXTRA("i:o:z")
+		IF_NC_EXTRA("i:o:z") IF_NC_SPLICE("Z")
 			"\0"
 			"?2:vv"IF_NC_SERVER(":ll"), /* max 2 params; -v and -l are counters */
 		&str_p, &str_s, &o_wait
@@ -866,6 +1066,18 @@ int nc_main(int argc UNUSED_PARAM, char **argv)
 	setsockopt_SOL_SOCKET_int(netfd, SO_RCVBUF, o_rcvbuf);
 	setsockopt_SOL_SOCKET_int(netfd, SO_SNDBUF, o_sndbuf);
 #endif
+#if ENABLE_NC_SPLICE
+	/* Hexdump and line delay need the data in userspace,
+	 * and datagrams don't survive being spliced into a pipe */
+	if (option_mask32 & (OPT_u|OPT_o|OPT_i))
+		option_mask32 &= ~OPT_Z;
+	if (o_splice) {
+		/* Set before listen/connect: window scaling is negotiated
+		 * on SYN */
+		set_big_sockbuf("/proc/sys/net/core/rmem_max", SO_RCVBUF);
+		set_big_sockbuf("/proc/sys/net/core/wmem_max", SO_SNDBUF);
+	}
+#endif
 
 #ifdef BLOAT
 	if (OPT_l && (option_mask32 & (OPT_u|OPT_l)) == (OPT_u|OPT_l)) {
@@ -918,5 +1130,15 @@ int nc_main(int argc UNUSED_PARAM, char **argv)
 	}
 	if (o_verbose > 1)                /* normally we don't care */
 		fprintf(stderr, SENT_N_RECV_M, wrote_net, wrote_out);
+#if ENABLE_NC_SPLICE
+	if (o_splice && o_verbose && G.relay_start_us) {
+		unsigned long long total = (unsigned long long)wrote_net + wrote_out;
+		unsigned ms = (monotonic_us() - G.relay_start_us) / 1000;
+		fprintf(stderr, "%llu bytes in %u.%03u seconds, %llu MB/s\n",
+			total, ms / 1000, ms % 1000,
+			total / 1000 / (ms ? ms : 1)
+		);
+	}
+#endif
 	return x;
 }
@@ -91,7 +91,7 @@ int ssl_server_main(int argc UNUSED_PARAM, char **argv)
 	tls->ofd = 4;
 
 	/* This can abort on errors */
-	tls_handshake_as_server(tls, pem_file);
+	tls_handshake_as_server(tls, tls_load_server_keys(pem_file));
 
 	/* Run PROG, wrap its data in TLS and I/O to socket */
 	xpiped_pair(to_prog);
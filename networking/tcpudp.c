@@ -41,6 +41,15 @@
 //config:	help
 //config:	udpsvd listens on an UDP port and runs a program for each new
 //config:	connection.
+//config:
+//config:config FEATURE_TCPUDPSVD_POOL
+//config:	bool "Support -P N: pre-forked handler processes"
+//config:	default y
+//config:	depends on (TCPSVD || UDPSVD) && !NOMMU
+//config:	help
+//config:	With -P N, N processes are forked in advance and wait for
+//config:	connections, which are passed to them over unix sockets.
+//config:	Forking and hostname lookups (-h) are done off the accept path.
 
 //applet:IF_TCPSVD(APPLET_ODDNAME(tcpsvd, tcpudpsvd, BB_DIR_USR_BIN, BB_SUID_DROP, tcpsvd))
 //applet:IF_UDPSVD(APPLET_ODDNAME(udpsvd, tcpudpsvd, BB_DIR_USR_BIN, BB_SUID_DROP, udpsvd))
@@ -49,7 +58,7 @@
 //kbuild:lib-$(CONFIG_UDPSVD) += tcpudp.o tcpudp_perhost.o
 
 //usage:#define tcpsvd_trivial_usage
-//usage:       "[-hEv] [-c N] [-C N[:MSG]] [-b N] [-u USER] [-l NAME] IP PORT PROG"
+//usage:       "[-hEv] [-c N] [-C N[:MSG]] [-b N]" IF_FEATURE_TCPUDPSVD_POOL(" [-P N]") " [-u USER] [-l NAME] IP PORT PROG"
 /* with not-implemented options: */
 /* //usage:    "[-hpEvv] [-c N] [-C N[:MSG]] [-b N] [-u USER] [-l NAME] [-i DIR|-x CDB] [-t SEC] IP PORT PROG" */
 //usage:#define tcpsvd_full_usage "\n\n"
@@ -60,6 +69,9 @@
 //usage:     "\n	-u USER[:GRP]	Change to user/group after bind"
 //usage:     "\n	-c N		Up to N connections simultaneously (default 30)"
 //usage:     "\n	-b N		Allow backlog of approximately N TCP SYNs (default 20)"
+//usage:	IF_FEATURE_TCPUDPSVD_POOL(
+//usage:     "\n	-P N		Keep N processes forked, ready to run PROG"
+//usage:	)
 //usage:     "\n	-C N[:MSG]	Allow only up to N connections from the same IP:"
 //usage:     "\n			new connections from this IP address are closed"
 //usage:     "\n			immediately, MSG is written to the peer before close"
@@ -82,7 +94,7 @@
 
 //usage:
 //usage:#define udpsvd_trivial_usage
-//usage:       "[-hEv] [-c N] [-u USER] [-l NAME] IP PORT PROG"
+//usage:       "[-hEv] [-c N]" IF_FEATURE_TCPUDPSVD_POOL(" [-P N]") " [-u USER] [-l NAME] IP PORT PROG"
 //usage:#define udpsvd_full_usage "\n\n"
 //usage:       "Create UDP socket, bind to IP:PORT and wait for incoming packets.\n"
 //usage:       "Run PROG for each packet, redirecting all further packets with same\n"
@@ -91,6 +103,9 @@
 //usage:     "\n	PROG ARGS	Program to run"
 //usage:     "\n	-u USER[:GRP]	Change to user/group after bind"
 //usage:     "\n	-c N		Up to N connections simultaneously (default 30)"
+//usage:	IF_FEATURE_TCPUDPSVD_POOL(
+//usage:     "\n	-P N		Keep N processes forked, ready to run PROG"
+//usage:	)
 //usage:     "\n	-E		Don't set up environment"
 //usage:     "\n	-h		Look up peer's hostname"
 //usage:     "\n	-l NAME		Local hostname (else look up local hostname in DNS)"
@@ -121,6 +136,20 @@
 #include "ssl_io.h"
 #endif
 
+#if ENABLE_FEATURE_TCPUDPSVD_POOL
+struct pool_worker {
+	pid_t pid;  /* 0: free slot */
+	int fd;     /* our end of socketpair, -1: worker died */
+};
+
+/* Sent to worker together with connection's fd */
+struct pool_msg {
+	len_and_sockaddr local;
+	len_and_sockaddr remote;
+	unsigned concurrency; /* cur_per_host */
+};
+#endif
+
 struct globals {
 	unsigned verbose;
 	unsigned max_per_host;
@@ -128,6 +157,11 @@ struct globals {
 	unsigned cnum;
 	unsigned cmax;
 	struct hcc *cc;
+#if ENABLE_FEATURE_TCPUDPSVD_POOL
+	unsigned pool_size;
+	unsigned pool_cnt;  /* forked workers, not yet given a connection */
+	struct pool_worker *pool;
+#endif
 	char **env_cur;
 	char *env_var[1]; /* actually bigger */
 } FIX_ALIASING;
@@ -209,7 +243,7 @@ enum {
 	OPT_p = (1 << 9),
 	OPT_t = (1 << 10),
 	OPT_v = (1 << 11),
-	OPT_V = (1 << 12),
+	OPT_P = (1 << 12),
 	OPT_U = (1 << 13), /* from here: sslsvd only */
 	OPT_slash = (1 << 14),
 	OPT_Z = (1 << 15),
@@ -225,6 +259,149 @@ static void if_verbose_print_connection_status(void)
 	}
 }
 
+#if ENABLE_FEATURE_TCPUDPSVD_POOL
+/* Returns 0 in the new worker, its pid in parent, -1 on error */
+static pid_t pool_spawn(int sock, int *worker_fd)
+{
+	struct pool_worker *w;
+	int sv[2];
+	pid_t pid;
+	unsigned i;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		bb_simple_perror_msg("socketpair");
+		return -1;
+	}
+	pid = fork();
+	if (pid < 0) {
+		bb_simple_perror_msg("fork");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		/* Worker: keep only our end of the socketpair.
+		 * fd 0 is the previous connection, if any */
+		close(0);
+		close(sock);
+		close(sv[0]);
+		for (i = 0; i < G.pool_size; i++)
+			if (G.pool[i].pid > 0 && G.pool[i].fd >= 0)
+				close(G.pool[i].fd);
+		*worker_fd = sv[1];
+		return 0;
+	}
+	close(sv[1]);
+	/* vforked PROGs should not inherit it */
+	close_on_exec_on(sv[0]);
+	w = G.pool;
+	while (w->pid != 0)
+		w++;
+	w->pid = pid;
+	w->fd = sv[0];
+	G.pool_cnt++;
+	return pid;
+}
+
+/* Worker: wait for parent to pass us a connection, make it fd 0 */
+static void pool_wait(int fd, struct pool_msg *m)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct cmsghdr *cmsg;
+	int conn;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = m;
+	iov.iov_len = sizeof(*m);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	do
+		r = recvmsg(fd, &msg, 0);
+	while (r < 0 && errno == EINTR);
+	if (r != sizeof(*m)) /* parent is gone */
+		_exit(EXIT_SUCCESS);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+		bb_simple_error_msg_and_die("no fd from parent");
+	memcpy(&conn, CMSG_DATA(cmsg), sizeof(conn));
+	close(fd);
+	xmove_fd(conn, 0);
+}
+
+/* Pass fd 0 to an idle worker. Returns its pid, or 0 if none took it */
+static pid_t pool_handoff(struct pool_msg *m)
+{
+	struct pool_worker *w;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} u;
+	struct cmsghdr *cmsg;
+	int conn = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = m;
+	iov.iov_len = sizeof(*m);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = u.buf;
+	msg.msg_controllen = sizeof(u.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(conn));
+	memcpy(CMSG_DATA(cmsg), &conn, sizeof(conn));
+
+	for (w = G.pool; w < G.pool + G.pool_size; w++) {
+		ssize_t r;
+
+		if (w->pid <= 0 || w->fd < 0)
+			continue;
+		r = sendmsg(w->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(w->fd);
+		w->fd = -1;
+		if (r == sizeof(*m)) {
+			/* from now on, it is a connection's child */
+			pid_t pid = w->pid;
+			w->pid = 0;
+			G.pool_cnt--;
+			return pid;
+		}
+		/* It died, slot is freed when we get its SIGCHLD */
+	}
+	return 0;
+}
+
+/* Was it an idle worker? Then it had no connection */
+static int pool_reaped(pid_t pid)
+{
+	struct pool_worker *w;
+
+	for (w = G.pool; w < G.pool + G.pool_size; w++) {
+		if (w->pid == pid) {
+			if (w->fd >= 0)
+				close(w->fd);
+			w->pid = 0;
+			G.pool_cnt--;
+			return 1;
+		}
+	}
+	return 0;
+}
+#else
+# define pool_reaped(pid) 0
+#endif
+
 /* SIGCHLD handler is reentrancy-safe because SIGCHLD is unmasked
  * only over accept() or recvfrom() calls, not over memory allocations
  * or printouts. Do need to save/restore errno in order not to mangle
@@ -237,6 +414,11 @@ static void sig_child_handler(int sig UNUSED_PARAM)
 	int sv_errno = errno;
 
 	while ((pid = wait_any_nohang(&wstat)) > 0) {
+		if (pool_reaped(pid)) {
+			if (verbose)
+				print_waitstat(pid, wstat);
+			continue;
+		}
 		if (max_per_host)
 			ipsvd_perhost_remove(G.cc, pid);
 		if (cnum)
@@ -290,12 +472,14 @@ int tcpudpsvd_main(int argc UNUSED_PARAM, char **argv)
 	);
 #else
 	opts = getopt32(argv, "^+"
-		"c:+C:i:x:u:l:Eb:+hpt:v" /* -c NUM, -b NUM */
+		"c:+C:i:x:u:l:Eb:+hpt:v" IF_FEATURE_TCPUDPSVD_POOL("P:+") /* -c NUM, -b NUM, -P NUM */
 		"\0"
 		/* 3+ args, -i at most once, -p implies -h, -v is a counter */
 		"-3:i--i:ph:vv",
 		&cmax, &str_C, &instructs, &instructs, &user, &preset_local_hostname,
-		&backlog, &str_t, &verbose
+		&backlog, &str_t
+		IF_FEATURE_TCPUDPSVD_POOL(, &G.pool_size),
+		&verbose
 	);
 #endif
 	if (opts & OPT_C) { /* -C n[:message] */
@@ -362,6 +546,10 @@ int tcpudpsvd_main(int argc UNUSED_PARAM, char **argv)
 
 	if (max_per_host)
 		G.cc = ipsvd_perhost_init(cmax);
+#if ENABLE_FEATURE_TCPUDPSVD_POOL
+	if (G.pool_size)
+		G.pool = xzalloc(G.pool_size * sizeof(G.pool[0]));
+#endif
 
 	local_port = bb_lookup_port(argv[1], tcp ? "tcp" : "udp", 0);
 	lsa = xhost2sockaddr(argv[0], local_port);
@@ -403,6 +591,29 @@ int tcpudpsvd_main(int argc UNUSED_PARAM, char **argv)
 	hccp = NULL;
 
  again1:
+#if ENABLE_FEATURE_TCPUDPSVD_POOL
+	/* Replace workers which got connections (or died).
+	 * Fork is cheap compared to what workers do before exec:
+	 * hostname lookups, setting up environment */
+	while (G.pool_cnt < G.pool_size) {
+		int worker_fd;
+
+		pid = pool_spawn(sock, &worker_fd);
+		if (pid < 0)
+			break;
+		if (pid == 0) {
+			struct pool_msg m;
+
+			pool_wait(worker_fd, &m);
+			local = m.local;
+			remote = m.remote;
+			cur_per_host = m.concurrency;
+			if (max_per_host)
+				remote_addr = xmalloc_sockaddr2dotted_noport(&remote.u.sa);
+			goto child;
+		}
+	}
+#endif
 	close(0);
 	/* It's important to close(0) _before_ wait loop:
 	 * fd#0 can be a shared connection fd.
@@ -490,6 +701,24 @@ int tcpudpsvd_main(int argc UNUSED_PARAM, char **argv)
 #endif
 	}
 
+#if ENABLE_FEATURE_TCPUDPSVD_POOL
+	if (G.pool_cnt) {
+		struct pool_msg m;
+
+		m.local = local;
+		m.remote = remote;
+		m.concurrency = cur_per_host;
+		pid = pool_handoff(&m);
+		if (pid > 0) {
+			/* Close connection now, not after refilling
+			 * the pool. Keep fd 0 busy, pool_spawn() should
+			 * not get it for a socketpair */
+			xmove_fd(xopen(bb_dev_null, O_RDONLY), 0);
+			goto parent;
+		}
+		/* no idle workers: fork */
+	}
+#endif
 	pid = vfork();
 	if (pid == -1) {
 		bb_simple_perror_msg("vfork");
@@ -497,6 +726,7 @@ int tcpudpsvd_main(int argc UNUSED_PARAM, char **argv)
 	}
 
 	if (pid != 0) {
+ IF_FEATURE_TCPUDPSVD_POOL(parent:)
 		/* Parent */
 		cnum++;
 		if_verbose_print_connection_status();
@@ -507,6 +737,7 @@ int tcpudpsvd_main(int argc UNUSED_PARAM, char **argv)
 		goto again;
 	}
 
+ IF_FEATURE_TCPUDPSVD_POOL(child:)
 	/* Child: prepare env, log, and exec prog */
 
 	{ /* vfork alert! every xmalloc in this block should be freed! */
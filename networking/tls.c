@@ -16,6 +16,8 @@
 //kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_pstm_sqr_comba.o
 //kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_aes.o
 //kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_aesgcm.o
+//kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_aes_hwaccel_x86-64.o
+//kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_chacha.o
 //kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_rsa.o
 //kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_fe.o
 //kbuild:lib-$(CONFIG_FEATURE_TLS_INTERNAL) += tls_sp_c32.o
@@ -30,6 +32,8 @@
 #define ALLOW_ECDHE_RSA_WITH_AES_128_CBC_SHA256         1
 #define ALLOW_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256       1
 #define ALLOW_ECDHE_RSA_WITH_AES_128_GCM_SHA256         1
+#define ALLOW_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 1
+#define ALLOW_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256   1
 #define ALLOW_RSA_WITH_AES_128_CBC_SHA256       1
 #define ALLOW_RSA_WITH_AES_256_CBC_SHA256       1
 #define ALLOW_RSA_WITH_AES_128_GCM_SHA256       1
@@ -85,6 +89,7 @@
 #define HANDSHAKE_SERVER_HELLO          2  /* 0x02 */
 #define HANDSHAKE_HELLO_VERIFY_REQUEST  3  /* 0x03 */
 #define HANDSHAKE_NEW_SESSION_TICKET    4  /* 0x04 */
+#define HANDSHAKE_ENCRYPTED_EXTENSIONS  8  /* 0x08 */ /* TLS 1.3 */
 #define HANDSHAKE_CERTIFICATE           11 /* 0x0b */
 #define HANDSHAKE_SERVER_KEY_EXCHANGE   12 /* 0x0c */
 #define HANDSHAKE_CERTIFICATE_REQUEST   13 /* 0x0d */
@@ -92,6 +97,8 @@
 #define HANDSHAKE_CERTIFICATE_VERIFY    15 /* 0x0f */
 #define HANDSHAKE_CLIENT_KEY_EXCHANGE   16 /* 0x10 */
 #define HANDSHAKE_FINISHED              20 /* 0x14 */
+#define HANDSHAKE_KEY_UPDATE            24 /* 0x18 */ /* TLS 1.3 */
+#define HANDSHAKE_MESSAGE_HASH          254 /* 0xfe */ /* TLS 1.3 */
 
 #define TLS_EMPTY_RENEGOTIATION_INFO_SCSV       0x00FF /* not a real cipher id... */
 
@@ -191,7 +198,14 @@
 #define TLS_MAX_OUTBUF          (1 << 14)
 
 /* Cipher suites we support, in preference order (best first) */
+#define NUM_TLS13_CIPHERS (2 * ENABLE_FEATURE_TLS_1_3)
+#define NUM_CHACHA_CIPHERS (0 \
+	+ ALLOW_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256 \
+	+ ALLOW_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256 \
+	)
 #define NUM_CIPHERS (0 \
+	+ NUM_TLS13_CIPHERS \
+	+ NUM_CHACHA_CIPHERS \
 	+ 4 * ENABLE_FEATURE_TLS_SHA1 \
 	+ ALLOW_ECDHE_ECDSA_WITH_AES_128_CBC_SHA256 \
 	+ ALLOW_ECDHE_RSA_WITH_AES_128_CBC_SHA256 \
@@ -207,6 +221,19 @@ static const uint8_t client_hello_ciphers[] = {
 	0x00,2 * (1 + NUM_CIPHERS), //len16_be
 	0x00,0xFF, //not a cipher - TLS_EMPTY_RENEGOTIATION_INFO_SCSV
 	/* ^^^^^^ RFC 5746 Renegotiation Indication Extension - some servers will refuse to work with us otherwise */
+	/* TLS 1.3 ciphers, used only if TLS 1.3 is negotiated. Must be first */
+#if ENABLE_FEATURE_TLS_1_3
+	0x13,0x03, //   TLS_CHACHA20_POLY1305_SHA256 - ok: openssl s_server ... -ciphersuites TLS_CHACHA20_POLY1305_SHA256
+	0x13,0x01, //   TLS_AES_128_GCM_SHA256 - ok: openssl s_server ... -ciphersuites TLS_AES_128_GCM_SHA256
+	//0x13,0x02, // TLS_AES_256_GCM_SHA384 - can't do SHA384 yet
+#endif
+	/* ChaCha20 ciphers go next: if AES is hw accelerated, they are moved to the end */
+#if ALLOW_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256
+	0xCC,0xA9, //   TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256
+#endif
+#if ALLOW_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256
+	0xCC,0xA8, //   TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256 - ok: openssl s_server ... -cipher ECDHE-RSA-CHACHA20-POLY1305
+#endif
 #if ENABLE_FEATURE_TLS_SHA1
 	0xC0,0x09, // 1 TLS_ECDHE_ECDSA_WITH_AES_128_CBC_SHA - ok: wget https://is.gd/
 	0xC0,0x0A, // 2 TLS_ECDHE_ECDSA_WITH_AES_256_CBC_SHA - ok: wget https://is.gd/
@@ -317,13 +344,39 @@ enum {
 	 * Server: we chose x25519 based on client's supported_groups (else P256) */
 	USE_EC_CURVE_X25519    = 1 << 4,
 	ENCRYPTION_AESGCM      = 1 << 5, // else AES-SHA (or NULL-SHA if ALLOW_RSA_NULL_SHA256=1)
+	ENCRYPTION_CHACHA      = 1 << 6, // ChaCha20-Poly1305
+	TLS13                  = 1 << 7, // TLS 1.3 is negotiated
 };
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
+static int is_cipher_AESGCM(const uint8_t *cipherid)
+{
+	if (cipherid[0] == 0xC0) /* C02B,2C,2F,30 */
+		return (cipherid[1] >= 0x2B && cipherid[1] <= 0x30);
+	return (cipherid[0] == 0x00 && cipherid[1] == 0x9C);
+}
+
+/* Server's order of preference: AEAD ciphers, then AES-CBC+HMAC.
+ * Of AEAD ones, AES-GCM goes first only if AES is hw accelerated:
+ * otherwise ChaCha20 is faster, and not prone to cache timing attacks.
+ */
+static unsigned cipher_pass(const uint8_t *cipherid)
+{
+	if (cipherid[0] == 0x13)
+		return 3; /* TLS 1.3 only, never chosen for TLS 1.2 */
+	if (cipherid[0] == 0xCC)
+		return aes_have_NI();
+	if (is_cipher_AESGCM(cipherid))
+		return !aes_have_NI();
+	return 2;
+}
+
 /* Note: return value matches KEY_RSA (0) / KEY_ECDSA (1) enum values */
 static int is_cipher_ECDSA(const uint8_t *cipherid)
 {
 	uint8_t cipher_lo;
+	if (cipherid[0] == 0xCC)
+		return cipherid[1] == 0xA9;
 	if (cipherid[0] != 0xC0)
 		return 0;
 	/* ECDHE cipher - check if ECDSA or RSA */
@@ -346,6 +399,27 @@ static void set_cipher_parameters(tls_state_t *tls, const uint8_t *cipherid)
 	tls->MAC_size = SHA256_OUTSIZE;
 	tls->IV_size = 0;
 
+#if ENABLE_FEATURE_TLS_1_3
+	if (cipherid[0] == 0x13) {
+		/* 1301 is AES128-GCM, 1303 is ChaCha20-Poly1305.
+		 * Key exchange is not a part of TLS 1.3 cipher suite
+		 */
+		if (cipherid1 == 0x01) {
+			tls->flags |= ENCRYPTION_AESGCM;
+			tls->key_size = AES128_KEYSIZE;
+		} else {
+			tls->flags |= ENCRYPTION_CHACHA;
+		}
+		tls->MAC_size = 0;
+		tls->IV_size = 12;
+	} else
+#endif
+	if (cipherid[0] == 0xCC) {
+		/* CCA8,A9 are ECDHE with ChaCha20-Poly1305 */
+		tls->flags |= NEED_EC_KEY | ENCRYPTION_CHACHA;
+		tls->MAC_size = 0;
+		tls->IV_size = 12;
+	} else
 	if (cipherid[0] == 0xC0) {
 		/* All C0xx are ECDHE */
 		tls->flags |= NEED_EC_KEY;
@@ -388,6 +462,20 @@ struct record_hdr {
 	uint8_t len16_hi, len16_lo;
 };
 
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+#define MAX_TICKET_LEN (8 * 1024)
+struct tls_session {
+	uint32_t saved;     /* time() when ticket was received */
+	uint32_t lifetime;  /* in seconds */
+	uint32_t age_add;   /* TLS 1.3 */
+	uint16_t cipher_id;
+	uint16_t ticket_len;
+	uint8_t version;    /* 3: TLS 1.2, 4: TLS 1.3 */
+	uint8_t secret[48]; /* TLS 1.2: master secret, TLS 1.3: PSK (32 bytes) */
+	/* uint8_t ticket[ticket_len]; */
+};
+#endif
+
 struct tls_handshake_data {
 	/* In bbox, md5/sha1/sha256 ctx's are the same structure */
 	md5sha_ctx_t handshake_hash_ctx;
@@ -403,36 +491,84 @@ struct tls_handshake_data {
 	/* for x25519, it contains one point in first 32 bytes */
 	/* for P256, it contains x,y point pair, each 32 bytes long */
 	uint8_t ecc_pub_key32[2 * 32];
+	/* our ephemeral EC private key: server's for ECDHE, client's for TLS 1.3 */
+	uint8_t ecc_priv_key32[32];
+
+#if ENABLE_FEATURE_TLS_1_3
+	/* Client: hash of first ClientHello (until ServerHello is seen),
+	 * then handshake secret, then master secret */
+	uint8_t tls13_secret[32];
+	/* Client sends random one (RFC 8446 D.4 middlebox compatibility),
+	 * server echoes it back */
+	uint8_t session_id_len;
+	uint8_t session_id[32];
+	smallint hello_retry;
+	/* Handshake messages, possibly coalesced into one record
+	 * or split between records */
+	uint8_t *hs_buf;
+	unsigned hs_buf_len;
+	unsigned hs_msg_len;
+#endif
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	/* Saved session we offer to the server */
+	struct tls_session *session;
+	smallint resumed;
+#endif
 
 /* HANDSHAKE HASH: */
 	//unsigned saved_client_hello_size;
 	//uint8_t saved_client_hello[1];
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
 	smallint reneg_info_requested;
-	/* Server certificate and key data */
+	int key_type_chosen;
+	struct tls_server_keys *sk;
+# if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	/* Client can take a ticket: TICKETS_TLS12 and/or TICKETS_TLS13 */
+	uint8_t tickets_ok;
+# endif
+#endif
+};
+enum {
+	KEY_RSA,
+	KEY_ECDSA,
+};
+
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
+/* Server certificate and key data.
+ * Loaded once, used for every connection.
+ */
+struct tls_server_keys {
 	char *keys[2];
 	char *certs[2];
 	unsigned keysize[2];
 	unsigned certsize[2];
-	int key_type_chosen;
 	psRsaKey_t rsa_priv_key;
-
-	/* For ECDHE: server's ephemeral EC private key */
-	uint8_t ecc_priv_key32[32];
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	/* Random keys: tickets are valid only in this process
+	 * and its children, the ones which inherited them */
+	struct tls_aes ticket_aes;
+	uint8_t ticket_mac_key[SHA256_OUTSIZE];
 #endif
 };
+#endif
+
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
 enum {
-	KEY_RSA,
-	KEY_ECDSA,
+	TICKETS_TLS12 = 1 << 0, /* sent empty or our "session_ticket" */
+	TICKETS_TLS13 = 1 << 1, /* sent "psk_key_exchange_modes" with psk_dhe_ke */
 };
+# define TICKET_LIFETIME (2 * 60 * 60)
+/* Our ticket: IV + AES-CTR encrypted struct tls_session + HMAC of both */
+# define TICKET_LEN (12 + sizeof(struct tls_session) + SHA256_OUTSIZE)
+#endif
 
 static unsigned get24be(const uint8_t *p)
 {
 	return 0x100*(0x100*p[0] + p[1]) + p[2];
 }
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
 static int is_minor_version_valid(tls_state_t *tls, uint8_t minor_ver)
 {
 	if (tls->expecting_first_packet == 1) {
@@ -874,8 +1010,6 @@ static void xwrite_encrypted_aesgcm(tls_state_t *tls, unsigned size, unsigned ty
 	uint8_t authtag[AES_BLOCK_SIZE] ALIGNED_long; //[16]
 	uint8_t *buf;
 	struct record_hdr *xhdr;
-	unsigned remaining;
-	unsigned cnt;
 	uint64_t t64;
 
 	buf = tls->outbuf + OUTBUF_PFX; /* see above for the byte it points to */
@@ -899,26 +1033,11 @@ static void xwrite_encrypted_aesgcm(tls_state_t *tls, unsigned size, unsigned ty
 	/* seq64 is not used later in this func, can increment here */
 	tls->write_seq64_be = SWAP_BE64(1 + SWAP_BE64(t64));
 
-	cnt = 1;
-	remaining = size;
-	while (remaining != 0) {
-		unsigned n;
-
-		cnt++;
-		COUNTER(nonce) = htonl(cnt); /* yes, first cnt here is 2 (!) */
-		aes_encrypt_one_block(&tls->aes_encrypt, nonce, scratch);
-		if (remaining >= AES_BLOCK_SIZE) {
-			n = AES_BLOCK_SIZE;
-			xorbuf_AES_BLOCK_SIZE(buf, scratch);
-		} else {
-			n = remaining;
-			xorbuf(buf, scratch, n);
-		}
-		buf += n;
-		remaining -= n;
-	}
+	COUNTER(nonce) = htonl(2); /* yes, first counter here is 2 (!) */
+	aes_ctr_encrypt(&tls->aes_encrypt, nonce, buf, size, buf);
+	buf += size;
 
-	aesgcm_GHASH(tls->H, aad, /*sizeof(aad),*/ tls->outbuf + OUTBUF_PFX, size, authtag /*, sizeof(authtag)*/);
+	aesgcm_GHASH(tls->H, aad, 13, tls->outbuf + OUTBUF_PFX, size, authtag /*, sizeof(authtag)*/);
 	COUNTER(nonce) = htonl(1);
 	aes_encrypt_one_block(&tls->aes_encrypt, nonce, scratch);
 	xorbuf_aligned_AES_BLOCK_SIZE(authtag, scratch);
@@ -940,8 +1059,111 @@ static void xwrite_encrypted_aesgcm(tls_state_t *tls, unsigned size, unsigned ty
 #undef COUNTER
 }
 
+/* RFC 7905 and RFC 8446 5.3: the 12-byte IV is xored with the 64-bit sequence number */
+static void aead_nonce(uint8_t *nonce, const uint8_t *IV, uint64_t seq64_be)
+{
+	memcpy(nonce, IV, 12);
+	xorbuf(nonce + 4, &seq64_be, 8);
+}
+
+static void xwrite_encrypted_chacha(tls_state_t *tls, unsigned size, unsigned type)
+{
+	uint8_t aad[13];
+	uint8_t nonce[12];
+	uint8_t *buf;
+	struct record_hdr *xhdr;
+
+	buf = tls->outbuf + OUTBUF_PFX;
+	dump_hex("xwrite_encrypted_chacha plaintext:%s", buf, size);
+
+	/* No explicit nonce: record header is right before the data */
+	xhdr = (void*)(buf - RECHDR_LEN);
+	xhdr->type = type;
+	xhdr->proto_maj = TLS_MAJ;
+	xhdr->proto_min = TLS_MIN;
+
+	move_to_unaligned64(aad, tls->write_seq64_be);
+	aad[8] = type;
+	aad[9] = TLS_MAJ;
+	aad[10] = TLS_MIN;
+	aad[11] = size >> 8;
+	aad[12] = size;
+	aead_nonce(nonce, tls->our_write_IV, tls->write_seq64_be);
+	tls->write_seq64_be = SWAP_BE64(1 + SWAP_BE64(tls->write_seq64_be));
+
+	chacha20poly1305_encrypt(tls->our_write_key, nonce, aad, 13, buf, size, buf + size);
+
+	size += 16;
+	xhdr->len16_hi = size >> 8;
+	xhdr->len16_lo = size;
+	size += RECHDR_LEN;
+	dump_raw_out(">> %s", xhdr, size);
+	xwrite(tls->ofd, xhdr, size);
+	dbg("wrote %u bytes", size);
+}
+
+#if ENABLE_FEATURE_TLS_1_3
+/* RFC 8446 5.2: real record type is appended to the data and encrypted too,
+ * outer record type is always application_data, record header is the AAD.
+ * No explicit nonce: nonce is IV xored with sequence number.
+ */
+static void xwrite_encrypted_tls13(tls_state_t *tls, unsigned size, unsigned type)
+{
+#define COUNTER(v) (*(uint32_t*)(v + 12))
+	uint8_t aad[AES_BLOCK_SIZE] ALIGNED_long;
+	uint8_t nonce[12 + 4] ALIGNED_long;
+	uint8_t scratch[AES_BLOCK_SIZE] ALIGNED_long;
+	uint8_t *buf;
+	struct record_hdr *xhdr;
+
+	buf = tls->outbuf + OUTBUF_PFX;
+	dump_hex("xwrite_encrypted_tls13 plaintext:%s", buf, size);
+	buf[size++] = type; /* TLSInnerPlaintext.type, no padding */
+
+	xhdr = (void*)(buf - RECHDR_LEN);
+	xhdr->type = RECORD_TYPE_APPLICATION_DATA;
+	xhdr->proto_maj = TLS_MAJ;
+	xhdr->proto_min = TLS_MIN;
+	xhdr->len16_hi = (size + 16) >> 8;
+	xhdr->len16_lo = (size + 16);
+
+	aead_nonce(nonce, tls->our_write_IV, tls->write_seq64_be);
+	tls->write_seq64_be = SWAP_BE64(1 + SWAP_BE64(tls->write_seq64_be));
+
+	if (tls->flags & ENCRYPTION_CHACHA) {
+		chacha20poly1305_encrypt(tls->our_write_key, nonce, (void*)xhdr, RECHDR_LEN,
+				buf, size, buf + size);
+	} else {
+		COUNTER(nonce) = htonl(2);
+		aes_ctr_encrypt(&tls->aes_encrypt, nonce, buf, size, buf);
+		memset(aad, 0, sizeof(aad));
+		memcpy(aad, xhdr, RECHDR_LEN);
+		aesgcm_GHASH(tls->H, aad, RECHDR_LEN, buf, size, buf + size);
+		COUNTER(nonce) = htonl(1);
+		aes_encrypt_one_block(&tls->aes_encrypt, nonce, scratch);
+		xorbuf(buf + size, scratch, AES_BLOCK_SIZE);
+	}
+
+	size += RECHDR_LEN + 16;
+	dump_raw_out(">> %s", xhdr, size);
+	xwrite(tls->ofd, xhdr, size);
+	dbg("wrote %u bytes", size);
+#undef COUNTER
+}
+#endif
+
 static void xwrite_encrypted(tls_state_t *tls, unsigned size, unsigned type)
 {
+#if ENABLE_FEATURE_TLS_1_3
+	if (tls->flags & TLS13) {
+		xwrite_encrypted_tls13(tls, size, type);
+		return;
+	}
+#endif
+	if (tls->flags & ENCRYPTION_CHACHA) {
+		xwrite_encrypted_chacha(tls, size, type);
+		return;
+	}
 	if (!(tls->flags & ENCRYPTION_AESGCM)) {
 		xwrite_encrypted_and_hmac_signed(tls, size, type);
 		return;
@@ -1041,10 +1263,8 @@ static void tls_aesgcm_decrypt(tls_state_t *tls, uint8_t *buf, int size)
 
 	//uint8_t aad[13 + 3] ALIGNED_long; /* +3 creates [16] buffer, simplifying GHASH() */
 	uint8_t nonce[12 + 4] ALIGNED_long; /* +4 creates space for AES block counter */
-	uint8_t scratch[AES_BLOCK_SIZE] ALIGNED_long; //[16]
+	//uint8_t scratch[AES_BLOCK_SIZE] ALIGNED_long; //[16]
 	//uint8_t authtag[AES_BLOCK_SIZE] ALIGNED_long; //[16]
-	unsigned remaining;
-	unsigned cnt;
 
 	//memcpy(aad, buf, 8);
 	//aad[8] = type;
@@ -1057,19 +1277,9 @@ static void tls_aesgcm_decrypt(tls_state_t *tls, uint8_t *buf, int size)
 	memcpy(nonce,     tls->peer_write_IV, 4);
 	memcpy(nonce + 4, buf, 8);
 
-	cnt = 1;
-	remaining = size;
-	while (remaining != 0) {
-		unsigned n;
-
-		cnt++;
-		COUNTER(nonce) = htonl(cnt); /* yes, first cnt here is 2 (!) */
-		aes_encrypt_one_block(&tls->aes_decrypt, nonce, scratch);
-		n = remaining > AES_BLOCK_SIZE ? AES_BLOCK_SIZE : remaining;
-		xorbuf_3(buf, scratch, buf + 8, n);
-		buf += n;
-		remaining -= n;
-	}
+	COUNTER(nonce) = htonl(2); /* yes, first counter here is 2 (!) */
+	/* Decrypt, and move plaintext 8 bytes back over the explicit nonce */
+	aes_ctr_encrypt(&tls->aes_decrypt, nonce, buf + 8, size, buf);
 
 	//aesgcm_GHASH(tls->H, aad, tls->inbuf + RECHDR_LEN, size, authtag);
 	//COUNTER(nonce) = htonl(1);
@@ -1080,6 +1290,81 @@ static void tls_aesgcm_decrypt(tls_state_t *tls, uint8_t *buf, int size)
 #undef COUNTER
 }
 
+static void tls_chacha_decrypt(tls_state_t *tls, uint8_t *buf, int size)
+{
+	uint8_t aad[13];
+	uint8_t nonce[12];
+
+	move_to_unaligned64(aad, tls->read_seq64_be);
+	aad[8] = tls->inbuf[0]; /* type */
+	aad[9] = tls->inbuf[1];
+	aad[10] = tls->inbuf[2];
+	aad[11] = size >> 8;
+	aad[12] = size;
+	aead_nonce(nonce, tls->peer_write_IV, tls->read_seq64_be);
+	tls->read_seq64_be = SWAP_BE64(1 + SWAP_BE64(tls->read_seq64_be));
+
+	if (!chacha20poly1305_decrypt(tls->peer_write_key, nonce, aad, 13, buf, size, buf + size))
+		bb_simple_error_msg_and_die("TLS record: bad MAC");
+}
+
+#if ENABLE_FEATURE_TLS_1_3
+/* Decrypts and verifies TLS 1.3 record in tls->inbuf, replaces record type
+ * in the header with the real one. Returns length of the data.
+ */
+static int tls13_decrypt(tls_state_t *tls, int size)
+{
+#define COUNTER(v) (*(uint32_t*)(v + 12))
+	uint8_t *buf = tls->inbuf + RECHDR_LEN;
+	uint8_t nonce[12 + 4] ALIGNED_long;
+
+	if (tls->inbuf[0] != RECORD_TYPE_APPLICATION_DATA)
+		bad_record_die(tls, "encrypted record", size);
+	size -= 16; /* drop tag */
+
+	aead_nonce(nonce, tls->peer_write_IV, tls->read_seq64_be);
+	tls->read_seq64_be = SWAP_BE64(1 + SWAP_BE64(tls->read_seq64_be));
+
+	if (tls->flags & ENCRYPTION_CHACHA) {
+		if (!chacha20poly1305_decrypt(tls->peer_write_key, nonce, tls->inbuf, RECHDR_LEN,
+				buf, size, buf + size)
+		) {
+			goto bad_mac;
+		}
+	} else {
+		uint8_t aad[AES_BLOCK_SIZE] ALIGNED_long;
+		uint8_t H[AES_BLOCK_SIZE] ALIGNED_long;
+		uint8_t authtag[AES_BLOCK_SIZE] ALIGNED_long;
+		uint8_t scratch[AES_BLOCK_SIZE] ALIGNED_long;
+
+		memset(aad, 0, sizeof(aad));
+		aes_encrypt_one_block(&tls->aes_decrypt, aad, H);
+		memcpy(aad, tls->inbuf, RECHDR_LEN);
+		aesgcm_GHASH(H, aad, RECHDR_LEN, buf, size, authtag);
+		COUNTER(nonce) = htonl(1);
+		aes_encrypt_one_block(&tls->aes_decrypt, nonce, scratch);
+		xorbuf_aligned_AES_BLOCK_SIZE(authtag, scratch);
+		if (memcmp(authtag, buf + size, AES_BLOCK_SIZE) != 0)
+			goto bad_mac;
+		COUNTER(nonce) = htonl(2);
+		aes_ctr_encrypt(&tls->aes_decrypt, nonce, buf, size, buf);
+	}
+
+	/* Strip zero padding, last nonzero byte is the real record type */
+	do {
+		if (--size < 0)
+			bb_simple_error_msg_and_die("encrypted record has no type");
+	} while (buf[size] == 0);
+	tls->inbuf[0] = buf[size];
+	return size;
+ bad_mac:
+	bb_simple_error_msg_and_die("TLS record: bad MAC");
+#undef COUNTER
+}
+
+static void tls13_post_handshake_msg(tls_state_t *tls, int len);
+#endif
+
 static int tls_xread_record(tls_state_t *tls, const char *expected)
 {
 	struct record_hdr *xhdr;
@@ -1152,11 +1437,32 @@ static int tls_xread_record(tls_state_t *tls, const char *expected)
 
 	sz = target - RECHDR_LEN;
 
+#if ENABLE_FEATURE_TLS_1_3
+	/* RFC 8446 D.4: peer may send unencrypted ChangeCipherSpec
+	 * during handshake (even after HelloRetryRequest).
+	 * It means nothing, skip it */
+	if (tls->hsd && ((tls->flags & TLS13) || tls->hsd->hello_retry)
+	 && tls->inbuf[0] == RECORD_TYPE_CHANGE_CIPHER_SPEC
+	) {
+		goto again;
+	}
+#endif
 	/* Needs to be decrypted? */
 	if (tls->min_encrypted_len_on_read != 0) {
 		if (sz < (int)tls->min_encrypted_len_on_read)
 			bb_error_msg_and_die("bad encrypted len:%u", sz);
 
+#if ENABLE_FEATURE_TLS_1_3
+		if (tls->flags & TLS13) {
+			sz = tls13_decrypt(tls, sz);
+			dbg("encrypted size:%u type:%u", sz, tls->inbuf[0]);
+		} else
+#endif
+		if (tls->flags & ENCRYPTION_CHACHA) {
+			sz -= 16; /* drop Poly1305 tag */
+			tls_chacha_decrypt(tls, tls->inbuf + RECHDR_LEN, sz);
+			dbg("encrypted size:%u", sz);
+		} else
 		if (tls->flags & ENCRYPTION_AESGCM) {
 			/* AESGCM */
 			uint8_t *p = tls->inbuf + RECHDR_LEN;
@@ -1226,6 +1532,19 @@ static int tls_xread_record(tls_state_t *tls, const char *expected)
 		goto end;
 	}
 
+#if ENABLE_FEATURE_TLS_1_3
+	if (tls->flags & TLS13) {
+		/* Handshake messages are hashed one by one as they are parsed */
+		if (tls->inbuf[0] == RECORD_TYPE_HANDSHAKE && !tls->hsd) {
+			/* NewSessionTicket or KeyUpdate */
+			tls13_post_handshake_msg(tls, sz);
+			goto again;
+		}
+		/* Zero-length application data records are allowed. Not EOF! */
+		if (sz == 0 && tls->inbuf[0] == RECORD_TYPE_APPLICATION_DATA)
+			goto again;
+	} else
+#endif
 	/* RFC 5246 is not saying it explicitly, but sha256 hash
 	 * in our FINISHED record must include data of incoming packets too!
 	 */
@@ -1549,102 +1868,612 @@ static void *get_outbuf_fill_handshake_record(tls_state_t *tls, unsigned type, u
 	return record;
 }
 
-static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+/* Session tickets are saved in files named after the server (SNI).
+ * Contents of the file: struct tls_session + ticket.
+ */
+static char *session_file_name(const char *sni)
 {
-	struct client_hello {
-		uint8_t type;
-		uint8_t len24_hi, len24_mid, len24_lo;
-		uint8_t proto_maj, proto_min;
-		uint8_t rand32[32];
-		uint8_t session_id_len;
-		/* uint8_t session_id[]; */
-		uint8_t cipherid_len16_hi, cipherid_len16_lo;
-		uint8_t cipherid[2 * (1 + NUM_CIPHERS)]; /* actually variable */
-		uint8_t comprtypes_len;
-		uint8_t comprtypes[1]; /* actually variable */
-	};
-	// https://www.iana.org/assignments/tls-extensiontype-values/tls-extensiontype-values.xhtml
-	static const uint8_t extensions[] = {
-		// is.gd responds with "handshake failure" to our hello if there's no supported_groups
-		0x00,0x0a, //extension_type: "supported_groups"
-			0x00,2 * (1 + ALLOW_CURVE_P256 + ALLOW_CURVE_X25519), //ext len
-			0x00,2 * (0 + ALLOW_CURVE_P256 + ALLOW_CURVE_X25519), //list len
-#if ALLOW_CURVE_P256
-			0x00,0x17, //curve_secp256r1 (aka P256, aka prime256v1)
-#endif
-			//0x00,0x18, //curve_secp384r1
-			//0x00,0x19, //curve_secp521r1
-#if ALLOW_CURVE_X25519
-			0x00,0x1d, //curve_x25519 (RFC 7748)
-#endif
-			//0x00,0x1e, //curve_x448 (RFC 7748)
+	if (!sni || !sni[0] || sni[0] == '.' || strchr(sni, '/'))
+		return NULL;
+	return concat_path_file(CONFIG_TLS_SESSION_CACHE_DIR, sni);
+}
 
-		//0x00,0x0b,0x00,0x04,0x03,0x00,0x01,0x02, //extension_type: "ec_point_formats"
-		//0x00,0x16,0x00,0x00, //extension_type: "encrpypt-then-mac"
-		//0x00,0x17,0x00,0x00, //extension_type: "extended_master"
-		//0x00,0x23,0x00,0x00, //extension_type: "session_ticket"
+/* Session secrets are as good as keys: don't use a cache dir
+ * which someone else can write to (or swap for a symlink)
+ */
+static int session_dir_is_private(void)
+{
+	struct stat st;
 
-		// kojipkgs.fedoraproject.org responds with alert code 80 ("internal error")
-		// to our hello without signature_algorithms.
-		// It is satisfied with just 0x04,0x01.
-		0x00,0x0d, //extension_type: "signature_algorithms" (RFC5246 section 7.4.1.4.1):
-#define SIGALGS (3 + 3 * ENABLE_FEATURE_TLS_SHA1)
-			0x00,2 * (1 + SIGALGS), //ext len
-			0x00,2 * (0 + SIGALGS), //list len
-			//Format: two bytes
-			// byte 1: 0:none,1:md5,2:sha1,3:sha224,4:sha256,5:sha384,6:sha512
-			// byte 2: 1:rsa,2:dsa,3:ecdsa
-			// (note that TLS 1.3 changes this, see RFC8446 section 4.2.3)
-#if ENABLE_FEATURE_TLS_SHA1
-			0x02,0x01, //sha1 + rsa
-			0x02,0x02, //sha1 + dsa
-			0x02,0x03, //sha1 + ecdsa
-#endif
-			0x04,0x01, //sha256 + rsa - kojipkgs.fedoraproject.org wants this
-			0x04,0x02, //sha256 + dsa
-			0x04,0x03, //sha256 + ecdsa
-// GNU Wget 1.18 to cdn.kernel.org sends these extensions:
-// 0055
-//   0005 0005 0100000000 - status_request
-//   0000 0013 0011 00 000e 63646e 2e 6b65726e656c 2e 6f7267 - server_name
-//   ff01 0001 00 - renegotiation_info
-//   0023 0000 - session_ticket
-//   000a 0008 0006001700180019 - supported_groups
-//   000b 0002 0100 - ec_point_formats
-//   000d 0016 0014 0401 0403 0501 0503 0601 0603 0301 0303 0201 0203 - signature_algorithms
-// wolfssl library sends this option, RFC 7627 (closes a security weakness, some servers may require it. TODO?):
-//   0017 0000 - extended master secret
-	};
-	struct client_hello *record;
-	uint8_t *ptr;
-	int len;
-	int ext_len;
-	int sni_len = sni ? strnlen(sni, 127 - 5) : 0;
+	if (lstat(CONFIG_TLS_SESSION_CACHE_DIR, &st) != 0
+	 || !S_ISDIR(st.st_mode)
+	 || st.st_uid != geteuid()
+	 || (st.st_mode & 07777) != 0700
+	) {
+		dbg("'%s' is not a private dir", CONFIG_TLS_SESSION_CACHE_DIR);
+		return 0;
+	}
+	return 1;
+}
 
-	ext_len = 0;
-	ext_len += sizeof(extensions);
-	if (sni_len)
-		ext_len += 9 + sni_len;
+static struct tls_session *load_session(const char *file)
+{
+	struct tls_session *s;
+	size_t size = sizeof(*s) + MAX_TICKET_LEN;
+
+	if (!session_dir_is_private())
+		return NULL;
+	s = xmalloc_open_read_close(file, &size);
+	if (!s)
+		return s;
+	if (size < sizeof(*s)
+	 || size != sizeof(*s) + s->ticket_len
+	 || s->ticket_len == 0
+	 || (uint32_t)time(NULL) - s->saved >= s->lifetime
+	) {
+		dbg("session in '%s' is bad or expired", file);
+		free(s);
+		return NULL;
+	}
+	dbg("loaded TLS 1.%u session from '%s'", s->version - 1, file);
+	return s;
+}
 
-	/* +2 is for "len of all extensions" 2-byte field */
-	len = sizeof(*record) + 2 + ext_len;
-	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_CLIENT_HELLO, len);
+static void save_session(tls_state_t *tls, struct tls_session *s, unsigned lifetime,
+		const uint8_t *ticket, unsigned ticket_len)
+{
+	char *tmp;
+	int fd;
 
-	record->proto_maj = TLS_MAJ;	/* the "requested" version of the protocol, */
-	record->proto_min = TLS_MIN;	/* can be higher than one in record headers */
-	tls_get_random(record->rand32, sizeof(record->rand32));
-	if (TLS_DEBUG_FIXED_SECRETS)
-		memset(record->rand32, 0x11, sizeof(record->rand32));
-	/* record->session_id_len = 0; - already is */
+	if (ticket_len == 0 || ticket_len > MAX_TICKET_LEN)
+		return;
+	/* RFC 8446: lifetime is at most 7 days. RFC 5077: 0 means "unspecified" */
+	if (lifetime - 1 >= 7 * 24 * 60 * 60)
+		lifetime = 7 * 24 * 60 * 60;
+	s->saved = time(NULL);
+	s->lifetime = lifetime;
+	s->cipher_id = tls->cipher_id;
+	s->ticket_len = ticket_len;
+
+	mkdir(CONFIG_TLS_SESSION_CACHE_DIR, 0700);
+	if (!session_dir_is_private())
+		return;
+	tmp = xasprintf("%s.%u", tls->session_file, (unsigned)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd >= 0) {
+		int ok = (full_write(fd, s, sizeof(*s)) == sizeof(*s)
+			&& full_write(fd, ticket, ticket_len) == (ssize_t)ticket_len
+		);
+		if (close(fd) == 0 && ok
+		 && rename(tmp, tls->session_file) == 0
+		) {
+			dbg("saved TLS 1.%u session to '%s'", s->version - 1, tls->session_file);
+		} else {
+			unlink(tmp);
+		}
+	}
+	free(tmp);
+}
 
-	BUILD_BUG_ON(sizeof(client_hello_ciphers) != 2 * (1 + 1 + NUM_CIPHERS + 1));
-	memcpy(&record->cipherid_len16_hi, client_hello_ciphers, sizeof(client_hello_ciphers));
+/* RFC 5077 3.3: NewSessionTicket comes just before server's ChangeCipherSpec.
+ * The record is known to be a handshake one, len >= 4.
+ */
+static void tls12_process_session_ticket(tls_state_t *tls, int len)
+{
+	struct tls_session s;
+	uint8_t *p = tls->inbuf + RECHDR_LEN;
+	unsigned ticket_len;
 
-	ptr = (void*)(record + 1);
-	*ptr++ = ext_len >> 8;
-	*ptr++ = ext_len;
-	if (sni_len) {
-		//ptr[0] = 0;             //
+	dbg("<< NEW_SESSION_TICKET");
+	/* 04 len24 lifetime_hint32 ticket_len16 ticket */
+	if (len < 4 + 4 + 2)
+		return;
+	ticket_len = (p[8] << 8) | p[9];
+	if (4 + 4 + 2 + ticket_len > (unsigned)len || !tls->session_file)
+		return;
+	memset(&s, 0, sizeof(s));
+	s.version = 3;
+	memcpy(s.secret, tls->hsd->master_secret, sizeof(tls->hsd->master_secret));
+	save_session(tls, &s, get_unaligned_be32(p + 4), p + 10, ticket_len);
+}
+#endif
+
+#if ENABLE_FEATURE_TLS_1_3
+/*
+ * TLS 1.3 key schedule (RFC 8446 section 7.1).
+ * Only SHA256 cipher suites are supported: all secrets are 32 bytes.
+ */
+static void tls13_transcript_hash(tls_state_t *tls, uint8_t *out32)
+{
+	md5sha_ctx_t ctx = tls->hsd->handshake_hash_ctx; /* struct copy */
+	sha_end(&ctx, out32);
+}
+
+/* HKDF-Expand-Label(Secret, Label, Context, Length), Length <= 32:
+ * HKDF-Expand output is just one HMAC block,
+ * T(1) = HMAC(Secret, HkdfLabel + 0x01)
+ */
+static void hkdf_expand_label(uint8_t *out, unsigned out_size,
+		const uint8_t *secret32, const char *label,
+		const uint8_t *context, unsigned context_size)
+{
+	hmac_ctx_t ctx;
+	uint8_t hdr[3 + 6 + 12 + 1];
+	uint8_t block[SHA256_OUTSIZE];
+	unsigned label_size = 6 + strlen(label);
+
+	/* struct { uint16 length; opaque label<7..255>; opaque context<0..255>; } */
+	hdr[0] = 0;
+	hdr[1] = out_size;
+	hdr[2] = label_size;
+	strcpy(stpcpy((char*)hdr + 3, "tls13 "), label);
+	hdr[3 + label_size] = context_size;
+
+	hmac_begin(&ctx, secret32, SHA256_OUTSIZE, sha256_begin_hmac);
+	hmac_hash(&ctx, hdr, 3 + label_size + 1);
+	if (context_size)
+		hmac_hash(&ctx, context, context_size);
+	hmac_hash(&ctx, "\x01", 1);
+	hmac_end(&ctx, block);
+	memcpy(out, block, out_size);
+}
+
+/* Derive-Secret(Secret, Label, Messages) */
+static void tls13_derive_secret(tls_state_t *tls, uint8_t *out32,
+		const uint8_t *secret32, const char *label)
+{
+	uint8_t hash[SHA256_OUTSIZE];
+
+	tls13_transcript_hash(tls, hash);
+	hkdf_expand_label(out32, SHA256_OUTSIZE, secret32, label, hash, SHA256_OUTSIZE);
+}
+
+static void sha256_of_nothing(uint8_t *out32)
+{
+	sha256_ctx_t ctx;
+
+	sha256_begin(&ctx);
+	sha256_end(&ctx, out32);
+}
+
+/* Early Secret = HKDF-Extract(0, PSK), PSK is all-zero if none */
+static void tls13_early_secret(uint8_t *secret32, const uint8_t *psk32)
+{
+	uint8_t zero32[SHA256_OUTSIZE];
+
+	memset(zero32, 0, sizeof(zero32));
+	hmac_block(zero32, SHA256_OUTSIZE, sha256_begin_hmac,
+			psk32 ? psk32 : zero32, SHA256_OUTSIZE, secret32);
+}
+
+/* Next secret in the chain: early -> handshake -> master:
+ * HKDF-Extract(Derive-Secret(Secret, "derived", ""), IKM)
+ */
+static void tls13_next_secret(uint8_t *secret32, const uint8_t *ikm32)
+{
+	uint8_t salt[SHA256_OUTSIZE];
+
+	sha256_of_nothing(salt); /* Transcript-Hash("") */
+	hkdf_expand_label(salt, SHA256_OUTSIZE, secret32, "derived", salt, SHA256_OUTSIZE);
+	hmac_block(salt, SHA256_OUTSIZE, sha256_begin_hmac, ikm32, SHA256_OUTSIZE, secret32);
+}
+
+/* Sets write (peer == 0) or read (peer != 0) key and IV
+ * from the traffic secret (RFC 8446 section 7.3).
+ * The secret is saved for Finished and KeyUpdate.
+ */
+static void tls13_set_traffic_keys(tls_state_t *tls, const uint8_t *secret32, int peer)
+{
+	uint8_t *secret, *key, *iv;
+
+	if (!peer) {
+		secret = tls->key_block;
+		tls->our_write_key = key = tls->key_block3;
+		tls->our_write_IV = iv = tls->key_block5;
+		tls->write_seq64_be = 0;
+	} else {
+		secret = tls->key_block2;
+		tls->peer_write_key = key = tls->key_block4;
+		tls->peer_write_IV = iv = tls->key_block6;
+		tls->read_seq64_be = 0;
+		/* content type byte + AEAD tag */
+		tls->min_encrypted_len_on_read = 1 + 16;
+	}
+	memcpy(secret, secret32, SHA256_OUTSIZE);
+	hkdf_expand_label(key, tls->key_size, secret, "key", NULL, 0);
+	hkdf_expand_label(iv, 12, secret, "iv", NULL, 0);
+	dump_hex("key:%s", key, tls->key_size);
+	dump_hex("iv:%s", iv, 12);
+
+	if (tls->flags & ENCRYPTION_CHACHA)
+		return;
+	if (!peer) {
+		uint8_t zero[AES_BLOCK_SIZE] ALIGNED_long;
+
+		aes_setkey(&tls->aes_encrypt, key, tls->key_size);
+		memset(zero, 0, AES_BLOCK_SIZE);
+		aes_encrypt_one_block(&tls->aes_encrypt, zero, tls->H);
+	} else {
+		aes_setkey(&tls->aes_decrypt, key, tls->key_size);
+	}
+}
+
+/* Derives handshake traffic keys from ECDHE shared secret */
+static void tls13_derive_handshake_keys(tls_state_t *tls, const uint8_t *premaster32, int server)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	uint8_t c_hs[SHA256_OUTSIZE];
+	uint8_t s_hs[SHA256_OUTSIZE];
+
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	if (hsd->resumed)
+		tls13_early_secret(hsd->tls13_secret, hsd->session->secret);
+	else
+#endif
+		tls13_early_secret(hsd->tls13_secret, NULL);
+	/* Handshake Secret */
+	tls13_next_secret(hsd->tls13_secret, premaster32);
+	tls13_derive_secret(tls, c_hs, hsd->tls13_secret, "c hs traffic");
+	tls13_derive_secret(tls, s_hs, hsd->tls13_secret, "s hs traffic");
+	tls13_set_traffic_keys(tls, server ? s_hs : c_hs, 0);
+	tls13_set_traffic_keys(tls, server ? c_hs : s_hs, 1);
+}
+
+/* Must be called when transcript ends with server's Finished */
+static void tls13_derive_app_secrets(tls_state_t *tls, uint8_t *c_ap32, uint8_t *s_ap32)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	uint8_t zero32[SHA256_OUTSIZE];
+
+	/* Master Secret */
+	memset(zero32, 0, sizeof(zero32));
+	tls13_next_secret(hsd->tls13_secret, zero32);
+	tls13_derive_secret(tls, c_ap32, hsd->tls13_secret, "c ap traffic");
+	tls13_derive_secret(tls, s_ap32, hsd->tls13_secret, "s ap traffic");
+}
+
+/* verify_data = HMAC(finished_key, Transcript-Hash) */
+static void tls13_verify_data(uint8_t *out32, const uint8_t *secret32, const uint8_t *hash32)
+{
+	uint8_t key[SHA256_OUTSIZE];
+
+	hkdf_expand_label(key, SHA256_OUTSIZE, secret32, "finished", NULL, 0);
+	hmac_block(key, SHA256_OUTSIZE, sha256_begin_hmac, hash32, SHA256_OUTSIZE, out32);
+}
+
+static void tls13_finished_mac(tls_state_t *tls, uint8_t *out32, const uint8_t *secret32)
+{
+	uint8_t hash[SHA256_OUTSIZE];
+
+	tls13_transcript_hash(tls, hash);
+	tls13_verify_data(out32, secret32, hash);
+}
+
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+/* PSK binder (RFC 8446 4.2.11.2): same as verify_data, but with
+ * binder_key = Derive-Secret(Early Secret, "res binder", ""), and
+ * the transcript includes ClientHello up to (not including) the binders
+ */
+static void tls13_psk_binder(const uint8_t *psk32, const md5sha_ctx_t *transcript,
+		const void *hello, unsigned len, uint8_t *out32)
+{
+	md5sha_ctx_t ctx = *transcript; /* struct copy */
+	uint8_t secret[SHA256_OUTSIZE];
+	uint8_t hash[SHA256_OUTSIZE];
+
+	tls13_early_secret(secret, psk32);
+	sha256_of_nothing(hash);
+	hkdf_expand_label(secret, SHA256_OUTSIZE, secret, "res binder", hash, SHA256_OUTSIZE);
+	md5sha_hash(&ctx, hello, len);
+	sha_end(&ctx, hash);
+	tls13_verify_data(out32, secret, hash);
+}
+
+static void tls13_process_session_ticket(tls_state_t *tls, const uint8_t *p, unsigned len)
+{
+	struct tls_session s;
+	unsigned lifetime, nonce_len, ticket_len;
+
+	dbg("<< NEW_SESSION_TICKET");
+	/* 04 len24 lifetime32 age_add32 nonce_len8 nonce ticket_len16 ticket extensions */
+	if (!tls->session_file || len < 4 + 4 + 4 + 1)
+		return;
+	nonce_len = p[12];
+	if (4 + 4 + 4 + 1 + nonce_len + 2 > len)
+		return;
+	ticket_len = (p[13 + nonce_len] << 8) | p[14 + nonce_len];
+	if (15 + nonce_len + ticket_len > len)
+		return;
+	lifetime = get_unaligned_be32(p + 4);
+	if (lifetime == 0) /* do not use */
+		return;
+	memset(&s, 0, sizeof(s));
+	s.version = 4;
+	s.age_add = get_unaligned_be32(p + 8);
+	/* PSK = HKDF-Expand-Label(resumption_master_secret, "resumption", ticket_nonce) */
+	hkdf_expand_label(s.secret, SHA256_OUTSIZE, tls->resumption_secret, "resumption", p + 13, nonce_len);
+	save_session(tls, &s, lifetime, p + 15 + nonce_len, ticket_len);
+}
+#endif
+
+/* Handshake messages can be coalesced into one record, or split
+ * between several records. Returns length of the next message,
+ * it is in hsd->hs_buf. It is not hashed yet: Finished needs
+ * the hash of the transcript up to, but not including it.
+ */
+static int tls13_xread_handshake_msg(tls_state_t *tls, const char *expected)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	unsigned len;
+
+	/* Drop previous message */
+	hsd->hs_buf_len -= hsd->hs_msg_len;
+	if (hsd->hs_buf_len)
+		memmove(hsd->hs_buf, hsd->hs_buf + hsd->hs_msg_len, hsd->hs_buf_len);
+
+	for (;;) {
+		int sz;
+
+		if (hsd->hs_buf_len >= 4) {
+			len = 4 + get24be(hsd->hs_buf + 1);
+			if (len <= hsd->hs_buf_len)
+				break;
+			if (len > 0x10000)
+				bb_error_msg_and_die("TLS %s is too long", expected);
+		}
+		sz = tls_xread_record(tls, expected);
+		if (sz <= 0 || tls->inbuf[0] != RECORD_TYPE_HANDSHAKE)
+			bad_record_die(tls, expected, sz);
+		hsd->hs_buf = xrealloc(hsd->hs_buf, hsd->hs_buf_len + sz);
+		memcpy(hsd->hs_buf + hsd->hs_buf_len, tls->inbuf + RECHDR_LEN, sz);
+		hsd->hs_buf_len += sz;
+	}
+	hsd->hs_msg_len = len;
+	dbg("<< handshake message type:%u len:%u", hsd->hs_buf[0], len);
+	return len;
+}
+
+static void tls13_hash_msg(tls_state_t *tls)
+{
+	hash_handshake(tls, "<< hash:%s", tls->hsd->hs_buf, tls->hsd->hs_msg_len);
+}
+
+static void tls13_bad_msg_die(tls_state_t *tls, const char *expected)
+{
+	bb_error_msg_and_die("unexpected TLS handshake message %u, expected %s",
+			tls->hsd->hs_buf[0], expected);
+}
+
+static void tls13_xwrite_handshake_msg(tls_state_t *tls, unsigned size)
+{
+	hash_handshake(tls, ">> hash:%s", tls->outbuf + OUTBUF_PFX, size);
+	xwrite_encrypted(tls, size, RECORD_TYPE_HANDSHAKE);
+}
+
+static void tls13_send_finished(tls_state_t *tls)
+{
+	struct finished {
+		uint8_t type;
+		uint8_t len24_hi, len24_mid, len24_lo;
+		uint8_t verify_data[SHA256_OUTSIZE];
+	};
+	struct finished *record;
+
+	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_FINISHED, sizeof(*record));
+	/* our handshake traffic secret is in key_block */
+	tls13_finished_mac(tls, record->verify_data, tls->key_block);
+	dbg(">> FINISHED");
+	tls13_xwrite_handshake_msg(tls, sizeof(*record));
+}
+
+static void tls13_get_finished(tls_state_t *tls, const char *expected)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	uint8_t verify_data[SHA256_OUTSIZE];
+
+	if (hsd->hs_buf[0] != HANDSHAKE_FINISHED
+	 || hsd->hs_msg_len != 4 + SHA256_OUTSIZE
+	) {
+		tls13_bad_msg_die(tls, expected);
+	}
+	/* peer's handshake traffic secret is in key_block2 */
+	tls13_finished_mac(tls, verify_data, tls->key_block2);
+	if (memcmp(verify_data, hsd->hs_buf + 4, SHA256_OUTSIZE) != 0)
+		bb_simple_error_msg_and_die("TLS handshake: bad Finished");
+	dbg("<< FINISHED");
+	tls13_hash_msg(tls);
+}
+
+static void tls13_update_traffic_keys(tls_state_t *tls, int peer)
+{
+	uint8_t secret[SHA256_OUTSIZE];
+
+	hkdf_expand_label(secret, SHA256_OUTSIZE,
+			peer ? tls->key_block2 : tls->key_block, "traffic upd",
+			NULL, 0);
+	tls13_set_traffic_keys(tls, secret, peer);
+}
+
+/* RFC 8446 4.6: NewSessionTicket and KeyUpdate can come
+ * after the handshake.
+ */
+static void tls13_post_handshake_msg(tls_state_t *tls, int len)
+{
+	uint8_t *p = tls->inbuf + RECHDR_LEN;
+
+	while (len >= 4) {
+		int msg_len = 4 + get24be(p + 1);
+
+		if (msg_len > len) /* continued in next record? */
+			break; /* KeyUpdate is never split, ignore */
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+		if (p[0] == HANDSHAKE_NEW_SESSION_TICKET)
+			tls13_process_session_ticket(tls, p, msg_len);
+#endif
+		if (p[0] == HANDSHAKE_KEY_UPDATE && msg_len == 5) {
+			int update_requested = p[4];
+
+			dbg("<< KEY_UPDATE request:%u", update_requested);
+			tls13_update_traffic_keys(tls, /*peer:*/ 1);
+			if (update_requested) {
+				get_outbuf_fill_handshake_record(tls, HANDSHAKE_KEY_UPDATE, 5);
+				/* update_not_requested (0) */
+				dbg(">> KEY_UPDATE");
+				xwrite_encrypted(tls, 5, RECORD_TYPE_HANDSHAKE);
+				tls13_update_traffic_keys(tls, /*peer:*/ 0);
+			}
+		}
+		p += msg_len;
+		len -= msg_len;
+	}
+}
+#endif
+
+static void send_client_hello(tls_state_t *tls, const char *sni)
+{
+	struct client_hello {
+		uint8_t type;
+		uint8_t len24_hi, len24_mid, len24_lo;
+		uint8_t proto_maj, proto_min;
+		uint8_t rand32[32];
+		uint8_t session_id_len;
+#if ENABLE_FEATURE_TLS_1_3
+		uint8_t session_id[32];
+#endif
+		uint8_t cipherid_len16_hi, cipherid_len16_lo;
+		uint8_t cipherid[2 * (1 + NUM_CIPHERS)]; /* actually variable */
+		uint8_t comprtypes_len;
+		uint8_t comprtypes[1]; /* actually variable */
+	};
+	// https://www.iana.org/assignments/tls-extensiontype-values/tls-extensiontype-values.xhtml
+	static const uint8_t extensions[] = {
+		// is.gd responds with "handshake failure" to our hello if there's no supported_groups
+		0x00,0x0a, //extension_type: "supported_groups"
+			0x00,2 * (1 + ALLOW_CURVE_P256 + ALLOW_CURVE_X25519), //ext len
+			0x00,2 * (0 + ALLOW_CURVE_P256 + ALLOW_CURVE_X25519), //list len
+#if ALLOW_CURVE_P256
+			0x00,0x17, //curve_secp256r1 (aka P256, aka prime256v1)
+#endif
+			//0x00,0x18, //curve_secp384r1
+			//0x00,0x19, //curve_secp521r1
+#if ALLOW_CURVE_X25519
+			0x00,0x1d, //curve_x25519 (RFC 7748)
+#endif
+			//0x00,0x1e, //curve_x448 (RFC 7748)
+
+		//0x00,0x0b,0x00,0x04,0x03,0x00,0x01,0x02, //extension_type: "ec_point_formats"
+		//0x00,0x16,0x00,0x00, //extension_type: "encrpypt-then-mac"
+		//0x00,0x17,0x00,0x00, //extension_type: "extended_master"
+		//0x00,0x23,0x00,0x00, //extension_type: "session_ticket"
+
+		// kojipkgs.fedoraproject.org responds with alert code 80 ("internal error")
+		// to our hello without signature_algorithms.
+		// It is satisfied with just 0x04,0x01.
+		0x00,0x0d, //extension_type: "signature_algorithms" (RFC5246 section 7.4.1.4.1):
+#define SIGALGS (3 + 3 * ENABLE_FEATURE_TLS_SHA1 + 2 * ENABLE_FEATURE_TLS_1_3)
+			0x00,2 * (1 + SIGALGS), //ext len
+			0x00,2 * (0 + SIGALGS), //list len
+			//Format: two bytes
+			// byte 1: 0:none,1:md5,2:sha1,3:sha224,4:sha256,5:sha384,6:sha512
+			// byte 2: 1:rsa,2:dsa,3:ecdsa
+			// (note that TLS 1.3 changes this, see RFC8446 section 4.2.3)
+#if ENABLE_FEATURE_TLS_SHA1
+			0x02,0x01, //sha1 + rsa
+			0x02,0x02, //sha1 + dsa
+			0x02,0x03, //sha1 + ecdsa
+#endif
+			0x04,0x01, //sha256 + rsa - kojipkgs.fedoraproject.org wants this
+			0x04,0x02, //sha256 + dsa
+			0x04,0x03, //sha256 + ecdsa
+#if ENABLE_FEATURE_TLS_1_3
+			0x08,0x04, //rsa_pss_rsae_sha256: TLS 1.3 servers sign with it
+			0x05,0x03, //ecdsa_secp384r1_sha384
+#endif
+// GNU Wget 1.18 to cdn.kernel.org sends these extensions:
+// 0055
+//   0005 0005 0100000000 - status_request
+//   0000 0013 0011 00 000e 63646e 2e 6b65726e656c 2e 6f7267 - server_name
+//   ff01 0001 00 - renegotiation_info
+//   0023 0000 - session_ticket
+//   000a 0008 0006001700180019 - supported_groups
+//   000b 0002 0100 - ec_point_formats
+//   000d 0016 0014 0401 0403 0501 0503 0601 0603 0301 0303 0201 0203 - signature_algorithms
+// wolfssl library sends this option, RFC 7627 (closes a security weakness, some servers may require it. TODO?):
+//   0017 0000 - extended master secret
+	};
+#if ENABLE_FEATURE_TLS_1_3
+	static const uint8_t tls13_extensions[] = {
+		0x00,0x2b, //extension_type: "supported_versions"
+			0x00,0x05, //ext len
+			0x04, //list len
+			0x03,0x04, //TLS 1.3
+			0x03,0x03, //TLS 1.2
+		0x00,0x33, //extension_type: "key_share", len and one share follow
+	};
+	struct tls_handshake_data *hsd = tls->hsd;
+	/* After HelloRetryRequest, send P256 key share instead of x25519 */
+	int key_len = hsd->hello_retry ? 1 + 2 * 32 : 32;
+#endif
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	struct tls_session *session = hsd->session;
+	int ticket12_len = (session && session->version == 3) ? session->ticket_len : 0;
+	int ticket13_len = (session && session->version == 4) ? session->ticket_len : 0;
+#endif
+	struct client_hello *record;
+	uint8_t *ptr;
+	int len;
+	int ext_len;
+	int sni_len = sni ? strnlen(sni, 127 - 5) : 0;
+
+	ext_len = 0;
+	ext_len += sizeof(extensions);
+	if (sni_len)
+		ext_len += 9 + sni_len;
+#if ENABLE_FEATURE_TLS_1_3
+	ext_len += sizeof(tls13_extensions) + 8 + key_len;
+#endif
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	ext_len += 4 + ticket12_len + 6;
+	if (ticket13_len)
+		ext_len += 4 + 2 + 2 + ticket13_len + 4 + 2 + 1 + 32;
+#endif
+
+	/* +2 is for "len of all extensions" 2-byte field */
+	len = sizeof(*record) + 2 + ext_len;
+	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_CLIENT_HELLO, len);
+
+	record->proto_maj = TLS_MAJ;	/* the "requested" version of the protocol, */
+	record->proto_min = TLS_MIN;	/* can be higher than one in record headers */
+	memcpy(record->rand32, tls->hsd->client_and_server_rand32, sizeof(record->rand32));
+#if ENABLE_FEATURE_TLS_1_3
+	record->session_id_len = sizeof(record->session_id);
+	memcpy(record->session_id, hsd->session_id, sizeof(record->session_id));
+#else
+	/* record->session_id_len = 0; - already is */
+#endif
+
+	BUILD_BUG_ON(sizeof(client_hello_ciphers) != 2 * (1 + 1 + NUM_CIPHERS + 1));
+	memcpy(&record->cipherid_len16_hi, client_hello_ciphers, sizeof(client_hello_ciphers));
+	if ((NUM_TLS13_CIPHERS || NUM_CHACHA_CIPHERS) && aes_have_NI()) {
+		/* AES-GCM is faster than ChaCha20 here: offer ChaCha20 last */
+		enum { NUM_TLS12_CIPHERS = NUM_CIPHERS - NUM_TLS13_CIPHERS };
+		const uint8_t *c = supported_ciphers + 2 * NUM_TLS13_CIPHERS;
+		uint8_t *p = record->cipherid + 2; /* skip SCSV */
+		if (NUM_TLS13_CIPHERS) {
+			p[1] = 0x01; /* TLS_AES_128_GCM_SHA256 */
+			p[3] = 0x03; /* TLS_CHACHA20_POLY1305_SHA256 */
+			p += 2 * NUM_TLS13_CIPHERS;
+		}
+		memcpy(p, c + 2 * NUM_CHACHA_CIPHERS, 2 * (NUM_TLS12_CIPHERS - NUM_CHACHA_CIPHERS));
+		memcpy(p + 2 * (NUM_TLS12_CIPHERS - NUM_CHACHA_CIPHERS), c, 2 * NUM_CHACHA_CIPHERS);
+	}
+
+	ptr = (void*)(record + 1);
+	*ptr++ = ext_len >> 8;
+	*ptr++ = ext_len;
+	if (sni_len) {
+		//ptr[0] = 0;             //
 		//ptr[1] = 0;             //extension_type
 		//ptr[2] = 0;         //
 		ptr[3] = sni_len + 5; //list len
@@ -1655,20 +2484,63 @@ static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
 		ptr[8] = sni_len;         //name len
 		ptr = mempcpy(&ptr[9], sni, sni_len);
 	}
-	memcpy(ptr, extensions, sizeof(extensions));
+	ptr = mempcpy(ptr, extensions, sizeof(extensions));
+#if ENABLE_FEATURE_TLS_1_3
+	ptr = mempcpy(ptr, tls13_extensions, sizeof(tls13_extensions));
+	//ptr[0] = 0;
+	ptr[1] = key_len + 6;     //ext len
+	//ptr[2] = 0;
+	ptr[3] = key_len + 4;     //list len
+	//ptr[4] = 0;
+	ptr[5] = hsd->hello_retry ? 0x17 : 0x1d; //group
+	//ptr[6] = 0;
+	ptr[7] = key_len;
+	ptr += 8;
+	if (!hsd->hello_retry) {
+		curve_x25519_generate_keypair(hsd->ecc_priv_key32, ptr);
+	} else {
+		*ptr = 4; /* uncompressed point */
+		curve_P256_generate_keypair(hsd->ecc_priv_key32, ptr + 1);
+	}
+#endif
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	ptr += key_len;
+	/* "session_ticket": empty, or TLS 1.2 ticket */
+	//ptr[0] = 0;
+	ptr[1] = 0x23;
+	ptr[2] = ticket12_len >> 8;
+	ptr[3] = ticket12_len;
+	ptr = mempcpy(ptr + 4, session + 1, ticket12_len);
+	/* "psk_key_exchange_modes": psk_dhe_ke */
+	ptr = mempcpy(ptr, "\x00\x2d\x00\x02\x01\x01", 6);
+	if (ticket13_len) {
+		/* "pre_shared_key", must be the last extension */
+		int identities_len = 2 + ticket13_len + 4;
+		uint32_t age = ((uint32_t)time(NULL) - session->saved) * 1000 + session->age_add;
+
+		//ptr[0] = 0;
+		ptr[1] = 0x29;
+		ptr[2] = (2 + identities_len + 2 + 1 + 32) >> 8;
+		ptr[3] = (2 + identities_len + 2 + 1 + 32);
+		ptr[4] = identities_len >> 8;
+		ptr[5] = identities_len;
+		ptr[6] = ticket13_len >> 8;
+		ptr[7] = ticket13_len;
+		ptr = mempcpy(ptr + 8, session + 1, ticket13_len);
+		put_unaligned_be32(age, ptr); /* obfuscated_ticket_age */
+		//ptr[4] = 0;
+		ptr[5] = 1 + 32; /* binders len */
+		ptr[6] = 32;
+		ptr += 7;
+		tls13_psk_binder(session->secret, &tls->hsd->handshake_hash_ctx,
+				record, ptr - 3 - (uint8_t*)record, ptr);
+	}
+#endif
 
-	tls->hsd = xzalloc(sizeof(*tls->hsd));
-	/* HANDSHAKE HASH: ^^^ + len if need to save saved_client_hello */
-	memcpy(tls->hsd->client_and_server_rand32, record->rand32, sizeof(record->rand32));
-/* HANDSHAKE HASH:
-	tls->hsd->saved_client_hello_size = len;
-	memcpy(tls->hsd->saved_client_hello, record, len);
- */
 	dbg(">> CLIENT_HELLO");
 	/* Can hash immediately only if we know which MAC hash to use.
 	 * So far we do know: it's sha256:
 	 */
-	sha256_begin(&tls->hsd->handshake_hash_ctx);
 	xwrite_and_update_handshake_hash(tls, len);
 	/* if this would become infeasible: save tls->hsd->saved_client_hello,
 	 * use "xwrite_handshake_record(tls, len)" here,
@@ -1676,6 +2548,137 @@ static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
 	 */
 }
 
+static void send_client_hello_and_alloc_hsd(tls_state_t *tls, const char *sni)
+{
+	tls->hsd = xzalloc(sizeof(*tls->hsd));
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	if (tls->session_file)
+		tls->hsd->session = load_session(tls->session_file);
+#endif
+	tls_get_random(tls->hsd->client_and_server_rand32, 32);
+	if (TLS_DEBUG_FIXED_SECRETS)
+		memset(tls->hsd->client_and_server_rand32, 0x11, 32);
+#if ENABLE_FEATURE_TLS_1_3
+	/* RFC 8446 D.4: non-empty session id makes TLS 1.3 handshake
+	 * look like TLS 1.2 session resumption to middleboxes */
+	tls_get_random(tls->hsd->session_id, sizeof(tls->hsd->session_id));
+#endif
+	sha256_begin(&tls->hsd->handshake_hash_ctx);
+	send_client_hello(tls, sni);
+#if ENABLE_FEATURE_TLS_1_3
+	/* Needed if server responds with HelloRetryRequest */
+	tls13_transcript_hash(tls, tls->hsd->tls13_secret);
+#endif
+}
+
+
+#if ENABLE_FEATURE_TLS_1_3
+/* TLS 1.3 ServerHello has "supported_versions" extension with 0x0304
+ * and server's key share. HelloRetryRequest is a ServerHello
+ * with special random, server asks for a key share for another group.
+ */
+static void tls13_process_server_hello(tls_state_t *tls, const uint8_t *hello, const uint8_t *ext)
+{
+	static const uint8_t hello_retry_rand32[32] ALIGN1 = {
+		/* SHA-256("HelloRetryRequest") */
+		0xcf,0x21,0xad,0x74,0xe5,0x9a,0x61,0x11,0xbe,0x1d,0x8c,0x02,0x1e,0x65,0xb8,0x91,
+		0xc2,0xa2,0x11,0x16,0x7a,0xbb,0x8c,0x5e,0x07,0x9e,0x09,0xe2,0xc8,0xa8,0x33,0x9c,
+	};
+	struct tls_handshake_data *hsd = tls->hsd;
+	const uint8_t *rand32 = hello + 6;
+	const uint8_t *end = hello + 4 + hello[3];
+	const uint8_t *key = NULL;
+	unsigned version = 0;
+	unsigned group = 0;
+	unsigned key_len = 0;
+
+	if (end - ext >= 2) {
+		ext += 2; /* skip length of all extensions */
+		while (end - ext >= 4) {
+			unsigned type = (ext[0] << 8) | ext[1];
+			unsigned len = (ext[2] << 8) | ext[3];
+
+			ext += 4;
+			if (len > end - ext)
+				break;
+			if (type == 0x002b && len == 2) /* supported_versions */
+				version = (ext[0] << 8) | ext[1];
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+			/* pre_shared_key: server selected our (only) PSK */
+			if (type == 0x0029 && len == 2 && (ext[0] | ext[1]) == 0
+			 && hsd->session && hsd->session->version == 4
+			) {
+				dbg("server accepted PSK");
+				hsd->resumed = 1;
+			}
+#endif
+			if (type == 0x0033 && len >= 2) { /* key_share */
+				group = (ext[0] << 8) | ext[1];
+				if (len >= 4) {
+					key_len = (ext[2] << 8) | ext[3];
+					key = ext + 4;
+					if (key_len != len - 4)
+						key = NULL;
+				}
+			}
+			ext += len;
+		}
+	}
+
+	if (version != 0x0304) {
+		/* RFC 8446 4.1.3: TLS 1.3 server negotiating TLS 1.2
+		 * puts this into the last 8 bytes of its random.
+		 * If we see it, something between us forced TLS 1.2.
+		 */
+		if (memcmp(rand32 + 24, "DOWNGRD\x01", 8) == 0)
+			bb_simple_error_msg_and_die("TLS downgrade attack detected");
+		if ((tls->cipher_id >> 8) == 0x13)
+			goto bad;
+		return;
+	}
+	if ((tls->cipher_id >> 8) != 0x13
+	 || hello[38] != sizeof(hsd->session_id)
+	 || memcmp(hello + 39, hsd->session_id, sizeof(hsd->session_id)) != 0
+	) {
+		goto bad;
+	}
+
+	if (memcmp(rand32, hello_retry_rand32, 32) == 0) {
+		uint8_t message_hash[4 + SHA256_OUTSIZE];
+
+		/* Our only other group is P256 */
+		if (hsd->hello_retry || group != 0x0017 || key)
+			bb_simple_error_msg_and_die("TLS: bad HelloRetryRequest");
+		dbg("<< HELLO_RETRY_REQUEST");
+		hsd->hello_retry = 1;
+		/* RFC 8446 4.4.1: ClientHello1 in the transcript is replaced
+		 * by synthetic message_hash message with its hash */
+		message_hash[0] = HANDSHAKE_MESSAGE_HASH;
+		message_hash[1] = 0;
+		message_hash[2] = 0;
+		message_hash[3] = SHA256_OUTSIZE;
+		memcpy(message_hash + 4, hsd->tls13_secret, SHA256_OUTSIZE);
+		sha256_begin(&hsd->handshake_hash_ctx);
+		hash_handshake(tls, ">> hash:%s", message_hash, sizeof(message_hash));
+		hash_handshake(tls, "<< hash:%s", hello, end - hello);
+		return;
+	}
+
+	if (key && !hsd->hello_retry && group == 0x001d && key_len == 32) {
+		tls->flags |= USE_EC_CURVE_X25519;
+		memcpy(hsd->ecc_pub_key32, key, 32);
+	} else
+	if (key && hsd->hello_retry && group == 0x0017 && key_len == 65 && key[0] == 4) {
+		tls->flags &= ~USE_EC_CURVE_X25519;
+		memcpy(hsd->ecc_pub_key32, key + 1, 2 * 32);
+	} else {
+ bad:
+		bad_record_die(tls, "'server hello'", 4 + hello[3]);
+	}
+	tls->flags |= TLS13;
+}
+#endif
+
 static void get_server_hello(tls_state_t *tls)
 {
 	struct server_hello {
@@ -1734,6 +2737,25 @@ static void get_server_hello(tls_state_t *tls)
 	set_cipher_parameters(tls, cipherid);
 	dbg("server chose cipher %04x", tls->cipher_id);
 	dbg("key_size:%u MAC_size:%u IV_size:%u", tls->key_size, tls->MAC_size, tls->IV_size);
+#if ENABLE_FEATURE_TLS_1_3
+	if (4 + hp->len24_lo > len)
+		bad_record_die(tls, "'server hello'", len);
+	tls13_process_server_hello(tls, &hp->type, cipherid + 3);
+#endif
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	/* RFC 5077 3.4: server accepted the ticket if it echoes our session id */
+	if (!(tls->flags & TLS13) && !tls->hsd->hello_retry
+	 && tls->hsd->session && tls->hsd->session->version == 3
+	 && hp->session_id_len == 32
+	 && memcmp(hp->session_id, tls->hsd->session_id, 32) == 0
+	) {
+		if (tls->cipher_id != tls->hsd->session->cipher_id)
+			bad_record_die(tls, "'server hello'", len);
+		dbg("server accepted session ticket");
+		tls->hsd->resumed = 1;
+		memcpy(tls->hsd->master_secret, tls->hsd->session->secret, sizeof(tls->hsd->master_secret));
+	}
+#endif
 
 	/* Handshake hash eventually destined to FINISHED record
 	 * is sha256 regardless of cipher
@@ -1891,12 +2913,13 @@ static void derive_master_secret_and_keys(tls_state_t *tls, uint8_t *premaster,
 	//                          [0..47];
 	// The master secret is always exactly 48 bytes in length.  The length
 	// of the premaster secret will vary depending on key exchange method.
-	prf_hmac_sha256(/*tls,*/
-		tls->hsd->master_secret, sizeof(tls->hsd->master_secret),
-		premaster, premaster_size,
-		"master secret",
-		tls->hsd->client_and_server_rand32, sizeof(tls->hsd->client_and_server_rand32)
-	);
+	if (premaster) /* else: resumed session, master secret is known */
+		prf_hmac_sha256(/*tls,*/
+			tls->hsd->master_secret, sizeof(tls->hsd->master_secret),
+			premaster, premaster_size,
+			"master secret",
+			tls->hsd->client_and_server_rand32, sizeof(tls->hsd->client_and_server_rand32)
+		);
 	dump_hex("master secret:%s", tls->hsd->master_secret, sizeof(tls->hsd->master_secret));
 
 	// RFC 5246
@@ -1948,6 +2971,9 @@ static void derive_master_secret_and_keys(tls_state_t *tls, uint8_t *premaster,
 static void initialize_aes_keys(tls_state_t *tls)
 {
 	uint8_t iv[AES_BLOCK_SIZE];
+
+	if (tls->flags & ENCRYPTION_CHACHA)
+		return; /* ChaCha20 uses raw keys */
 	aes_setkey(&tls->aes_decrypt, tls->peer_write_key, tls->key_size);
 	aes_setkey(&tls->aes_encrypt, tls->our_write_key, tls->key_size);
 	if (1) { //if AESGCM
@@ -1956,6 +2982,27 @@ static void initialize_aes_keys(tls_state_t *tls)
 	}
 }
 
+/* With premaster == NULL, hsd->master_secret is from resumed session */
+static void set_client_keys(tls_state_t *tls, uint8_t *premaster, int premaster_size)
+{
+	derive_master_secret_and_keys(tls, premaster, premaster_size);
+	// The key_block is partitioned as follows:
+	tls->our_write_MAC_key  = tls->key_block;                          // client_write_MAC_key[]
+	tls->peer_write_MAC_key = tls->key_block          + tls->MAC_size; // server_write_MAC_key[]
+	tls->our_write_key      = tls->peer_write_MAC_key + tls->MAC_size; // client_write_key[]
+	tls->peer_write_key     = tls->our_write_key      + tls->key_size; // server_write_key[]
+	tls->our_write_IV       = tls->peer_write_key     + tls->key_size; // client_write_IV[]
+	tls->peer_write_IV      = tls->our_write_IV       + tls->IV_size;  // server_write_IV[]
+	dump_hex("client write_MAC_key:%s", tls->our_write_MAC_key, tls->MAC_size);
+	dump_hex("client write_key:%s",	tls->our_write_key, tls->key_size);
+	dump_hex("client write_IV:%s", tls->our_write_IV, tls->IV_size);
+	dump_hex("server write_MAC_key:%s", tls->peer_write_MAC_key, tls->MAC_size);
+	dump_hex("server write_key:%s",	tls->peer_write_key, tls->key_size);
+	dump_hex("server write_IV:%s", tls->peer_write_IV, tls->IV_size);
+
+	initialize_aes_keys(tls);
+}
+
 static void send_client_key_exchange(tls_state_t *tls)
 {
 	struct client_key_exchange {
@@ -2037,22 +3084,7 @@ static void send_client_key_exchange(tls_state_t *tls)
 	dbg(">> CLIENT_KEY_EXCHANGE");
 	xwrite_and_update_handshake_hash(tls, len);
 
-	derive_master_secret_and_keys(tls, premaster, premaster_size);
-	// The key_block is partitioned as follows:
-	tls->our_write_MAC_key  = tls->key_block;                          // client_write_MAC_key[]
-	tls->peer_write_MAC_key = tls->key_block          + tls->MAC_size; // server_write_MAC_key[]
-	tls->our_write_key      = tls->peer_write_MAC_key + tls->MAC_size; // client_write_key[]
-	tls->peer_write_key     = tls->our_write_key      + tls->key_size; // server_write_key[]
-	tls->our_write_IV       = tls->peer_write_key     + tls->key_size; // client_write_IV[]
-	tls->peer_write_IV      = tls->our_write_IV       + tls->IV_size;  // server_write_IV[]
-	dump_hex("client write_MAC_key:%s", tls->our_write_MAC_key, tls->MAC_size);
-	dump_hex("client write_key:%s",	tls->our_write_key, tls->key_size);
-	dump_hex("client write_IV:%s", tls->our_write_IV, tls->IV_size);
-	dump_hex("server write_MAC_key:%s", tls->peer_write_MAC_key, tls->MAC_size);
-	dump_hex("server write_key:%s",	tls->peer_write_key, tls->key_size);
-	dump_hex("server write_IV:%s", tls->peer_write_IV, tls->IV_size);
-
-	initialize_aes_keys(tls);
+	set_client_keys(tls, premaster, premaster_size);
 }
 
 static const uint8_t rec_CHANGE_CIPHER_SPEC[] ALIGN1 = {
@@ -2140,6 +3172,15 @@ static void get_change_cipher_spec(tls_state_t *tls)
 
 	/* Get CHANGE_CIPHER_SPEC */
 	len = tls_xread_record(tls, "switch to encrypted traffic");
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	if (len >= 4
+	 && tls->inbuf[0] == RECORD_TYPE_HANDSHAKE
+	 && tls->inbuf[RECHDR_LEN] == HANDSHAKE_NEW_SESSION_TICKET
+	) {
+		tls12_process_session_ticket(tls, len);
+		len = tls_xread_record(tls, "switch to encrypted traffic");
+	}
+#endif
 	if (len != 1 || memcmp(tls->inbuf, rec_CHANGE_CIPHER_SPEC, 6) != 0)
 		bad_record_die(tls, "switch to encrypted traffic", len);
 	dbg("<< CHANGE_CIPHER_SPEC");
@@ -2150,6 +3191,9 @@ static void get_change_cipher_spec(tls_state_t *tls)
 	) {
 		tls->min_encrypted_len_on_read = tls->MAC_size;
 	} else
+	if (tls->flags & ENCRYPTION_CHACHA) {
+		tls->min_encrypted_len_on_read = 16; /* Poly1305 tag */
+	} else
 	if (!(tls->flags & ENCRYPTION_AESGCM)) {
 		unsigned mac_blocks = (unsigned)(TLS_MAC_SIZE(tls) + AES_BLOCK_SIZE-1) / AES_BLOCK_SIZE;
 		/* all incoming packets now should be encrypted and have
@@ -2178,6 +3222,81 @@ static void get_finished(tls_state_t *tls, const char *expected)
 	 */
 }
 
+#if ENABLE_FEATURE_TLS_1_3
+static void tls13_handshake(tls_state_t *tls)
+{
+	// Client              RFC 8446                Server
+	// ClientHello+key_share ----->
+	//                                  ServerHello+key_share
+	//                                  {EncryptedExtensions}
+	//                                  {CertificateRequest*}
+	//                                         {Certificate}
+	//                                   {CertificateVerify}
+	//                      <-----              {Finished}
+	// {Certificate*}
+	// {Finished}           ----->
+	// [Application Data]   <---->      [Application Data]
+	struct tls_handshake_data *hsd = tls->hsd;
+	uint8_t premaster[32];
+	uint8_t c_ap[SHA256_OUTSIZE];
+	uint8_t s_ap[SHA256_OUTSIZE];
+	int got_cert_req;
+
+	if (tls->flags & USE_EC_CURVE_X25519)
+		curve_x25519_compute_premaster(hsd->ecc_priv_key32, hsd->ecc_pub_key32, premaster);
+	else
+		curve_P256_compute_premaster(hsd->ecc_priv_key32, hsd->ecc_pub_key32, premaster);
+	tls13_derive_handshake_keys(tls, premaster, /*server:*/ 0);
+
+	/* from now on everything is encrypted */
+
+	tls13_xread_handshake_msg(tls, "encrypted extensions");
+	if (hsd->hs_buf[0] != HANDSHAKE_ENCRYPTED_EXTENSIONS)
+		tls13_bad_msg_die(tls, "encrypted extensions");
+	dbg("<< ENCRYPTED_EXTENSIONS");
+	tls13_hash_msg(tls);
+
+	got_cert_req = 0;
+	for (;;) {
+		tls13_xread_handshake_msg(tls, "'server finished'");
+		if (hsd->hs_buf[0] == HANDSHAKE_FINISHED)
+			break;
+		if (hsd->hs_buf[0] == HANDSHAKE_CERTIFICATE_REQUEST) {
+			dbg("<< CERTIFICATE_REQUEST");
+			got_cert_req = 1;
+		} else
+		/* As with TLS 1.2, server's certificate is not checked:
+		 * we do not verify cert chains, thus verifying
+		 * the signature wouldn't add any security.
+		 */
+		if (hsd->hs_buf[0] != HANDSHAKE_CERTIFICATE
+		 && hsd->hs_buf[0] != HANDSHAKE_CERTIFICATE_VERIFY
+		) {
+			tls13_bad_msg_die(tls, "'server finished'");
+		}
+		tls13_hash_msg(tls);
+	}
+	tls13_get_finished(tls, "'server finished'");
+	tls13_derive_app_secrets(tls, c_ap, s_ap);
+
+	send_change_cipher_spec(tls);
+	if (got_cert_req) {
+		/* Empty certificate_list, no request context */
+		get_outbuf_fill_handshake_record(tls, HANDSHAKE_CERTIFICATE, 4 + 4);
+		dbg(">> CERTIFICATE");
+		tls13_xwrite_handshake_msg(tls, 4 + 4);
+	}
+	tls13_send_finished(tls);
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	/* For session tickets which come after handshake */
+	tls13_derive_secret(tls, tls->resumption_secret, hsd->tls13_secret, "res master");
+#endif
+
+	tls13_set_traffic_keys(tls, c_ap, 0);
+	tls13_set_traffic_keys(tls, s_ap, 1);
+}
+#endif
+
 void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni)
 {
 	// Client              RFC 5246                Server
@@ -2200,8 +3319,42 @@ void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni)
 	int len;
 	int got_cert_req;
 
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	tls->session_file = session_file_name(sni);
+#endif
 	send_client_hello_and_alloc_hsd(tls, sni);
 	get_server_hello(tls);
+#if ENABLE_FEATURE_TLS_1_3
+	if (tls->hsd->hello_retry && !(tls->flags & TLS13)) {
+		/* It was HelloRetryRequest: try again with P256 key */
+		send_client_hello(tls, sni);
+		get_server_hello(tls);
+		if (!(tls->flags & TLS13))
+			bb_simple_error_msg_and_die("TLS: bad HelloRetryRequest");
+	}
+	if (tls->flags & TLS13) {
+		tls13_handshake(tls);
+		goto free_hsd;
+	}
+#endif
+#if ENABLE_FEATURE_TLS_SESSION_TICKETS
+	if (tls->hsd->resumed) {
+		// Client              RFC 5077                Server
+		// ClientHello(ticket)  ------->
+		//                                        ServerHello
+		//                                  NewSessionTicket*
+		//                                 [ChangeCipherSpec]
+		//                      <-------             Finished
+		// [ChangeCipherSpec]
+		// Finished             ------->
+		set_client_keys(tls, NULL, 0);
+		get_change_cipher_spec(tls);
+		get_finished(tls, "'server finished'");
+		send_change_cipher_spec(tls);
+		send_finished(tls, "client finished");
+		goto free_hsd;
+	}
+#endif
 
 	// RFC 5246
 	// The server MUST send a Certificate message whenever the agreed-
@@ -2277,6 +3430,11 @@ void FAST_FUNC tls_handshake(tls_state_t *tls, const char *sni)
 
 	/* application data can be sent/received */
 
+#if ENABLE_FEATURE_TLS_1_3
+ free_hsd:
+	free(tls->hsd->hs_buf);
+#endif
+	IF_FEATURE_TLS_SESSION_TICKETS(free(tls->hsd->session);)
 	/* free handshake data */
 	psRsaKey_clear(&tls->hsd->server_rsa_pub_key);
 //	if (PARANOIA)
@@ -2422,10 +3580,176 @@ void FAST_FUNC tls_run_copy_loop(tls_state_t *tls, unsigned flags)
 	}
 }
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+/* Reads up to size bytes of application data. Returns 0 on EOF */
+int FAST_FUNC tls_read_data(tls_state_t *tls, void *buf, int size)
+{
+	if (tls->data_len == 0) {
+		int nread = tls_xread_record(tls, "encrypted data");
+		if (nread < 1)
+			return 0;
+		if (tls->inbuf[0] != RECORD_TYPE_APPLICATION_DATA)
+			bad_record_die(tls, "encrypted data", nread);
+		tls->data_ofs = RECHDR_LEN;
+		tls->data_len = nread;
+	}
+	if (size > tls->data_len)
+		size = tls->data_len;
+	memcpy(buf, tls->inbuf + tls->data_ofs, size);
+	tls->data_ofs += size;
+	tls->data_len -= size;
+	return size;
+}
+
+/* Can tls_read_data() return something without reading the fd?
+ * (poll() on tls->ifd does not know about it) */
+int FAST_FUNC tls_has_buffered_data(tls_state_t *tls)
+{
+	return tls->data_len != 0 || tls_has_buffered_record(tls);
+}
+
+void FAST_FUNC tls_write_data(tls_state_t *tls, const void *buf, int size)
+{
+	while (size > 0) {
+		int len = size < TLS_MAX_OUTBUF ? size : TLS_MAX_OUTBUF;
+		memcpy(tls_get_outbuf(tls, len), buf, len);
+		tls_xwrite(tls, len);
+		buf = (const char *)buf + len;
+		size -= len;
+	}
+}
+
+void FAST_FUNC tls_send_close_notify(tls_state_t *tls)
+{
+	uint8_t *buf = tls_get_outbuf(tls, 2);
+	buf[0] = 1; /* warning */
+	buf[1] = 0; /* close_notify */
+	xwrite_encrypted(tls, 2, RECORD_TYPE_ALERT);
+}
+
+void FAST_FUNC tls_free_state(tls_state_t *tls)
+{
+	free(tls->inbuf);
+	free(tls->outbuf);
+	free(tls);
+}
+
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
 
 /* =============== SERVER-SIDE CODE =============== */
 
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+/* Session tickets (RFC 5077, RFC 8446 4.6.1) are stateless:
+ * the session is in the ticket, encrypted with our key
+ */
+static void seal_ticket(struct tls_server_keys *sk, struct tls_session *s, uint8_t *ticket)
+{
+	uint8_t nonce[AES_BLOCK_SIZE];
+
+	tls_get_random(ticket, 12);
+	memcpy(nonce, ticket, 12);
+	memset(nonce + 12, 0, 4);
+	aes_ctr_encrypt(&sk->ticket_aes, nonce, s, sizeof(*s), ticket + 12);
+	hmac_block(sk->ticket_mac_key, SHA256_OUTSIZE, sha256_begin_hmac,
+			ticket, 12 + sizeof(*s), ticket + 12 + sizeof(*s));
+}
+
+/* Returns malloced session, or NULL if the ticket is not ours,
+ * is for another TLS version, or has expired
+ */
+static struct tls_session *open_ticket(struct tls_server_keys *sk,
+		const uint8_t *ticket, unsigned ticket_len, unsigned version)
+{
+	struct tls_session *s;
+	uint8_t nonce[AES_BLOCK_SIZE];
+	uint8_t mac[SHA256_OUTSIZE];
+	unsigned i, diff;
+
+	if (ticket_len != TICKET_LEN)
+		return NULL;
+	hmac_block(sk->ticket_mac_key, SHA256_OUTSIZE, sha256_begin_hmac,
+			ticket, 12 + sizeof(*s), mac);
+	/* Don't tell timing attacks how many bytes matched */
+	diff = 0;
+	for (i = 0; i < SHA256_OUTSIZE; i++)
+		diff |= mac[i] ^ ticket[12 + sizeof(*s) + i];
+	if (diff)
+		return NULL;
+	s = xmalloc(sizeof(*s));
+	memcpy(nonce, ticket, 12);
+	memset(nonce + 12, 0, 4);
+	aes_ctr_encrypt(&sk->ticket_aes, nonce, ticket + 12, sizeof(*s), s);
+	if (s->version != version
+	 || (uint32_t)time(NULL) - s->saved >= s->lifetime
+	) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/* Client offers a ticket we gave it earlier. Use it
+ * if its cipher is still acceptable to both of us.
+ */
+static int tls12_check_ticket(tls_state_t *tls, const uint8_t *ciphers, int cipher_list_len,
+		const uint8_t *ticket, unsigned ticket_len)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	struct tls_session *s;
+	unsigned i, j;
+
+	/* RFC 5077 3.4: we accept the ticket by echoing client's session id */
+	if (hsd->session_id_len == 0)
+		return 0;
+	s = open_ticket(hsd->sk, ticket, ticket_len, 3);
+	if (!s)
+		return 0;
+	for (j = 0; j < cipher_list_len; j += 2) {
+		if (((ciphers[j] << 8) | ciphers[j + 1]) != s->cipher_id)
+			continue;
+		for (i = 0; i < NUM_CIPHERS*2; i += 2) {
+			if (supported_ciphers[i] == ciphers[j]
+			 && supported_ciphers[i + 1] == ciphers[j + 1]
+			) {
+				set_cipher_parameters(tls, &ciphers[j]);
+				dbg("resuming TLS 1.2 session, cipher: %04x", tls->cipher_id);
+				memcpy(hsd->master_secret, s->secret, sizeof(hsd->master_secret));
+				hsd->session = s;
+				hsd->resumed = 1;
+				return 1;
+			}
+		}
+	}
+	free(s);
+	return 0;
+}
+
+/* "pre_shared_key" has the ticket, and the binder which proves
+ * that client knows the PSK. We look only at the first one.
+ */
+static void tls13_check_psk(tls_state_t *tls, const uint8_t *hello,
+		const uint8_t *ticket, unsigned ticket_len, const uint8_t *binders)
+{
+	struct tls_session *s;
+	md5sha_ctx_t ctx;
+	uint8_t binder[SHA256_OUTSIZE];
+
+	s = open_ticket(tls->hsd->sk, ticket, ticket_len, 4);
+	if (!s)
+		return; /* do full handshake */
+	/* Binder covers ClientHello up to the list of binders */
+	sha256_begin(&ctx);
+	tls13_psk_binder(s->secret, &ctx, hello, binders - hello, binder);
+	if (binders[2] != SHA256_OUTSIZE
+	 || memcmp(binders + 3, binder, SHA256_OUTSIZE) != 0
+	) {
+		bb_simple_error_msg_and_die("TLS: bad PSK binder");
+	}
+	dbg("resuming TLS 1.3 session");
+	tls->hsd->session = s;
+	tls->hsd->resumed = 1;
+}
+#endif
+
 static void get_client_hello(tls_state_t *tls)
 {
 	struct client_hello {
@@ -2436,9 +3760,21 @@ static void get_client_hello(tls_state_t *tls)
 		uint8_t session_id_len;
 		/* followed by session_id, cipher suites, compression methods, extensions */
 	};
-	unsigned i, j;
+	unsigned i, j, pass;
 	struct client_hello *hp;
 	uint8_t *p;
+	uint8_t *ciphers;
+#if ENABLE_FEATURE_TLS_1_3
+	smallint tls13_ok = 0;
+	unsigned tls13_group = 0;
+#endif
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	const uint8_t *ticket12 = NULL;
+	const uint8_t *psk = NULL;
+	const uint8_t *binders = binders; /* for gcc */
+	unsigned ticket12_len = 0;
+	unsigned psk_len = 0;
+#endif
 	int cipher_list_len;
 	int extensions_len;
 	int len;
@@ -2458,6 +3794,14 @@ static void get_client_hello(tls_state_t *tls)
 	/* Save client random */
 	memcpy(tls->hsd->client_and_server_rand32, hp->rand32, 32);
 
+#if ENABLE_FEATURE_TLS_1_3
+	/* TLS 1.3 server echoes it back */
+	if (hp->session_id_len <= sizeof(tls->hsd->session_id)) {
+		tls->hsd->session_id_len = hp->session_id_len;
+		memcpy(tls->hsd->session_id, hp + 1, hp->session_id_len);
+	}
+#endif
+
 	/* Skip session ID and handshake header */
 	p = (uint8_t*)(hp + 1) + hp->session_id_len;
 	len -= (sizeof(*hp) + hp->session_id_len);
@@ -2473,6 +3817,7 @@ static void get_client_hello(tls_state_t *tls)
 	if (len < cipher_list_len) {
 		bb_simple_error_msg_and_die("malformed ClientHello");
 	}
+	ciphers = p;
 
 	/* Check whether we have TLS_EMPTY_RENEGOTIATION_INFO_SCSV */
 	for (j = 0; j < cipher_list_len; j += 2) {
@@ -2485,41 +3830,6 @@ static void get_client_hello(tls_state_t *tls)
 		}
 	}
 
-	/* Select cipher + cert pair from client's list, preferring our ciphers in order */
-	for (i = 0; i < NUM_CIPHERS*2; i += 2) {
-		const uint8_t *our_cipher = &supported_ciphers[i];
-		int key_type;
-
-		/* Determine required key type for this cipher */
-		key_type = is_cipher_ECDSA(our_cipher);
-		if (key_type == KEY_ECDSA) {
-			if (!tls->hsd->keys[KEY_ECDSA])
-				/* No ECDSA cert configured, can't choose this */
-				continue;
-			//TODO: ECDSA not supported yet at all
-			continue;
-		} else {
-			if (!tls->hsd->keys[KEY_RSA])
-				/* No RSA cert configured, can't choose this */
-				continue;
-			/* We _can_ choose this! */
-		}
-
-		/* Check if this cipher is in client's list */
-		for (j = 0; j < cipher_list_len; j += 2) {
-			if (p[j] == our_cipher[0] && p[j + 1] == our_cipher[1]) {
-				/* Found a match! */
-				set_cipher_parameters(tls, our_cipher);
-				dbg("Selected cipher: %04x", tls->cipher_id);
-				tls->hsd->key_type_chosen = key_type;
-				goto cipher_selected;
-			}
-		}
-		/* try our next cipherid */
-	}
-	bb_simple_error_msg_and_die("no common cipher suites");
-
- cipher_selected:
 	/* Skip past cipher list */
 	p += cipher_list_len;
 	len -= cipher_list_len;
@@ -2531,7 +3841,7 @@ static void get_client_hello(tls_state_t *tls)
 	/* Parse extensions if present */
 	if (len < 2) {
 		dbg("No extensions");
-		return; /* no extensions */
+		goto select_cipher; /* no extensions */
 	}
 	extensions_len = (p[0] << 8) | p[1];
 	p += 2;
@@ -2540,7 +3850,7 @@ static void get_client_hello(tls_state_t *tls)
 
 	if (len < extensions_len) {
 		dbg("Malformed extensions length (len %d < extensions_len %u)", len, extensions_len);
-		return; /* malformed extensions, ignore */
+		goto select_cipher; /* malformed extensions, ignore */
 	}
 
 	/* Process extensions */
@@ -2553,7 +3863,7 @@ static void get_client_hello(tls_state_t *tls)
 		extensions_len -= 4 + ext_len;
 		if (extensions_len < 0) {
 			dbg("Extension length overflow");
-			return; /* malformed */
+			goto select_cipher; /* malformed */
 		}
 
 		if (ext_type == 0x000a) { /* supported_groups */
@@ -2563,7 +3873,7 @@ static void get_client_hello(tls_state_t *tls)
 			p += 2;
 			ext_len -= 2;
 			if (ext_len != curve_list_len || (ext_len & 1))
-				return; /* malformed */
+				goto select_cipher; /* malformed */
 			while (1) {
 				unsigned curve;
 				ext_len -= 2; /* skip (presumably existing) curve id */
@@ -2585,74 +3895,256 @@ static void get_client_hello(tls_state_t *tls)
 			dbg("got reneg_info extension ff01");
 			tls->hsd->reneg_info_requested = 1;
 		}
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+		if (ext_type == 0x0023) { /* session_ticket */
+			/* Empty: "give me a ticket", else: "here is the one you gave me" */
+			tls->hsd->tickets_ok |= TICKETS_TLS12;
+			ticket12 = p;
+			ticket12_len = ext_len;
+		}
+		if (ext_type == 0x002d && ext_len >= 1) { /* psk_key_exchange_modes */
+			for (j = 1; j <= p[0] && j < ext_len; j++) {
+				if (p[j] == 1) /* psk_dhe_ke */
+					tls->hsd->tickets_ok |= TICKETS_TLS13;
+			}
+		}
+		/* pre_shared_key: identities_len16 {id_len16 id age32}... binders_len16 {len8 binder}...
+		 * It must be the last extension.
+		 */
+		if (ext_type == 0x0029 && extensions_len == 0 && ext_len >= 2 + 2) {
+			unsigned ids_len = (p[0] << 8) | p[1];
+			unsigned id_len = (p[2] << 8) | p[3];
+			if (2 + id_len + 4 <= ids_len
+			 && 2 + ids_len + 2 + 1 + SHA256_OUTSIZE <= ext_len
+			) {
+				psk = p + 4;
+				psk_len = id_len;
+				binders = p + 2 + ids_len;
+			}
+		}
+#endif
+#if ENABLE_FEATURE_TLS_1_3
+		if (ext_type == 0x002b && ext_len >= 1) { /* supported_versions */
+			for (j = 1; j + 1 <= p[0] && j + 1 < ext_len; j += 2) {
+				if (p[j] == 0x03 && p[j + 1] == 0x04)
+					tls13_ok |= 1;
+			}
+		}
+		if (ext_type == 0x000d && ext_len >= 2) { /* signature_algorithms */
+			/* We can sign only with rsa_pss_rsae_sha256 */
+			for (j = 2; j + 1 < ext_len; j += 2) {
+				if (p[j] == 0x08 && p[j + 1] == 0x04)
+					tls13_ok |= 2;
+			}
+		}
+		if (ext_type == 0x0033 && ext_len >= 2) { /* key_share */
+			/* Take x25519 share, or P256 one */
+			for (j = 2; j + 4 <= ext_len;) {
+				unsigned group = (p[j] << 8) | p[j + 1];
+				unsigned key_len = (p[j + 2] << 8) | p[j + 3];
+
+				j += 4;
+				if (j + key_len > ext_len)
+					break;
+				if (group == 0x001d && key_len == 32) {
+					memcpy(tls->hsd->ecc_pub_key32, p + j, 32);
+					tls13_group = group;
+					break;
+				}
+				if (group == 0x0017 && key_len == 65 && p[j] == 4 && !tls13_group) {
+					memcpy(tls->hsd->ecc_pub_key32, p + j + 1, 2 * 32);
+					tls13_group = group;
+				}
+				j += key_len;
+			}
+		}
+#endif
 		p += ext_len;
 	}
+
+ select_cipher:
+#if ENABLE_FEATURE_TLS_1_3
+	/* TLS 1.3 only needs our RSA key (we sign with RSA-PSS)
+	 * and client's key share for a group we support.
+	 * HelloRetryRequest is not implemented.
+	 */
+	if (tls13_ok == 3 && tls13_group && tls->hsd->sk->keys[KEY_RSA]) {
+		/* Prefer AES-GCM if AES-NI is present, else ChaCha20 */
+		uint8_t want = aes_have_NI() ? 0x01 : 0x03;
+		for (pass = 0; pass < 2; pass++) {
+			for (j = 0; j < cipher_list_len; j += 2) {
+				if (ciphers[j] == 0x13 && ciphers[j + 1] == want) {
+					set_cipher_parameters(tls, &ciphers[j]);
+					dbg("Selected TLS 1.3 cipher: %04x", tls->cipher_id);
+					tls->hsd->key_type_chosen = KEY_RSA;
+					tls->flags &= ~USE_EC_CURVE_X25519;
+					if (tls13_group == 0x001d)
+						tls->flags |= USE_EC_CURVE_X25519;
+					tls->flags |= TLS13;
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+					if (psk && (tls->hsd->tickets_ok & TICKETS_TLS13))
+						tls13_check_psk(tls, &hp->type, psk, psk_len, binders);
+#endif
+					return;
+				}
+			}
+			want ^= 0x01 ^ 0x03;
+		}
+	}
+#endif
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (ticket12_len
+	 && tls12_check_ticket(tls, ciphers, cipher_list_len, ticket12, ticket12_len)
+	) {
+		return;
+	}
+#endif
+	/* Select cipher + cert pair from client's list, preferring our ciphers in order.
+	 * AEAD ones go first: they need no separate HMAC pass over the data.
+	 */
+	pass = 0;
+ next_pass:
+	for (i = 0; i < NUM_CIPHERS*2; i += 2) {
+		const uint8_t *our_cipher = &supported_ciphers[i];
+		int key_type;
+
+		if (cipher_pass(our_cipher) != pass)
+			continue;
+
+		/* Determine required key type for this cipher */
+		key_type = is_cipher_ECDSA(our_cipher);
+		if (key_type == KEY_ECDSA) {
+			if (!tls->hsd->sk->keys[KEY_ECDSA])
+				/* No ECDSA cert configured, can't choose this */
+				continue;
+			//TODO: ECDSA not supported yet at all
+			continue;
+		} else {
+			if (!tls->hsd->sk->keys[KEY_RSA])
+				/* No RSA cert configured, can't choose this */
+				continue;
+			/* We _can_ choose this! */
+		}
+
+		/* Check if this cipher is in client's list */
+		for (j = 0; j < cipher_list_len; j += 2) {
+			if (ciphers[j] == our_cipher[0] && ciphers[j + 1] == our_cipher[1]) {
+				/* Found a match! */
+				set_cipher_parameters(tls, our_cipher);
+				dbg("Selected cipher: %04x", tls->cipher_id);
+				tls->hsd->key_type_chosen = key_type;
+				return;
+			}
+		}
+		/* try our next cipherid */
+	}
+	if (++pass <= 2)
+		goto next_pass;
+	bb_simple_error_msg_and_die("no common cipher suites");
 }
 
 static void send_server_hello(tls_state_t *tls)
 {
-	struct server_hello {
-		uint8_t type;
-		uint8_t len24_hi, len24_mid, len24_lo;
-		uint8_t proto_maj, proto_min;
-		uint8_t rand32[32];
-		uint8_t session_id_len;
-		uint8_t cipherid_hi, cipherid_lo;
-		uint8_t comprtype;
-		uint8_t extensions_len_hi, extensions_len_lo;
-		/* extensions follow */
-		uint8_t ext_reneg_info[5];  /* ff 01 00 01 00 */
-	};
-	struct server_hello *record;
-	unsigned len = sizeof(*record);
+	struct tls_handshake_data *hsd = tls->hsd;
+	uint8_t *record, *p;
+	unsigned session_id_len = 0;
+	unsigned ext_len = 0;
+	unsigned len;
 
-	if (!tls->hsd->reneg_info_requested)
-		len -= 7;
+	if (hsd->reneg_info_requested)
+		ext_len += 5;
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (hsd->resumed)
+		/* RFC 5077 3.4: echo client's session id to accept its ticket */
+		session_id_len = hsd->session_id_len;
+	else if (hsd->tickets_ok & TICKETS_TLS12)
+		/* Empty "session_ticket": we'll send NewSessionTicket */
+		ext_len += 4;
+#endif
+	len = 4 + 2 + 32 + 1 + session_id_len + 2 + 1;
+	if (ext_len)
+		len += 2 + ext_len;
 
 	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_SERVER_HELLO, len);
-
-	record->proto_maj = TLS_MAJ;
-	record->proto_min = TLS_MIN;
+	p = record + 4;
+	*p++ = TLS_MAJ;
+	*p++ = TLS_MIN;
 
 	/* Generate server random */
-	tls_get_random(record->rand32, sizeof(record->rand32));
-	memcpy(tls->hsd->client_and_server_rand32 + 32, record->rand32, 32);
+	tls_get_random(p, 32);
+	memcpy(hsd->client_and_server_rand32 + 32, p, 32);
+	p += 32;
 
-	/* No session ID */
-	//record->session_id_len = 0;
+	*p++ = session_id_len;
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	p = mempcpy(p, hsd->session_id, session_id_len);
+#endif
 
 	/* Selected cipher suite */
-	record->cipherid_hi = tls->cipher_id >> 8;
-	record->cipherid_lo = tls->cipher_id; // & 0xff implicit
+	*p++ = tls->cipher_id >> 8;
+	*p++ = tls->cipher_id; // & 0xff implicit
 
 	/* No compression */
-	//record->comprtype = 0;
+	*p++ = 0;
 
-	if (tls->hsd->reneg_info_requested) {
+	if (ext_len) {
 		/* Extensions */
-		//record->extensions_len_hi = 0;
-		record->extensions_len_lo = 5; /* length of renegotiation_info extension */
-
-		/* Renegotiation info extension (RFC 5746) */
-		record->ext_reneg_info[0] = 0xff;
-		record->ext_reneg_info[1] = 0x01; /* extension type */
-		//record->ext_reneg_info[2] = 0x00;
-		record->ext_reneg_info[3] = 0x01; /* extension data length: 1 byte */
-		//record->ext_reneg_info[4] = 0x00; /* renegotiation info length: 0 (no previous connection) */
+		*p++ = 0;
+		*p++ = ext_len;
+		if (hsd->reneg_info_requested) {
+			/* Renegotiation info extension (RFC 5746):
+			 * ff01, 1 byte of data: empty renegotiated_connection
+			 */
+			*p++ = 0xff; *p++ = 0x01; *p++ = 0x00; *p++ = 0x01; *p++ = 0x00;
+		}
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+		if (!hsd->resumed && (hsd->tickets_ok & TICKETS_TLS12)) {
+			/* Empty session_ticket extension */
+			*p++ = 0x00; *p++ = 0x23; *p++ = 0x00; *p++ = 0x00;
+		}
+#endif
 	}
 
 	dbg(">> SERVER_HELLO");
 	xwrite_and_update_handshake_hash(tls, len);
 }
 
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+/* RFC 5077 3.3: NewSessionTicket comes after client's Finished,
+ * before our ChangeCipherSpec
+ */
+static void tls12_send_session_ticket(tls_state_t *tls)
+{
+	struct tls_session s;
+	uint8_t *record;
+	unsigned len = 4 + 4 + 2 + TICKET_LEN;
+
+	memset(&s, 0, sizeof(s));
+	s.version = 3;
+	s.saved = time(NULL);
+	s.lifetime = TICKET_LIFETIME;
+	s.cipher_id = tls->cipher_id;
+	memcpy(s.secret, tls->hsd->master_secret, sizeof(tls->hsd->master_secret));
+
+	/* 04 len24 lifetime_hint32 ticket_len16 ticket */
+	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_NEW_SESSION_TICKET, len);
+	put_unaligned_be32(TICKET_LIFETIME, record + 4);
+	record[8] = TICKET_LEN >> 8;
+	record[9] = TICKET_LEN;
+	seal_ticket(tls->hsd->sk, &s, record + 10);
+	dbg(">> NEW_SESSION_TICKET");
+	xwrite_and_update_handshake_hash(tls, len);
+}
+#endif
+
 static void send_server_certificate(tls_state_t *tls)
 {
 	void *record;
 	int n = tls->hsd->key_type_chosen;
-	int sz = tls->hsd->certsize[n];
+	int sz = tls->hsd->sk->certsize[n];
 
 	record = tls_get_outbuf(tls, sz);
-	memcpy(record, tls->hsd->certs[n], sz);
+	memcpy(record, tls->hsd->sk->certs[n], sz);
 	dbg(">> CERTIFICATE");
 	xwrite_and_update_handshake_hash(tls, sz);
 }
@@ -2729,7 +4221,7 @@ static void send_server_key_exchange(tls_state_t *tls)
 	*p++ = 1; /* RSA */
 
 	/* Sign the hash */
-	sig_len = privRsaEncryptSignedElement(NULL, &tls->hsd->rsa_priv_key,
+	sig_len = privRsaEncryptSignedElement(NULL, &tls->hsd->sk->rsa_priv_key,
 		hash, 32, p + 2, 512, NULL);
 	if (sig_len < 0) {
 		bb_simple_error_msg_and_die("RSA signature failed");
@@ -2767,6 +4259,27 @@ static void send_server_hello_done(tls_state_t *tls)
 	xwrite_and_update_handshake_hash(tls, sizeof(*record));
 }
 
+/* With premaster == NULL, hsd->master_secret is from resumed session */
+static void set_server_keys(tls_state_t *tls, uint8_t *premaster, int premaster_size)
+{
+	derive_master_secret_and_keys(tls, premaster, premaster_size);
+	// The key_block[] is partitioned as follows:
+	tls->peer_write_MAC_key = tls->key_block;                         // client_write_MAC_key[]
+	tls->our_write_MAC_key  = tls->key_block         + tls->MAC_size; // server_write_MAC_key[]
+	tls->peer_write_key     = tls->our_write_MAC_key + tls->MAC_size; // client_write_key[]
+	tls->our_write_key      = tls->peer_write_key    + tls->key_size; // server_write_key[]
+	tls->peer_write_IV      = tls->our_write_key     + tls->key_size; // client_write_IV[]
+	tls->our_write_IV       = tls->peer_write_IV     + tls->IV_size;  // server_write_IV[]
+	dump_hex("server write_MAC_key:%s", tls->our_write_MAC_key, tls->MAC_size);
+	dump_hex("server write_key:%s",	tls->our_write_key, tls->key_size);
+	dump_hex("server write_IV:%s", tls->our_write_IV, tls->IV_size);
+	dump_hex("client write_MAC_key:%s", tls->peer_write_MAC_key, tls->MAC_size);
+	dump_hex("client write_key:%s",	tls->peer_write_key, tls->key_size);
+	dump_hex("client write_IV:%s", tls->peer_write_IV, tls->IV_size);
+
+	initialize_aes_keys(tls);
+}
+
 /* Receive and process ClientKeyExchange */
 static void get_client_key_exchange(tls_state_t *tls)
 {
@@ -2807,7 +4320,7 @@ static void get_client_key_exchange(tls_state_t *tls)
 		{
 			int32 ret;
 			uint32 plen;
-			psRsaKey_t *key = &tls->hsd->rsa_priv_key;
+			psRsaKey_t *key = &tls->hsd->sk->rsa_priv_key;
 
 			plen = RSA_PREMASTER_SIZE;
 			ret = psRsaDecryptPriv(NULL, key,
@@ -2866,22 +4379,7 @@ static void get_client_key_exchange(tls_state_t *tls)
 		dbg("Computed ECDHE premaster secret (%d bytes)", premaster_size);
 	}
 
-	derive_master_secret_and_keys(tls, premaster, premaster_size);
-	// The key_block[] is partitioned as follows:
-	tls->peer_write_MAC_key = tls->key_block;                         // client_write_MAC_key[]
-	tls->our_write_MAC_key  = tls->key_block         + tls->MAC_size; // server_write_MAC_key[]
-	tls->peer_write_key     = tls->our_write_MAC_key + tls->MAC_size; // client_write_key[]
-	tls->our_write_key      = tls->peer_write_key    + tls->key_size; // server_write_key[]
-	tls->peer_write_IV      = tls->our_write_key     + tls->key_size; // client_write_IV[]
-	tls->our_write_IV       = tls->peer_write_IV     + tls->IV_size;  // server_write_IV[]
-	dump_hex("server write_MAC_key:%s", tls->our_write_MAC_key, tls->MAC_size);
-	dump_hex("server write_key:%s",	tls->our_write_key, tls->key_size);
-	dump_hex("server write_IV:%s", tls->our_write_IV, tls->IV_size);
-	dump_hex("client write_MAC_key:%s", tls->peer_write_MAC_key, tls->MAC_size);
-	dump_hex("client write_key:%s",	tls->peer_write_key, tls->key_size);
-	dump_hex("client write_IV:%s", tls->peer_write_IV, tls->IV_size);
-
-	initialize_aes_keys(tls);
+	set_server_keys(tls, premaster, premaster_size);
 }
 
 /* Load RSA private key from DER file (supports PKCS#8 or PKCS#1)
@@ -2965,10 +4463,8 @@ static char *decode_base64_or_die(char *dst, const char *src)
 	return dst_end;
 }
 
-/* Parse PEM file and extract key + cert chain pairs
- * Returns number of pairs loaded
- */
-static void load_pem_key_cert_pairs(tls_state_t *tls, const char *pem_filename)
+/* Parse PEM file and extract key + cert chain pairs */
+struct tls_server_keys* FAST_FUNC tls_load_server_keys(const char *pem_filename)
 {
 	static const char BLOCK_NAMES[] ALIGN1 =
 		"EC PARAMETERS"  "\0"
@@ -2982,6 +4478,7 @@ static void load_pem_key_cert_pairs(tls_state_t *tls, const char *pem_filename)
 		str_CERTIFICATE = 1,
 		str_EC_KEY = 2,
 	};
+	struct tls_server_keys *sk;
 	char *p;
 	char *pem_data;
 	size_t pem_size;
@@ -2992,6 +4489,7 @@ static void load_pem_key_cert_pairs(tls_state_t *tls, const char *pem_filename)
 	/* Read PEM file */
 	pem_size = 64 * 1024; /* sanity limit */
 	pem_data = xmalloc_xopen_read_close(pem_filename, &pem_size);
+	sk = xzalloc(sizeof(*sk));
 
 	der_data = NULL;
 	der_size = 0;
@@ -3100,8 +4598,8 @@ static void load_pem_key_cert_pairs(tls_state_t *tls, const char *pem_filename)
 			cert_msg->cert_chain_len24_mid = n >> 8;
 			cert_msg->cert_chain_len24_lo  = n;
 
-			tls->hsd->certs[keyidx] = der_data;
-			tls->hsd->certsize[keyidx] = der_size;
+			sk->certs[keyidx] = der_data;
+			sk->certsize[keyidx] = der_size;
 			continue;
 		}
 
@@ -3114,44 +4612,243 @@ static void load_pem_key_cert_pairs(tls_state_t *tls, const char *pem_filename)
 		der_data = xrealloc(der_data, der_size);
 
 		keyidx = (n == str_EC_KEY) ? KEY_ECDSA : KEY_RSA;
-		if (tls->hsd->keys[keyidx])
+		if (sk->keys[keyidx])
 			bb_error_msg_and_die("'%s': more than one key", pem_filename);
-		tls->hsd->keys[keyidx] = der_data;
-		tls->hsd->keysize[keyidx] = der_size;
+		sk->keys[keyidx] = der_data;
+		sk->keysize[keyidx] = der_size;
 
 		der_data = NULL;
 		der_size = 0;
 	} /* while (parsing PEM) */
 	free(pem_data);
 
-	if (!tls->hsd->keys[KEY_RSA] && !tls->hsd->keys[KEY_ECDSA])
+	if (!sk->keys[KEY_RSA] && !sk->keys[KEY_ECDSA])
 		bb_error_msg_and_die("'%s': no private keys", pem_filename);
 
-	if (tls->hsd->keys[KEY_RSA]) {
-		if (!tls->hsd->certs[KEY_RSA])
+	if (sk->keys[KEY_RSA]) {
+		if (!sk->certs[KEY_RSA])
 			bb_error_msg_and_die("'%s': key with no cert", pem_filename);
 		/* Parse RSA key from DER */
-		load_rsa_priv_key(&tls->hsd->rsa_priv_key, (uint8_t*)tls->hsd->keys[KEY_RSA], tls->hsd->keysize[KEY_RSA]);
+		load_rsa_priv_key(&sk->rsa_priv_key, (uint8_t*)sk->keys[KEY_RSA], sk->keysize[KEY_RSA]);
 	}
-	if (tls->hsd->keys[KEY_ECDSA]) {
-		if (!tls->hsd->certs[KEY_ECDSA])
+	if (sk->keys[KEY_ECDSA]) {
+		if (!sk->certs[KEY_ECDSA])
 			bb_error_msg_and_die("'%s': key with no cert", pem_filename);
 		bb_error_msg("'%s': ECDSA keys not supported", pem_filename);
 	}
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	{
+		uint8_t key[16];
+		tls_get_random(key, sizeof(key));
+		aes_setkey(&sk->ticket_aes, key, sizeof(key));
+		tls_get_random(sk->ticket_mac_key, sizeof(sk->ticket_mac_key));
+	}
+#endif
 
-	return;
+	return sk;
  err:
 	bb_error_msg_and_die("malformed PEM file at '%.*s'", (int)(skip_whitespace(p) - p), p);
 }
 
+#if ENABLE_FEATURE_TLS_1_3
+static void tls13_send_server_hello(tls_state_t *tls, uint8_t *premaster)
+{
+	struct tls_handshake_data *hsd = tls->hsd;
+	int x25519 = (tls->flags & USE_EC_CURVE_X25519);
+	int key_len = x25519 ? 32 : 1 + 2 * 32;
+	int ext_len = 6 + 8 + key_len;
+	int len;
+	uint8_t *record, *p;
+
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (hsd->resumed)
+		ext_len += 6;
+#endif
+	len = 4 + 2 + 32 + 1 + hsd->session_id_len + 2 + 1 + 2 + ext_len;
+	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_SERVER_HELLO, len);
+	p = record + 4;
+	*p++ = TLS_MAJ; /* legacy_version: TLS 1.2 */
+	*p++ = TLS_MIN;
+	tls_get_random(p, 32);
+	p += 32;
+	*p++ = hsd->session_id_len;
+	p = mempcpy(p, hsd->session_id, hsd->session_id_len);
+	*p++ = tls->cipher_id >> 8;
+	*p++ = tls->cipher_id;
+	*p++ = 0; /* no compression */
+	*p++ = 0; /* extensions len */
+	*p++ = ext_len;
+	/* supported_versions: TLS 1.3 */
+	*p++ = 0x00; *p++ = 0x2b; *p++ = 0x00; *p++ = 0x02; *p++ = 0x03; *p++ = 0x04;
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (hsd->resumed) {
+		/* pre_shared_key: selected_identity 0 */
+		*p++ = 0x00; *p++ = 0x29; *p++ = 0x00; *p++ = 0x02; *p++ = 0x00; *p++ = 0x00;
+	}
+#endif
+	/* key_share */
+	*p++ = 0x00; *p++ = 0x33; *p++ = 0x00; *p++ = 4 + key_len;
+	*p++ = 0x00; *p++ = x25519 ? 0x1d : 0x17; *p++ = 0x00; *p++ = key_len;
+	if (x25519) {
+		curve_x25519_generate_keypair(hsd->ecc_priv_key32, p);
+		curve_x25519_compute_premaster(hsd->ecc_priv_key32, hsd->ecc_pub_key32, premaster);
+	} else {
+		*p = 4; /* uncompressed point */
+		curve_P256_generate_keypair(hsd->ecc_priv_key32, p + 1);
+		curve_P256_compute_premaster(hsd->ecc_priv_key32, hsd->ecc_pub_key32, premaster);
+	}
+	dbg(">> SERVER_HELLO (TLS 1.3)");
+	xwrite_and_update_handshake_hash(tls, len);
+}
+
+/* TLS 1.3 Certificate message has request context
+ * and extensions for every cert: convert TLS 1.2 one we have
+ */
+static void tls13_send_server_certificate(tls_state_t *tls)
+{
+	const uint8_t *cert12 = (void*)tls->hsd->sk->certs[KEY_RSA];
+	const uint8_t *end = cert12 + tls->hsd->sk->certsize[KEY_RSA];
+	const uint8_t *s;
+	uint8_t *record, *d;
+	int len;
+
+	len = tls->hsd->sk->certsize[KEY_RSA] + 1;
+	for (s = cert12 + 7; s < end; s += 3 + get24be(s))
+		len += 2;
+	record = tls_get_zeroed_outbuf(tls, len);
+	fill_handshake_record_hdr(record, HANDSHAKE_CERTIFICATE, len);
+	/* record[4] = 0; - certificate_request_context is empty */
+	record[5] = (len - 8) >> 16;
+	record[6] = (len - 8) >> 8;
+	record[7] = (len - 8);
+	d = record + 8;
+	for (s = cert12 + 7; s < end;) {
+		int sz = 3 + get24be(s);
+		d = mempcpy(d, s, sz);
+		d += 2; /* no extensions */
+		s += sz;
+	}
+	dbg(">> CERTIFICATE");
+	tls13_xwrite_handshake_msg(tls, len);
+}
+
+static void tls13_send_certificate_verify(tls_state_t *tls)
+{
+	static const char context[] ALIGN1 = "TLS 1.3, server CertificateVerify";
+	psRsaKey_t *key = &tls->hsd->sk->rsa_priv_key;
+	sha256_ctx_t ctx;
+	uint8_t buf[64];
+	uint8_t *record;
+	int32 sig_len;
+
+	/* RFC 8446 4.4.3: signature covers 64 spaces, context string,
+	 * zero byte and transcript hash */
+	tls13_transcript_hash(tls, buf);
+	sha256_begin(&ctx);
+	memset(buf + 32, ' ', 32);
+	sha256_hash(&ctx, buf + 32, 32);
+	sha256_hash(&ctx, buf + 32, 32);
+	sha256_hash(&ctx, context, sizeof(context)); /* with NUL */
+	sha256_hash(&ctx, buf, SHA256_OUTSIZE);
+	sha256_end(&ctx, buf);
+
+	record = tls_get_outbuf(tls, 8 + key->size);
+	record[4] = 0x08; /* rsa_pss_rsae_sha256 */
+	record[5] = 0x04;
+	sig_len = privRsaSignPssSha256(key, buf, record + 8, key->size);
+	if (sig_len < 0)
+		bb_simple_error_msg_and_die("RSA signature failed");
+	record[6] = sig_len >> 8;
+	record[7] = sig_len;
+	fill_handshake_record_hdr(record, HANDSHAKE_CERTIFICATE_VERIFY, 8 + sig_len);
+	dbg(">> CERTIFICATE_VERIFY");
+	tls13_xwrite_handshake_msg(tls, 8 + sig_len);
+}
+
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+/* Post-handshake message, encrypted with application keys.
+ * The transcript must end with client's Finished.
+ */
+static void tls13_send_session_ticket(tls_state_t *tls)
+{
+	struct tls_session s;
+	uint8_t res_secret[SHA256_OUTSIZE];
+	uint8_t *record;
+	unsigned len = 4 + 4 + 4 + 2 + 2 + TICKET_LEN + 2;
+
+	memset(&s, 0, sizeof(s));
+	s.version = 4;
+	s.saved = time(NULL);
+	s.lifetime = TICKET_LIFETIME;
+	s.cipher_id = tls->cipher_id;
+	tls_get_random(&s.age_add, sizeof(s.age_add));
+	/* PSK = HKDF-Expand-Label(resumption_master_secret, "resumption", ticket_nonce),
+	 * we send only one ticket, with nonce 0 */
+	tls13_derive_secret(tls, res_secret, tls->hsd->tls13_secret, "res master");
+	hkdf_expand_label(s.secret, SHA256_OUTSIZE, res_secret, "resumption", (uint8_t*)"", 1);
+
+	/* 04 len24 lifetime32 age_add32 nonce_len8 nonce ticket_len16 ticket extensions_len16 */
+	record = get_outbuf_fill_handshake_record(tls, HANDSHAKE_NEW_SESSION_TICKET, len);
+	put_unaligned_be32(TICKET_LIFETIME, record + 4);
+	put_unaligned_be32(s.age_add, record + 8);
+	record[12] = 1;
+	/* record[13] = 0; - nonce */
+	record[14] = TICKET_LEN >> 8;
+	record[15] = TICKET_LEN;
+	seal_ticket(tls->hsd->sk, &s, record + 16);
+	/* no extensions */
+	dbg(">> NEW_SESSION_TICKET");
+	xwrite_encrypted(tls, len, RECORD_TYPE_HANDSHAKE);
+}
+#endif
+
+static void tls13_handshake_as_server(tls_state_t *tls)
+{
+	uint8_t premaster[32];
+	uint8_t c_ap[SHA256_OUTSIZE];
+	uint8_t s_ap[SHA256_OUTSIZE];
+
+	tls13_send_server_hello(tls, premaster);
+	/* RFC 8446 D.4: client in compatibility mode gets CCS too */
+	if (tls->hsd->session_id_len)
+		send_change_cipher_spec(tls);
+	tls13_derive_handshake_keys(tls, premaster, /*server:*/ 1);
+
+	/* from now on everything is encrypted */
+
+	/* Empty EncryptedExtensions */
+	get_outbuf_fill_handshake_record(tls, HANDSHAKE_ENCRYPTED_EXTENSIONS, 4 + 2);
+	dbg(">> ENCRYPTED_EXTENSIONS");
+	tls13_xwrite_handshake_msg(tls, 4 + 2);
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	/* Resumed session is authenticated by PSK */
+	if (!tls->hsd->resumed)
+#endif
+	{
+		tls13_send_server_certificate(tls);
+		tls13_send_certificate_verify(tls);
+	}
+	tls13_send_finished(tls);
+
+	tls13_derive_app_secrets(tls, c_ap, s_ap);
+	tls13_set_traffic_keys(tls, s_ap, 0);
+
+	tls13_xread_handshake_msg(tls, "'client finished'");
+	tls13_get_finished(tls, "'client finished'");
+	tls13_set_traffic_keys(tls, c_ap, 1);
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (tls->hsd->tickets_ok & TICKETS_TLS13)
+		tls13_send_session_ticket(tls);
+#endif
+}
+#endif
+
 void FAST_FUNC tls_handshake_as_server(tls_state_t *tls,
-	const char *pem_filename)
+	struct tls_server_keys *sk)
 {
 	/* Allocate handshake data */
 	tls->hsd = xzalloc(sizeof(*tls->hsd));
-
-	/* Load server key(s) and certificate(s) from PEM file */
-	load_pem_key_cert_pairs(tls, pem_filename);
+	tls->hsd->sk = sk;
 
 	sha256_begin(&tls->hsd->handshake_hash_ctx);
 
@@ -3171,7 +4868,24 @@ void FAST_FUNC tls_handshake_as_server(tls_state_t *tls,
 	tls->expecting_first_packet = 1;
 	get_client_hello(tls);
 	tls->expecting_first_packet = 0;
+#if ENABLE_FEATURE_TLS_1_3
+	if (tls->flags & TLS13) {
+		tls13_handshake_as_server(tls);
+		goto free_hsd;
+	}
+#endif
 	send_server_hello(tls);
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (tls->hsd->resumed) {
+		/* Abbreviated handshake: we send Finished first */
+		set_server_keys(tls, NULL, 0);
+		send_change_cipher_spec(tls);
+		send_finished(tls, "server finished");
+		get_change_cipher_spec(tls);
+		get_finished(tls, "'client finished'");
+		goto free_hsd;
+	}
+#endif
 	send_server_certificate(tls);
 	if (tls->flags & NEED_EC_KEY)
 		send_server_key_exchange(tls);
@@ -3182,17 +4896,21 @@ void FAST_FUNC tls_handshake_as_server(tls_state_t *tls,
 	/* Get (encrypted) FINISHED from the client */
 	get_finished(tls, "'cliend finished'");
 
+#if ENABLE_FEATURE_TLS_SERVER_TICKETS
+	if (tls->hsd->tickets_ok & TICKETS_TLS12)
+		tls12_send_session_ticket(tls);
+#endif
 	send_change_cipher_spec(tls);
 	send_finished(tls, "server finished");
 
 	/* application data can be sent/received */
 
-	/* free handshake data */
-	psRsaKey_clear(&tls->hsd->rsa_priv_key);
-	free(tls->hsd->keys[0]);
-	free(tls->hsd->keys[1]);
-	free(tls->hsd->certs[0]);
-	free(tls->hsd->certs[1]);
+#if ENABLE_FEATURE_TLS_1_3
+ free_hsd:
+	free(tls->hsd->hs_buf);
+#endif
+	IF_FEATURE_TLS_SERVER_TICKETS(free(tls->hsd->session);)
+	/* free handshake data (keys stay for next connection) */
 //	if (PARANOIA)
 //		memset(tls->hsd, 0, sizeof(*tls->hsd));
 	free(tls->hsd);
@@ -105,6 +105,7 @@ void tls_get_random(void *buf, unsigned len) FAST_FUNC;
 #include "tls_pstm.h"
 #include "tls_aes.h"
 #include "tls_aesgcm.h"
+#include "tls_chacha.h"
 #include "tls_rsa.h"
 
 #define EC_CURVE_KEYSIZE   32
@@ -118,7 +119,7 @@ void curve_x25519_compute_premaster(
 		const uint8_t *privkey32, const uint8_t *peerkey32,
 		uint8_t *premaster32) FAST_FUNC;
 
-#if ENABLE_SSL_SERVER
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL || ENABLE_FEATURE_TLS_1_3
 void curve_P256_generate_keypair(
 		uint8_t *privkey32, uint8_t *pubkey2x32) FAST_FUNC;
 void curve_P256_compute_premaster(
@@ -40,6 +40,39 @@
  */
 #include "tls.h"
 
+#if AES_HWACCEL
+static void cpuid_eax_ebx_ecx(unsigned *eax, unsigned *ebx, unsigned *ecx, unsigned *edx)
+{
+	asm ("cpuid"
+		: "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		: "0" (*eax), "1" (*ebx), "2" (*ecx)
+	);
+}
+static smallint aesNI;
+static NOINLINE int get_aesNI(void)
+{
+	/* Leaf 1: ECX bit 25 is AES-NI, bit 1 is PCLMULQDQ.
+	 * (No AES-NI CPU lacks PCLMULQDQ, but some VMs hide it).
+	 */
+	unsigned eax = 1;
+	unsigned ecx = 0;
+	unsigned ebx = 0;
+	unsigned edx;
+	cpuid_eax_ebx_ecx(&eax, &ebx, &ecx, &edx);
+	ecx &= (1 << 25) | (1 << 1);
+	aesNI = (ecx == ((1 << 25) | (1 << 1))) ? 1 : -1;
+	return aesNI;
+}
+int FAST_FUNC aes_have_NI(void)
+{
+	int ni = aesNI;
+	if (!ni)
+		ni = get_aesNI();
+	return ni > 0;
+}
+struct ASM_expects_240_rounds { char t[1 - 2*(offsetof(struct tls_aes, rounds) != 240)]; };
+#endif
+
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM -
 // This can be useful in (embedded) bootloader applications, where ROM is often limited.
@@ -356,6 +389,12 @@ void FAST_FUNC aes_encrypt_one_block(struct tls_aes *aes, const void *data, void
 	const uint8_t *pt = data;
 	uint8_t *ct = dst;
 
+#if AES_HWACCEL
+	if (aes_have_NI()) {
+		aes_encrypt_one_block_NI(aes, data, dst);
+		return;
+	}
+#endif
 	for (i = 0; i < 16; i++)
 		astate[i] = pt[i];
 	aes_encrypt_1(aes, astate);
@@ -391,6 +430,40 @@ void FAST_FUNC aes_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data,
 	}
 }
 
+/* Counter mode as used by AES-GCM: nonce[12..15] is a big-endian counter
+ * of the first block, it is incremented (mod 2^32) for every block.
+ * dst may be the same as data, or be below it.
+ */
+void FAST_FUNC aes_ctr_encrypt(struct tls_aes *aes, void *nonce, const void *data, size_t len, void *dst)
+{
+	uint8_t scratch[16];
+	uint8_t *counter = (uint8_t*)nonce + 12;
+
+	const uint8_t *pt = data;
+	uint8_t *ct = dst;
+
+#if AES_HWACCEL
+	if (aes_have_NI()) {
+		unsigned blocks = len / 16;
+		aes_ctr_blocks_NI(aes, nonce, pt, ct, blocks);
+		put_unaligned_be32(get_unaligned_be32(counter) + blocks, counter);
+		pt += blocks * 16;
+		ct += blocks * 16;
+		len %= 16;
+	}
+#endif
+	while (len > 0) {
+		unsigned n = len < 16 ? len : 16;
+
+		aes_encrypt_one_block(aes, nonce, scratch);
+		put_unaligned_be32(get_unaligned_be32(counter) + 1, counter);
+		xorbuf_3(ct, scratch, pt, n);
+		ct += n;
+		pt += n;
+		len -= n;
+	}
+}
+
 static void aes_decrypt_1(struct tls_aes *aes, unsigned astate[16])
 {
 	unsigned rounds = aes->rounds;
@@ -459,3 +532,116 @@ void FAST_FUNC aes_cbc_decrypt(struct tls_aes *aes, void *iv, const void *data,
 		len -= 16;
 	}
 }
+
+#if ENABLE_UNIT_TEST
+
+/* AES-GCM encryption done the way tls.c does it. dst gets len+16 bytes:
+ * ciphertext followed by the tag.
+ */
+static void aesgcm_encrypt_for_test(const uint8_t *key, unsigned key_len,
+		const uint8_t *iv, const uint8_t *aad, unsigned aad_len,
+		const uint8_t *pt, unsigned len, uint8_t *dst)
+{
+	struct tls_aes aes;
+	uint8_t h[16], nonce[16], a[16], s[16];
+
+	aes_setkey(&aes, key, key_len);
+	memset(h, 0, 16);
+	aes_encrypt_one_block(&aes, h, h);
+	memcpy(nonce, iv, 12);
+	put_unaligned_be32(2, nonce + 12);
+	aes_ctr_encrypt(&aes, nonce, pt, len, dst);
+	memset(a, 0, 16);
+	memcpy(a, aad, aad_len);
+	aesgcm_GHASH(h, a, aad_len, dst, len, s);
+	put_unaligned_be32(1, nonce + 12);
+	aes_encrypt_one_block(&aes, nonce, nonce);
+	xorbuf_3(dst + len, nonce, s, 16);
+}
+
+BBUNIT_DEFINE_TEST(aes_gcm)
+{
+	/* Test cases 2, 3 and 15 from the GCM spec (McGrew, Viega).
+	 * The third vector is test case 4 with AAD cut to 13 bytes,
+	 * the size TLS 1.2 uses; tag computed with openssl aes-128-ecb
+	 * and a reference GHASH which reproduce test cases 2-4.
+	 */
+	static const struct {
+		const char *key, *iv, *aad, *pt, *ct_tag;
+	} test_array[] = {
+		{ "00000000000000000000000000000000",
+		  "000000000000000000000000",
+		  "",
+		  "00000000000000000000000000000000",
+		  "0388dace60b6a392f328c2b971b2fe78"
+		  "ab6e47d42cec13bdf53a67b21257bddf" },
+		{ "feffe9928665731c6d6a8f9467308308",
+		  "cafebabefacedbaddecaf888",
+		  "",
+		  "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+		  "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+		  "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+		  "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985"
+		  "4d5c2af327cd64a62cf35abd2ba6fab4" },
+		{ "feffe9928665731c6d6a8f9467308308",
+		  "cafebabefacedbaddecaf888",
+		  "feedfacedeadbeeffeedfacede",
+		  "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+		  "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+		  "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+		  "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091"
+		  "1f770e857224ff6aebf7fb05cbb1e52d" },
+		{ "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+		  "cafebabefacedbaddecaf888",
+		  "",
+		  "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+		  "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b391aafd255",
+		  "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+		  "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad"
+		  "b094dac5d93471bdec1a502270e3cc6c" },
+	};
+	uint8_t key[32], iv[12], aad[16];
+	uint8_t pt[10 * 16 + 15], ct[sizeof(pt) + 16];
+	char hex[sizeof(ct) * 2 + 1];
+	unsigned key_len, aad_len, len;
+	int i, pass;
+
+	/* First pass runs generic code, second one AES-NI if CPU has it */
+	for (pass = 0; pass < 2; pass++) {
+#if AES_HWACCEL
+		aesNI = pass ? 0 : -1;
+#endif
+		for (i = 0; i < ARRAY_SIZE(test_array); i++) {
+			key_len = (char*)hex2bin((char*)key, test_array[i].key, sizeof(key)) - (char*)key;
+			hex2bin((char*)iv, test_array[i].iv, sizeof(iv));
+			aad_len = (char*)hex2bin((char*)aad, test_array[i].aad, sizeof(aad)) - (char*)aad;
+			len = (char*)hex2bin((char*)pt, test_array[i].pt, sizeof(pt)) - (char*)pt;
+			aesgcm_encrypt_for_test(key, key_len, iv, aad, aad_len, pt, len, ct);
+			*bin2hex(hex, (char*)ct, len + 16) = '\0';
+			BBUNIT_ASSERT_STREQ(test_array[i].ct_tag, hex);
+		}
+	}
+
+#if AES_HWACCEL
+	/* NI code does 4 blocks at a time, generic code does the tail:
+	 * check every length against generic code
+	 */
+	if (aes_have_NI()) {
+		uint8_t ct_NI[sizeof(ct)];
+
+		for (i = 0; i < sizeof(pt); i++)
+			pt[i] = i * 7;
+		for (len = 0; len <= sizeof(pt); len++) {
+			aesNI = -1;
+			aesgcm_encrypt_for_test(key, 16, iv, aad, 13, pt, len, ct);
+			aesNI = 1;
+			aesgcm_encrypt_for_test(key, 16, iv, aad, 13, pt, len, ct_NI);
+			BBUNIT_ASSERT_EQ(0, memcmp(ct, ct_NI, len + 16));
+		}
+	}
+#endif
+
+	BBUNIT_ENDTEST;
+}
+
+#endif /* ENABLE_UNIT_TEST */
@@ -12,3 +12,16 @@ void aes_encrypt_one_block(struct tls_aes *aes, const void *data, void *dst) FAS
 
 void aes_cbc_encrypt(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst) FAST_FUNC;
 void aes_cbc_decrypt(struct tls_aes *aes, void *iv, const void *data, size_t len, void *dst) FAST_FUNC;
+
+void aes_ctr_encrypt(struct tls_aes *aes, void *nonce, const void *data, size_t len, void *dst) FAST_FUNC;
+
+#if ENABLE_FEATURE_TLS_AES_HWACCEL && defined(__GNUC__) && defined(__x86_64__)
+# define AES_HWACCEL 1
+int aes_have_NI(void) FAST_FUNC;
+void aes_encrypt_one_block_NI(struct tls_aes *aes, const void *data, void *dst) FAST_FUNC;
+void aes_ctr_blocks_NI(struct tls_aes *aes, const void *nonce, const void *data, void *dst, unsigned blocks) FAST_FUNC;
+void aesgcm_GHASH_blocks_NI(uint8_t *x, const uint8_t *h, const void *data, unsigned blocks) FAST_FUNC;
+#else
+# define AES_HWACCEL 0
+# define aes_have_NI() 0
+#endif
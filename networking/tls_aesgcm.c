@@ -123,16 +123,42 @@ static void GMULT(byte* X, byte* Y)
     XMEMCPY(X, Z, AES_BLOCK_SIZE);
 }
 
+#if AES_HWACCEL
+static void aesgcm_GHASH_NI(const byte* h,
+    const byte* a, unsigned aSz,
+    const byte* c, unsigned cSz,
+    byte* s
+)
+{
+    byte x[AES_BLOCK_SIZE];
+    byte scratch[AES_BLOCK_SIZE];
+    unsigned partial = cSz % AES_BLOCK_SIZE;
+
+    XMEMSET(x, 0, AES_BLOCK_SIZE);
+    aesgcm_GHASH_blocks_NI(x, h, a, 1);
+    aesgcm_GHASH_blocks_NI(x, h, c, cSz / AES_BLOCK_SIZE);
+    if (partial != 0) {
+        XMEMSET(scratch, 0, AES_BLOCK_SIZE);
+        XMEMCPY(scratch, c + cSz - partial, partial);
+        aesgcm_GHASH_blocks_NI(x, h, scratch, 1);
+    }
+    XMEMSET(scratch, 0, AES_BLOCK_SIZE);
+    *(uint32_t*)(scratch + 4) = SWAP_BE32(aSz * 8);
+    *(uint32_t*)(scratch + 12) = SWAP_BE32(cSz * 8);
+    aesgcm_GHASH_blocks_NI(x, h, scratch, 1);
+    XMEMCPY(s, x, AES_BLOCK_SIZE);
+}
+#endif
+
 //bbox:
-// for TLS AES-GCM, a (which is AAD) is always 13 bytes long, and bbox code provides
-// extra 3 zeroed bytes, making it a[16], or a[AES_BLOCK_SIZE].
+// for TLS AES-GCM, a (which is AAD) is 13 bytes long (5 bytes in TLS 1.3),
+// and bbox code provides zeroed bytes after it, making it a[16], or a[AES_BLOCK_SIZE].
 // Resulting auth tag in s[] is also always AES_BLOCK_SIZE bytes.
 //
 // This allows some simplifications.
-#define aSz 13
 #define sSz AES_BLOCK_SIZE
 void FAST_FUNC aesgcm_GHASH(byte* h,
-    const byte* a, //unsigned aSz,
+    const byte* a, unsigned aSz,
     const byte* c, unsigned cSz,
     byte* s //, unsigned sSz
 )
@@ -142,6 +168,13 @@ void FAST_FUNC aesgcm_GHASH(byte* h,
     unsigned blocks, partial;
     //was: byte* h = aes->H;
 
+#if AES_HWACCEL
+    if (aes_have_NI()) {
+        aesgcm_GHASH_NI(h, a, aSz, c, cSz, s);
+        return;
+    }
+#endif
+
     //XMEMSET(x, 0, AES_BLOCK_SIZE);
 
     /* Hash in A, the Additional Authentication Data */
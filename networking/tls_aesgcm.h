@@ -5,7 +5,7 @@
  */
 
 void aesgcm_GHASH(uint8_t* h,
-	const uint8_t* a, //unsigned aSz,
+	const uint8_t* a, unsigned aSz,
 	const uint8_t* c, unsigned cSz,
 	uint8_t* s //, unsigned sSz
 ) FAST_FUNC;
@@ -0,0 +1,258 @@
+/*
+ * Licensed under GPLv2, see file LICENSE in this source tree.
+ */
+/* ChaCha20 and Poly1305 (RFC 8439), and their AEAD combination
+ * for TLS_ECDHE_*_WITH_CHACHA20_POLY1305_SHA256 (RFC 7905).
+ * Unlike table-driven AES, both use only add/xor/rotate/multiply:
+ * constant-time, and fast without special CPU insns.
+ */
+#include "tls.h"
+
+/* GCC and clang lower these to SIMD insns (SSE2, NEON, ...) if available,
+ * or to ordinary 32-bit ops otherwise.
+ */
+typedef uint32_t vec4 __attribute__((vector_size(16)));
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) do { \
+	a += b; d ^= a; d = ROTL(d, 16); \
+	c += d; b ^= c; b = ROTL(b, 12); \
+	a += b; d ^= a; d = ROTL(d, 8); \
+	c += d; b ^= c; b = ROTL(b, 7); \
+} while (0)
+
+/* Generate four consecutive 64-byte keystream blocks, first one
+ * has block counter in[12]. Each vector lane computes one block,
+ * thus no shuffling between lanes is needed.
+ */
+static void chacha20_block4(const uint32_t in[16], uint8_t *out)
+{
+	vec4 x[16];
+	vec4 orig[16];
+	uint32_t w[16][4];
+	unsigned i, j;
+
+	for (i = 0; i < 16; i++) {
+		vec4 v = { in[i], in[i], in[i], in[i] };
+		x[i] = v;
+	}
+	{
+		vec4 inc = { 0, 1, 2, 3 };
+		x[12] += inc;
+	}
+	memcpy(orig, x, sizeof(x));
+
+	for (i = 0; i < 10; i++) {
+		/* column rounds */
+		QUARTERROUND(x[0], x[4], x[ 8], x[12]);
+		QUARTERROUND(x[1], x[5], x[ 9], x[13]);
+		QUARTERROUND(x[2], x[6], x[10], x[14]);
+		QUARTERROUND(x[3], x[7], x[11], x[15]);
+		/* diagonal rounds */
+		QUARTERROUND(x[0], x[5], x[10], x[15]);
+		QUARTERROUND(x[1], x[6], x[11], x[12]);
+		QUARTERROUND(x[2], x[7], x[ 8], x[13]);
+		QUARTERROUND(x[3], x[4], x[ 9], x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		x[i] += orig[i];
+
+	memcpy(w, x, sizeof(w));
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < 16; i++) {
+			put_unaligned_le32(w[i][j], out);
+			out += 4;
+		}
+	}
+}
+
+/* Poly1305 with 26-bit limbs: all products fit in 64 bits
+ * (derived from public domain poly1305-donna-32)
+ */
+struct poly1305 {
+	uint32_t r[5];
+	uint32_t h[5];
+	uint32_t pad[4];
+};
+
+static void poly1305_init(struct poly1305 *p, const uint8_t *key)
+{
+	/* r &= 0xffffffc0ffffffc0ffffffc0fffffff */
+	p->r[0] = (get_unaligned_le32(key +  0)     ) & 0x3ffffff;
+	p->r[1] = (get_unaligned_le32(key +  3) >> 2) & 0x3ffff03;
+	p->r[2] = (get_unaligned_le32(key +  6) >> 4) & 0x3ffc0ff;
+	p->r[3] = (get_unaligned_le32(key +  9) >> 6) & 0x3f03fff;
+	p->r[4] = (get_unaligned_le32(key + 12) >> 8) & 0x00fffff;
+	memset(p->h, 0, sizeof(p->h));
+	p->pad[0] = get_unaligned_le32(key + 16);
+	p->pad[1] = get_unaligned_le32(key + 20);
+	p->pad[2] = get_unaligned_le32(key + 24);
+	p->pad[3] = get_unaligned_le32(key + 28);
+}
+
+/* Process len bytes, zero-padding the last partial block (AEAD does that) */
+static void poly1305_update_padded(struct poly1305 *p, const uint8_t *m, unsigned len)
+{
+	const uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+	const uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+	uint8_t block[16];
+
+	while (len != 0) {
+		uint64_t d0, d1, d2, d3, d4;
+		uint32_t c;
+
+		if (len < 16) {
+			memset(block, 0, sizeof(block));
+			memcpy(block, m, len);
+			m = block;
+			len = 16;
+		}
+		h0 += (get_unaligned_le32(m +  0)     ) & 0x3ffffff;
+		h1 += (get_unaligned_le32(m +  3) >> 2) & 0x3ffffff;
+		h2 += (get_unaligned_le32(m +  6) >> 4) & 0x3ffffff;
+		h3 += (get_unaligned_le32(m +  9) >> 6) & 0x3ffffff;
+		h4 += (get_unaligned_le32(m + 12) >> 8) | (1 << 24);
+
+		d0 = ((uint64_t)h0 * r0) + ((uint64_t)h1 * s4) + ((uint64_t)h2 * s3) + ((uint64_t)h3 * s2) + ((uint64_t)h4 * s1);
+		d1 = ((uint64_t)h0 * r1) + ((uint64_t)h1 * r0) + ((uint64_t)h2 * s4) + ((uint64_t)h3 * s3) + ((uint64_t)h4 * s2);
+		d2 = ((uint64_t)h0 * r2) + ((uint64_t)h1 * r1) + ((uint64_t)h2 * r0) + ((uint64_t)h3 * s4) + ((uint64_t)h4 * s3);
+		d3 = ((uint64_t)h0 * r3) + ((uint64_t)h1 * r2) + ((uint64_t)h2 * r1) + ((uint64_t)h3 * r0) + ((uint64_t)h4 * s4);
+		d4 = ((uint64_t)h0 * r4) + ((uint64_t)h1 * r3) + ((uint64_t)h2 * r2) + ((uint64_t)h3 * r1) + ((uint64_t)h4 * r0);
+
+		c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+		d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+		d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+		d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+		d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+		h1 += c;
+
+		m += 16;
+		len -= 16;
+	}
+	p->h[0] = h0; p->h[1] = h1; p->h[2] = h2; p->h[3] = h3; p->h[4] = h4;
+}
+
+static void poly1305_finish(struct poly1305 *p, uint8_t *mac)
+{
+	uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+	uint32_t g0, g1, g2, g3, g4;
+	uint32_t c, mask;
+	uint64_t f;
+
+	/* fully carry h */
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	/* g = h + -p = h - (2^130 - 5) */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1 << 26);
+
+	/* h = (h >= p) ? g : h, without branches */
+	mask = (g4 >> 31) - 1;
+	h0 = (h0 & ~mask) | (g0 & mask);
+	h1 = (h1 & ~mask) | (g1 & mask);
+	h2 = (h2 & ~mask) | (g2 & mask);
+	h3 = (h3 & ~mask) | (g3 & mask);
+	h4 = (h4 & ~mask) | (g4 & mask);
+
+	/* h = h % 2^128, in 32-bit words */
+	h0 = (h0      ) | (h1 << 26);
+	h1 = (h1 >>  6) | (h2 << 20);
+	h2 = (h2 >> 12) | (h3 << 14);
+	h3 = (h3 >> 18) | (h4 <<  8);
+
+	/* mac = (h + pad) % 2^128 */
+	f = (uint64_t)h0 + p->pad[0];             put_unaligned_le32((uint32_t)f, mac +  0);
+	f = (uint64_t)h1 + p->pad[1] + (f >> 32); put_unaligned_le32((uint32_t)f, mac +  4);
+	f = (uint64_t)h2 + p->pad[2] + (f >> 32); put_unaligned_le32((uint32_t)f, mac +  8);
+	f = (uint64_t)h3 + p->pad[3] + (f >> 32); put_unaligned_le32((uint32_t)f, mac + 12);
+}
+
+/* RFC 8439 2.8: tag = Poly1305(otk, AAD || pad16 || C || pad16 || len(AAD) || len(C)),
+ * where otk is the first 32 bytes of ChaCha20 keystream block 0,
+ * and data is xored with keystream starting from block 1.
+ */
+static void chacha20poly1305(const uint8_t *key, const uint8_t *nonce,
+		const uint8_t *aad, unsigned aad_len,
+		uint8_t *data, unsigned len, uint8_t *tag,
+		int encrypt)
+{
+	uint32_t state[16];
+	uint8_t keystream[4 * 64];
+	uint8_t lens[16];
+	struct poly1305 p;
+	unsigned ofs, i;
+
+	state[0] = 0x61707865; /* "expand 32-byte k" */
+	state[1] = 0x3320646e;
+	state[2] = 0x79622d32;
+	state[3] = 0x6b206574;
+	for (i = 0; i < 8; i++)
+		state[4 + i] = get_unaligned_le32(key + i * 4);
+	state[12] = 0;
+	state[13] = get_unaligned_le32(nonce + 0);
+	state[14] = get_unaligned_le32(nonce + 4);
+	state[15] = get_unaligned_le32(nonce + 8);
+
+	chacha20_block4(state, keystream);
+	poly1305_init(&p, keystream);
+	poly1305_update_padded(&p, aad, aad_len);
+	if (!encrypt)
+		poly1305_update_padded(&p, data, len);
+
+	ofs = 64; /* block 0 was used for Poly1305 key */
+	for (i = 0; i < len;) {
+		unsigned n;
+
+		if (ofs == sizeof(keystream)) {
+			state[12] += 4;
+			chacha20_block4(state, keystream);
+			ofs = 0;
+		}
+		n = sizeof(keystream) - ofs;
+		if (n > len - i)
+			n = len - i;
+		xorbuf(data + i, keystream + ofs, n);
+		ofs += n;
+		i += n;
+	}
+
+	if (encrypt)
+		poly1305_update_padded(&p, data, len);
+	memset(lens, 0, sizeof(lens));
+	lens[0] = aad_len;
+	put_unaligned_le32(len, lens + 8);
+	poly1305_update_padded(&p, lens, 16);
+	poly1305_finish(&p, tag);
+}
+
+void FAST_FUNC chacha20poly1305_encrypt(const uint8_t *key, const uint8_t *nonce,
+		const uint8_t *aad, unsigned aad_len,
+		uint8_t *data, unsigned len, uint8_t *tag)
+{
+	chacha20poly1305(key, nonce, aad, aad_len, data, len, tag, 1);
+}
+
+int FAST_FUNC chacha20poly1305_decrypt(const uint8_t *key, const uint8_t *nonce,
+		const uint8_t *aad, unsigned aad_len,
+		uint8_t *data, unsigned len, const uint8_t *tag)
+{
+	uint8_t mytag[16];
+	unsigned diff, i;
+
+	chacha20poly1305(key, nonce, aad, aad_len, data, len, mytag, 0);
+	/* constant time compare */
+	diff = 0;
+	for (i = 0; i < 16; i++)
+		diff |= mytag[i] ^ tag[i];
+	return diff == 0;
+}
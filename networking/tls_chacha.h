@@ -0,0 +1,15 @@
+/*
+ * Licensed under GPLv2, see file LICENSE in this source tree.
+ */
+
+/* RFC 8439 AEAD_CHACHA20_POLY1305. AAD is 13 bytes in TLS 1.2,
+ * 5 bytes (record header) in TLS 1.3, it must be shorter than 256 bytes.
+ * Data is encrypted/decrypted in place, tag is 16 bytes.
+ */
+void chacha20poly1305_encrypt(const uint8_t *key, const uint8_t *nonce,
+	const uint8_t *aad, unsigned aad_len,
+	uint8_t *data, unsigned len, uint8_t *tag) FAST_FUNC;
+/* Returns 0 if tag does not match */
+int chacha20poly1305_decrypt(const uint8_t *key, const uint8_t *nonce,
+	const uint8_t *aad, unsigned aad_len,
+	uint8_t *data, unsigned len, const uint8_t *tag) FAST_FUNC;
@@ -478,7 +478,7 @@ int32 FAST_FUNC pstm_read_unsigned_bin(pstm_int *a, unsigned char *b, int32 c)
 /******************************************************************************/
 /*
 */
-static int pstm_count_bits(pstm_int * a)
+int FAST_FUNC pstm_count_bits(pstm_int * a)
 {
 	int     r; //bbox: was int16
 	pstm_digit q;
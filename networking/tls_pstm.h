@@ -156,7 +156,7 @@ extern int32 pstm_init_size(psPool_t *pool, pstm_int * a, uint32 size) FAST_FUNC
 //made static:extern int32 pstm_init_copy(psPool_t *pool, pstm_int * a, pstm_int * b,
 //made static:				int toSqr); //bbox: was int16 toSqr
 
-//made static:extern int pstm_count_bits (pstm_int * a) FAST_FUNC; //bbox: was returning int16
+extern int pstm_count_bits (pstm_int * a) FAST_FUNC; //bbox: was returning int16
 
 //bbox: pool unused
 #define pstm_init_for_read_unsigned_bin(pool, a, len) \
@@ -212,7 +212,7 @@ int32 FAST_FUNC psRsaEncryptPub(psPool_t *pool, psRsaKey_t *key,
 	return size;
 }
 
-#if ENABLE_SSL_SERVER // || ENABLE_FEATURE_HTTPD_SSL
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL
 
 #define psRsaEncryptPriv(pool, key, in, inlen, out, outlen, data) \
         psRsaEncryptPriv(      key, in, inlen, out, outlen)
@@ -294,6 +294,54 @@ int32 FAST_FUNC privRsaEncryptSignedElement(psPool_t *pool, psRsaKey_t *key, //b
 	return rc;
 }
 
+#if ENABLE_FEATURE_TLS_1_3
+/* RFC 8017 9.1.1 EMSA-PSS-ENCODE with SHA256, MGF1-SHA256 and 32-byte salt,
+ * then RSASP1: this is "rsa_pss_rsae_sha256" signature of TLS 1.3.
+ */
+int32 FAST_FUNC privRsaSignPssSha256(psRsaKey_t *key,
+		const unsigned char *hash32, unsigned char *out, uint32 outlen)
+{
+	sha256_ctx_t ctx;
+	unsigned char mask[32];
+	unsigned char *H;
+	uint32 emBits, emLen, dbLen, i;
+	int32 err;
+
+	emBits = pstm_count_bits(&key->N) - 1;
+	emLen = (emBits + 7) / 8;
+	if (outlen < key->size || emLen < 32 + 32 + 2)
+		return PS_ARG_FAIL;
+
+	/* EM = maskedDB || H || 0xbc, DB = 00..00 || 01 || salt */
+	dbLen = emLen - 32 - 1;
+	H = out + dbLen;
+	tls_get_random(H - 32, 32); /* salt */
+	memset(mask, 0, 8);
+	sha256_begin(&ctx);
+	sha256_hash(&ctx, mask, 8);
+	sha256_hash(&ctx, hash32, 32);
+	sha256_hash(&ctx, H - 32, 32);
+	sha256_end(&ctx, H);
+	memset(out, 0, dbLen - 32 - 1);
+	out[dbLen - 32 - 1] = 1;
+	for (i = 0; i < dbLen; i += 32) {
+		uint32_t counter = SWAP_BE32(i / 32);
+		sha256_begin(&ctx);
+		sha256_hash(&ctx, H, 32);
+		sha256_hash(&ctx, &counter, 4);
+		sha256_end(&ctx, mask);
+		xorbuf(out + i, mask, min(32, dbLen - i));
+	}
+	out[0] &= 0xff >> (8 * emLen - emBits);
+	out[emLen - 1] = 0xbc;
+
+	err = psRsaCrypt(NULL, out, emLen, out, &outlen, key, PRIVKEY_TYPE, NULL);
+	if (err < PS_SUCCESS)
+		return err;
+	return outlen;
+}
+#endif
+
 /* Remove PKCS#1 padding (Type 2) from decrypted data
  * Format: 00 || 02 || PS || 00 || M
  * Returns length of unpadded message, or negative on error
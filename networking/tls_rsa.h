@@ -42,3 +42,7 @@ int32 psRsaDecryptPriv(psPool_t *pool, psRsaKey_t *key,
 int32 privRsaEncryptSignedElement(psPool_t *pool, psRsaKey_t *key,
                                                 unsigned char *in, uint32 inlen,
                                                 unsigned char *out, uint32 outlen, void *data) FAST_FUNC;
+
+int32 privRsaSignPssSha256(psRsaKey_t *key,
+                                                const unsigned char *hash32,
+                                                unsigned char *out, uint32 outlen) FAST_FUNC;
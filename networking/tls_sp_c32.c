@@ -1527,7 +1527,7 @@ static void sp_ecc_make_key_256(sp_digit privkey[8], uint8_t *pubkey)
  * conversions are handled internally within these functions.
  */
 
-#if ENABLE_SSL_SERVER
+#if ENABLE_SSL_SERVER || ENABLE_FEATURE_HTTPD_SSL || ENABLE_FEATURE_TLS_1_3
 /* Generate P256 keypair: random private key + corresponding public key */
 void FAST_FUNC curve_P256_generate_keypair(uint8_t *privkey32, uint8_t *pubkey2x32)
 {
@@ -53,7 +53,38 @@
 #endif
 
 /* globals */
-#define g_leases ((struct dyn_lease*)ptr_to_globals)
+struct globals {
+	/* Index of g_leases[], entries are referred to by their number.
+	 * slot[0..used-1] is a binary heap of used entries keyed by
+	 * expiration time: slot[0] is the one which expires first.
+	 * slot[used..max_leases-1] are empty entries.
+	 * pos[N] is the position of entry N in slot[].
+	 */
+	uint32_t *slot;
+	uint32_t *pos;
+	unsigned used;
+	/* Hash chains of used entries by MAC and by IP.
+	 * Heads and links are entry number + 1, 0 ends the chain.
+	 */
+	unsigned hash_mask;
+	uint32_t *mac_head;
+	uint32_t *nip_head;
+	uint32_t *mac_next;
+	uint32_t *nip_next;
+	/* Bit per address of start_ip..end_ip, set if it has a lease */
+	uint32_t *leased;
+	/* Lease file is a journal: a snapshot of the table written
+	 * at journal_written_at, followed by records of changed leases.
+	 * journal_fd is -1 until the snapshot is written.
+	 */
+	int journal_fd;
+	unsigned journal_len; /* records in the file */
+	int64_t journal_written_at;
+	smallint leases_dirty; /* there are changes not in the file */
+	struct dyn_lease leases[];
+} FIX_ALIASING;
+#define G (*ptr_to_globals)
+#define g_leases (G.leases)
 /* struct server_data_t server_data is in bb_common_bufsiz1 */
 
 struct static_lease {
@@ -132,40 +163,209 @@ static int is_nip_reserved_as_static(uint32_t nip)
 	return 0;
 }
 
-/* Find the oldest expired lease, NULL if there are no expired leases */
-static struct dyn_lease *oldest_expired_lease(void)
+static void init_lease_index(unsigned num_ips)
 {
-	struct dyn_lease *oldest_lease = NULL;
-	leasetime_t oldest_time = time(NULL);
-	unsigned i;
+	unsigned max = server_data.max_leases;
+	unsigned hsize, i;
+	uint32_t *p;
+
+	hsize = 16;
+	while (hsize < max)
+		hsize <<= 1;
+	G.hash_mask = hsize - 1;
+
+	p = xzalloc((max * 4 + hsize * 2 + (num_ips + 31) / 32) * sizeof(*p));
+	G.slot = p; p += max;
+	G.pos = p; p += max;
+	G.mac_next = p; p += max;
+	G.nip_next = p; p += max;
+	G.mac_head = p; p += hsize;
+	G.nip_head = p; p += hsize;
+	G.leased = p;
+
+	for (i = 0; i < max; i++)
+		G.slot[i] = G.pos[i] = i;
+}
 
-	/* Unexpired leases have g_leases[i].expires >= current time
-	 * and therefore can't ever match */
-	for (i = 0; i < server_data.max_leases; i++) {
-		if (g_leases[i].expires == 0 /* empty entry */
-		 || g_leases[i].expires < oldest_time
-		) {
-			oldest_time = g_leases[i].expires;
-			oldest_lease = &g_leases[i];
-		}
+static unsigned hash_u32(uint32_t v)
+{
+	v *= 0x9e3779b1;
+	return (v ^ (v >> 16)) & G.hash_mask;
+}
+
+static unsigned hash_mac(const uint8_t *mac)
+{
+	/* First bytes are vendor's, they vary least */
+	return hash_u32(((uint32_t)mac[2] << 24) + (mac[3] << 16) + (mac[4] << 8) + mac[5]
+			+ (mac[0] << 8) + mac[1]);
+}
+
+static int is_zero_mac(const uint8_t *mac)
+{
+	return (mac[0] | mac[1] | mac[2] | mac[3] | mac[4] | mac[5]) == 0;
+}
+
+/* Bit number in G.leased[], or -1 if not in start_ip..end_ip */
+static int leased_bit(uint32_t nip)
+{
+	uint32_t ip = ntohl(nip);
+	if (ip < server_data.start_ip || ip > server_data.end_ip)
+		return -1;
+	return ip - server_data.start_ip;
+}
+
+static void unlink_from_chain(uint32_t *pp, uint32_t *next, unsigned n)
+{
+	while (*pp != n + 1)
+		pp = &next[*pp - 1];
+	*pp = next[n];
+}
+
+static void heap_swap(unsigned a, unsigned b)
+{
+	uint32_t t = G.slot[a];
+	G.slot[a] = G.slot[b];
+	G.slot[b] = t;
+	G.pos[G.slot[a]] = a;
+	G.pos[G.slot[b]] = b;
+}
+
+static void heap_sift(unsigned i)
+{
+	/* Up */
+	while (i != 0) {
+		unsigned parent = (i - 1) / 2;
+		if (g_leases[G.slot[parent]].expires <= g_leases[G.slot[i]].expires)
+			break;
+		heap_swap(i, parent);
+		i = parent;
+	}
+	/* Down */
+	for (;;) {
+		unsigned c = i * 2 + 1;
+		if (c >= G.used)
+			break;
+		if (c + 1 < G.used
+		 && g_leases[G.slot[c + 1]].expires < g_leases[G.slot[c]].expires
+		)
+			c++;
+		if (g_leases[G.slot[i]].expires <= g_leases[G.slot[c]].expires)
+			break;
+		heap_swap(i, c);
+		i = c;
 	}
-	return oldest_lease;
 }
 
-/* Clear out all leases with matching nonzero chaddr OR yiaddr.
- * If chaddr == NULL, this is a conflict lease.
- */
-static void clear_leases(const uint8_t *chaddr, uint32_t yiaddr)
+static int is_used_lease(struct dyn_lease *lease)
 {
+	return G.pos[lease - g_leases] < G.used;
+}
+
+/* Lease's fields are set: add it to heap, hashes and bitmap */
+static void link_lease(struct dyn_lease *lease)
+{
+	unsigned n = lease - g_leases;
+	unsigned h;
+	int bit;
+
+	/* Move from the empty part of slot[] to the end of heap */
+	heap_swap(G.pos[n], G.used);
+	G.used++;
+	heap_sift(G.pos[n]);
+
+	if (!is_zero_mac(lease->lease_mac)) {
+		h = hash_mac(lease->lease_mac);
+		G.mac_next[n] = G.mac_head[h];
+		G.mac_head[h] = n + 1;
+	}
+	h = hash_u32(lease->lease_nip);
+	G.nip_next[n] = G.nip_head[h];
+	G.nip_head[h] = n + 1;
+
+	bit = leased_bit(lease->lease_nip);
+	if (bit >= 0)
+		G.leased[bit / 32] |= (1U << (bit % 32));
+}
+
+/* Make it an empty entry */
+static void unlink_lease(struct dyn_lease *lease)
+{
+	unsigned n = lease - g_leases;
 	unsigned i;
+	int bit;
 
-	for (i = 0; i < server_data.max_leases; i++) {
-		if ((chaddr && memcmp(g_leases[i].lease_mac, chaddr, 6) == 0)
-		 || (yiaddr && g_leases[i].lease_nip == yiaddr)
-		) {
-			memset(&g_leases[i], 0, sizeof(g_leases[i]));
-		}
+	if (!is_used_lease(lease))
+		return;
+
+	if (!is_zero_mac(lease->lease_mac))
+		unlink_from_chain(&G.mac_head[hash_mac(lease->lease_mac)], G.mac_next, n);
+	unlink_from_chain(&G.nip_head[hash_u32(lease->lease_nip)], G.nip_next, n);
+
+	bit = leased_bit(lease->lease_nip);
+	if (bit >= 0)
+		G.leased[bit / 32] &= ~(1U << (bit % 32));
+
+	/* Replace it with the last heap element */
+	i = G.pos[n];
+	G.used--;
+	heap_swap(i, G.used);
+	if (i < G.used)
+		heap_sift(i);
+
+	memset(lease, 0, sizeof(*lease));
+}
+
+static void set_lease_expires(struct dyn_lease *lease, leasetime_t expires)
+{
+	lease->expires = expires;
+	heap_sift(G.pos[lease - g_leases]);
+}
+
+/* Find an empty entry, or the oldest expired lease.
+ * NULL if there are no expired leases.
+ */
+static struct dyn_lease *oldest_expired_lease(void)
+{
+	struct dyn_lease *oldest_lease;
+
+	if (G.used < server_data.max_leases)
+		return &g_leases[G.slot[G.used]];
+	if (G.used == 0) /* max_leases 0 */
+		return NULL;
+	oldest_lease = &g_leases[G.slot[0]];
+	if (oldest_lease->expires < (leasetime_t) time(NULL))
+		return oldest_lease;
+	return NULL;
+}
+
+/* Find the lease that matches MAC, NULL if no match */
+static struct dyn_lease *find_lease_by_mac(const uint8_t *mac)
+{
+	uint32_t n;
+
+	if (is_zero_mac(mac))
+		return NULL;
+	n = G.mac_head[hash_mac(mac)];
+	while (n != 0) {
+		if (memcmp(g_leases[n - 1].lease_mac, mac, 6) == 0)
+			return &g_leases[n - 1];
+		n = G.mac_next[n - 1];
 	}
+	return NULL;
+}
+
+/* Find the lease that matches IP, NULL is no match */
+static struct dyn_lease *find_lease_by_nip(uint32_t nip)
+{
+	uint32_t n;
+
+	n = G.nip_head[hash_u32(nip)];
+	while (n != 0) {
+		if (g_leases[n - 1].lease_nip == nip)
+			return &g_leases[n - 1];
+		n = G.nip_next[n - 1];
+	}
+	return NULL;
 }
 
 /* Add a lease into the table, clearing out any old ones.
@@ -179,12 +379,19 @@ static struct dyn_lease *add_lease(
 	struct dyn_lease *oldest;
 
 	/* clean out any old ones */
-	clear_leases(chaddr, yiaddr);
+	if (chaddr) {
+		oldest = find_lease_by_mac(chaddr);
+		if (oldest)
+			unlink_lease(oldest);
+	}
+	oldest = find_lease_by_nip(yiaddr);
+	if (oldest)
+		unlink_lease(oldest);
 
 	oldest = oldest_expired_lease();
 
 	if (oldest) {
-		memset(oldest, 0, sizeof(*oldest));
+		unlink_lease(oldest);
 		if (hostname) {
 			char *p;
 
@@ -210,6 +417,7 @@ static struct dyn_lease *add_lease(
 			memcpy(oldest->lease_mac, chaddr, 6);
 		oldest->lease_nip = yiaddr;
 		oldest->expires = time(NULL) + leasetime;
+		link_lease(oldest);
 	}
 
 	return oldest;
@@ -221,36 +429,17 @@ static int is_expired_lease(struct dyn_lease *lease)
 	return (lease->expires < (leasetime_t) time(NULL));
 }
 
-/* Find the first lease that matches MAC, NULL if no match */
-static struct dyn_lease *find_lease_by_mac(const uint8_t *mac)
-{
-	unsigned i;
-
-	for (i = 0; i < server_data.max_leases; i++)
-		if (memcmp(g_leases[i].lease_mac, mac, 6) == 0)
-			return &g_leases[i];
-
-	return NULL;
-}
-
-/* Find the first lease that matches IP, NULL is no match */
-static struct dyn_lease *find_lease_by_nip(uint32_t nip)
-{
-	unsigned i;
-
-	for (i = 0; i < server_data.max_leases; i++)
-		if (g_leases[i].lease_nip == nip)
-			return &g_leases[i];
-
-	return NULL;
-}
-
 /* Check if the IP is taken; if it is, add it to the lease table */
 static int nobody_responds_to_arp(uint32_t nip, const uint8_t *safe_mac, unsigned arpping_ms)
 {
 	struct in_addr temp;
 	int r;
 
+	/* -a 0: a reply can't arrive in time anyway, and setting up
+	 * a packet socket per probe is slow */
+	if (arpping_ms == 0)
+		return 1;
+
 	r = arpping(nip, safe_mac,
 			server_data.server_nip,
 			server_data.server_mac,
@@ -266,14 +455,29 @@ static int nobody_responds_to_arp(uint32_t nip, const uint8_t *safe_mac, unsigne
 	return 0;
 }
 
+/* First address number >= i and < end which has no lease, or end */
+static unsigned next_unleased(unsigned i, unsigned end)
+{
+	while (i < end) {
+		uint32_t word = G.leased[i / 32];
+		if (word == 0xffffffff && (i % 32) == 0) {
+			i += 32;
+			continue;
+		}
+		if (!(word & (1U << (i % 32))))
+			return i;
+		i++;
+	}
+	return end;
+}
+
 /* Find a new usable (we think) address */
 static uint32_t find_free_or_expired_nip(const uint8_t *safe_mac, unsigned arpping_ms)
 {
-	uint32_t addr;
-	struct dyn_lease *oldest_lease = NULL;
+	unsigned num_ips = server_data.end_ip - server_data.start_ip + 1;
+	unsigned first, pass;
 
 #if ENABLE_FEATURE_UDHCPD_BASE_IP_ON_MAC
-	uint32_t stop;
 	unsigned i, hash;
 
 	/* hash hwaddr: use the SDBM hashing algorithm.  Seems to give good
@@ -284,53 +488,43 @@ static uint32_t find_free_or_expired_nip(const uint8_t *safe_mac, unsigned arppi
 		hash += safe_mac[i] + (hash << 6) + (hash << 16) - hash;
 
 	/* pick a seed based on hwaddr then iterate until we find a free address. */
-	addr = server_data.start_ip
-		+ (hash % (1 + server_data.end_ip - server_data.start_ip));
-	stop = addr;
+	first = hash % num_ips;
 #else
-	addr = server_data.start_ip;
-#define stop (server_data.end_ip + 1)
+	first = 0;
 #endif
-	do {
-		uint32_t nip;
-		struct dyn_lease *lease;
-
-		/* (Addresses ending in .0 or .255 can legitimately be allocated
-		 * in various situations, so _don't_ skip these.  The user needs
-		 * to choose start_ip and end_ip correctly for a particular
-		 * network environment.) */
-
-		nip = htonl(addr);
-		/* skip our own address */
-		if (nip == server_data.server_nip)
-			goto next_addr;
-		/* is this a static lease addr? */
-		if (is_nip_reserved_as_static(nip))
-			goto next_addr;
-
-		lease = find_lease_by_nip(nip);
-		if (!lease) {
+	/* Addresses without a lease: first..end, then start..first-1 */
+	for (pass = 0; pass < 2; pass++) {
+		unsigned end = pass ? first : num_ips;
+		unsigned n = pass ? 0 : first;
+
+		while ((n = next_unleased(n, end)) < end) {
+			/* (Addresses ending in .0 or .255 can legitimately be allocated
+			 * in various situations, so _don't_ skip these.  The user needs
+			 * to choose start_ip and end_ip correctly for a particular
+			 * network environment.) */
+			uint32_t nip = htonl(server_data.start_ip + n);
+
+			/* skip our own address, and static lease addresses */
+			if (nip != server_data.server_nip
+			 && !is_nip_reserved_as_static(nip)
 //TODO: DHCP servers do not always sit on the same subnet as clients: should *ping*, not arp-ping!
-			if (nobody_responds_to_arp(nip, safe_mac, arpping_ms))
+			 && nobody_responds_to_arp(nip, safe_mac, arpping_ms)
+			) {
 				return nip;
-		} else {
-			if (!oldest_lease || lease->expires < oldest_lease->expires)
-				oldest_lease = lease;
+			}
+			n++;
 		}
+	}
 
- next_addr:
-		addr++;
-#if ENABLE_FEATURE_UDHCPD_BASE_IP_ON_MAC
-		if (addr > server_data.end_ip)
-			addr = server_data.start_ip;
-#endif
-	} while (addr != stop);
-
-	if (oldest_lease
-	 && is_expired_lease(oldest_lease)
-	 && nobody_responds_to_arp(oldest_lease->lease_nip, safe_mac, arpping_ms)
-	) {
-		return oldest_lease->lease_nip;
+	/* All addresses are leased. Leases in the table are
+	 * only for addresses of our range: reuse the oldest one */
+	if (G.used != 0) {
+		struct dyn_lease *oldest_lease = &g_leases[G.slot[0]];
+		if (is_expired_lease(oldest_lease)
+		 && nobody_responds_to_arp(oldest_lease->lease_nip, safe_mac, arpping_ms)
+		) {
+			return oldest_lease->lease_nip;
+		}
 	}
 
 	return 0;
@@ -455,61 +649,171 @@ static NOINLINE void read_config(const char *file)
 		bb_error_msg_and_die("bad start/end IP range in %s", file);
 }
 
+static void lease_to_file(struct dyn_lease *rec, const struct dyn_lease *lease)
+{
+	signed_leasetime_t expires;
+
+	*rec = *lease;
+	/* Stored as seconds since journal_written_at */
+	expires = lease->expires - G.journal_written_at;
+	if (expires < 0)
+		expires = 0;
+	rec->expires = htonl(expires);
+}
+
+static void notify_leases(void)
+{
+	if (server_data.notify_file) {
+		char *argv[3];
+		argv[0] = server_data.notify_file;
+		argv[1] = server_data.lease_file;
+		argv[2] = NULL;
+		spawn_and_wait(argv);
+	}
+}
+
+/* Write all leases to a new file, replace the lease file with it */
 static void write_leases(void)
 {
+	struct dyn_lease buf[32];
+	char *tmp_file;
 	int fd;
-	unsigned i;
-	leasetime_t curr;
+	unsigned i, n;
 	int64_t written_at;
 
-	fd = open_or_warn(server_data.lease_file, O_WRONLY|O_CREAT|O_TRUNC);
+	if (G.journal_fd >= 0) {
+		close(G.journal_fd);
+		G.journal_fd = -1;
+	}
+
+	tmp_file = xasprintf("%s.new", server_data.lease_file);
+	fd = open_or_warn(tmp_file, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND);
 	if (fd < 0)
-		return;
+		goto ret;
 
-	curr = written_at = time(NULL);
+	G.journal_written_at = time(NULL);
+	written_at = SWAP_BE64(G.journal_written_at);
+	if (full_write(fd, &written_at, sizeof(written_at)) != sizeof(written_at))
+		goto err;
+
+	n = 0;
+	for (i = 0; i < G.used; i++) {
+		lease_to_file(&buf[n], &g_leases[G.slot[i]]);
+		if (++n == ARRAY_SIZE(buf) || i == G.used - 1) {
+			if (full_write(fd, buf, n * sizeof(buf[0])) != (ssize_t)(n * sizeof(buf[0])))
+				goto err;
+			n = 0;
+		}
+	}
+	/* Data must be on disk before rename, else a crash
+	 * may leave us with an empty lease file */
+	if (fsync(fd) != 0 || rename(tmp_file, server_data.lease_file) != 0)
+		goto err;
+
+	G.journal_fd = fd;
+	G.journal_len = G.used;
+	G.leases_dirty = 0;
+	free(tmp_file);
+	notify_leases();
+	return;
+
+ err:
+	bb_perror_msg("can't write '%s'", tmp_file);
+	close(fd);
+	unlink(tmp_file);
+ ret:
+	free(tmp_file);
+}
 
-	written_at = SWAP_BE64(written_at);
-	full_write(fd, &written_at, sizeof(written_at));
+static int journal_needs_compaction(void)
+{
+	return G.journal_fd < 0
+		/* mostly superseded records? */
+		|| G.journal_len > G.used * 2 + 64
+		/* read_leases() ignores files older than 12 hours */
+		|| time(NULL) - G.journal_written_at > 6 * 60 * 60;
+}
 
-	for (i = 0; i < server_data.max_leases; i++) {
-		leasetime_t tmp_time;
+/* Append the lease to the lease file */
+static void journal_lease(struct dyn_lease *lease)
+{
+	struct dyn_lease rec;
 
-		if (g_leases[i].lease_nip == 0)
-			continue;
+	if (journal_needs_compaction()) {
+		write_leases();
+		return;
+	}
+	lease_to_file(&rec, lease);
+	if (full_write(G.journal_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+		/* Disk full? Partial record must not be followed
+		 * by more records: start a new file */
+		bb_perror_msg("can't write '%s'", server_data.lease_file);
+		write_leases();
+		return;
+	}
+	G.journal_len++;
+	notify_leases();
+}
 
-		/* Screw with the time in the struct, for easier writing */
-		tmp_time = g_leases[i].expires;
+static void lease_changed(struct dyn_lease *lease)
+{
+	if (ENABLE_FEATURE_UDHCPD_WRITE_LEASES_EARLY)
+		journal_lease(lease);
+	else
+		G.leases_dirty = 1;
+}
 
-		g_leases[i].expires -= curr;
-		if ((signed_leasetime_t) g_leases[i].expires < 0)
-			g_leases[i].expires = 0;
-		g_leases[i].expires = htonl(g_leases[i].expires);
+/* Periodic and on-exit write */
+static void flush_leases(void)
+{
+	if (G.leases_dirty || journal_needs_compaction())
+		write_leases();
+}
 
-		/* No error check. If the file gets truncated,
-		 * we lose some leases on restart. Oh well. */
-		full_write(fd, &g_leases[i], sizeof(g_leases[i]));
+/* Returns 0 if lease table is full */
+static int read_lease(struct dyn_lease *lease, int64_t time_passed)
+{
+	uint32_t y = ntohl(lease->lease_nip);
+	signed_leasetime_t expires;
 
-		/* Then restore it when done */
-		g_leases[i].expires = tmp_time;
-	}
-	close(fd);
+	if (y < server_data.start_ip || y > server_data.end_ip)
+		return 1;
 
-	if (server_data.notify_file) {
-		char *argv[3];
-		argv[0] = server_data.notify_file;
-		argv[1] = server_data.lease_file;
-		argv[2] = NULL;
-		spawn_and_wait(argv);
+	expires = ntohl(lease->expires) - (signed_leasetime_t)time_passed;
+	if (expires <= 0)
+		/* We keep expired leases: add_lease() will add
+		 * a lease with 0 seconds remaining.
+		 * Fewer IP address changes this way for mass reboot scenario.
+		 */
+		expires = 0;
+
+	/* Check if there is a different static lease for this IP or MAC */
+	if (get_static_nip_by_mac(lease->lease_mac)) {
+		/* NB: we do not add lease even if static_nip == lease.lease_nip.
+		 */
+		return 1;
 	}
+	if (is_nip_reserved_as_static(lease->lease_nip))
+		return 1;
+
+	/* NB: add_lease takes "relative time", IOW,
+	 * lease duration, not lease deadline.
+	 * Later records in the file override earlier ones
+	 * for the same MAC or IP: add_lease() does that.
+	 */
+	return add_lease(lease->lease_mac, lease->lease_nip,
+			expires,
+			lease->hostname, sizeof(lease->hostname)
+		) != NULL;
 }
 
 static NOINLINE void read_leases(const char *file)
 {
-	struct dyn_lease lease;
+	struct dyn_lease buf[32];
 	int64_t written_at, time_passed;
-	int fd;
+	int fd, n;
 #if defined CONFIG_UDHCP_DEBUG && CONFIG_UDHCP_DEBUG >= 1
-	unsigned i = 0;
+	unsigned cnt = 0;
 #endif
 
 	fd = open_or_warn(file, O_RDONLY);
@@ -526,45 +830,19 @@ static NOINLINE void read_leases(const char *file)
 	if ((uint64_t)time_passed > 12 * 60 * 60)
 		goto ret;
 
-	while (full_read(fd, &lease, sizeof(lease)) == sizeof(lease)) {
-		uint32_t y = ntohl(lease.lease_nip);
-		if (y >= server_data.start_ip && y <= server_data.end_ip) {
-			signed_leasetime_t expires = ntohl(lease.expires) - (signed_leasetime_t)time_passed;
-			uint32_t static_nip;
-
-			if (expires <= 0)
-				/* We keep expired leases: add_lease() will add
-				 * a lease with 0 seconds remaining.
-				 * Fewer IP address changes this way for mass reboot scenario.
-				 */
-				expires = 0;
-
-			/* Check if there is a different static lease for this IP or MAC */
-			static_nip = get_static_nip_by_mac(lease.lease_mac);
-			if (static_nip) {
-				/* NB: we do not add lease even if static_nip == lease.lease_nip.
-				 */
-				continue;
-			}
-			if (is_nip_reserved_as_static(lease.lease_nip))
-				continue;
-
-			/* NB: add_lease takes "relative time", IOW,
-			 * lease duration, not lease deadline. */
-			if (add_lease(lease.lease_mac, lease.lease_nip,
-					expires,
-					lease.hostname, sizeof(lease.hostname)
-				) == 0
-			) {
+	while ((n = full_read(fd, buf, sizeof(buf))) >= (int)sizeof(buf[0])) {
+		int i;
+		for (i = 0; i < n / (int)sizeof(buf[0]); i++) {
+			if (!read_lease(&buf[i], time_passed)) {
 				bb_error_msg("too many leases while loading %s", file);
-				break;
+				goto ret;
 			}
 #if defined CONFIG_UDHCP_DEBUG && CONFIG_UDHCP_DEBUG >= 1
-			i++;
+			cnt++;
 #endif
 		}
 	}
-	log1("read %d leases", i);
+	log1("read %d leases", cnt);
  ret:
 	close(fd);
 }
@@ -851,6 +1129,7 @@ static NOINLINE void send_NAK(struct dhcp_packet *oldpacket)
 static NOINLINE void send_ACK(struct dhcp_packet *oldpacket, uint32_t yiaddr)
 {
 	struct dhcp_packet packet;
+	struct dyn_lease *lease;
 	uint32_t lease_time_sec;
 	const char *p_host_name;
 
@@ -864,15 +1143,13 @@ static NOINLINE void send_ACK(struct dhcp_packet *oldpacket, uint32_t yiaddr)
 	send_packet_verbose(&packet, "sending ACK to %s");
 
 	p_host_name = (const char*) udhcp_get_option(oldpacket, DHCP_HOST_NAME);
-	add_lease(packet.chaddr, packet.yiaddr,
+	lease = add_lease(packet.chaddr, packet.yiaddr,
 		lease_time_sec,
 		p_host_name,
 		p_host_name ? (unsigned char)p_host_name[OPT_LEN - OPT_DATA] : 0
 	);
-	if (ENABLE_FEATURE_UDHCPD_WRITE_LEASES_EARLY) {
-		/* rewrite the file with leases at every new acceptance */
-		write_leases();
-	}
+	if (lease)
+		lease_changed(lease);
 }
 
 /* NOINLINE: limit stack usage in caller */
@@ -995,7 +1272,9 @@ int udhcpd_main(int argc UNUSED_PARAM, char **argv)
 	}
 
 	/* this sets g_leases */
-	SET_PTR_TO_GLOBALS(xzalloc(server_data.max_leases * sizeof(g_leases[0])));
+	SET_PTR_TO_GLOBALS(xzalloc(sizeof(G) + server_data.max_leases * sizeof(g_leases[0])));
+	init_lease_index(num_ips);
+	G.journal_fd = -1;
 
 	read_leases(server_data.lease_file);
 
@@ -1035,7 +1314,7 @@ int udhcpd_main(int argc UNUSED_PARAM, char **argv)
 			tv = timeout_end - monotonic_sec();
 			if (tv <= 0) {
  write_leases:
-				write_leases();
+				flush_leases();
 				goto continue_with_autotime;
 			}
 			tv *= 1000;
@@ -1060,7 +1339,7 @@ int udhcpd_main(int argc UNUSED_PARAM, char **argv)
 			goto continue_with_autotime;
 		case SIGTERM:
 			bb_info_msg("received %s", "SIGTERM");
-			write_leases();
+			flush_leases();
 			goto ret0;
 		}
 
@@ -1285,10 +1564,13 @@ o DHCPREQUEST generated during REBINDING state:
 			if (server_id_opt
 			 && requested_ip_opt
 			 && lease  /* chaddr matches this lease */
+			 && !static_lease_nip
 			 && requested_nip == lease->lease_nip
 			) {
-				memset(lease->lease_mac, 0, sizeof(lease->lease_mac));
-				lease->expires = time(NULL) + server_data.decline_time;
+				/* Keep the address, but not for this MAC */
+				lease = add_lease(NULL, requested_nip, server_data.decline_time, NULL, 0);
+				if (lease)
+					lease_changed(lease);
 			}
 			break;
 
@@ -1304,9 +1586,11 @@ o DHCPREQUEST generated during REBINDING state:
 			log1("received %s", "RELEASE");
 			if (server_id_opt
 			 && lease  /* chaddr matches this lease */
+			 && !static_lease_nip
 			 && packet.ciaddr == lease->lease_nip
 			) {
-				lease->expires = time(NULL);
+				set_lease_expires(lease, time(NULL));
+				lease_changed(lease);
 			}
 			break;
 
@@ -19,6 +19,53 @@
 #include "dhcpd.h"
 #include "unicode.h"
 
+/* udhcpd appends changed leases to the file: a record is superseded
+ * by a later one with the same IP or MAC. Sort record pointers
+ * by key, then by position in the file, to find them.
+ */
+static int cmp_nip(const void *a, const void *b)
+{
+	const struct dyn_lease *l1 = *(const struct dyn_lease **)a;
+	const struct dyn_lease *l2 = *(const struct dyn_lease **)b;
+
+	if (l1->lease_nip != l2->lease_nip)
+		return l1->lease_nip < l2->lease_nip ? -1 : 1;
+	return l1 < l2 ? -1 : (l1 > l2);
+}
+
+static int cmp_mac(const void *a, const void *b)
+{
+	const struct dyn_lease *l1 = *(const struct dyn_lease **)a;
+	const struct dyn_lease *l2 = *(const struct dyn_lease **)b;
+	int r = memcmp(l1->lease_mac, l2->lease_mac, 6);
+
+	if (r)
+		return r;
+	return l1 < l2 ? -1 : (l1 > l2);
+}
+
+static void mark_superseded(struct dyn_lease **sorted, unsigned n, char *gone,
+		struct dyn_lease *base, int (*cmp)(const void *, const void *), int by_mac)
+{
+	unsigned i;
+
+	qsort(sorted, n, sizeof(sorted[0]), cmp);
+	for (i = 0; i + 1 < n; i++) {
+		struct dyn_lease *l = sorted[i];
+		struct dyn_lease *next = sorted[i + 1];
+		if (by_mac) {
+			static const uint8_t zero_mac[6];
+			if (memcmp(l->lease_mac, next->lease_mac, 6) == 0
+			 && memcmp(l->lease_mac, zero_mac, 6) != 0 /* declined addresses have no MAC */
+			) {
+				gone[l - base] = 1;
+			}
+		} else if (l->lease_nip == next->lease_nip) {
+			gone[l - base] = 1;
+		}
+	}
+}
+
 int dumpleases_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int dumpleases_main(int argc UNUSED_PARAM, char **argv)
 {
@@ -27,7 +74,10 @@ int dumpleases_main(int argc UNUSED_PARAM, char **argv)
 	unsigned opt;
 	int64_t written_at, curr;
 	const char *file = LEASES_FILE;
-	struct dyn_lease lease;
+	struct dyn_lease *leases, **sorted;
+	char *gone;
+	size_t size;
+	unsigned n, k;
 
 	enum {
 		OPT_a = 0x1, // -a
@@ -68,28 +118,43 @@ int dumpleases_main(int argc UNUSED_PARAM, char **argv)
 	if (curr < written_at)
 		written_at = curr; /* lease file from future! :) */
 
-	while (full_read(fd, &lease, sizeof(lease)) == sizeof(lease)) {
+	size = INT_MAX;
+	leases = xmalloc_read(fd, &size);
+	n = size / sizeof(leases[0]);
+	sorted = xmalloc(n * sizeof(sorted[0]) + 1);
+	gone = xzalloc(n + 1);
+	for (k = 0; k < n; k++)
+		sorted[k] = &leases[k];
+	mark_superseded(sorted, n, gone, leases, cmp_nip, 0);
+	mark_superseded(sorted, n, gone, leases, cmp_mac, 1);
+
+	for (k = 0; k < n; k++) {
+		struct dyn_lease *lp = &leases[k];
 		struct in_addr addr;
 		int64_t expires_abs;
+		const char *fmt;
+
+		if (gone[k])
+			continue;
 
-		const char *fmt = ":%02x" + 1;
+		fmt = ":%02x" + 1;
 		for (i = 0; i < 6; i++) {
-			printf(fmt, lease.lease_mac[i]);
+			printf(fmt, lp->lease_mac[i]);
 			fmt = ":%02x";
 		}
-		addr.s_addr = lease.lease_nip;
+		addr.s_addr = lp->lease_nip;
 #if ENABLE_UNICODE_SUPPORT
 		{
-			char *uni_name = unicode_conv_to_printable_fixedwidth(/*NULL,*/ lease.hostname, 19);
+			char *uni_name = unicode_conv_to_printable_fixedwidth(/*NULL,*/ lp->hostname, 19);
 			printf(" %-16s%s ", inet_ntoa(addr), uni_name);
 			free(uni_name);
 		}
 #else
 		/* actually, 15+1 and 19+1, +1 is a space between columns */
-		/* lease.hostname is char[20] and is always NUL terminated */
-		printf(" %-16s%-20s", inet_ntoa(addr), lease.hostname);
+		/* hostname is char[20] and is always NUL terminated */
+		printf(" %-16s%-20s", inet_ntoa(addr), lp->hostname);
 #endif
-		expires_abs = ntohl(lease.expires) + written_at;
+		expires_abs = ntohl(lp->expires) + written_at;
 		if (expires_abs <= curr) {
 			puts("expired");
 			continue;
@@ -53,6 +53,15 @@
 //config:	FEATURE_WGET_LONG_OPTIONS is also enabled, the --timeout option
 //config:	will work in addition to -T.
 //config:
+//config:config FEATURE_WGET_PARALLEL
+//config:	bool "Enable parallel downloads option -j N"
+//config:	default y
+//config:	depends on WGET && !NOMMU && PLATFORM_POSIX
+//config:	help
+//config:	"wget -j N URL..." downloads URLs in N processes.
+//config:	Each of them reuses its connection for the next URL
+//config:	to the same server (if server allows that).
+//config:
 //config:config FEATURE_WGET_HTTPS
 //config:	bool "Support HTTPS using internal TLS code"
 //config:	default y
@@ -144,11 +153,11 @@
 //usage:       "	"IF_FEATURE_TLS_SCHANNEL("[--no-check-certificate] ")"[-P DIR] [-U AGENT]"IF_FEATURE_WGET_TIMEOUT(" [-T SEC]")" URL..."
 //usage:	)
 //usage:	IF_PLATFORM_POSIX(
-//usage:       "	"IF_FEATURE_WGET_OPENSSL("[--no-check-certificate] ")"[-P DIR] [-U AGENT]"IF_FEATURE_WGET_TIMEOUT(" [-T SEC]")" URL..."
+//usage:       "	"IF_FEATURE_WGET_OPENSSL("[--no-check-certificate] ")"[-P DIR] [-U AGENT]"IF_FEATURE_WGET_TIMEOUT(" [-T SEC]")IF_FEATURE_WGET_PARALLEL(" [-j N]")" URL..."
 //usage:	)
 //usage:	)
 //usage:	IF_NOT_FEATURE_WGET_LONG_OPTIONS(
-//usage:       "[-cqS] [-O FILE] [-o LOGFILE] [-Y on/off] [-P DIR] [-U AGENT]"IF_FEATURE_WGET_TIMEOUT(" [-T SEC]")" URL..."
+//usage:       "[-cqS] [-O FILE] [-o LOGFILE] [-Y on/off] [-P DIR] [-U AGENT]"IF_FEATURE_WGET_TIMEOUT(" [-T SEC]")IF_FEATURE_WGET_PARALLEL(" [-j N]")" URL..."
 //usage:	)
 //usage:#define wget_full_usage "\n\n"
 //usage:       "Retrieve files via HTTP or FTP\n"
@@ -175,6 +184,9 @@
 //usage:     "\n	-o LOGFILE	Log messages to FILE"
 //usage:     "\n	-U STR		Use STR for User-Agent header"
 //usage:     "\n	-Y on/off	Use proxy"
+//usage:	IF_FEATURE_WGET_PARALLEL(
+//usage:     "\n	-j N		Download up to N URLs at once (not with -O)"
+//usage:	)
 
 #include "libbb.h"
 
@@ -285,6 +297,16 @@ struct globals {
 #endif
 	smallint chunked;         /* chunked transfer encoding */
 	smallint got_clen;        /* got content-length: from server  */
+	smallint keep_alive;      /* more URLs follow: ask for persistent connection */
+	smallint can_reuse;       /* server agreed to keep this connection open */
+	/* Idle connection left over from previous URL (HTTP only) */
+	FILE *ka_sfp;
+	char *ka_host;
+	const char *ka_protocol;
+	int ka_port;
+#if ENABLE_FEATURE_WGET_PARALLEL
+	unsigned jobs;            /* -j N */
+#endif
 	/* Local downloads do benefit from big buffer.
 	 * With 512 byte buffer, it was measured to be
 	 * an order of magnitude slower than with big one.
@@ -313,11 +335,15 @@ enum {
 	WGET_OPT_NETWORK_READ_TIMEOUT = (1 << 8),
 	WGET_OPT_RETRIES    = (1 << 9),
 	WGET_OPT_nsomething = (1 << 10),
-	WGET_OPT_HEADER     = (1 << 11) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
-	WGET_OPT_POST_DATA  = (1 << 12) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
-	WGET_OPT_SPIDER     = (1 << 13) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
-	WGET_OPT_NO_CHECK_CERT = (1 << 14) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
-	WGET_OPT_POST_FILE  = (1 << 15) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
+	OPTBIT_JOBS         = 11,
+	/* -j N is optional, long options follow it */
+	OPTBIT_HEADER       = OPTBIT_JOBS + ENABLE_FEATURE_WGET_PARALLEL,
+	WGET_OPT_JOBS       = (1 << OPTBIT_JOBS) * ENABLE_FEATURE_WGET_PARALLEL,
+	WGET_OPT_HEADER     = (1 << OPTBIT_HEADER) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
+	WGET_OPT_POST_DATA  = (1 << (OPTBIT_HEADER + 1)) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
+	WGET_OPT_SPIDER     = (1 << (OPTBIT_HEADER + 2)) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
+	WGET_OPT_NO_CHECK_CERT = (1 << (OPTBIT_HEADER + 3)) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
+	WGET_OPT_POST_FILE  = (1 << (OPTBIT_HEADER + 4)) * ENABLE_FEATURE_WGET_LONG_OPTIONS,
 	/* hijack this bit for other than opts purposes: */
 	WGET_NO_FTRUNCATE   = (1 << 31)
 };
@@ -341,6 +367,12 @@ static void progress_meter(int flag)
 	if (G.log_fd >= 0)
 		return;
 
+#if ENABLE_FEATURE_WGET_PARALLEL
+	/* Bars of several -j N workers would overwrite each other */
+	if (G.jobs > 1)
+		return;
+#endif
+
 	if (flag == PROGRESS_START)
 		bb_progress_init(&G.pmt, G.curfile);
 
@@ -1104,8 +1136,14 @@ static void NOINLINE retrieve_file_data(FILE *dfp)
 		 */
 		if (G.content_len < 0 || errno)
 			bb_error_msg_and_die("bad chunk length '%s'", G.wget_buf);
-		if (G.content_len == 0)
+		if (G.content_len == 0) {
+			/* Connection will be reused: eat trailer (usually empty),
+			 * or it would be read as the next response */
+			if (G.can_reuse)
+				while (get_sanitized_hdr(dfp) != NULL)
+					continue;
 			break; /* all done! */
+		}
 		G.got_clen = 1;
 		/*
 		 * Note that fgets may result in some data being buffered in dfp.
@@ -1149,6 +1187,95 @@ static void NOINLINE retrieve_file_data(FILE *dfp)
 	}
 }
 
+static len_and_sockaddr *resolve_server(const struct host_info *server)
+{
+	len_and_sockaddr *lsa;
+
+	lsa = xhost2sockaddr(server->host, server->port);
+	if (!(option_mask32 & WGET_OPT_QUIET)) {
+		char *s = xmalloc_sockaddr2dotted(&lsa->u.sa);
+		fprintf(stderr, "Connecting to %s (%s)\n", server->host, s);
+		free(s);
+	}
+	return lsa;
+}
+
+static FILE *open_http_session(const struct host_info *server, len_and_sockaddr *lsa)
+{
+	FILE *sfp;
+
+#if ENABLE_FEATURE_WGET_OPENSSL
+	/* openssl (and maybe internal TLS) support is configured */
+	if (server->protocol == P_HTTPS) {
+		/* openssl-based helper
+		 * Inconvenient API since we can't give it an open fd
+		 */
+		int fd = spawn_https_helper_openssl(server->host, server->port);
+# if ENABLE_FEATURE_WGET_HTTPS
+		if (fd < 0) { /* no openssl? try internal */
+			sfp = open_socket(lsa);
+			spawn_ssl_client(server->host, fileno(sfp), /*flags*/ 0);
+			return sfp;
+		}
+# else
+		/* We don't check for exec("openssl") failure in this case */
+# endif
+		sfp = fdopen(fd, "r+");
+		if (!sfp)
+			bb_die_memory_exhausted();
+		return sfp;
+	}
+	sfp = open_socket(lsa);
+#elif ENABLE_FEATURE_WGET_HTTPS
+	/* Only internal TLS support is configured */
+	sfp = open_socket(lsa);
+	if (server->protocol == P_HTTPS)
+		spawn_ssl_client(server->host, fileno(sfp), /*flags*/
+# if ENABLE_FEATURE_TLS_SCHANNEL
+			(option_mask32 & WGET_OPT_NO_CHECK_CERT) ?
+				TLS_NO_CHECK_CERTIFICATE :
+# endif
+				0);
+#else
+	/* ssl (https) support is not configured */
+	sfp = open_socket(lsa);
+#endif
+	return sfp;
+}
+
+/* HTTP/1.1 keep-alive: the connection (and https helper process)
+ * of previous URL is kept if the server agreed to it,
+ * and used for the next URL if it goes to the same server.
+ */
+static void keep_http_session(FILE *sfp, const struct host_info *server)
+{
+	G.ka_sfp = sfp;
+	G.ka_host = xstrdup(server->host);
+	G.ka_protocol = server->protocol;
+	G.ka_port = server->port;
+}
+
+static FILE *reuse_http_session(const struct host_info *server)
+{
+	FILE *sfp = G.ka_sfp;
+
+	if (!sfp)
+		return NULL;
+	G.ka_sfp = NULL;
+	if (G.ka_protocol != server->protocol
+	 || G.ka_port != server->port
+	 || strcmp(G.ka_host, server->host) != 0
+	) {
+		/* We keep only one, and it's not useful anymore */
+		fclose(sfp);
+		sfp = NULL;
+	} else if (!(option_mask32 & WGET_OPT_QUIET)) {
+		fprintf(stderr, "Reusing connection to %s\n", server->host);
+	}
+	free(G.ka_host);
+	return sfp;
+}
+
 static void download_one_url(const char *url)
 {
 	bool use_proxy;                 /* Use proxies if env vars are set  */
@@ -1223,16 +1350,12 @@ static void download_one_url(const char *url)
 
 	redir_limit = 16;
  resolve_lsa:
-	lsa = xhost2sockaddr(server.host, server.port);
-	if (!(option_mask32 & WGET_OPT_QUIET)) {
-		char *s = xmalloc_sockaddr2dotted(&lsa->u.sa);
-		fprintf(stderr, "Connecting to %s (%s)\n", server.host, s);
-		free(s);
-	}
+	lsa = NULL; /* resolved only when we need a new connection */
  establish_session:
 	/*G.content_len = 0; - redundant, got_clen = 0 is enough */
 	G.got_clen = 0;
 	G.chunked = 0;
+	G.can_reuse = 0;
 	if (!ENABLE_FEATURE_WGET_FTP
 	 || use_proxy || target.protocol[0] != 'f' /*not ftp[s]*/
 	) {
@@ -1241,45 +1364,19 @@ static void download_one_url(const char *url)
 		 */
 		char *str;
 		int status;
-
-		/* Open socket to http(s) server */
-#if ENABLE_FEATURE_WGET_OPENSSL
-		/* openssl (and maybe internal TLS) support is configured */
-		if (server.protocol == P_HTTPS) {
-			/* openssl-based helper
-			 * Inconvenient API since we can't give it an open fd
-			 */
-			int fd = spawn_https_helper_openssl(server.host, server.port);
-# if ENABLE_FEATURE_WGET_HTTPS
-			if (fd < 0) { /* no openssl? try internal */
-				sfp = open_socket(lsa);
-				spawn_ssl_client(server.host, fileno(sfp), /*flags*/ 0);
-				goto socket_opened;
-			}
-# else
-			/* We don't check for exec("openssl") failure in this case */
-# endif
-			sfp = fdopen(fd, "r+");
-			if (!sfp)
-				bb_die_memory_exhausted();
-			goto socket_opened;
+		smallint reused;
+
+		/* Open socket to http(s) server, or use the kept one */
+		sfp = reuse_http_session(&server);
+		reused = (sfp != NULL);
+		if (!sfp) {
+ new_session:
+			reused = 0;
+			if (!lsa)
+				lsa = resolve_server(&server);
+			sfp = open_http_session(&server, lsa);
 		}
-		sfp = open_socket(lsa);
- socket_opened:
-#elif ENABLE_FEATURE_WGET_HTTPS
-		/* Only internal TLS support is configured */
-		sfp = open_socket(lsa);
-		if (server.protocol == P_HTTPS)
-			spawn_ssl_client(server.host, fileno(sfp), /*flags*/
-#  if ENABLE_FEATURE_TLS_SCHANNEL
-				(option_mask32 & WGET_OPT_NO_CHECK_CERT) ?
-					TLS_NO_CHECK_CERTIFICATE :
-#  endif
-					0);
-#else
-		/* ssl (https) support is not configured */
-		sfp = open_socket(lsa);
-#endif
+
 		/* Send HTTP request */
 		if (use_proxy) {
 			SENDFMT(sfp, "GET %s://%s/%s HTTP/1.1\r\n",
@@ -1296,9 +1393,9 @@ static void download_one_url(const char *url)
 			SENDFMT(sfp, "User-Agent: %s\r\n", G.user_agent);
 
 		/* Ask server to close the connection as soon as we are done
-		 * (IOW: we do not intend to send more requests)
+		 * unless we intend to send more requests
 		 */
-		SENDFMT(sfp, "Connection: close\r\n");
+		SENDFMT(sfp, "Connection: %s\r\n", G.keep_alive ? "keep-alive" : "close");
 
 #if ENABLE_FEATURE_WGET_AUTHENTICATION
 		if (target.user && !USR_HEADER_AUTH) {
@@ -1358,13 +1455,17 @@ static void download_one_url(const char *url)
 			SENDFMT(sfp, "\r\n");
 		}
 
-		fflush(sfp);
+		if (fflush(sfp) != 0 && reused) {
+			/* Server closed kept connection while it was idle */
+			fclose(sfp);
+			goto new_session;
+		}
 
 /* Tried doing this unconditionally.
  * Cloudflare and nginx/1.11.5 are shocked to see SHUT_WR on non-HTTPS.
  */
 #if SSL_SUPPORTED
-		if (target.protocol == P_HTTPS) {
+		if (target.protocol == P_HTTPS && !G.keep_alive) {
 			/* If we use SSL helper, keeping our end of the socket open for writing
 			 * makes our end (i.e. the same fd!) readable (EAGAIN instead of EOF)
 			 * even after child closes its copy of the fd.
@@ -1378,8 +1479,26 @@ static void download_one_url(const char *url)
 		 * Retrieve HTTP response line and check for "200" status code.
 		 */
  read_response:
+		if (reused) {
+			/* Server may have closed kept connection right before
+			 * it got our request. Then we see EOF at once.
+			 */
+			int c;
+			set_alarm();
+			c = getc(sfp);
+			clear_alarm();
+			if (c == EOF) {
+				fclose(sfp);
+				goto new_session;
+			}
+			ungetc(c, sfp);
+			reused = 0;
+		}
 		fgets_trim_sanitize(sfp, "  %s\n");
 
+		/* HTTP/1.1 connections are persistent unless told otherwise */
+		G.can_reuse = (G.keep_alive && is_prefixed_with(G.wget_buf, "HTTP/1.1 "));
+
 		str = G.wget_buf;
 		str = skip_non_whitespace(str);
 		str = skip_whitespace(str);
@@ -1463,9 +1582,10 @@ However, in real world it was observed that some web servers
 		 */
 		while ((str = get_sanitized_hdr(sfp)) != NULL) {
 			static const char keywords[] ALIGN1 =
-				"content-length\0""transfer-encoding\0""location\0";
+				"content-length\0""transfer-encoding\0""location\0""connection\0";
 			enum {
-				KEY_content_length = 1, KEY_transfer_encoding, KEY_location
+				KEY_content_length = 1, KEY_transfer_encoding, KEY_location,
+				KEY_connection
 			};
 			smalluint key;
 
@@ -1491,6 +1611,13 @@ However, in real world it was observed that some web servers
 					bb_error_msg_and_die("transfer encoding '%s' is not supported", str);
 				G.chunked = 1;
 			}
+			if (key == KEY_connection && G.keep_alive) {
+				/* HTTP/1.0 server can say "keep-alive" */
+				if (strcasestr(str, "close"))
+					G.can_reuse = 0;
+				else if (strcasestr(str, "keep-alive"))
+					G.can_reuse = 1;
+			}
 			if (key == KEY_location && status >= 300) {
 				if (--redir_limit == 0)
 					bb_simple_error_msg_and_die("too many redirections");
@@ -1520,6 +1647,15 @@ However, in real world it was observed that some web servers
 //		if (status >= 300)
 //			bb_error_msg_and_die("bad redirection (no Location: header from server)");
 
+		if (G.can_reuse && status == 204 && !G.got_clen && !G.chunked) {
+			/* No body, even without "Content-Length: 0" */
+			G.got_clen = 1;
+			G.content_len = 0;
+		}
+		/* Without known length, body ends only when server closes */
+		if ((!G.got_clen && !G.chunked) || (option_mask32 & WGET_OPT_SPIDER))
+			G.can_reuse = 0;
+
 		/* For HTTP, data is pumped over the same connection */
 		dfp = sfp;
 	}
@@ -1528,6 +1664,8 @@ However, in real world it was observed that some web servers
 		/*
 		 *  FTP session
 		 */
+		if (!lsa)
+			lsa = resolve_server(&server);
 		sfp = prepare_ftp_session(&dfp, &target, lsa);
 	}
 #endif
@@ -1556,7 +1694,10 @@ However, in real world it was observed that some web servers
 		/* ftpcmd("QUIT", NULL, sfp); - why bother? */
 	}
 #endif
-	fclose(sfp);
+	if (G.can_reuse)
+		keep_http_session(sfp, &server);
+	else
+		fclose(sfp);
 
 	free(server.allocated);
 	free(target.allocated);
@@ -1566,6 +1707,58 @@ However, in real world it was observed that some web servers
 	free(redirected_path);
 }
 
+#if ENABLE_FEATURE_WGET_PARALLEL
+/* -j N: all workers read URL indexes from one pipe,
+ * an idle worker picks the next URL.
+ * Every worker has its own kept connection.
+ */
+static int download_in_parallel(char **argv)
+{
+	struct fd_pair job_pipe;
+	unsigned cnt, i;
+	pid_t *pids;
+	int err = EXIT_SUCCESS;
+
+	cnt = string_array_len(argv);
+	if (G.jobs > cnt)
+		G.jobs = cnt;
+	pids = xmalloc(G.jobs * sizeof(pids[0]));
+
+	xpiped_pair(job_pipe);
+	fflush_all();
+	for (i = 0; i < G.jobs; i++) {
+		pids[i] = xfork();
+		if (pids[i] == 0) {
+			/* Child */
+			unsigned idx;
+
+			close(job_pipe.wr);
+			G.keep_alive = 1;
+			while (safe_read(job_pipe.rd, &idx, sizeof(idx)) == sizeof(idx))
+				download_one_url(argv[idx]);
+			exit(EXIT_SUCCESS);
+		}
+	}
+	close(job_pipe.rd);
+
+	for (i = 0; i < cnt; i++) {
+		/* Fails with EPIPE if all workers died */
+		if (full_write(job_pipe.wr, &i, sizeof(i)) != sizeof(i))
+			break;
+	}
+	close(job_pipe.wr); /* EOF tells workers to exit */
+
+	for (i = 0; i < G.jobs; i++) {
+		int status;
+		if (safe_waitpid(pids[i], &status, 0) < 0 || status != 0)
+			err = EXIT_FAILURE;
+	}
+	if (ENABLE_FEATURE_CLEAN_UP)
+		free(pids);
+	return err;
+}
+#endif
+
 int wget_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
 int wget_main(int argc UNUSED_PARAM, char **argv)
 {
@@ -1630,6 +1823,7 @@ IF_DESKTOP(	"no-parent\0"        No_argument       "\xf0")
 		 * "n::" above says that we accept -n[ARG].
 		 * Specifying "n:" would be a bug: "-n ARG" would eat ARG!
 		 */
+		IF_FEATURE_WGET_PARALLEL("j:+")
 		"\0"
 		"-1" /* at least one URL */
 		IF_FEATURE_WGET_LONG_OPTIONS(":\xfe--\xfb")
@@ -1642,6 +1836,7 @@ IF_DESKTOP(	"no-parent\0"        No_argument       "\xf0")
 		IF_FEATURE_WGET_TIMEOUT(&G.timeout_seconds) IF_NOT_FEATURE_WGET_TIMEOUT(NULL),
 		NULL, /* -t RETRIES */
 		NULL  /* -n[ARG] */
+		IF_FEATURE_WGET_PARALLEL(, &G.jobs)
 		IF_FEATURE_WGET_LONG_OPTIONS(, &headers_llist)
 		IF_FEATURE_WGET_LONG_OPTIONS(, &G.post_data)
 		IF_FEATURE_WGET_LONG_OPTIONS(, &G.post_file)
@@ -1711,8 +1906,22 @@ IF_DESKTOP(	"no-parent\0"        No_argument       "\xf0")
 		}
 	}
 
-	while (*argv)
+	if (argv[1]) {
+		/* Server may close the connection we kept for next URL,
+		 * our write to it then should not kill us */
+		signal(SIGPIPE, SIG_IGN);
+	}
+#if ENABLE_FEATURE_WGET_PARALLEL
+	/* -O FILE would be written by all workers at once */
+	if (G.jobs > 1 && argv[1] && !G.fname_out)
+		return download_in_parallel(argv);
+	G.jobs = 0;
+#endif
+
+	while (*argv) {
+		G.keep_alive = (argv[1] != NULL);
 		download_one_url(*argv++);
+	}
 
 	if (G.output_fd >= 0)
 		xclose(G.output_fd);
@@ -0,0 +1,307 @@
+/* vi: set sw=4 ts=4: */
+/*
+ * DISCOVER storm load generator for udhcpd benchmarking.
+ *
+ * Licensed under GPLv2 or later, see file LICENSE in this source tree.
+ *
+ * Simulates N clients which come up at once (think "power cut"):
+ * each sends DISCOVER, and REQUEST for the address it was offered.
+ * Up to W clients are in flight at any time. -r R repeats the storm
+ * R times with the same MACs, like clients rebooting again after
+ * they got their leases.
+ *
+ * Replies are broadcast to port PORT+1. With -g ADDR, requests look
+ * as if they came through a DHCP relay at ADDR (ours), and replies
+ * are sent to ADDR:PORT. This avoids raw sockets on the server side,
+ * which are slow to create, so the server's lease handling dominates.
+ *
+ * udhcpd and its clients must be on different hosts (or namespaces):
+ *	ip netns add storm
+ *	ip link add vs0 type veth peer name vs1 netns storm
+ *	ip addr add 10.99.0.1/16 dev vs0; ip link set vs0 up
+ *	ip -n storm addr add 10.99.0.2/16 dev vs1; ip -n storm link set vs1 up
+ *	cat >storm.conf <<EOF
+ *	interface vs0
+ *	start 10.99.0.10
+ *	end 10.99.255.254
+ *	max_leases 65534
+ *	auto_time 0
+ *	EOF
+ *	busybox udhcpd -f -a 0 storm.conf 2>/dev/null &
+ *	gcc -O2 -o dhcpd_storm scripts/dhcpd_storm.c
+ *	ip netns exec storm ./dhcpd_storm -n 50000 -w 64 -g 10.99.0.2 10.99.0.1
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+struct dhcp_packet {
+	uint8_t op;
+	uint8_t htype;
+	uint8_t hlen;
+	uint8_t hops;
+	uint32_t xid;
+	uint16_t secs;
+	uint16_t flags;
+	uint32_t ciaddr;
+	uint32_t yiaddr;
+	uint32_t siaddr;
+	uint32_t giaddr;
+	uint8_t chaddr[16];
+	uint8_t sname[64];
+	uint8_t file[128];
+	uint32_t cookie;
+	uint8_t options[308];
+};
+
+enum {
+	DHCPDISCOVER = 1,
+	DHCPOFFER    = 2,
+	DHCPREQUEST  = 3,
+	DHCPACK      = 5,
+	DHCPNAK      = 6,
+};
+
+/* Per-client state */
+enum { IDLE, DISCOVERING, REQUESTING, DONE };
+struct client {
+	uint8_t state;
+	uint32_t offered_nip;
+	uint32_t server_nip;
+};
+
+static struct client *clients;
+static unsigned num_clients;
+static int fd;
+static int send_fd;
+static struct sockaddr_in server_sa;
+static uint32_t relay_nip;
+static unsigned round_no;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xid: round in high byte, client number in low 24 bits */
+static void send_msg(unsigned n, int type)
+{
+	struct dhcp_packet pkt;
+	uint8_t *opt;
+
+	memset(&pkt, 0, sizeof(pkt));
+	pkt.op = 1; /* BOOTREQUEST */
+	pkt.htype = 1; /* ethernet */
+	pkt.hlen = 6;
+	pkt.xid = htonl((round_no << 24) | n);
+	pkt.flags = htons(0x8000); /* broadcast replies */
+	pkt.giaddr = relay_nip;
+	pkt.chaddr[0] = 0x02; /* locally administered */
+	pkt.chaddr[1] = 0x42;
+	pkt.chaddr[3] = n >> 16;
+	pkt.chaddr[4] = n >> 8;
+	pkt.chaddr[5] = n;
+	pkt.cookie = htonl(0x63825363);
+	opt = pkt.options;
+	*opt++ = 53; /* message type */
+	*opt++ = 1;
+	*opt++ = type;
+	if (type == DHCPREQUEST) {
+		*opt++ = 50; /* requested IP */
+		*opt++ = 4;
+		memcpy(opt, &clients[n].offered_nip, 4);
+		opt += 4;
+		*opt++ = 54; /* server id */
+		*opt++ = 4;
+		memcpy(opt, &clients[n].server_nip, 4);
+		opt += 4;
+	}
+	*opt = 255;
+
+	if (sendto(send_fd, &pkt, sizeof(pkt), 0,
+			(struct sockaddr *)&server_sa, sizeof(server_sa)) < 0
+	) {
+		perror("sendto");
+		exit(1);
+	}
+}
+
+/* Returns message type, fills *nip and *server_nip */
+static int parse_reply(struct dhcp_packet *pkt, int len, uint32_t *server_nip)
+{
+	uint8_t *opt = pkt->options;
+	uint8_t *end = (uint8_t *)pkt + len;
+	int type = 0;
+
+	if (len < (int)offsetof(struct dhcp_packet, options) || pkt->op != 2)
+		return 0;
+	*server_nip = 0;
+	while (opt < end && *opt != 255) {
+		if (*opt == 0) {
+			opt++;
+			continue;
+		}
+		if (opt + 2 > end || opt + 2 + opt[1] > end)
+			break;
+		if (opt[0] == 53 && opt[1] == 1)
+			type = opt[2];
+		if (opt[0] == 54 && opt[1] == 4)
+			memcpy(server_nip, opt + 2, 4);
+		opt += 2 + opt[1];
+	}
+	return type;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"Usage: dhcpd_storm [-n CLIENTS] [-w WINDOW] [-r ROUNDS] [-P PORT] [-g RELAY_IP] SERVER_IP\n"
+		"Defaults: -n 10000 -w 32 -r 1 -P 67\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_in sa;
+	unsigned window = 32;
+	unsigned rounds = 1;
+	unsigned port = 67;
+	int one = 1;
+	int c;
+
+	num_clients = 10000;
+	while ((c = getopt(argc, argv, "n:w:r:P:g:")) != -1) {
+		switch (c) {
+		case 'n': num_clients = strtoul(optarg, NULL, 0); break;
+		case 'w': window = strtoul(optarg, NULL, 0); break;
+		case 'r': rounds = strtoul(optarg, NULL, 0); break;
+		case 'P': port = strtoul(optarg, NULL, 0); break;
+		case 'g':
+			if (!inet_aton(optarg, (struct in_addr *)&relay_nip))
+				usage();
+			break;
+		default: usage();
+		}
+	}
+	if (num_clients == 0 || num_clients > 0xffffff || window == 0 || rounds > 255)
+		usage();
+
+	memset(&server_sa, 0, sizeof(server_sa));
+	server_sa.sin_family = AF_INET;
+	server_sa.sin_port = htons(port);
+	if (!argv[optind] || !inet_aton(argv[optind], &server_sa.sin_addr))
+		usage();
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one));
+	c = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &c, sizeof(c));
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	/* Relay agents get replies on server port */
+	sa.sin_port = htons(relay_nip ? port : port + 1);
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	/* udhcpd's reply socket is connected to ADDR:PORT and would
+	 * steal requests from there while it exists: send from elsewhere */
+	send_fd = fd;
+	if (relay_nip)
+		send_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	clients = calloc(num_clients, sizeof(clients[0]));
+	if (!clients)
+		return 1;
+
+	for (round_no = 1; round_no <= rounds; round_no++) {
+		unsigned next = 0, in_flight = 0, done = 0, naks = 0, resent = 0;
+		double start = now(), last_progress = start;
+		unsigned i;
+
+		for (i = 0; i < num_clients; i++)
+			clients[i].state = IDLE;
+
+		while (done < num_clients) {
+			struct pollfd pfd;
+			struct dhcp_packet pkt;
+			uint32_t xid, server_nip;
+			int len, type;
+			unsigned n;
+
+			while (in_flight < window && next < num_clients) {
+				clients[next].state = DISCOVERING;
+				send_msg(next, DHCPDISCOVER);
+				next++;
+				in_flight++;
+			}
+
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 1000) <= 0) {
+				/* Lost packets? Retry everything in flight */
+				if (now() - last_progress > 10) {
+					fprintf(stderr, "no progress, giving up: %u/%u done\n",
+						done, num_clients);
+					return 1;
+				}
+				for (i = 0; i < next; i++) {
+					if (clients[i].state == DISCOVERING) {
+						send_msg(i, DHCPDISCOVER);
+						resent++;
+					} else if (clients[i].state == REQUESTING) {
+						send_msg(i, DHCPREQUEST);
+						resent++;
+					}
+				}
+				continue;
+			}
+			len = recv(fd, &pkt, sizeof(pkt), 0);
+			type = parse_reply(&pkt, len, &server_nip);
+			xid = ntohl(pkt.xid);
+			n = xid & 0xffffff;
+			if (!type || (xid >> 24) != round_no || n >= next)
+				continue;
+			last_progress = now();
+
+			if (type == DHCPOFFER && clients[n].state == DISCOVERING) {
+				clients[n].state = REQUESTING;
+				clients[n].offered_nip = pkt.yiaddr;
+				clients[n].server_nip = server_nip;
+				send_msg(n, DHCPREQUEST);
+			} else
+			if ((type == DHCPACK || type == DHCPNAK)
+			 && clients[n].state == REQUESTING
+			) {
+				if (type == DHCPNAK)
+					naks++;
+				clients[n].state = DONE;
+				in_flight--;
+				done++;
+			}
+		}
+
+		{
+			double t = now() - start;
+			printf("round %u: %u clients in %.3f s, %.0f clients/s"
+				" (%u NAKs, %u retransmits)\n",
+				round_no, num_clients, t, num_clients / t, naks, resent);
+		}
+	}
+	return 0;
+}
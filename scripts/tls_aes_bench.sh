@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# AES128-GCM throughput of the internal TLS code, for comparing builds
+# with and without FEATURE_TLS_AES_HWACCEL.
+#
+# Licensed under GPLv2, see file LICENSE in this source tree.
+#
+# Usage: tls_aes_bench.sh [-s MBYTES] [-p PORT] BUSYBOX...
+#
+# For every BUSYBOX binary, a file of MBYTES (default 200) is sent
+# over loopback twice, and wall clock time of each transfer is printed:
+#	httpd -S:   "busybox httpd -S" encrypts, openssl s_client receives
+#	ssl_client: openssl s_server -WWW encrypts, "busybox ssl_client"
+#	            receives (not wget: it may run openssl s_client instead)
+# openssl does its side with AES-NI, so the times are mostly ours.
+# Needs openssl (also used to make a throwaway RSA key).
+#
+# Example:
+#	make defconfig; make; cp busybox /tmp/busybox_ni
+#	make menuconfig	# turn off FEATURE_TLS_AES_HWACCEL
+#	make; cp busybox /tmp/busybox_generic
+#	scripts/tls_aes_bench.sh /tmp/busybox_generic /tmp/busybox_ni
+
+size=200
+port=8443
+while getopts s:p: opt; do
+	case $opt in
+	s) size=$OPTARG ;;
+	p) port=$OPTARG ;;
+	*) exit 1 ;;
+	esac
+done
+shift $((OPTIND - 1))
+if [ $# = 0 ]; then
+	echo "Usage: ${0##*/} [-s MBYTES] [-p PORT] BUSYBOX..." >&2
+	exit 1
+fi
+
+cipher=ECDHE-RSA-AES128-GCM-SHA256
+dir=$(mktemp -d) || exit 1
+server=
+trap '[ "$server" ] && kill $server; rm -rf "$dir"' EXIT
+trap 'exit 1' INT TERM
+
+openssl req -x509 -newkey rsa:2048 -nodes \
+	-subj /CN=localhost -days 1 \
+	-keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null || exit 1
+cat "$dir/key.pem" "$dir/cert.pem" >"$dir/server.pem"
+mkdir "$dir/www"
+dd if=/dev/zero of="$dir/www/big" bs=1M count=$size 2>/dev/null
+
+now() { date +%s.%N; }
+# elapsed START: seconds since START, two decimals
+elapsed() { echo "$1 $(now)" | awk '{ printf "%.2f s", $2 - $1 }'; }
+# wait_port: until something listens on $port (up to 5 s)
+wait_port() {
+	i=0
+	while [ $i -lt 50 ]; do
+		openssl s_client -connect 127.0.0.1:$port </dev/null >/dev/null 2>&1 && return
+		sleep 0.1
+		i=$((i + 1))
+	done
+}
+
+for bb; do
+	# applets are found by argv[0], make it "busybox"
+	mkdir -p "$dir/bin"
+	ln -sf "$(realpath "$bb")" "$dir/bin/busybox"
+	echo "$bb:"
+
+	"$dir/bin/busybox" httpd -f -p 127.0.0.1:$port -S "$dir/server.pem" -h "$dir/www" &
+	server=$!
+	wait_port
+	start=$(now)
+	printf 'GET /big HTTP/1.0\r\n\r\n' \
+	| openssl s_client -quiet -ign_eof -tls1_2 -cipher $cipher \
+		-connect 127.0.0.1:$port 2>/dev/null | wc -c >"$dir/bytes"
+	echo "	httpd -S:   $(elapsed $start) ($(cat "$dir/bytes") bytes)"
+	kill $server; wait $server 2>/dev/null; server=
+
+	(cd "$dir/www" && exec openssl s_server -quiet -WWW -tls1_2 -cipher $cipher \
+		-accept 127.0.0.1:$port -key ../key.pem -cert ../cert.pem) >/dev/null 2>&1 &
+	server=$!
+	wait_port
+	start=$(now)
+	printf 'GET /big HTTP/1.0\r\n\r\n' \
+	| "$dir/bin/busybox" ssl_client 127.0.0.1:$port | wc -c >"$dir/bytes"
+	echo "	ssl_client: $(elapsed $start) ($(cat "$dir/bytes") bytes)"
+	kill $server; wait $server 2>/dev/null; server=
+done
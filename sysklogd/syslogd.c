@@ -35,6 +35,14 @@
 //config:	This enables syslogd to rotate the message files
 //config:	on his own. No need to use an external rotate script.
 //config:
+//config:config FEATURE_ROTATE_LOGFILE_GZIP
+//config:	bool "Compress rotated message files"
+//config:	default y
+//config:	depends on FEATURE_ROTATE_LOGFILE
+//config:	help
+//config:	Support -z: rotated files are compressed by gzip (the applet,
+//config:	or gzip from PATH) running in background.
+//config:
 //config:config FEATURE_REMOTE_LOG
 //config:	bool "Remote Log support"
 //config:	default y
@@ -49,6 +57,16 @@
 //config:	measure to prevent system logs from being tampered with
 //config:	by an intruder.
 //config:
+//config:config FEATURE_REMOTE_LOG_TCP
+//config:	bool "Remote logging over TCP"
+//config:	default y
+//config:	depends on FEATURE_REMOTE_LOG
+//config:	help
+//config:	Support -R tcp:HOST[:PORT]. Messages are sent with RFC 6587
+//config:	octet-counting framing. They are queued in memory (and,
+//config:	with -Q FILE, on disk) while the remote host is unreachable
+//config:	or slow, instead of being lost as with UDP.
+//config:
 //config:config FEATURE_SYSLOGD_DUP
 //config:	bool "Support -D (drop dups) option"
 //config:	default y
@@ -80,7 +98,8 @@
 //config:	help
 //config:	This option sets the size of the syslog read buffer.
 //config:	Actual memory usage increases around five times the
-//config:	change done here.
+//config:	change done here. Several messages are read at once
+//config:	into up to 16 such buffers, using at most 16 kbytes.
 //config:
 //config:config FEATURE_IPC_SYSLOG
 //config:	bool "Circular Buffer support"
@@ -131,6 +150,11 @@
 //usage:     "\n	-n		Run in foreground"
 //usage:	IF_FEATURE_REMOTE_LOG(
 //usage:     "\n	-R HOST[:PORT]	Log to HOST:PORT (default PORT:514)"
+//usage:	IF_FEATURE_REMOTE_LOG_TCP(
+//usage:     "\n			tcp:HOST[:PORT] to log over TCP"
+//usage:     "\n	-Q FILE		Queue TCP logs in FILE if memory queue is full"
+//usage:     "\n			(FILE.1, FILE.2... for other TCP hosts)"
+//usage:	)
 //usage:     "\n	-L		Log locally and via network (default is network only if -R)"
 //usage:	)
 //usage:	IF_FEATURE_IPC_SYSLOG(
@@ -145,6 +169,9 @@
 //usage:     "\n	-s SIZE		Max size (KB) before rotation (default 200KB, 0=off)"
 //usage:     "\n	-b N		N rotated logs to keep (default 1, max 99, 0=purge)"
 //usage:	)
+//usage:	IF_FEATURE_ROTATE_LOGFILE_GZIP(
+//usage:     "\n	-z		Gzip rotated logs"
+//usage:	)
 //usage:     "\n	-l N		Log only messages more urgent than prio N (1-8)"
 //usage:     "\n	-S		Smaller output"
 //usage:     "\n	-t		Strip client-generated timestamps"
@@ -159,6 +186,9 @@
 //usage:#define syslogd_example_usage
 //usage:       "$ syslogd -R masterlog:514\n"
 //usage:       "$ syslogd -R 192.168.1.1:601\n"
+//usage:	IF_FEATURE_REMOTE_LOG_TCP(
+//usage:       "$ syslogd -R tcp:masterlog -Q /var/spool/syslogd.queue\n"
+//usage:	)
 
 /*
  * Done in syslogd_and_logger.c:
@@ -198,6 +228,12 @@
 enum {
 	MAX_READ = CONFIG_FEATURE_SYSLOGD_READ_BUFFER_SIZE,
 	DNS_WAIT_SEC = 2 * 60,
+	/* Receive up to 16 messages per syscall, using no more than 16k */
+	RECV_BATCH = MAX_READ <= 1024 ? 16 : MAX_READ <= 8 * 1024 ? 16 * 1024 / MAX_READ : 1,
+	/* Messages to log files are buffered, written out when the buffer
+	 * is full, when there is nothing more to read, or after LOG_FLUSH_MS */
+	LOG_BUF_SIZE = 4 * 1024,
+	LOG_FLUSH_MS = 1000,
 };
 
 /* Semaphore operation structures */
@@ -207,22 +243,61 @@ struct shbuf_ds {
 	char data[1];   /* data/messages */
 };
 
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+enum {
+	TCP_QUEUE_SIZE = 256 * 1024,
+	TCP_SPILL_MAX = 16 * 1024 * 1024,
+	TCP_BACKOFF_MIN_MS = 1000,
+	TCP_BACKOFF_MAX_MS = 60 * 1000,
+};
+
+/* Messages for TCP remote host, framed as in RFC 6587: "LEN MSG".
+ * data[] holds whole frames, the first one may be partially sent.
+ * When it is full, frames go to the spill file, and while there are
+ * any there, all new frames go there too, to keep them in order.
+ */
+struct tcp_queue {
+	int spill_fd; /* -1: no spill file */
+	char *spill_path;
+	off_t spill_rd, spill_wr; /* unsent frames in spill file */
+	unsigned head, len; /* frames in data[] */
+	unsigned sent;      /* bytes of them already sent */
+	unsigned dropped;   /* messages lost since last notice */
+	unsigned backoff_ms;
+	unsigned long long next_connect_ms;
+	smallint connecting;
+	char data[TCP_QUEUE_SIZE];
+};
+#endif
+
 #if ENABLE_FEATURE_REMOTE_LOG
 typedef struct {
 	int remoteFD;
 	unsigned last_dns_resolve;
 	len_and_sockaddr *remoteAddr;
 	const char *remoteHostname;
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+	struct tcp_queue *tcp; /* NULL for UDP */
+#endif
 } remoteHost_t;
 #endif
 
 typedef struct logFile_t {
 	const char *path;
 	int fd;
+	/* when we last checked that path still refers to fd */
 	time_t last_log_time;
+	dev_t dev;
+	ino_t ino;
+	/* messages not written out yet, LOG_BUF_SIZE bytes */
+	char *buf;
+	unsigned buf_used;
 #if ENABLE_FEATURE_ROTATE_LOGFILE
 	unsigned size;
 	uint8_t isRegular;
+# if ENABLE_FEATURE_ROTATE_LOGFILE_GZIP
+	pid_t gzip_pid; /* compressing FILE.0 */
+# endif
 #endif
 } logFile_t;
 
@@ -272,14 +347,34 @@ struct globals {
 #if ENABLE_FEATURE_REMOTE_LOG
 	llist_t *remoteHosts;
 #endif
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+	unsigned num_tcp;
+	/* [0] is /dev/log, others are TCP hosts in pfd_host[] */
+	struct pollfd *pfd;
+	remoteHost_t **pfd_host;
+#endif
 #if ENABLE_FEATURE_IPC_SYSLOG
 	struct shbuf_ds *shbuf;
 #endif
 	/* localhost's name. We print only first 64 chars */
 	char *hostname;
 
+	/* Some log files have buffered messages since this time */
+	unsigned long long buffered_since_ms;
+	smallint have_buffered;
+#if ENABLE_FEATURE_SYSLOGD_DUP
+	/* Last logged message. Points to recvbuf[i],
+	 * or to last_buf after the batch is done */
+	char *last_msg;
+	int last_sz;
+	char last_buf[MAX_READ];
+#endif
+#if defined(MSG_WAITFORONE)
+	struct mmsghdr msgs[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+#endif
 	/* We recv into recvbuf... */
-	char recvbuf[MAX_READ * (1 + ENABLE_FEATURE_SYSLOGD_DUP)];
+	char recvbuf[RECV_BATCH][MAX_READ];
 	/* ...then copy to parsebuf, escaping control chars */
 	/* (can grow x2 max) */
 	char parsebuf[MAX_READ*2];
@@ -333,6 +428,8 @@ enum {
 	IF_FEATURE_SYSLOGD_DUP(   OPTBIT_dup        ,)	// -D
 	IF_FEATURE_SYSLOGD_CFG(   OPTBIT_cfg        ,)	// -f
 	IF_FEATURE_KMSG_SYSLOG(   OPTBIT_kmsg       ,)	// -K
+	IF_FEATURE_REMOTE_LOG_TCP(OPTBIT_queue      ,)	// -Q
+	IF_FEATURE_ROTATE_LOGFILE_GZIP(OPTBIT_gzip  ,)	// -z
 
 	OPT_mark        = 1 << OPTBIT_mark    ,
 	OPT_nofork      = 1 << OPTBIT_nofork  ,
@@ -348,6 +445,8 @@ enum {
 	OPT_dup         = IF_FEATURE_SYSLOGD_DUP(   (1 << OPTBIT_dup        )) + 0,
 	OPT_cfg         = IF_FEATURE_SYSLOGD_CFG(   (1 << OPTBIT_cfg        )) + 0,
 	OPT_kmsg        = IF_FEATURE_KMSG_SYSLOG(   (1 << OPTBIT_kmsg       )) + 0,
+	OPT_queue       = IF_FEATURE_REMOTE_LOG_TCP((1 << OPTBIT_queue      )) + 0,
+	OPT_gzip        = IF_FEATURE_ROTATE_LOGFILE_GZIP((1 << OPTBIT_gzip  )) + 0,
 };
 #define OPTION_STR "m:nO:l:St" \
 	IF_FEATURE_ROTATE_LOGFILE("s:" ) \
@@ -357,18 +456,22 @@ enum {
 	IF_FEATURE_IPC_SYSLOG(    "C::") \
 	IF_FEATURE_SYSLOGD_DUP(   "D"  ) \
 	IF_FEATURE_SYSLOGD_CFG(   "f:" ) \
-	IF_FEATURE_KMSG_SYSLOG(   "K"  )
+	IF_FEATURE_KMSG_SYSLOG(   "K"  ) \
+	IF_FEATURE_REMOTE_LOG_TCP("Q:" ) \
+	IF_FEATURE_ROTATE_LOGFILE_GZIP("z")
 #define OPTION_DECL *opt_m, *opt_l \
 	IF_FEATURE_ROTATE_LOGFILE(,*opt_s) \
 	IF_FEATURE_ROTATE_LOGFILE(,*opt_b) \
 	IF_FEATURE_IPC_SYSLOG(    ,*opt_C = NULL) \
-	IF_FEATURE_SYSLOGD_CFG(   ,*opt_f = NULL)
+	IF_FEATURE_SYSLOGD_CFG(   ,*opt_f = NULL) \
+	IF_FEATURE_REMOTE_LOG_TCP(,*opt_Q = NULL)
 #define OPTION_PARAM &opt_m, &(G.logFile.path), &opt_l \
 	IF_FEATURE_ROTATE_LOGFILE(,&opt_s) \
 	IF_FEATURE_ROTATE_LOGFILE(,&opt_b) \
 	IF_FEATURE_REMOTE_LOG(    ,&remoteAddrList) \
 	IF_FEATURE_IPC_SYSLOG(    ,&opt_C) \
-	IF_FEATURE_SYSLOGD_CFG(   ,&opt_f)
+	IF_FEATURE_SYSLOGD_CFG(   ,&opt_f) \
+	IF_FEATURE_REMOTE_LOG_TCP(,&opt_Q)
 
 
 #if ENABLE_FEATURE_SYSLOGD_CFG
@@ -687,6 +790,88 @@ static void kmsg_cleanup(void) {}
 static void log_to_kmsg(int pri UNUSED_PARAM, const char *msg UNUSED_PARAM) {}
 #endif /* FEATURE_KMSG_SYSLOG */
 
+/* Write out buffered messages, and MSG if it's not NULL */
+static void write_log_file(logFile_t *log_file, const char *msg, int len)
+{
+	struct iovec iov[2];
+	ssize_t r;
+
+	iov[0].iov_base = log_file->buf;
+	iov[0].iov_len = log_file->buf_used;
+	iov[1].iov_base = (char*)msg;
+	iov[1].iov_len = len;
+	log_file->buf_used = 0;
+	r = writev(log_file->fd, iov, 2);
+/* TODO: what to do on write errors ("disk full")? */
+	if (r < 0)
+		return;
+	/* Short write? Finish it (fd is O_NONBLOCK, can be a pipe) */
+	if (r < iov[0].iov_len) {
+		full_write(log_file->fd, (char*)iov[0].iov_base + r, iov[0].iov_len - r);
+		r = 0;
+	} else {
+		r -= iov[0].iov_len;
+	}
+	if (r < len)
+		full_write(log_file->fd, msg + r, len - r);
+}
+
+static void flush_log_file(logFile_t *log_file)
+{
+	if (log_file->buf_used)
+		write_log_file(log_file, NULL, 0);
+}
+
+static void flush_log_files(void)
+{
+#if ENABLE_FEATURE_SYSLOGD_CFG
+	logRule_t *rule;
+
+	/* several rules can share a file, it's flushed by the first one */
+	for (rule = G.log_rules; rule; rule = rule->next)
+		flush_log_file(rule->file);
+#endif
+	flush_log_file(&G.logFile);
+	G.have_buffered = 0;
+}
+
+#if ENABLE_FEATURE_ROTATE_LOGFILE_GZIP
+/* Is FILE.0 of previous rotation still being compressed? */
+static int gzip_is_running(logFile_t *log_file)
+{
+	int status;
+
+	if (log_file->gzip_pid > 0) {
+		pid_t pid = safe_waitpid(log_file->gzip_pid, &status, WNOHANG);
+		if (pid == 0)
+			return 1;
+		/* FILE.0 stays uncompressed, rotation will shift it along */
+		if (pid > 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0))
+			bb_error_msg("can't compress %s.0", log_file->path);
+	}
+	log_file->gzip_pid = 0;
+	return 0;
+}
+
+/* Compress FILE.0 to FILE.0.gz, do not wait for it */
+static void gzip_in_background(logFile_t *log_file, char *file)
+{
+	char *argv[4];
+	pid_t pid;
+
+	argv[0] = (char*)"gzip";
+	argv[1] = (char*)"-f";
+	argv[2] = file;
+	argv[3] = NULL;
+	pid = spawn(argv);
+	if (pid > 0)
+		log_file->gzip_pid = pid;
+}
+#else
+# define gzip_is_running(log_file) 0
+# define gzip_in_background(log_file, file) ((void)0)
+#endif
+
 /* Print a message to the log file. */
 static void log_locally(time_t now, char *msg, logFile_t *log_file)
 {
@@ -698,18 +883,25 @@ static void log_locally(time_t now, char *msg, logFile_t *log_file)
 	/* fd can't be 0 (we connect fd 0 to /dev/log socket) */
 	/* fd is 1 if "-O -" is in use */
 	if (log_file->fd > 1) {
-		/* Reopen log files every second. This allows admin
-		 * to delete the files and not worry about restarting us.
-		 * This costs almost nothing since it happens
-		 * _at most_ once a second for each file, and happens
-		 * only when each file is actually written.
+		/* Check every second that the file was not deleted
+		 * or renamed away, and reopen it if it was.
+		 * This allows admin to delete the files
+		 * and not worry about restarting us.
 		 */
 		if (!now)
 			now = time(NULL);
 		if (log_file->last_log_time != now) {
+			struct stat statf;
+
 			log_file->last_log_time = now;
-			close(log_file->fd);
-			goto reopen;
+			if (stat(log_file->path, &statf) != 0
+			 || statf.st_ino != log_file->ino
+			 || statf.st_dev != log_file->dev
+			) {
+				flush_log_file(log_file);
+				close(log_file->fd);
+				goto reopen;
+			}
 		}
 	}
 	else if (log_file->fd == 1) {
@@ -720,9 +912,10 @@ static void log_locally(time_t now, char *msg, logFile_t *log_file)
 			log_file->fd = 1;
 			/* log_file->isRegular = 0; - already is */
 		} else {
+			struct stat statf;
  reopen:
 			log_file->fd = open(log_file->path, O_WRONLY | O_CREAT
-					| O_NOCTTY | O_APPEND | O_NONBLOCK,
+					| O_NOCTTY | O_APPEND | O_NONBLOCK | O_CLOEXEC,
 					0666);
 			if (log_file->fd < 0) {
 				/* cannot open logfile? - print to /dev/console then */
@@ -734,16 +927,19 @@ static void log_locally(time_t now, char *msg, logFile_t *log_file)
 					close(fd);
 				return;
 			}
+			/* Can fail only if fd is bad, which it isn't */
+			fstat(log_file->fd, &statf);
+			log_file->dev = statf.st_dev;
+			log_file->ino = statf.st_ino;
 #if ENABLE_FEATURE_ROTATE_LOGFILE
-			{
-				struct stat statf;
-				log_file->isRegular = (fstat(log_file->fd, &statf) == 0 && S_ISREG(statf.st_mode));
-				/* bug (mostly harmless): can wrap around if file > 4gb */
-				log_file->size = statf.st_size;
-			}
+			log_file->isRegular = S_ISREG(statf.st_mode);
+			/* bug (mostly harmless): can wrap around if file > 4gb */
+			log_file->size = statf.st_size;
 #endif
 		}
 	}
+	if (!log_file->buf)
+		log_file->buf = xmalloc(LOG_BUF_SIZE);
 
 #ifdef SYSLOGD_WRLOCK
 	fl.l_whence = SEEK_SET;
@@ -754,22 +950,43 @@ static void log_locally(time_t now, char *msg, logFile_t *log_file)
 #endif
 
 #if ENABLE_FEATURE_ROTATE_LOGFILE
-	if (G.logFileSize && log_file->isRegular && log_file->size > G.logFileSize) {
+	/* If the previous one is still being compressed, rotate later */
+	if (G.logFileSize && log_file->isRegular && log_file->size > G.logFileSize
+	 && !gzip_is_running(log_file)
+	) {
+		flush_log_file(log_file);
 		if (G.logFileRotate) { /* always 0..99 */
-			int i = strlen(log_file->path) + 3 + 1;
+			const char *gz = (option_mask32 & OPT_gzip) ? ".gz" : "";
+			int i = strlen(log_file->path) + 3 + 3 + 1;
 			char oldFile[i];
 			char newFile[i];
 			i = G.logFileRotate - 1;
-			/* rename: f.8 -> f.9; f.7 -> f.8; ... */
-			while (1) {
+			if (gz[0]) {
+				/* The oldest one can be in either form */
 				sprintf(newFile, "%s.%d", log_file->path, i);
+				unlink(newFile);
+				strcat(newFile, gz);
+				unlink(newFile);
+			}
+			/* rename: f.8 -> f.9; f.7 -> f.8; ... (f.8.gz -> f.9.gz if -z) */
+			while (1) {
+				sprintf(newFile, "%s.%d%s", log_file->path, i, gz);
 				if (i == 0) break;
-				sprintf(oldFile, "%s.%d", log_file->path, --i);
+				sprintf(oldFile, "%s.%d%s", log_file->path, --i, gz);
 				/* ignore errors - file might be missing */
 				rename(oldFile, newFile);
+				if (gz[0]) {
+					/* Not compressed (gzip failed)? Keep it too */
+					*strrchr(oldFile, '.') = '\0';
+					*strrchr(newFile, '.') = '\0';
+					rename(oldFile, newFile);
+				}
 			}
-			/* newFile == "f.0" now */
+			/* newFile == "f.0" (or "f.0.gz") now */
+			sprintf(newFile, "%s.0", log_file->path);
 			rename(log_file->path, newFile);
+			if (gz[0])
+				gzip_in_background(log_file, newFile);
 		}
 
 		/* We may or may not have just renamed the file away;
@@ -789,14 +1006,21 @@ static void log_locally(time_t now, char *msg, logFile_t *log_file)
 		close(log_file->fd);
 		goto reopen;
 	}
-/* TODO: what to do on write errors ("disk full")? */
-	len = full_write(log_file->fd, msg, len);
-	if (len > 0)
-		log_file->size += len;
-#else
-	full_write(log_file->fd, msg, len);
+	log_file->size += len;
 #endif
 
+	if (log_file->buf_used + len > LOG_BUF_SIZE) {
+		/* Does not fit: write out buffer and this message */
+		write_log_file(log_file, msg, len);
+	} else {
+		memcpy(log_file->buf + log_file->buf_used, msg, len);
+		log_file->buf_used += len;
+		if (!G.have_buffered) {
+			G.have_buffered = 1;
+			G.buffered_since_ms = monotonic_ms();
+		}
+	}
+
 #ifdef SYSLOGD_WRLOCK
 	fl.l_type = F_UNLCK;
 	fcntl(log_file->fd, F_SETLKW, &fl);
@@ -983,8 +1207,10 @@ static int create_socket(void)
 }
 
 #if ENABLE_FEATURE_REMOTE_LOG
-static int try_to_resolve_remote(remoteHost_t *rh)
+static int try_to_resolve_remote(remoteHost_t *rh, int type)
 {
+	int fd;
+
 	if (!rh->remoteAddr) {
 		unsigned now = monotonic_sec();
 
@@ -996,7 +1222,339 @@ static int try_to_resolve_remote(remoteHost_t *rh)
 		if (!rh->remoteAddr)
 			return -1;
 	}
-	return xsocket(rh->remoteAddr->u.sa.sa_family, SOCK_DGRAM, 0);
+	fd = xsocket(rh->remoteAddr->u.sa.sa_family, type, 0);
+	close_on_exec_on(fd);
+	return fd;
+}
+#endif
+
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+static void tcpq_put(struct tcp_queue *q, const char *s, unsigned n)
+{
+	unsigned tail = (q->head + q->len) % TCP_QUEUE_SIZE;
+	unsigned k = TCP_QUEUE_SIZE - tail;
+
+	if (k > n)
+		k = n;
+	memcpy(q->data + tail, s, k);
+	memcpy(q->data, s + k, n - k);
+	q->len += n;
+}
+
+/* Size of the frame at q->head */
+static unsigned tcpq_frame_size(struct tcp_queue *q)
+{
+	unsigned i = q->head;
+	unsigned hdr_len = 1; /* the space */
+	unsigned len = 0;
+	char c;
+
+	while ((c = q->data[i]) != ' ') {
+		len = len * 10 + (c - '0');
+		hdr_len++;
+		i = (i + 1) % TCP_QUEUE_SIZE;
+	}
+	return hdr_len + len;
+}
+
+/* Move frames from spill file to data[] while they fit */
+static void tcpq_refill(struct tcp_queue *q)
+{
+	char buf[MAX_READ + 4 * 1024];
+
+	while (q->spill_wr) {
+		off_t left = q->spill_wr - q->spill_rd;
+		unsigned n = TCP_QUEUE_SIZE - q->len;
+		unsigned pos;
+		ssize_t r;
+
+		if (left == 0) {
+			/* All read, start over */
+			q->spill_rd = q->spill_wr = 0;
+			ftruncate(q->spill_fd, 0);
+			break;
+		}
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+		if (n > left)
+			n = left;
+		r = pread(q->spill_fd, buf, n, q->spill_rd);
+		if (r <= 0)
+			goto bad;
+		/* Take whole frames */
+		pos = 0;
+		for (;;) {
+			unsigned i = pos;
+			unsigned len = 0;
+
+			while (i < r && isdigit(buf[i]))
+				len = len * 10 + (buf[i++] - '0');
+			if (i == r)
+				break; /* incomplete */
+			if (buf[i] != ' ' || i == pos || len > sizeof(buf) / 2)
+				goto bad;
+			len += i + 1 - pos;
+			if (pos + len > r)
+				break; /* incomplete */
+			pos += len;
+		}
+		if (pos == 0) {
+			/* The frame does not fit into data[] yet,
+			 * or the file ends with a partial frame */
+			if (r == left)
+				goto bad;
+			break;
+		}
+		tcpq_put(q, buf, pos);
+		q->spill_rd += pos;
+	}
+	return;
+ bad:
+	/* Killed while writing it? */
+	bb_error_msg("%s is corrupted, truncating", q->spill_path);
+	q->spill_rd = q->spill_wr = 0;
+	ftruncate(q->spill_fd, 0);
+}
+
+/* Returns 0 if there is no room for MSG */
+static int tcpq_store(struct tcp_queue *q, const char *msg, unsigned len)
+{
+	char hdr[sizeof(int)*3 + 2];
+	unsigned hl = sprintf(hdr, "%u ", len);
+
+	if (q->spill_wr == 0 && q->len + hl + len <= TCP_QUEUE_SIZE) {
+		tcpq_put(q, hdr, hl);
+		tcpq_put(q, msg, len);
+		return 1;
+	}
+	if (q->spill_fd < 0 || q->spill_wr + hl + len > TCP_SPILL_MAX)
+		return 0;
+	if (pwrite(q->spill_fd, hdr, hl, q->spill_wr) != hl
+	 || pwrite(q->spill_fd, msg, len, q->spill_wr + hl) != len
+	) {
+		return 0;
+	}
+	q->spill_wr += hl + len;
+	return 1;
+}
+
+static void tcp_enqueue(struct tcp_queue *q, const char *msg, unsigned len)
+{
+	if (q->dropped) {
+		/* Tell the remote side that there is a gap */
+		char note[sizeof("<%u>syslogd: %u messages lost") + sizeof(int)*3 * 2];
+		sprintf(note, "<%u>syslogd: %u messages lost",
+				LOG_SYSLOG | LOG_WARNING, q->dropped);
+		if (!tcpq_store(q, note, strlen(note))) {
+			q->dropped++;
+			return;
+		}
+		q->dropped = 0;
+	}
+	if (!tcpq_store(q, msg, len))
+		q->dropped++;
+}
+
+static void tcp_disconnect(remoteHost_t *rh)
+{
+	struct tcp_queue *q = rh->tcp;
+
+	if (rh->remoteFD >= 0)
+		close(rh->remoteFD);
+	rh->remoteFD = -1;
+	q->connecting = 0;
+	/* Partially sent frame is resent whole */
+	q->sent = 0;
+	q->next_connect_ms = monotonic_ms() + q->backoff_ms;
+	q->backoff_ms *= 2;
+	if (q->backoff_ms > TCP_BACKOFF_MAX_MS)
+		q->backoff_ms = TCP_BACKOFF_MAX_MS;
+	/* Maybe it moved to another address? */
+	if (rh->remoteAddr && (monotonic_sec() - rh->last_dns_resolve) >= DNS_WAIT_SEC) {
+		free(rh->remoteAddr);
+		rh->remoteAddr = NULL;
+	}
+}
+
+static void tcp_connect(remoteHost_t *rh)
+{
+	rh->remoteFD = try_to_resolve_remote(rh, SOCK_STREAM);
+	if (rh->remoteFD < 0) {
+		tcp_disconnect(rh);
+		return;
+	}
+	ndelay_on(rh->remoteFD);
+	rh->tcp->connecting = 1;
+	if (connect(rh->remoteFD, &rh->remoteAddr->u.sa, rh->remoteAddr->len) != 0
+	 && errno != EINPROGRESS
+	) {
+		tcp_disconnect(rh);
+	}
+}
+
+static void tcp_send(remoteHost_t *rh)
+{
+	struct tcp_queue *q = rh->tcp;
+	struct msghdr msg;
+	struct iovec iov[2];
+	unsigned start = (q->head + q->sent) % TCP_QUEUE_SIZE;
+	unsigned n = q->len - q->sent;
+	unsigned k = TCP_QUEUE_SIZE - start;
+	ssize_t r;
+
+	if (n == 0)
+		return;
+	if (k > n)
+		k = n;
+	iov[0].iov_base = q->data + start;
+	iov[0].iov_len = k;
+	iov[1].iov_base = q->data;
+	iov[1].iov_len = n - k;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	r = sendmsg(rh->remoteFD, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (r < 0) {
+		if (errno != EAGAIN)
+			tcp_disconnect(rh);
+		return;
+	}
+	/* Forget frames which are sent completely */
+	q->sent += r;
+	while (q->len) {
+		unsigned size = tcpq_frame_size(q);
+		if (size > q->sent)
+			break;
+		q->head = (q->head + size) % TCP_QUEUE_SIZE;
+		q->len -= size;
+		q->sent -= size;
+	}
+	tcpq_refill(q);
+}
+
+static void tcp_send_all(void)
+{
+	llist_t *item;
+
+	for (item = G.remoteHosts; item; item = item->link) {
+		remoteHost_t *rh = (remoteHost_t *)item->data;
+		if (rh->tcp && rh->remoteFD >= 0 && !rh->tcp->connecting)
+			tcp_send(rh);
+	}
+}
+
+static void tcp_handle_events(remoteHost_t *rh, int revents)
+{
+	struct tcp_queue *q = rh->tcp;
+
+	if (q->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		getsockopt(rh->remoteFD, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err) {
+			tcp_disconnect(rh);
+			return;
+		}
+		q->connecting = 0;
+		q->backoff_ms = TCP_BACKOFF_MIN_MS;
+	} else if (revents & (POLLIN | POLLERR | POLLHUP)) {
+		/* Remote side does not talk to us. It's EOF or error */
+		char buf[64];
+		ssize_t r = recv(rh->remoteFD, buf, sizeof(buf), MSG_DONTWAIT);
+		if (r == 0 || (r < 0 && errno != EAGAIN)) {
+			tcp_disconnect(rh);
+			return;
+		}
+	}
+	tcp_send(rh);
+}
+
+/* Wait until there are messages to read. Meanwhile, (re)connect
+ * to TCP hosts, send queued messages, flush log files if idle.
+ */
+static void wait_for_messages(void)
+{
+	for (;;) {
+		unsigned long long now = monotonic_ms();
+		int timeout = G.have_buffered ? 0 : -1;
+		llist_t *item;
+		unsigned i, n;
+
+		G.pfd[0].fd = STDIN_FILENO;
+		G.pfd[0].events = POLLIN;
+		n = 1;
+		for (item = G.remoteHosts; item; item = item->link) {
+			remoteHost_t *rh = (remoteHost_t *)item->data;
+			struct tcp_queue *q = rh->tcp;
+
+			if (!q)
+				continue;
+			if (rh->remoteFD < 0) {
+				if ((long long)(q->next_connect_ms - now) <= 0)
+					tcp_connect(rh);
+				if (rh->remoteFD < 0) {
+					/* tcp_disconnect() scheduled next attempt */
+					long long t = q->next_connect_ms - now;
+					if (t < 0)
+						t = 0;
+					if (timeout < 0 || timeout > t)
+						timeout = t;
+					continue;
+				}
+			}
+			G.pfd[n].fd = rh->remoteFD;
+			G.pfd[n].events = POLLIN;
+			if (q->connecting || q->len > q->sent)
+				G.pfd[n].events = POLLIN | POLLOUT;
+			G.pfd_host[n] = rh;
+			n++;
+		}
+		if (poll(G.pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				return;
+			bb_simple_perror_msg_and_die("poll");
+		}
+		for (i = 1; i < n; i++)
+			if (G.pfd[i].revents)
+				tcp_handle_events(G.pfd_host[i], G.pfd[i].revents);
+		if (G.pfd[0].revents)
+			return;
+		if (G.have_buffered)
+			flush_log_files();
+	}
+}
+
+/* Keep unsent messages in spill file for the next run */
+static void tcp_save_queues(void)
+{
+	llist_t *item;
+
+	for (item = G.remoteHosts; item; item = item->link) {
+		remoteHost_t *rh = (remoteHost_t *)item->data;
+		struct tcp_queue *q = rh->tcp;
+		char *tmp;
+		int fd;
+
+		if (!q || q->spill_fd < 0)
+			continue;
+		if (q->len == 0 && q->spill_rd == 0)
+			continue; /* spill file has exactly what is unsent */
+		tmp = xasprintf("%s.new", q->spill_path);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd >= 0) {
+			unsigned k = TCP_QUEUE_SIZE - q->head;
+			if (k > q->len)
+				k = q->len;
+			full_write(fd, q->data + q->head, k);
+			full_write(fd, q->data, q->len - k);
+			lseek(q->spill_fd, q->spill_rd, SEEK_SET);
+			bb_copyfd_size(q->spill_fd, fd, q->spill_wr - q->spill_rd);
+			close(fd);
+			rename(tmp, q->spill_path);
+		}
+		free(tmp);
+	}
 }
 #endif
 
@@ -1020,8 +1578,32 @@ static int NOINLINE syslogd_init(char **argv)
 		rh->remoteHostname = llist_pop(&remoteAddrList);
 		rh->remoteFD = -1;
 		rh->last_dns_resolve = monotonic_sec() - DNS_WAIT_SEC - 1;
+# if ENABLE_FEATURE_REMOTE_LOG_TCP
+		if (is_prefixed_with(rh->remoteHostname, "tcp:")) {
+			struct tcp_queue *q = xzalloc(sizeof(*q));
+			rh->remoteHostname += 4;
+			q->backoff_ms = TCP_BACKOFF_MIN_MS;
+			q->spill_fd = -1;
+			if (opt_Q) {
+				q->spill_path = G.num_tcp ? xasprintf("%s.%u", opt_Q, G.num_tcp) : xstrdup(opt_Q);
+				q->spill_fd = xopen3(q->spill_path, O_RDWR | O_CREAT, 0600);
+				close_on_exec_on(q->spill_fd);
+				/* Left from previous run? */
+				q->spill_wr = lseek(q->spill_fd, 0, SEEK_END);
+				tcpq_refill(q);
+			}
+			rh->tcp = q;
+			G.num_tcp++;
+		}
+# endif
 		llist_add_to(&G.remoteHosts, rh);
 	}
+# if ENABLE_FEATURE_REMOTE_LOG_TCP
+	if (G.num_tcp) {
+		G.pfd = xzalloc((G.num_tcp + 1) * sizeof(G.pfd[0]));
+		G.pfd_host = xzalloc((G.num_tcp + 1) * sizeof(G.pfd_host[0]));
+	}
+# endif
 #endif
 
 #ifdef SYSLOGD_MARK
@@ -1067,6 +1649,20 @@ static int NOINLINE syslogd_init(char **argv)
 	}
 
 	xmove_fd(fd, STDIN_FILENO);
+	/* Not before re-exec on NOMMU: gzip children don't need it */
+	close_on_exec_on(STDIN_FILENO);
+#if defined(MSG_WAITFORONE)
+	{
+		unsigned i;
+		for (i = 0; i < RECV_BATCH; i++) {
+			G.iov[i].iov_base = G.recvbuf[i];
+			/* leave room for terminating NUL or '\n' */
+			G.iov[i].iov_len = MAX_READ - 1;
+			G.msgs[i].msg_hdr.msg_iov = &G.iov[i];
+			G.msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+	}
+#endif
 
 	/* Set up signal handlers (so that they interrupt read()) */
 	signal_no_SA_RESTART_empty_mask(SIGTERM, record_signo);
@@ -1080,20 +1676,106 @@ static int NOINLINE syslogd_init(char **argv)
 	return opts;
 }
 
-int syslogd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
-int syslogd_main(int argc UNUSED_PARAM, char **argv)
+/* recvbuf[sz] is available for our use */
+static void process_message(char *recvbuf, int sz)
 {
-	int opts;
 #if ENABLE_FEATURE_REMOTE_LOG
 	llist_t *item;
 #endif
+
+	/* Drop trailing '\n' and NULs (typically there is one NUL) */
+	while (1) {
+		if (sz == 0)
+			return;
+		/* man 3 syslog says: "A trailing newline is added when needed".
+		 * However, neither glibc nor uclibc do this:
+		 * syslog(prio, "test")   sends "test\0" to /dev/log,
+		 * syslog(prio, "test\n") sends "test\n\0".
+		 * IOW: newline is passed verbatim!
+		 * I take it to mean that it's syslogd's job
+		 * to make those look identical in the log files. */
+		if (recvbuf[sz-1] != '\0' && recvbuf[sz-1] != '\n')
+			break;
+		sz--;
+	}
 #if ENABLE_FEATURE_SYSLOGD_DUP
-	int last_sz = -1;
-	char *last_buf;
-	char *recvbuf;
+	if ((option_mask32 & OPT_dup) && (sz == G.last_sz))
+		if (memcmp(G.last_msg, recvbuf, sz) == 0)
+			return;
+	G.last_msg = recvbuf;
+	G.last_sz = sz;
+#endif
+#if ENABLE_FEATURE_REMOTE_LOG
+	/* Stock syslogd sends it '\n'-terminated
+	 * over network, mimic that */
+	recvbuf[sz] = '\n';
+
+	/* We are not modifying log messages in any way before send */
+	/* Remote site cannot trust _us_ anyway and need to do validation again */
+	for (item = G.remoteHosts; item != NULL; item = item->link) {
+		remoteHost_t *rh = (remoteHost_t *)item->data;
+
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+		if (rh->tcp) {
+			/* Sent after the whole batch is received */
+			tcp_enqueue(rh->tcp, recvbuf, sz);
+			continue;
+		}
+#endif
+		if (rh->remoteFD == -1) {
+			rh->remoteFD = try_to_resolve_remote(rh, SOCK_DGRAM);
+			if (rh->remoteFD == -1)
+				continue;
+		}
+
+		/* Send message to remote logger.
+		 * On some errors, close and set remoteFD to -1
+		 * so that DNS resolution is retried.
+		 */
+		if (sendto(rh->remoteFD, recvbuf, sz+1,
+				MSG_DONTWAIT | MSG_NOSIGNAL,
+				&(rh->remoteAddr->u.sa), rh->remoteAddr->len) == -1
+		) {
+			switch (errno) {
+			case ECONNRESET:
+			case ENOTCONN: /* paranoia */
+			case EPIPE:
+				close(rh->remoteFD);
+				rh->remoteFD = -1;
+				free(rh->remoteAddr);
+				rh->remoteAddr = NULL;
+			}
+		}
+	}
+#endif
+	if (!ENABLE_FEATURE_REMOTE_LOG || (option_mask32 & OPT_locallog)) {
+		recvbuf[sz] = '\0'; /* ensure it *is* NUL terminated */
+		split_escape_and_log(recvbuf, sz);
+	}
+}
+
+/* Receive up to RECV_BATCH messages into G.recvbuf[], sizes into SZ[] */
+static int recv_messages(int flags, int *sz)
+{
+#if defined(MSG_WAITFORONE)
+	int i, n;
+
+	/* Block for the first one, take what is queued after it */
+	n = recvmmsg(STDIN_FILENO, G.msgs, RECV_BATCH, MSG_WAITFORONE | flags, NULL);
+	for (i = 0; i < n; i++)
+		sz[i] = G.msgs[i].msg_len;
+	return n;
 #else
-#define recvbuf (G.recvbuf)
+	sz[0] = recv(STDIN_FILENO, G.recvbuf[0], MAX_READ - 1, flags);
+	return sz[0] < 0 ? -1 : 1;
 #endif
+}
+
+int syslogd_main(int argc, char **argv) MAIN_EXTERNALLY_VISIBLE;
+int syslogd_main(int argc UNUSED_PARAM, char **argv)
+{
+	int opts;
+	int sz[RECV_BATCH];
 
 	INIT_G();
 	opts = syslogd_init(argv);
@@ -1101,97 +1783,56 @@ int syslogd_main(int argc UNUSED_PARAM, char **argv)
 	timestamp_and_log_internal("syslogd started: BusyBox v" BB_VER);
 	write_pidfile_std_path_and_ext("syslogd");
 
-#if ENABLE_FEATURE_SYSLOGD_DUP
-	recvbuf = G.recvbuf;
-#endif
 	while (!bb_got_signal) {
-		ssize_t sz;
+		int i, n;
 
-#if ENABLE_FEATURE_SYSLOGD_DUP
-		last_buf = recvbuf;
-		if (recvbuf == G.recvbuf)
-			recvbuf = G.recvbuf + MAX_READ;
-		else
-			recvbuf = G.recvbuf;
+		/* Do not sleep while there are unwritten messages */
+		int flags = G.have_buffered ? MSG_DONTWAIT : 0;
+
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+		if (G.pfd) {
+			wait_for_messages();
+			flags = MSG_DONTWAIT;
+		}
 #endif
- read_again:
-		sz = read(STDIN_FILENO, recvbuf, MAX_READ - 1);
-		if (sz < 0) {
+		n = recv_messages(flags, sz);
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				flush_log_files();
+				continue;
+			}
 			if (!bb_got_signal)
 				bb_perror_msg("read from %s", _PATH_LOG);
 			break;
 		}
-
-		/* Drop trailing '\n' and NULs (typically there is one NUL) */
-		while (1) {
-			if (sz == 0)
-				goto read_again;
-			/* man 3 syslog says: "A trailing newline is added when needed".
-			 * However, neither glibc nor uclibc do this:
-			 * syslog(prio, "test")   sends "test\0" to /dev/log,
-			 * syslog(prio, "test\n") sends "test\n\0".
-			 * IOW: newline is passed verbatim!
-			 * I take it to mean that it's syslogd's job
-			 * to make those look identical in the log files. */
-			if (recvbuf[sz-1] != '\0' && recvbuf[sz-1] != '\n')
-				break;
-			sz--;
-		}
-#if ENABLE_FEATURE_SYSLOGD_DUP
-		if ((opts & OPT_dup) && (sz == last_sz))
-			if (memcmp(last_buf, recvbuf, sz) == 0)
-				continue;
-		last_sz = sz;
+		for (i = 0; i < n; i++)
+			process_message(G.recvbuf[i], sz[i]);
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+		tcp_send_all();
 #endif
-#if ENABLE_FEATURE_REMOTE_LOG
-		/* Stock syslogd sends it '\n'-terminated
-		 * over network, mimic that */
-		recvbuf[sz] = '\n';
-
-		/* We are not modifying log messages in any way before send */
-		/* Remote site cannot trust _us_ anyway and need to do validation again */
-		for (item = G.remoteHosts; item != NULL; item = item->link) {
-			remoteHost_t *rh = (remoteHost_t *)item->data;
-
-			if (rh->remoteFD == -1) {
-				rh->remoteFD = try_to_resolve_remote(rh);
-				if (rh->remoteFD == -1)
-					continue;
-			}
-
-			/* Send message to remote logger.
-			 * On some errors, close and set remoteFD to -1
-			 * so that DNS resolution is retried.
-			 */
-			if (sendto(rh->remoteFD, recvbuf, sz+1,
-					MSG_DONTWAIT | MSG_NOSIGNAL,
-					&(rh->remoteAddr->u.sa), rh->remoteAddr->len) == -1
-			) {
-				switch (errno) {
-				case ECONNRESET:
-				case ENOTCONN: /* paranoia */
-				case EPIPE:
-					close(rh->remoteFD);
-					rh->remoteFD = -1;
-					free(rh->remoteAddr);
-					rh->remoteAddr = NULL;
-				}
-			}
+#if ENABLE_FEATURE_SYSLOGD_DUP
+		/* recvbuf[] will be overwritten, keep last message for -D */
+		if ((opts & OPT_dup) && G.last_msg && G.last_msg != G.last_buf) {
+			memcpy(G.last_buf, G.last_msg, G.last_sz);
+			G.last_msg = G.last_buf;
 		}
 #endif
-		if (!ENABLE_FEATURE_REMOTE_LOG || (opts & OPT_locallog)) {
-			recvbuf[sz] = '\0'; /* ensure it *is* NUL terminated */
-			split_escape_and_log(recvbuf, sz);
-		}
+		/* Busy: do not keep messages in buffers for too long */
+		if (G.have_buffered && monotonic_ms() - G.buffered_since_ms >= LOG_FLUSH_MS)
+			flush_log_files();
 	} /* while (!bb_got_signal) */
 
 	timestamp_and_log_internal("syslogd exiting");
+	flush_log_files();
+#if ENABLE_FEATURE_REMOTE_LOG_TCP
+	tcp_send_all();
+	tcp_save_queues();
+#endif
 	remove_pidfile_std_path_and_ext("syslogd");
 	ipcsyslog_cleanup();
 	if (opts & OPT_kmsg)
 		kmsg_cleanup();
 	kill_myself_with_sig(bb_got_signal);
-#undef recvbuf
 }
 
 /* Clean up. Needed because we are included from syslogd_and_logger.c */